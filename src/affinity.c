@@ -0,0 +1,388 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "affinity.h"
+
+#ifdef CPU_SETSIZE
+#define AFFINITY_MAX_CPUS CPU_SETSIZE
+#else
+#define AFFINITY_MAX_CPUS 1024
+#endif
+#define AFFINITY_NODE_PATH "/sys/devices/system/node"
+#define AFFINITY_CGROUP_PATH "/sys/fs/cgroup"
+
+
+int affinity_parse_cpulist(const char *str, int *cpus, int max) {
+    int count = 0;
+    const char *ptr = str;
+
+    while (*ptr != '\0' && *ptr != '\n') {
+        char *end;
+        long first = strtol(ptr, &end, 10);
+        long last = first;
+        if (end == ptr || first < 0) {
+            return -1;
+        }
+        ptr = end;
+        if (*ptr == '-') {
+            ptr++;
+            last = strtol(ptr, &end, 10);
+            if (end == ptr || last < first) {
+                return -1;
+            }
+            ptr = end;
+        }
+        for (long c = first; c <= last && count < max; c++) {
+            cpus[count++] = (int)c;
+        }
+        if (*ptr == ',') {
+            ptr++;
+        } else if (*ptr != '\0' && *ptr != '\n') {
+            return -1;
+        }
+    }
+    return count;
+}
+
+
+/*
+ * Find out the NUMA node each CPU belongs to. CPUs not listed anywhere (or
+ * all of them, if the system does not expose NUMA information) belong to
+ * node 0.
+ */
+void _cpu_nodes(int *node_of) {
+    memset(node_of, 0, AFFINITY_MAX_CPUS * sizeof(int));
+
+    DIR *dfd = opendir(AFFINITY_NODE_PATH);
+    if (dfd == NULL) {
+        return;
+    }
+
+    struct dirent *dp;
+    int *cpus = malloc(AFFINITY_MAX_CPUS * sizeof(int));
+    while ((dp = readdir(dfd)) != NULL) {
+        int node;
+        char path[PATH_MAX], list[4096];
+        if (sscanf(dp->d_name, "node%d", &node) != 1) {
+            continue;
+        }
+
+        int len = snprintf(path, sizeof(path), "%s/%s/cpulist",
+                           AFFINITY_NODE_PATH, dp->d_name);
+        if (len < 0 || (size_t)len >= sizeof(path)) {
+            continue;
+        }
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL) {
+            continue;
+        }
+        if (fgets(list, sizeof(list), fp) != NULL) {
+            int n = affinity_parse_cpulist(list, cpus, AFFINITY_MAX_CPUS);
+            for (int i = 0; i < n; i++) {
+                if (cpus[i] < AFFINITY_MAX_CPUS) {
+                    node_of[cpus[i]] = node;
+                }
+            }
+        }
+        fclose(fp);
+    }
+    free(cpus);
+    closedir(dfd);
+}
+
+
+int affinity_plan(uint8_t policy,
+                  const char *list,
+                  uint16_t n,
+                  int *cpu,
+                  int *node) {
+    int *node_of = malloc(AFFINITY_MAX_CPUS * sizeof(int));
+    int *cpus = malloc(AFFINITY_MAX_CPUS * sizeof(int));
+    int count = 0, r = 0;
+    if (node_of == NULL || cpus == NULL) {
+        free(node_of);
+        free(cpus);
+        return -1;
+    }
+    _cpu_nodes(node_of);
+
+    if (policy == ISHAKE_AFFINITY_LIST) {
+        count = list ? affinity_parse_cpulist(list, cpus, AFFINITY_MAX_CPUS)
+                     : -1;
+    } else {
+#ifdef __linux__
+        // the CPUs we are allowed to use, ordered by node
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            int max_node = 0;
+            for (int c = 0; c < AFFINITY_MAX_CPUS; c++) {
+                if (node_of[c] > max_node) max_node = node_of[c];
+            }
+            for (int nd = 0; nd <= max_node; nd++) {
+                for (int c = 0; c < AFFINITY_MAX_CPUS; c++) {
+                    if (CPU_ISSET(c, &set) && node_of[c] == nd) {
+                        cpus[count++] = c;
+                    }
+                }
+            }
+        }
+#endif
+    }
+    if (count <= 0) {
+        free(node_of);
+        free(cpus);
+        return -1;
+    }
+
+    if (policy == ISHAKE_AFFINITY_SCATTER) {
+        // find where each node starts in the list of CPUs
+        int *starts = malloc((count + 1) * sizeof(int));
+        int nodes = 0;
+        for (int i = 0; i < count; i++) {
+            if (i == 0 || node_of[cpus[i]] != node_of[cpus[i - 1]]) {
+                starts[nodes++] = i;
+            }
+        }
+        starts[nodes] = count;
+
+        // round-robin over nodes, and then over the CPUs in each node
+        for (int i = 0; i < n; i++) {
+            int nd = i % nodes;
+            int len = starts[nd + 1] - starts[nd];
+            cpu[i] = cpus[starts[nd] + (i / nodes) % len];
+        }
+        free(starts);
+    } else if (policy == ISHAKE_AFFINITY_COMPACT ||
+               policy == ISHAKE_AFFINITY_LIST) {
+        for (int i = 0; i < n; i++) {
+            cpu[i] = cpus[i % count];
+        }
+    } else {
+        r = -1;
+    }
+
+    for (int i = 0; i < n && r == 0; i++) {
+        node[i] = cpu[i] < AFFINITY_MAX_CPUS ? node_of[cpu[i]] : 0;
+    }
+
+    free(node_of);
+    free(cpus);
+    return r;
+}
+
+
+int affinity_pin(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    if (cpu < 0 || cpu >= AFFINITY_MAX_CPUS) {
+        return -1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+#else
+    return -1;
+#endif
+}
+
+
+/*
+ * Read the CPU quota set in a cgroup directory, as a (fractional) amount of
+ * CPUs. cgroup v2 keeps "QUOTA PERIOD" in cpu.max, with "max" meaning there
+ * is no quota, while v1 has them in cpu.cfs_quota_us and cpu.cfs_period_us,
+ * with -1 meaning the same. Returns 0 if there is no quota.
+ */
+double _cgroup_quota(const char *dir, int v2) {
+    char path[4096], max[32];
+    long long quota = -1, period = 0;
+    FILE *fp;
+
+    if (v2) {
+        snprintf(path, sizeof(path), "%s/cpu.max", dir);
+        if ((fp = fopen(path, "r")) == NULL) {
+            return 0;
+        }
+        if (fscanf(fp, "%31s %lld", max, &period) == 2 &&
+            strcmp(max, "max") != 0) {
+            quota = atoll(max);
+        }
+        fclose(fp);
+    } else {
+        snprintf(path, sizeof(path), "%s/cpu.cfs_quota_us", dir);
+        if ((fp = fopen(path, "r")) == NULL) {
+            return 0;
+        }
+        if (fscanf(fp, "%lld", &quota) != 1) {
+            quota = -1;
+        }
+        fclose(fp);
+        snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+        if ((fp = fopen(path, "r")) == NULL) {
+            return 0;
+        }
+        if (fscanf(fp, "%lld", &period) != 1) {
+            period = 0;
+        }
+        fclose(fp);
+    }
+
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+    return (double)quota / (double)period;
+}
+
+
+/*
+ * Find the lowest CPU quota that applies to a cgroup mounted at base, from
+ * the cgroup itself up to the root of the hierarchy, as a parent's quota
+ * limits all its children. In a container with its own cgroup namespace the
+ * path in /proc/self/cgroup may not exist under base, and base is the
+ * container's cgroup itself.
+ */
+double _cgroup_lowest_quota(const char *base, const char *cgroup, int v2) {
+    char dir[4096];
+    double lowest = 0;
+
+    snprintf(dir, sizeof(dir), "%s%s", base, cgroup);
+    if (access(dir, F_OK) != 0) {
+        snprintf(dir, sizeof(dir), "%s", base);
+    }
+    size_t base_len = strlen(base);
+    while (1) {
+        double quota = _cgroup_quota(dir, v2);
+        if (quota > 0 && (lowest == 0 || quota < lowest)) {
+            lowest = quota;
+        }
+        char *slash = strrchr(dir, '/');
+        if (strlen(dir) <= base_len || slash == NULL ||
+            (size_t)(slash - dir) < base_len) {
+            break;
+        }
+        *slash = '\0';
+    }
+    return lowest;
+}
+
+
+/*
+ * Find the CPU quota of the cgroups of this process, in CPUs, looking at
+ * both the v2 (unified) hierarchy and the cpu controller of v1. Returns 0 if
+ * there is none.
+ */
+double _cgroup_cpus(void) {
+    const char *v1_bases[] = {AFFINITY_CGROUP_PATH "/cpu,cpuacct",
+                              AFFINITY_CGROUP_PATH "/cpuacct,cpu",
+                              AFFINITY_CGROUP_PATH "/cpu"};
+    const char *v2_bases[] = {AFFINITY_CGROUP_PATH,
+                              AFFINITY_CGROUP_PATH "/unified"};
+    char line[4096];
+    double lowest = 0;
+
+    FILE *fp = fopen("/proc/self/cgroup", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        // lines look like "ID:CONTROLLERS:PATH", with no controllers for v2
+        char *controllers = strchr(line, ':');
+        if (controllers == NULL) {
+            continue;
+        }
+        controllers++;
+        char *cgroup = strchr(controllers, ':');
+        if (cgroup == NULL) {
+            continue;
+        }
+        *cgroup++ = '\0';
+        cgroup[strcspn(cgroup, "\n")] = '\0';
+        if (strcmp(cgroup, "/") == 0) {
+            cgroup[0] = '\0';
+        }
+
+        int v2 = controllers[0] == '\0', cpu = v2;
+        char *save = NULL;
+        for (char *c = strtok_r(controllers, ",", &save); c && !cpu;
+             c = strtok_r(NULL, ",", &save)) {
+            cpu = strcmp(c, "cpu") == 0;
+        }
+        if (!cpu) {
+            continue;
+        }
+
+        const char **bases = v2 ? v2_bases : v1_bases;
+        int nbases = v2 ? 2 : 3;
+        for (int b = 0; b < nbases; b++) {
+            if (access(bases[b], F_OK) != 0) {
+                continue;
+            }
+            double quota = _cgroup_lowest_quota(bases[b], cgroup, v2);
+            if (quota > 0 && (lowest == 0 || quota < lowest)) {
+                lowest = quota;
+            }
+            break;
+        }
+    }
+    fclose(fp);
+    return lowest;
+}
+
+
+int affinity_cpus(void) {
+    int count = 0;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        count = CPU_COUNT(&set);
+    }
+#endif
+    if (count <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        count = online > 0 ? (int)online : 1;
+    }
+
+    // a quota of 1.5 CPUs still lets us keep two of them busy part time
+    double quota = _cgroup_cpus();
+    if (quota > 0 && quota < count) {
+        count = (int)quota;
+        if (count < quota) {
+            count++;
+        }
+    }
+    return count < 1 ? 1 : count;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+
+#ifndef ISHAKE_AFFINITY_H
+#define ISHAKE_AFFINITY_H
+
+#define ISHAKE_AFFINITY_NONE 0
+#define ISHAKE_AFFINITY_COMPACT 1
+#define ISHAKE_AFFINITY_SCATTER 2
+#define ISHAKE_AFFINITY_LIST 3
+
+/*
+ * Decide where each of n worker threads should run, according to a policy:
+ *
+ * - ISHAKE_AFFINITY_COMPACT fills all the CPUs in a NUMA node before moving
+ *   to the next one.
+ * - ISHAKE_AFFINITY_SCATTER spreads workers evenly across NUMA nodes.
+ * - ISHAKE_AFFINITY_LIST uses the CPUs in list (e.g. "0,2,4-7") in order.
+ *
+ * Only the CPUs this process is allowed to run on are used, except for
+ * ISHAKE_AFFINITY_LIST. The CPU and NUMA node for each worker are stored in
+ * cpu and node. Returns 0 on success, -1 otherwise.
+ */
+int affinity_plan(uint8_t policy,
+                  const char *list,
+                  uint16_t n,
+                  int *cpu,
+                  int *node);
+
+/*
+ * Pin the calling thread to the given CPU.
+ */
+int affinity_pin(int cpu);
+
+/*
+ * Obtain the amount of CPUs this process can keep busy: those in its
+ * affinity mask, capped by the CPU quota of its cgroups (v1 or v2), rounded
+ * up. Always at least one.
+ */
+int affinity_cpus(void);
+
+/*
+ * Parse a list of CPUs in the format used by the kernel (e.g. "0,2,4-7").
+ * Returns the amount of CPUs parsed, or -1 if the list is not valid.
+ */
+int affinity_parse_cpulist(const char *str, int *cpus, int max);
+
+#endif //ISHAKE_AFFINITY_H
@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "blockstore.h"
+
+// records a new store has room for
+#define BLOCKSTORE_MIN_CAP 1024
+
+
+/*
+ * The size of the data slots of a store.
+ */
+uint32_t _blockstore_slot_size(blockstore_t *bs) {
+    return bs->hdr->block_size - 16;
+}
+
+
+/*
+ * Map the file of a store into memory, with the given size.
+ */
+int _blockstore_map(blockstore_t *bs, size_t size) {
+    int prot = PROT_READ | (bs->writable ? PROT_WRITE : 0);
+    if (bs->map) {
+        munmap(bs->map, bs->size);
+    }
+    bs->map = mmap(NULL, size, prot, MAP_SHARED, bs->fd, 0);
+    if (bs->map == MAP_FAILED) {
+        bs->map = NULL;
+        return -1;
+    }
+    bs->size = size;
+    bs->hdr = (blockstore_header_t *) bs->map;
+    return 0;
+}
+
+
+/*
+ * Make sure the file has room for the given amount of bytes, growing it
+ * geometrically so that appending blocks one by one stays cheap.
+ */
+int _blockstore_reserve(blockstore_t *bs, uint64_t size) {
+    if (size <= bs->size) {
+        return 0;
+    }
+    uint64_t grow = bs->size * 2 > size ? bs->size * 2 : size;
+    if (ftruncate(bs->fd, (off_t)grow)) {
+        return -1;
+    }
+    return _blockstore_map(bs, (size_t)grow);
+}
+
+
+/*
+ * Take a data slot, from the list of free ones if possible.
+ */
+int64_t _blockstore_slot(blockstore_t *bs) {
+    uint64_t off = bs->hdr->free;
+    if (off) {
+        memcpy(&bs->hdr->free, bs->map + off, sizeof(uint64_t));
+        return (int64_t)off;
+    }
+    off = bs->hdr->end;
+    if (_blockstore_reserve(bs, off + _blockstore_slot_size(bs))) {
+        return -1;
+    }
+    bs->hdr->end += _blockstore_slot_size(bs);
+    return (int64_t)off;
+}
+
+
+/*
+ * Give a data slot back to the list of free ones.
+ */
+void _blockstore_release(blockstore_t *bs, uint64_t off) {
+    memcpy(bs->map + off, &bs->hdr->free, sizeof(uint64_t));
+    bs->hdr->free = off;
+}
+
+
+/*
+ * The bucket of the index where the search for a nonce starts.
+ */
+uint64_t _blockstore_bucket(blockstore_t *bs, uint64_t nonce) {
+    uint64_t x = nonce * 0x9E3779B97F4A7C15ULL;
+    return (x ^ (x >> 29)) & (bs->hdr->cap * 2 - 1);
+}
+
+
+/*
+ * Get the entry of the index for a nonce, or the empty one where it would go
+ * if it is not there.
+ */
+uint64_t *_blockstore_entry(blockstore_t *bs, uint64_t nonce) {
+    uint64_t *index = (uint64_t *)(bs->map + bs->hdr->index);
+    uint64_t mask = bs->hdr->cap * 2 - 1;
+    for (uint64_t i = _blockstore_bucket(bs, nonce);; i = (i + 1) & mask) {
+        if (index[i] == 0 ||
+            blockstore_record(bs, index[i] - 1)->nonce == nonce) {
+            return &index[i];
+        }
+    }
+}
+
+
+/*
+ * Remove a nonce from the index, moving back the entries that follow it so
+ * that no search stops short of them.
+ */
+void _blockstore_unindex(blockstore_t *bs, uint64_t nonce) {
+    uint64_t *index = (uint64_t *)(bs->map + bs->hdr->index);
+    uint64_t mask = bs->hdr->cap * 2 - 1;
+    uint64_t i = (uint64_t)(_blockstore_entry(bs, nonce) - index);
+    for (uint64_t j = (i + 1) & mask; index[i] && index[j];
+         j = (j + 1) & mask) {
+        uint64_t k = _blockstore_bucket(bs, blockstore_record(bs, index[j] -
+                                                                  1)->nonce);
+        if ((i < j && i < k && k <= j) || (j < i && (i < k || k <= j))) {
+            continue; // it would not be found any sooner in i
+        }
+        index[i] = index[j];
+        i = j;
+    }
+    index[i] = 0;
+}
+
+
+/*
+ * Make room for more records, moving the table and the index to the end of
+ * the file. The space they used is recycled as data slots.
+ */
+int _blockstore_grow(blockstore_t *bs) {
+    blockstore_header_t *h = bs->hdr;
+    uint64_t cap = h->cap * 2, old = h->records;
+    uint64_t oldlen = h->cap * (h->record_size + 2 * sizeof(uint64_t));
+    uint64_t off = h->end;
+    if (_blockstore_reserve(bs, off + cap * (bs->hdr->record_size +
+                                             2 * sizeof(uint64_t)))) {
+        return -1;
+    }
+    h = bs->hdr;
+    memcpy(bs->map + off, bs->map + old, h->count * h->record_size);
+    h->records = off;
+    h->index = off + cap * h->record_size;
+    h->cap = cap;
+    h->end = h->index + cap * 2 * sizeof(uint64_t);
+
+    memset(bs->map + h->index, 0, cap * 2 * sizeof(uint64_t));
+    for (uint64_t i = 0; i < h->count; i++) {
+        *_blockstore_entry(bs, blockstore_record(bs, i)->nonce) = i + 1;
+    }
+
+    uint32_t slot = _blockstore_slot_size(bs);
+    for (uint64_t s = 0; slot >= sizeof(uint64_t) && s + slot <= oldlen;
+         s += slot) {
+        _blockstore_release(bs, old + s);
+    }
+    return 0;
+}
+
+
+int blockstore_create(blockstore_t *bs, const char *path, uint32_t block_size,
+                      uint16_t bits) {
+    if (bs == NULL || bits % 64 || block_size <= 16 + sizeof(uint64_t)) {
+        return -1;
+    }
+    bs->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (bs->fd < 0) {
+        return -1;
+    }
+    bs->writable = 1;
+    bs->map = NULL;
+    bs->size = 0;
+
+    uint16_t record_size = (uint16_t)(sizeof(blockstore_record_t) + bits / 8);
+    uint64_t records = (sizeof(blockstore_header_t) + bits / 8 + 63) / 64 * 64;
+    uint64_t index = records + BLOCKSTORE_MIN_CAP * record_size;
+    uint64_t end = index + BLOCKSTORE_MIN_CAP * 2 * sizeof(uint64_t);
+    if (ftruncate(bs->fd, (off_t)end) || _blockstore_map(bs, (size_t)end)) {
+        close(bs->fd);
+        return -1;
+    }
+
+    blockstore_header_t *h = bs->hdr;
+    memcpy(h->magic, BLOCKSTORE_MAGIC, 8);
+    h->version = BLOCKSTORE_VERSION;
+    h->block_size = block_size;
+    h->bits = bits;
+    h->record_size = record_size;
+    h->flags = bits ? BLOCKSTORE_DIGEST : 0; // the total of nothing is zero
+    h->count = 0;
+    h->cap = BLOCKSTORE_MIN_CAP;
+    h->records = records;
+    h->index = index;
+    h->first = 0;
+    h->free = 0;
+    h->end = end;
+    return 0;
+}
+
+
+int blockstore_open(blockstore_t *bs, const char *path, int writable) {
+    struct stat st;
+    bs->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (bs->fd < 0) {
+        return -1;
+    }
+    bs->writable = writable;
+    bs->map = NULL;
+    bs->size = 0;
+    if (fstat(bs->fd, &st) ||
+        (size_t)st.st_size < sizeof(blockstore_header_t) ||
+        _blockstore_map(bs, (size_t)st.st_size)) {
+        close(bs->fd);
+        return -1;
+    }
+
+    blockstore_header_t *h = bs->hdr;
+    if (memcmp(h->magic, BLOCKSTORE_MAGIC, 8) != 0 ||
+        h->version != BLOCKSTORE_VERSION || h->end > bs->size ||
+        h->records + h->cap * h->record_size > h->end ||
+        h->index + h->cap * 2 * sizeof(uint64_t) > h->end ||
+        h->cap == 0 || (h->cap & (h->cap - 1)) || h->count > h->cap ||
+        h->first > h->count || h->block_size <= 16 + sizeof(uint64_t)) {
+        munmap(bs->map, bs->size);
+        close(bs->fd);
+        return -1;
+    }
+    return 0;
+}
+
+
+blockstore_record_t *blockstore_record(blockstore_t *bs, uint64_t slot) {
+    return (blockstore_record_t *)
+            (bs->map + bs->hdr->records + slot * bs->hdr->record_size);
+}
+
+
+uint8_t *blockstore_data(blockstore_t *bs, blockstore_record_t *r) {
+    return bs->map + r->offset;
+}
+
+
+uint64_t *blockstore_total(blockstore_t *bs) {
+    if (bs->hdr->bits == 0) {
+        return NULL;
+    }
+    return (uint64_t *)(bs->map + sizeof(blockstore_header_t));
+}
+
+
+int64_t blockstore_find(blockstore_t *bs, uint64_t nonce) {
+    return (int64_t)*_blockstore_entry(bs, nonce) - 1;
+}
+
+
+int64_t blockstore_next(blockstore_t *bs, uint64_t slot) {
+    return (int64_t)blockstore_record(bs, slot)->after - 1;
+}
+
+
+int64_t blockstore_insert(blockstore_t *bs, int64_t after, uint64_t nonce,
+                          const uint8_t *data, uint32_t len) {
+    if (!bs->writable || after >= (int64_t)bs->hdr->count ||
+        len > _blockstore_slot_size(bs) || blockstore_find(bs, nonce) >= 0) {
+        return -1;
+    }
+    if (bs->hdr->count == bs->hdr->cap && _blockstore_grow(bs)) {
+        return -1;
+    }
+    int64_t off = _blockstore_slot(bs);
+    if (off < 0) {
+        return -1;
+    }
+    memcpy(bs->map + off, data, len);
+
+    // the new record goes at the end of the table, and into the chain
+    blockstore_header_t *h = bs->hdr;
+    uint64_t slot = h->count++, next;
+    blockstore_record_t *rec = blockstore_record(bs, slot);
+    memset(rec, 0, h->record_size);
+    rec->nonce = nonce;
+    rec->offset = (uint64_t)off;
+    rec->length = len;
+    if (after < 0) {
+        next = h->first;
+        h->first = slot + 1;
+    } else {
+        blockstore_record_t *a = blockstore_record(bs, (uint64_t)after);
+        rec->prev = a->nonce;
+        rec->before = (uint64_t)after + 1;
+        next = a->after;
+        a->after = slot + 1;
+    }
+    rec->after = next;
+    if (next) {
+        blockstore_record_t *n = blockstore_record(bs, next - 1);
+        n->prev = nonce;
+        n->before = slot + 1;
+        n->flags &= ~BLOCKSTORE_DIGEST;
+    }
+    *_blockstore_entry(bs, nonce) = slot + 1;
+    return (int64_t)slot;
+}
+
+
+int blockstore_update(blockstore_t *bs, uint64_t slot, const uint8_t *data,
+                      uint32_t len) {
+    if (!bs->writable || slot >= bs->hdr->count ||
+        len > _blockstore_slot_size(bs)) {
+        return -1;
+    }
+    blockstore_record_t *rec = blockstore_record(bs, slot);
+    memcpy(bs->map + rec->offset, data, len);
+    rec->length = len;
+    rec->flags &= ~BLOCKSTORE_DIGEST;
+    return 0;
+}
+
+
+int blockstore_delete(blockstore_t *bs, uint64_t slot) {
+    blockstore_header_t *h = bs->hdr;
+    if (!bs->writable || slot >= h->count) {
+        return -1;
+    }
+    blockstore_record_t *rec = blockstore_record(bs, slot);
+    _blockstore_release(bs, rec->offset);
+    _blockstore_unindex(bs, rec->nonce);
+
+    // take it out of the chain
+    if (rec->before) {
+        blockstore_record(bs, rec->before - 1)->after = rec->after;
+    } else {
+        h->first = rec->after;
+    }
+    if (rec->after) {
+        blockstore_record_t *next = blockstore_record(bs, rec->after - 1);
+        next->prev = rec->prev;
+        next->before = rec->before;
+        next->flags &= ~BLOCKSTORE_DIGEST;
+    }
+
+    // move the last record to the slot left free, and point everything to it
+    uint64_t last = --h->count;
+    if (slot == last) {
+        return 0;
+    }
+    memcpy(rec, blockstore_record(bs, last), h->record_size);
+    if (rec->before) {
+        blockstore_record(bs, rec->before - 1)->after = slot + 1;
+    } else {
+        h->first = slot + 1;
+    }
+    if (rec->after) {
+        blockstore_record(bs, rec->after - 1)->before = slot + 1;
+    }
+    *_blockstore_entry(bs, rec->nonce) = slot + 1;
+    return 0;
+}
+
+
+int blockstore_close(blockstore_t *bs) {
+    int r = 0;
+    uint64_t end = bs->hdr->end;
+    if (bs->writable) {
+        r = msync(bs->map, bs->size, MS_SYNC);
+    }
+    munmap(bs->map, bs->size);
+    if (bs->writable && end < bs->size) { // drop the room we reserved
+        r |= ftruncate(bs->fd, (off_t)end);
+    }
+    r |= close(bs->fd);
+    return r ? -1 : 0;
+}
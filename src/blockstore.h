@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef ISHAKE_BLOCKSTORE_H
+#define ISHAKE_BLOCKSTORE_H
+
+#define BLOCKSTORE_MAGIC "iSHAKEbs"
+#define BLOCKSTORE_VERSION 2
+
+// the cached digest of a record, or the total of a store, is valid
+#define BLOCKSTORE_DIGEST 1
+
+/*
+ * The header at the start of a block store file. All fields are in host
+ * byte order, and the file is meant to be mapped into memory.
+ *
+ * The header is followed by the total digest of the store (if digests are
+ * cached), and then by the table of records, the index and the data slots,
+ * in no particular order. Every data slot is as large as the data of a block
+ * in FULL mode, that is, the block size minus 16 bytes of header. The index
+ * is an open addressing hash table of twice as many entries as records fit
+ * in the table, each of them the slot of a record plus one, or 0 if empty.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint16_t bits;        // size of the cached digests, or 0 if none are kept
+    uint16_t record_size; // including the cached digest, if any
+    uint32_t flags;       // BLOCKSTORE_DIGEST if the total digest is valid
+    uint64_t count;       // records in use
+    uint64_t cap;         // records that fit in the table
+    uint64_t records;     // offset of the table of records
+    uint64_t index;       // offset of the index of records by nonce
+    uint64_t first;       // slot of the first block plus one, or 0
+    uint64_t free;        // offset of the first free data slot, or 0
+    uint64_t end;         // offset of the end of the used space
+} blockstore_header_t;
+
+/*
+ * A block in the store. Records take the first count slots of the table, in
+ * no particular order, and are chained in the order of the blocks by the
+ * slots of the ones around them, so that the prev of every block is the
+ * nonce of the one before it.
+ */
+typedef struct {
+    uint64_t nonce;
+    uint64_t prev;
+    uint64_t before;   // slot of the block before plus one, or 0
+    uint64_t after;    // slot of the block after plus one, or 0
+    uint64_t offset;   // where the data of the block is
+    uint32_t length;   // how much data it has
+    uint32_t flags;    // BLOCKSTORE_DIGEST if the cached digest is valid
+    uint64_t digest[]; // bits / 64 words, if digests are cached
+} blockstore_record_t;
+
+/*
+ * A block store mapped into memory.
+ */
+typedef struct {
+    int fd;
+    int writable;
+    uint8_t *map;
+    size_t size;
+    blockstore_header_t *hdr;
+} blockstore_t;
+
+/*
+ * Create an empty block store, caching digests of the given amount of bits
+ * (or none if bits is 0).
+ */
+int blockstore_create(blockstore_t *bs, const char *path, uint32_t block_size,
+                      uint16_t bits);
+
+/*
+ * Open an existing block store, for reading only or also for writing.
+ */
+int blockstore_open(blockstore_t *bs, const char *path, int writable);
+
+/*
+ * Get the record in a slot of the table.
+ */
+blockstore_record_t *blockstore_record(blockstore_t *bs, uint64_t slot);
+
+/*
+ * Get the data of the block in a record.
+ */
+uint8_t *blockstore_data(blockstore_t *bs, blockstore_record_t *r);
+
+/*
+ * Get the total digest of the store, or NULL if digests are not cached.
+ */
+uint64_t *blockstore_total(blockstore_t *bs);
+
+/*
+ * Find the slot of the block with a nonce, or -1 if there is none.
+ */
+int64_t blockstore_find(blockstore_t *bs, uint64_t nonce);
+
+/*
+ * Get the slot of the block following the one in a slot, or -1 if it is the
+ * last one.
+ */
+int64_t blockstore_next(blockstore_t *bs, uint64_t slot);
+
+/*
+ * Insert a block right after the one in a slot, or first if after is -1,
+ * chaining it to the blocks around it. The cached digest of the block that
+ * follows, if any, is invalidated. Returns the slot of the new block, or -1
+ * on error.
+ *
+ * Records and data may move, so pointers to them are no longer valid.
+ */
+int64_t blockstore_insert(blockstore_t *bs, int64_t after, uint64_t nonce,
+                          const uint8_t *data, uint32_t len);
+
+/*
+ * Replace the data of the block in a slot, invalidating its digest.
+ */
+int blockstore_update(blockstore_t *bs, uint64_t slot, const uint8_t *data,
+                      uint32_t len);
+
+/*
+ * Delete the block in a slot, chaining the one that follows it to the one
+ * before. The cached digest of the block that follows, if any, is
+ * invalidated. The last record of the table takes the slot left free.
+ */
+int blockstore_delete(blockstore_t *bs, uint64_t slot);
+
+/*
+ * Write any changes, trim the file and unmap it.
+ */
+int blockstore_close(blockstore_t *bs);
+
+#endif //ISHAKE_BLOCKSTORE_H
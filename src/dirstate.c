@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dirstate.h"
+
+
+int dirstate_init(dirstate_t *st, uint32_t block_size, uint16_t bits,
+                  uint8_t mode) {
+    if (st == NULL || bits % 64) {
+        return -1;
+    }
+    st->block_size = block_size;
+    st->bits = bits;
+    st->mode = mode;
+    st->total = calloc(bits / 64, sizeof(uint64_t));
+    st->entries = NULL;
+    st->count = 0;
+    st->cap = 0;
+    return st->total == NULL ? -1 : 0;
+}
+
+
+size_t dirstate_pos(dirstate_t *st, uint64_t nonce) {
+    size_t lo = 0, hi = st->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (st->entries[mid].nonce < nonce) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+
+dirstate_entry_t *dirstate_find(dirstate_t *st, uint64_t nonce) {
+    size_t pos = dirstate_pos(st, nonce);
+    if (pos < st->count && st->entries[pos].nonce == nonce) {
+        return &st->entries[pos];
+    }
+    return NULL;
+}
+
+
+dirstate_entry_t *dirstate_add(dirstate_t *st, uint64_t nonce) {
+    size_t pos = dirstate_pos(st, nonce);
+    if (pos < st->count && st->entries[pos].nonce == nonce) {
+        return &st->entries[pos];
+    }
+
+    if (st->count == st->cap) {
+        size_t cap = st->cap ? st->cap * 2 : 1024;
+        dirstate_entry_t *e = realloc(st->entries,
+                                      cap * sizeof(dirstate_entry_t));
+        if (e == NULL) {
+            return NULL;
+        }
+        st->entries = e;
+        st->cap = cap;
+    }
+    memmove(&st->entries[pos + 1], &st->entries[pos],
+            (st->count - pos) * sizeof(dirstate_entry_t));
+    st->count++;
+
+    dirstate_entry_t *e = &st->entries[pos];
+    memset(e, 0, sizeof(dirstate_entry_t));
+    e->nonce = nonce;
+    e->digest = calloc(st->bits / 64, sizeof(uint64_t));
+    return e;
+}
+
+
+int dirstate_remove(dirstate_t *st, uint64_t nonce) {
+    size_t pos = dirstate_pos(st, nonce);
+    if (pos == st->count || st->entries[pos].nonce != nonce) {
+        return -1;
+    }
+    free(st->entries[pos].digest);
+    free(st->entries[pos].name);
+    memmove(&st->entries[pos], &st->entries[pos + 1],
+            (st->count - pos - 1) * sizeof(dirstate_entry_t));
+    st->count--;
+    return 0;
+}
+
+
+int dirstate_load(dirstate_t *st, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 1;
+    }
+
+    char magic[8];
+    uint32_t block_size;
+    uint16_t bits;
+    uint8_t mode;
+    uint64_t count;
+    if (fread(magic, 1, 8, fp) != 8 ||
+        memcmp(magic, DIRSTATE_MAGIC, 8) != 0 ||
+        fread(&block_size, sizeof(block_size), 1, fp) != 1 ||
+        fread(&bits, sizeof(bits), 1, fp) != 1 ||
+        fread(&mode, sizeof(mode), 1, fp) != 1 ||
+        fread(&count, sizeof(count), 1, fp) != 1 ||
+        block_size != st->block_size || bits != st->bits || mode != st->mode ||
+        fread(st->total, 1, bits / 8, fp) != bits / 8) {
+        // not a state we can use, start from scratch
+        memset(st->total, 0, st->bits / 8);
+        fclose(fp);
+        return 1;
+    }
+
+    // entries were saved sorted, so we just need to read them in order
+    st->entries = malloc(count * sizeof(dirstate_entry_t));
+    st->cap = count;
+    for (uint64_t i = 0; i < count; i++) {
+        dirstate_entry_t *e = &st->entries[i];
+        uint16_t namelen;
+        e->digest = malloc(bits / 8);
+        e->name = NULL;
+        if (fread(&e->nonce, sizeof(uint64_t), 6, fp) != 6 ||
+            fread(e->digest, 1, bits / 8, fp) != bits / 8 ||
+            fread(&namelen, sizeof(namelen), 1, fp) != 1 ||
+            (e->name = calloc(namelen + 1, 1)) == NULL ||
+            fread(e->name, 1, namelen, fp) != namelen) {
+            free(e->digest);
+            free(e->name);
+            break;
+        }
+        st->count++;
+    }
+    fclose(fp);
+
+    if (st->count != count) { // truncated, don't trust any of it
+        for (size_t i = 0; i < st->count; i++) {
+            free(st->entries[i].digest);
+            free(st->entries[i].name);
+        }
+        st->count = 0;
+        memset(st->total, 0, st->bits / 8);
+        return 1;
+    }
+    return 0;
+}
+
+
+int dirstate_save(dirstate_t *st, const char *path) {
+    size_t len = strlen(path);
+    char *tmp = malloc(len + 5);
+    snprintf(tmp, len + 5, "%s.tmp", path);
+
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        free(tmp);
+        return -1;
+    }
+
+    uint64_t count = st->count;
+    int r = 0;
+    if (fwrite(DIRSTATE_MAGIC, 1, 8, fp) != 8 ||
+        fwrite(&st->block_size, sizeof(st->block_size), 1, fp) != 1 ||
+        fwrite(&st->bits, sizeof(st->bits), 1, fp) != 1 ||
+        fwrite(&st->mode, sizeof(st->mode), 1, fp) != 1 ||
+        fwrite(&count, sizeof(count), 1, fp) != 1 ||
+        fwrite(st->total, 1, st->bits / 8, fp) != st->bits / 8) {
+        r = -1;
+    }
+    for (size_t i = 0; i < st->count && r == 0; i++) {
+        dirstate_entry_t *e = &st->entries[i];
+        uint16_t namelen = e->name ? (uint16_t)strlen(e->name) : 0;
+        if (fwrite(&e->nonce, sizeof(uint64_t), 6, fp) != 6 ||
+            fwrite(e->digest, 1, st->bits / 8, fp) != st->bits / 8 ||
+            fwrite(&namelen, sizeof(namelen), 1, fp) != 1 ||
+            fwrite(e->name, 1, namelen, fp) != namelen) {
+            r = -1;
+        }
+    }
+    if (fclose(fp) || r) {
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+
+    r = rename(tmp, path);
+    free(tmp);
+    return r;
+}
+
+
+void dirstate_cleanup(dirstate_t *st) {
+    for (size_t i = 0; i < st->count; i++) {
+        free(st->entries[i].digest);
+        free(st->entries[i].name);
+    }
+    free(st->entries);
+    free(st->total);
+    free(st);
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef ISHAKE_DIRSTATE_H
+#define ISHAKE_DIRSTATE_H
+
+#define DIRSTATE_MAGIC "iSHAKEst"
+
+/*
+ * What we know about a block file: the metadata it had when it was hashed,
+ * and the hash of the corresponding block.
+ */
+typedef struct {
+    uint64_t nonce; // index or nonce, parsed from the file name
+    uint64_t prev;  // nonce of the previous block, in FULL mode
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t *digest;
+    char *name;     // path to the file, relative to the directory
+} dirstate_entry_t;
+
+/*
+ * The state of a directory of block files, with its entries sorted by nonce
+ * and the digest they add up to.
+ */
+typedef struct {
+    uint32_t block_size;
+    uint16_t bits;
+    uint8_t mode;
+    uint64_t *total;
+    dirstate_entry_t *entries;
+    size_t count;
+    size_t cap;
+} dirstate_t;
+
+/*
+ * Initialize an empty state for the given parameters.
+ */
+int dirstate_init(dirstate_t *st, uint32_t block_size, uint16_t bits,
+                  uint8_t mode);
+
+/*
+ * Load a state from a file. If the file does not exist, or was saved with
+ * different parameters, the state is left empty and 1 is returned.
+ */
+int dirstate_load(dirstate_t *st, const char *path);
+
+/*
+ * Save a state to a file, atomically replacing it.
+ */
+int dirstate_save(dirstate_t *st, const char *path);
+
+/*
+ * Find the position where an entry with a nonce is, or should be.
+ */
+size_t dirstate_pos(dirstate_t *st, uint64_t nonce);
+
+/*
+ * Find the entry for a nonce, or NULL if there is none.
+ */
+dirstate_entry_t *dirstate_find(dirstate_t *st, uint64_t nonce);
+
+/*
+ * Add an entry for a nonce, keeping them sorted. The digest of the entry is
+ * allocated and zeroed, and its name is left unset.
+ */
+dirstate_entry_t *dirstate_add(dirstate_t *st, uint64_t nonce);
+
+/*
+ * Remove the entry for a nonce.
+ */
+int dirstate_remove(dirstate_t *st, uint64_t nonce);
+
+/*
+ * Release the resources of a state, including the structure itself.
+ */
+void dirstate_cleanup(dirstate_t *st);
+
+#endif //ISHAKE_DIRSTATE_H
@@ -25,13 +25,31 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "ishake.h"
+#include "trace.h"
 #include "utils.h"
+#include "keccak_x4.h"
 #include "KeccakCodePackage.h"
 
 
+/*
+ * Start the Keccak state of a block, in the variant we are using.
+ */
+void _keccak_init(ishake_t *is, Keccak_HashInstance *keccak) {
+    if (is->output_len <= 4160) { // we're using iSHAKE128
+        Keccak_HashInitialize_SHAKE128(keccak);
+    } else { // iSHAKE256
+        Keccak_HashInitialize_SHAKE256(keccak);
+    }
+    keccak->fixedOutputLength = is->output_len;
+}
+
+
 int _hash_block(
         ishake_t *is,
         ishake_block_t *block,
@@ -44,117 +62,551 @@ int _hash_block(
         h.value.nonce.nonce = swap_uint64(h.value.nonce.nonce);
         h.value.nonce.prev = swap_uint64(h.value.nonce.prev);
     }
-    uint8_t *data = NULL;
-    data = malloc((block->data_len + h.length) * sizeof(uint8_t));
-    if (data == NULL) {
-        return -1;
-    }
-    memcpy(data, block->data, block->data_len);
-    memcpy(data + block->data_len, &h.value, h.length);
 
-    uint8_t *buf;
-    buf = calloc((unsigned int)is->output_len / 8, sizeof(uint8_t));
+    uint8_t buf[16512 / 8];
 
     Keccak_HashInstance keccak;
-    if (is->output_len <= 4160) { // we're using iSHAKE128
-        Keccak_HashInitialize_SHAKE128(&keccak);
-    } else { // iSHAKE256
-        Keccak_HashInitialize_SHAKE256(&keccak);
-    }
-    keccak.fixedOutputLength = is->output_len;
-    Keccak_HashUpdate(&keccak, data, (block->data_len + h.length) * 8);
+    _keccak_init(is, &keccak);
+
+    // absorb the data and then the header, no need to copy them together
+    Keccak_HashUpdate(&keccak, block->data, (DataLength)block->data_len * 8);
+    Keccak_HashUpdate(&keccak, (uint8_t *)&h.value, (DataLength)h.length * 8);
     Keccak_HashFinal(&keccak, buf);
-    free(data);
 
     // cast the resulting hash to (uint64_t *) for simplicity
     uint8_t2uint64_t(hash, buf, (unsigned long)is->output_len/8);
-    free(buf);
     return 0;
 }
 
 uint64_t *ishake_hash_block(ishake_t *is, ishake_block_t *block) {
     uint64_t *hash;
     hash = calloc((size_t)is->output_len/64, sizeof(uint64_t));
-    if (_hash_block(is, block, hash) != 0) {
+    if (hash == NULL || _hash_block(is, block, hash) != 0) {
+        free(hash);
         return NULL;
     }
     return hash;
 }
 
+
 /*
- * Hash an ishake block and combine it into an existing hash in the way
- * specified by op.
- */
-int _hash_and_combine(ishake_t *is, ishake_block_t *block, group_op op) {
-    if (is->thrd_no > 0) { // use the workers to do this
-        ishake_task_t *task = calloc(1, sizeof(ishake_task_t));
-        task->block = block;
-        task->prev = NULL;
-        task->op = op;
-        pthread_mutex_lock(&(is->stack_lck));
-        if (is->stack == NULL) { // empty stack
-            is->stack = task;
-        } else { // non-empty stack
-            task->prev = is->stack;
-            is->stack = task;
+ * Resize the active part of an adaptive pool as blocks are handed over, and
+ * get its new size. A backlog means data comes faster than the active
+ * workers hash it, so one more is woken up. Finding nothing pending block
+ * after block means data comes slower (e.g. waiting for I/O), so the last
+ * active worker is parked, and it stops taking turns to be woken up.
+ */
+uint16_t _adapt(ishake_t *is) {
+    uint16_t active = __atomic_load_n(&is->active, __ATOMIC_SEQ_CST);
+    uint64_t pending = __atomic_load_n(&is->pending, __ATOMIC_SEQ_CST);
+
+    if (pending > (uint64_t)ISHAKE_ADAPT_GROW * active) {
+        __atomic_store_n(&is->idle_seen, 0, __ATOMIC_RELAXED);
+        if (active < is->thrd_no) {
+            // under the lock of its queue, so that it cannot miss the wakeup
+            ishake_queue_t *queue = &is->queues[is->workers[active].queue];
+            pthread_mutex_lock(&queue->lck);
+            __atomic_store_n(&is->active, ++active, __ATOMIC_SEQ_CST);
+            pthread_cond_broadcast(&queue->unparked);
+            pthread_mutex_unlock(&queue->lck);
         }
-        pthread_mutex_unlock(&(is->stack_lck));
-        pthread_cond_signal(&is->data_available);
-        return 0;
+    } else if (pending > 0) {
+        __atomic_store_n(&is->idle_seen, 0, __ATOMIC_RELAXED);
+    } else if (active > 1 &&
+               __atomic_add_fetch(&is->idle_seen, 1, __ATOMIC_RELAXED) >=
+               ISHAKE_ADAPT_SHRINK) {
+        __atomic_store_n(&is->idle_seen, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&is->active, --active, __ATOMIC_SEQ_CST);
+    }
+    return active;
+}
+
+
+/*
+ * Pick the queue for the next task. Tasks are spread over the active workers
+ * in a round-robin fashion, so queues get work in proportion to their
+ * workers, with a turn all producers take without waiting for each other.
+ */
+uint16_t _next_queue(ishake_t *is) {
+    uint16_t active = is->adaptive ? _adapt(is) : is->thrd_no;
+    uint16_t turn = __atomic_fetch_add(&is->next_worker, 1, __ATOMIC_RELAXED);
+    return is->workers[turn % active].queue;
+}
+
+
+/*
+ * Get a block buffer allocated in the NUMA node of a queue, if any is left.
+ */
+unsigned char *_pool_get(ishake_t *is, uint16_t q) {
+    ishake_queue_t *queue = &is->queues[q];
+    unsigned char *buf = NULL;
+    pthread_mutex_lock(&queue->pool_lck);
+    if (queue->pool_len > 0) {
+        buf = queue->pool[--queue->pool_len];
     }
+    pthread_mutex_unlock(&queue->pool_lck);
+    return buf;
+}
+
+
+/*
+ * Give a block to the workers in a queue. Pooled blocks have their data in a
+ * buffer that must go back to the pool of the queue once hashed.
+ */
+int _enqueue(ishake_t *is,
+             ishake_producer_t *p,
+             uint16_t q,
+             ishake_block_t *block,
+             group_op op,
+             uint8_t pooled) {
+    ishake_queue_t *queue = &is->queues[q];
+    ishake_task_t *task = malloc(sizeof(ishake_task_t));
+    if (task == NULL) {
+        return -1;
+    }
+    task->block = block;
+    task->op = op;
+    task->pooled = pooled;
+    task->epoch = p->op_epoch;
+    __atomic_add_fetch(&is->epoch_pending[task->epoch & 1], 1,
+                       __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&is->pending, 1, __ATOMIC_SEQ_CST);
+
+    // push it without the lock, producers only race with each other here
+    ishake_task_t *top = __atomic_load_n(&queue->stack, __ATOMIC_RELAXED);
+    do {
+        task->prev = top;
+    } while (!__atomic_compare_exchange_n(&queue->stack, &top, task, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // workers only wait after finding the stack empty with the lock held, so
+    // whoever fills it takes the lock to wake one up, and nobody else has to
+    if (top == NULL) {
+        pthread_mutex_lock(&queue->lck);
+        pthread_cond_signal(&queue->data_available);
+        pthread_mutex_unlock(&queue->lck);
+    }
+    return 0;
+}
+
+
+/*
+ * Take the last task pushed to a queue, or NULL if there is none. Tasks are
+ * pushed without the lock of the queue, but it must be held to take them, so
+ * that no task can be taken, freed and pushed again while we look at it.
+ */
+ishake_task_t *_dequeue(ishake_queue_t *queue) {
+    ishake_task_t *task = __atomic_load_n(&queue->stack, __ATOMIC_ACQUIRE);
+    while (task != NULL &&
+           !__atomic_compare_exchange_n(&queue->stack, &task, task->prev, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        // someone pushed another task meanwhile, take that one
+    }
+    return task;
+}
+
+
+/*
+ * Let whoever is waiting for asynchronous work know that it is done.
+ */
+void _notify(ishake_t *is) {
+    if (is->notify_fd >= 0) {
+        uint64_t one = 1;
+        if (write(is->notify_fd, &one, sizeof(one)) != sizeof(one)) {
+            // nothing we can do, the counter of an eventfd is full
+        }
+    }
+    if (is->notify_cb != NULL) {
+        is->notify_cb(is, is->notify_arg);
+    }
+}
+
+
+/*
+ * Start changing the hash in the structure. Readers retry until the change
+ * is over, as it is protected by a seqlock.
+ */
+void _hash_write_begin(ishake_t *is) {
+    __atomic_store_n(&is->hash_seq, is->hash_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-    // no threads, process here
+
+/*
+ * Finish changing the hash in the structure.
+ */
+void _hash_write_end(ishake_t *is) {
+    __atomic_store_n(&is->hash_seq, is->hash_seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Read a consistent copy of the hash in the structure, and the amount of
+ * operations it covers when there are no threads.
+ */
+void _hash_read(ishake_t *is, uint64_t *out, uint64_t *seq) {
+    uint32_t before, after;
+    do {
+        before = __atomic_load_n(&is->hash_seq, __ATOMIC_ACQUIRE);
+        if (before & 1) { // a change is in progress
+            sched_yield();
+            continue;
+        }
+        memcpy(out, is->hash, (size_t)is->output_len/8);
+        *seq = __atomic_load_n(&is->seq, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&is->hash_seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+}
+
+
+/*
+ * Get the current time in nanoseconds, to tell isolated operations.
+ */
+uint64_t _now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+/*
+ * Tell whether the operations of a producer are tagged with snapshot epochs.
+ * They all are, except those of the hash's own producer without threads,
+ * which change the hash right away.
+ */
+uint8_t _epochs(ishake_t *is, ishake_producer_t *p) {
+    return is->thrd_no > 0 || p != &is->main;
+}
+
+
+/*
+ * Get the producer after another one, starting with the hash's own.
+ */
+ishake_producer_t *_next_producer(ishake_t *is, ishake_producer_t *p) {
+    if (p == &is->main) {
+        return __atomic_load_n(&is->producers, __ATOMIC_ACQUIRE);
+    }
+    return p->next;
+}
+
+
+/*
+ * Start an operation. Without threads, the hash is changed right away, so
+ * this starts a change for readers to wait for. Otherwise, the blocks of
+ * the operation are tagged with the current snapshot epoch, which is held
+ * open until the operation is over, so that a snapshot waits for all of
+ * them to be hashed, or for none.
+ */
+void _op_begin(ishake_t *is, ishake_producer_t *p) {
+    if (p->op_depth++ > 0) { // part of another operation
+        return;
+    }
+    if (!_epochs(is, p)) {
+        _hash_write_begin(is);
+        return;
+    }
+
+    uint64_t e;
+    while (1) {
+        e = __atomic_load_n(&is->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&is->epoch_pending[e & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&is->epoch, __ATOMIC_SEQ_CST) == e) {
+            break;
+        }
+        // a snapshot closed the epoch meanwhile, use the next one
+        __atomic_sub_fetch(&is->epoch_pending[e & 1], 1, __ATOMIC_SEQ_CST);
+    }
+    p->op_epoch = e;
+
+    p->op_isolated = is->inline_bytes > 0 &&
+                     _now() - __atomic_load_n(&is->last_op, __ATOMIC_RELAXED)
+                     >= is->inline_gap;
+}
+
+
+/*
+ * Finish an operation.
+ */
+void _op_end(ishake_t *is, ishake_producer_t *p) {
+    if (--p->op_depth > 0) {
+        return;
+    }
+    if (!_epochs(is, p)) {
+        __atomic_store_n(&is->seq, is->seq + 1, __ATOMIC_RELAXED);
+        _hash_write_end(is);
+        return;
+    }
+
+    uint8_t slot = (uint8_t)(p->op_epoch & 1);
+    __atomic_add_fetch(&is->epoch_ops[slot], 1, __ATOMIC_SEQ_CST);
+    __atomic_sub_fetch(&is->epoch_pending[slot], 1, __ATOMIC_SEQ_CST);
+    if (is->inline_bytes > 0) {
+        __atomic_store_n(&is->last_op, _now(), __ATOMIC_RELAXED);
+    }
+}
+
+
+/*
+ * Count a block in the stats, for anyone to read while we go on.
+ */
+void _count(uint64_t *counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Decide whether a block of an operation is hashed here instead of by the
+ * workers: it must be small, and the operation isolated, with the workers
+ * idle enough not to be hashing a previous one anyway. Otherwise, count why.
+ */
+uint8_t _hash_inline(ishake_t *is,
+                     ishake_producer_t *p,
+                     ishake_block_t *block) {
+    if (p->hash[p->op_epoch & 1] == NULL || p->op_submitted) {
+        _count(&is->stats.bulk_blocks);
+    } else if (block->data_len > is->inline_bytes) {
+        _count(&is->stats.large_blocks);
+    } else if (!p->op_isolated) {
+        _count(&is->stats.burst_blocks);
+    } else if (__atomic_load_n(&is->pending, __ATOMIC_SEQ_CST) >
+               is->inline_pending) {
+        _count(&is->stats.busy_blocks);
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Combine the hash of a block computed by the calling thread, into the
+ * accumulator of its producer if its operations have snapshot epochs.
+ */
+void _combine_here(ishake_t *is,
+                   ishake_producer_t *p,
+                   uint64_t *hash,
+                   group_op op) {
+    uint64_t *acc = _epochs(is, p) ? p->hash[p->op_epoch & 1] : is->hash;
+    combine(acc, hash, (uint16_t)(is->output_len/64), op);
+    _count(&is->stats.inline_blocks);
+}
+
+
+/*
+ * Finish the hash of a block in APPEND mode whose data is already absorbed
+ * into a Keccak state, which is left untouched, by absorbing its index.
+ */
+void _keccak_finish(ishake_t *is,
+                    Keccak_HashInstance *keccak,
+                    uint64_t idx,
+                    uint64_t *hash) {
+    Keccak_HashInstance copy = *keccak;
+    uint8_t buf[16512 / 8];
+    idx = swap_uint64(idx);
+    Keccak_HashUpdate(&copy, (uint8_t *)&idx, sizeof(idx) * 8);
+    Keccak_HashFinal(&copy, buf);
+    uint8_t2uint64_t(hash, buf, (unsigned long)is->output_len/8);
+}
+
+
+/*
+ * Close the block a producer is filling, now that it is full or there is no
+ * more data, and add it to the digest.
+ */
+void _tail_close(ishake_t *is, ishake_producer_t *p) {
+    uint64_t hash[16512 / 64];
+    _op_begin(is, p);
+    uint64_t idx = __atomic_add_fetch(&is->block_no, 1, __ATOMIC_RELAXED);
+    _keccak_finish(is, p->tail, idx, hash);
+    _combine_here(is, p, hash, add_mod64);
+    _op_end(is, p);
+
+    free(p->tail);
+    p->tail = NULL;
+    p->tail_len = 0;
+}
+
+
+/*
+ * Hash an ishake block and combine it into an existing hash in the way
+ * specified by op. The block is freed afterwards, whether it is processed
+ * here or by a worker.
+ */
+int _hash_and_combine(ishake_t *is,
+                      ishake_producer_t *p,
+                      ishake_block_t *block,
+                      group_op op) {
+    if (is->thrd_no > 0 && !_hash_inline(is, p, block)) { // use the workers
+        return _enqueue(is, p, _next_queue(is), block, op, 0);
+    }
+
+    // process here
     uint64_t *hash = ishake_hash_block(is, block);
+    free(block->data);
+    free(block);
     if (hash == NULL) {
         return -1;
     }
-    combine(is->hash, hash, (uint16_t)(is->output_len/64), op);
+    _combine_here(is, p, hash, op);
     free(hash);
     return 0;
 }
 
 
+/*
+ * Add what the producers hashed themselves to the digest, once no more
+ * operations will come.
+ */
+void _fold_inline(ishake_t *is) {
+    if (is->workers) { // they may be adding to the hash too
+        pthread_mutex_lock(&is->combine_lck);
+    }
+    _hash_write_begin(is);
+    for (ishake_producer_t *p = &is->main; p; p = _next_producer(is, p)) {
+        for (int slot = 0; slot < 2; slot++) {
+            if (p->hash[slot]) {
+                combine(is->hash, p->hash[slot],
+                        (uint16_t)(is->output_len/64), add_mod64);
+                memset(p->hash[slot], 0,
+                       (size_t)is->output_len/64 * sizeof(uint64_t));
+            }
+        }
+    }
+    _hash_write_end(is);
+    if (is->workers) {
+        pthread_mutex_unlock(&is->combine_lck);
+    }
+}
+
+
 /**
  * Worker thread.
  *
- * It will pick up tasks from a stack, hash the corresponding block and combine
- * it with the existing hash.
+ * It will pick up tasks from the stack of its queue, hash the corresponding
+ * block and combine it with its own accumulator.
  */
 void *_worker(void *arg) {
-    ishake_t *is = (ishake_t *) arg;
+    ishake_worker_t *w = (ishake_worker_t *) arg;
+    ishake_t *is = w->is;
+    ishake_queue_t *queue = &is->queues[w->queue];
+    uint16_t words = (uint16_t)(is->output_len/64);
+    uint16_t index = (uint16_t)(w - is->workers);
+
+    // everything we allocate from now on will be local to our NUMA node
+    if (w->cpu >= 0) {
+        affinity_pin(w->cpu);
+    }
+    uint64_t *even = calloc(words, sizeof(uint64_t));
+    uint64_t *odd = calloc(words, sizeof(uint64_t));
+    if (even == NULL || odd == NULL) {
+        free(even);
+        free(odd);
+        even = odd = NULL;
+    }
+    __atomic_store_n(&w->hash[0], even, __ATOMIC_RELEASE);
+    __atomic_store_n(&w->hash[1], odd, __ATOMIC_RELEASE);
+    uint64_t *hash = calloc(words, sizeof(uint64_t));
+
+    // prepare some block buffers in our node, touching them to allocate pages
+    if (is->mode == ISHAKE_APPEND_ONLY_MODE) {
+        uint32_t data_len = is->block_size - (uint32_t)sizeof(uint64_t);
+        for (int i = 0; i < ISHAKE_POOL_BUFFERS; i++) {
+            unsigned char *buf = malloc(data_len);
+            if (buf == NULL) {
+                break;
+            }
+            memset(buf, 0, data_len);
+            pthread_mutex_lock(&queue->pool_lck);
+            if (queue->pool_len < queue->pool_cap) {
+                queue->pool[queue->pool_len++] = buf;
+                buf = NULL;
+            }
+            pthread_mutex_unlock(&queue->pool_lck);
+            free(buf);
+        }
+    }
 
-    pthread_mutex_lock(&(is->stack_lck));
+    pthread_mutex_lock(&queue->lck);
     while (1) {
-        if (is->stack != NULL) {
-            ishake_task_t *task = is->stack;
-            is->stack = task->prev;
-            pthread_mutex_unlock(&(is->stack_lck));
+        ishake_task_t *task = _dequeue(queue);
+        if (task != NULL) {
+            if (__atomic_load_n(&queue->stack, __ATOMIC_RELAXED) != NULL) {
+                // more to do, and producers only wake us up when it was none
+                pthread_cond_signal(&queue->data_available);
+            }
+            pthread_mutex_unlock(&queue->lck);
 
             // hash the block
-            uint64_t *hash = ishake_hash_block(is, task->block);
-            free(task->block->data);
-            free(task->block);
+            _hash_block(is, task->block, hash);
 
             // combine the resulting hash
-            pthread_mutex_lock(&is->combine_lck);
-            combine(is->hash, hash, (uint16_t)
-                    (is->output_len/64), task->op);
-            pthread_mutex_unlock(&is->combine_lck);
-            free(hash);
+            uint8_t slot = (uint8_t)(task->epoch & 1);
+            if (w->hash[slot]) {
+                combine(w->hash[slot], hash, words, task->op);
+            } else { // no accumulator of our own, use the shared one
+                pthread_mutex_lock(&is->combine_lck);
+                _hash_write_begin(is);
+                combine(is->hash, hash, words, task->op);
+                _hash_write_end(is);
+                pthread_mutex_unlock(&is->combine_lck);
+            }
+            __atomic_sub_fetch(&is->epoch_pending[slot], 1, __ATOMIC_SEQ_CST);
+
+            // return the buffer to the pool if it came from there
+            unsigned char *data = task->block->data;
+            if (task->pooled) {
+                pthread_mutex_lock(&queue->pool_lck);
+                if (queue->pool_len < queue->pool_cap) {
+                    queue->pool[queue->pool_len++] = data;
+                    data = NULL;
+                }
+                pthread_mutex_unlock(&queue->pool_lck);
+            }
+            free(data);
+            free(task->block);
             free(task);
-
-            // do this once we stop calling ishake_append() in main()
-            pthread_mutex_lock(&is->stack_lck);
+            if (__atomic_sub_fetch(&is->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+                _notify(is);
+            }
+            pthread_mutex_lock(&queue->lck);
             continue;
         }
 
-        if (is->done == 1) {
-            pthread_mutex_unlock(&is->stack_lck);
+        if (queue->done == 1) {
+            pthread_mutex_unlock(&queue->lck);
             break;
         }
-        pthread_cond_wait(&is->data_available, &is->stack_lck);
+        if (is->adaptive &&
+            index >= __atomic_load_n(&is->active, __ATOMIC_SEQ_CST)) {
+            // parked, tasks come here only if queued before we were
+            pthread_cond_wait(&queue->unparked, &queue->lck);
+        } else {
+            pthread_cond_wait(&queue->data_available, &queue->lck);
+        }
     }
 
+    free(hash);
+
+    // add our accumulator to the digest, the last one out writes the result
+    pthread_mutex_lock(&is->combine_lck);
+    _hash_write_begin(is);
+    for (int slot = 0; slot < 2; slot++) {
+        if (w->hash[slot]) {
+            combine(is->hash, w->hash[slot], words, add_mod64);
+            free(w->hash[slot]);
+            w->hash[slot] = NULL;
+        }
+    }
+    _hash_write_end(is);
+    uint8_t last = --is->live == 0;
+    pthread_mutex_unlock(&is->combine_lck);
+
+    if (last && is->output != NULL) { // someone is waiting for the result
+        uint64_t2uint8_t(is->output, is->hash, (unsigned long)words);
+        __atomic_store_n(&is->finished, 1, __ATOMIC_SEQ_CST);
+        _notify(is);
+    }
     pthread_exit(NULL);
 }
 
@@ -169,40 +621,152 @@ int ishake_init(ishake_t *is,
                 uint16_t hashbitlen,
                 uint8_t mode,
                 uint16_t threads) {
-    if (hashbitlen % 64 || !is || !blk_size) {
+    return ishake_init_affinity(is, blk_size, hashbitlen, mode, threads,
+                                ISHAKE_AFFINITY_NONE, NULL);
+}
+
+
+int ishake_init_affinity(ishake_t *is,
+                         uint32_t blk_size,
+                         uint16_t hashbitlen,
+                         uint8_t mode,
+                         uint16_t threads,
+                         uint8_t affinity,
+                         const char *cpus) {
+    if (!is) {
+        return -1;
+    }
+    memset(&is->main, 0, sizeof(ishake_producer_t));
+    is->main.is = is;
+    is->producers = NULL;
+    is->hash = NULL;
+    is->workers = NULL;
+    is->snap_sum[0] = NULL;
+    is->snap_sum[1] = NULL;
+    is->trace = NULL;
+    pthread_mutex_init(&is->snap_lck, NULL);
+    is->adaptive = threads == ISHAKE_THREADS_AUTO;
+    if (is->adaptive) { // leave a CPU for whoever produces the data
+        threads = (uint16_t)(affinity_cpus() - 1);
+        is->adaptive = threads > 0;
+    }
+    if (hashbitlen % 64 || !blk_size) {
         return -1;
     }
     if (hashbitlen < 2688 || hashbitlen > 16512 ||
         (hashbitlen > 4160 && hashbitlen < 6528)) {
         return -1;
     }
+    if (mode == ISHAKE_APPEND_ONLY_MODE && blk_size <= sizeof(uint64_t)) {
+        return -1;
+    }
 
     // common initialization
     is->mode = mode;
     is->block_no = 0;
     is->block_size = blk_size;
     is->proc_bytes = 0;
-    is->remaining = 0;
-    is->buf = 0;
     is->output_len = hashbitlen;// / (uint16_t)8;
     is->hash = calloc((size_t)is->output_len/64, sizeof(uint64_t));
+    is->thrd_no = threads;
+    is->affinity = affinity;
+    is->done = 0;
+    is->workers = NULL;
+    is->queues = NULL;
+    is->queue_no = 0;
+    is->next_worker = 0;
+    is->active = is->adaptive ? 1 : threads;
+    is->idle_seen = 0;
+    is->inline_bytes = ISHAKE_INLINE_BYTES;
+    is->inline_pending = ISHAKE_INLINE_PENDING;
+    is->inline_gap = ISHAKE_INLINE_GAP;
+    is->last_op = 0;
+    memset(&is->stats, 0, sizeof(ishake_stats_t));
+    is->pending = 0;
+    is->live = threads;
+    is->finished = 0;
+    is->output = NULL;
+    is->notify_fd = -1;
+    is->notify_cb = NULL;
+    is->notify_arg = NULL;
+    is->hash_seq = 0;
+    is->seq = 0;
+    is->epoch = 0;
+    is->snap_seq = 0;
+    for (int slot = 0; slot < 2; slot++) {
+        is->epoch_pending[slot] = 0;
+        is->epoch_ops[slot] = 0;
+        is->snap_sum[slot] = calloc((size_t)is->output_len/64,
+                                    sizeof(uint64_t));
+    }
 
     if (threads > 0) { // we are asked to use threads
-        // basic thread initialization
-        is->thrd_no = threads;
-        is->threads = calloc(1, sizeof(pthread_t *) * threads);
-        is->done = 0;
-        is->stack = NULL;
+        for (int slot = 0; slot < 2; slot++) {
+            is->main.hash[slot] = calloc((size_t)is->output_len/64,
+                                         sizeof(uint64_t));
+        }
+        int *cpu = malloc(threads * sizeof(int));
+        int *node = malloc(threads * sizeof(int));
+        is->workers = calloc(threads, sizeof(ishake_worker_t));
+        if (cpu == NULL || node == NULL || is->workers == NULL) {
+            free(cpu);
+            free(node);
+            return -1;
+        }
+
+        // decide where workers run, all of them in the same queue by default
+        if (affinity == ISHAKE_AFFINITY_NONE ||
+            affinity_plan(affinity, cpus, threads, cpu, node)) {
+            if (affinity != ISHAKE_AFFINITY_NONE) {
+                free(cpu);
+                free(node);
+                return -1;
+            }
+            for (int i = 0; i < threads; i++) {
+                cpu[i] = -1;
+                node[i] = 0;
+            }
+        }
+
+        // one queue per NUMA node in use
+        for (int i = 0; i < threads; i++) {
+            int q;
+            for (q = 0; q < i; q++) {
+                if (node[q] == node[i]) {
+                    break;
+                }
+            }
+            if (q == i) { // first worker in this node
+                is->workers[i].queue = is->queue_no++;
+            } else {
+                is->workers[i].queue = is->workers[q].queue;
+            }
+            is->workers[i].cpu = cpu[i];
+            is->workers[i].is = is;
+        }
+        free(cpu);
+        free(node);
 
         // mutexes/conditions initialization
-        pthread_mutex_init(&is->stack_lck, NULL);
+        is->queues = calloc(is->queue_no, sizeof(ishake_queue_t));
+        if (is->queues == NULL) {
+            return -1;
+        }
+        for (int q = 0; q < is->queue_no; q++) {
+            pthread_mutex_init(&is->queues[q].lck, NULL);
+            pthread_mutex_init(&is->queues[q].pool_lck, NULL);
+            pthread_cond_init(&is->queues[q].data_available, NULL);
+            pthread_cond_init(&is->queues[q].unparked, NULL);
+            is->queues[q].pool_cap = ISHAKE_POOL_BUFFERS * threads;
+            is->queues[q].pool = calloc(is->queues[q].pool_cap,
+                                        sizeof(unsigned char *));
+        }
         pthread_mutex_init(&is->combine_lck, NULL);
-        pthread_cond_init(&is->data_available, NULL);
 
         // initialize worker pool
         for (int i = 0; i < threads; i++) {
-            is->threads[i] = calloc(1, sizeof(pthread_t));
-            if (pthread_create(is->threads[i], NULL, _worker, (void *)is)) {
+            if (pthread_create(&is->workers[i].thread, NULL, _worker,
+                               (void *)&is->workers[i])) {
                 return -1;
             }
         }
@@ -212,46 +776,130 @@ int ishake_init(ishake_t *is,
 }
 
 
-int ishake_append(ishake_t *is, unsigned char *data, uint64_t len) {
-    if (!is || !data || is->mode == ISHAKE_FULL_MODE) return -1;
+/*
+ * Tell when a call starts, if we are tracing calls.
+ */
+uint64_t _trace_now(ishake_t *is) {
+    return is->trace ? _now() : 0;
+}
 
-    unsigned char *input = NULL;
-    input = calloc(len + is->remaining, sizeof(unsigned char));
-    if (input == NULL) return -1;
+
+/*
+ * Add a block to the record of a call, if we are tracing calls. Its data is
+ * copied if recorded, as the block is freed once hashed.
+ */
+void _trace_block(ishake_t *is, trace_record_t *rec, ishake_block_t *block) {
+    if (!is->trace || block == NULL) {
+        return;
+    }
+    rec->header[rec->parts] = block->header;
+    trace_part(is->trace, &rec->part[rec->parts], block->data,
+               block->data_len, 1);
+    rec->parts++;
+}
+
+
+/*
+ * Write the record of a call that started at start, if we are tracing.
+ */
+void _trace_end(ishake_t *is, trace_record_t *rec, uint64_t start) {
+    if (!is->trace) {
+        return;
+    }
+    rec->at = start - is->trace->start;
+    rec->took = _now() - start;
+    trace_write(is->trace, rec);
+}
+
+
+int _append_data(ishake_t *is,
+                 ishake_producer_t *p,
+                 unsigned char *data,
+                 uint64_t len) {
+    if (p->tail) { // fill the block we started absorbing first
+        uint32_t data_len = is->block_size - (uint32_t)sizeof(uint64_t);
+        uint64_t take = data_len - p->tail_len < len ?
+                        data_len - p->tail_len : len;
+        Keccak_HashUpdate(p->tail, data, (DataLength)take * 8);
+        p->tail_len += (uint32_t)take;
+        __atomic_add_fetch(&is->proc_bytes, take, __ATOMIC_RELAXED);
+        data += take;
+        len -= take;
+        if (p->tail_len < data_len) {
+            return 0;
+        }
+        _tail_close(is, p);
+    }
 
     // see if we have data pending from previous calls
-    if (is->remaining) {
-        memcpy(input, is->buf, is->remaining);
-        free(is->buf);
-        is->buf = NULL;
+    unsigned char *input = NULL;
+    unsigned char *ptr = data;
+    if (p->remaining) {
+        input = calloc(len + p->remaining, sizeof(unsigned char));
+        if (input == NULL) return -1;
+        memcpy(input, p->buf, p->remaining);
+        memcpy(input + p->remaining, data, len);
+        free(p->buf);
+        p->buf = NULL;
+        len += p->remaining;
+        ptr = input;
     }
-    memcpy(input + is->remaining, data, len);
-    len += is->remaining;
 
     // iterate over data, processing as many blocks as possible
-    unsigned char *ptr = input;
-    while (len >= (is->block_size - sizeof(uint64_t))) {
-        is->block_no++;
+    uint32_t data_len = is->block_size - (uint32_t)sizeof(uint64_t);
+    while (len >= data_len) {
+        _op_begin(is, p);
         ishake_block_t *block = malloc(sizeof(ishake_block_t));
-        block->header.value.idx = is->block_no;
+        block->header.value.idx = __atomic_add_fetch(&is->block_no, 1,
+                                                     __ATOMIC_RELAXED);
         block->header.length = sizeof(is->block_no);
-        block->data_len = is->block_size - sizeof(uint64_t);
-        block->data = calloc(block->data_len, sizeof(unsigned char));
-        memcpy(block->data, ptr, block->data_len);
+        block->data_len = data_len;
+
+        // the block is not ours anymore after handing it over
+        if (is->thrd_no > 0) {
+            // use a buffer from the NUMA node of the workers, if possible
+            uint16_t q = _next_queue(is);
+            block->data = _pool_get(is, q);
+            uint8_t pooled = block->data != NULL;
+            if (!pooled) {
+                block->data = malloc(data_len);
+            }
+            memcpy(block->data, ptr, data_len);
+            _enqueue(is, p, q, block, add_mod64, pooled);
+            _count(&is->stats.bulk_blocks);
+        } else {
+            block->data = malloc(data_len);
+            memcpy(block->data, ptr, data_len);
+            _hash_and_combine(is, p, block, add_mod64);
+        }
+        _op_end(is, p);
 
-        _hash_and_combine(is, block, add_mod64);
+        ptr += data_len;
+        __atomic_add_fetch(&is->proc_bytes, data_len, __ATOMIC_RELAXED);
+        len -= data_len;
+    }
 
-        ptr += block->data_len;
-        is->proc_bytes += block->data_len;
-        len -= block->data_len;
+    /*
+     * Without workers, start absorbing the remaining data right away, so
+     * that finishing the block takes just its index when it fills up or the
+     * input ends. Workers are given whole blocks instead, so the data waits.
+     */
+    if (len && is->thrd_no == 0) {
+        p->tail = malloc(sizeof(Keccak_HashInstance));
+        if (p->tail == NULL) return -1;
+        _keccak_init(is, p->tail);
+        Keccak_HashUpdate(p->tail, ptr, (DataLength)len * 8);
+        p->tail_len = (uint32_t)len;
+        __atomic_add_fetch(&is->proc_bytes, len, __ATOMIC_RELAXED);
+        len = 0;
     }
 
     // store remaining data
-    is->remaining = (uint32_t)len;
-    if (is->remaining) {
-        is->buf = calloc(is->remaining, sizeof(unsigned char));
-        if (is->buf == NULL) return -1;
-        memcpy(is->buf, ptr, is->remaining);
+    p->remaining = (uint32_t)len;
+    if (p->remaining) {
+        p->buf = calloc(p->remaining, sizeof(unsigned char));
+        if (p->buf == NULL) return -1;
+        memcpy(p->buf, ptr, p->remaining);
     }
     free(input);
 
@@ -259,21 +907,57 @@ int ishake_append(ishake_t *is, unsigned char *data, uint64_t len) {
 }
 
 
-int ishake_insert(ishake_t *is, ishake_block_t *new, ishake_block_t *next) {
-    if (is == NULL) {
-        return -1;
+/*
+ * Append data for a producer, recording the call if we are tracing.
+ */
+int _traced_append(ishake_t *is,
+                   ishake_producer_t *p,
+                   unsigned char *data,
+                   uint64_t len) {
+    if (!data || is->mode == ISHAKE_FULL_MODE) return -1;
+
+    trace_record_t rec = {.op = TRACE_APPEND, .parts = 1};
+    if (is->trace) {
+        trace_part(is->trace, &rec.part[0], data, len, 0);
     }
+    uint64_t start = _trace_now(is);
+    int r = _append_data(is, p, data, len);
+    _trace_end(is, &rec, start);
+    return r;
+}
 
+
+int ishake_append(ishake_t *is, unsigned char *data, uint64_t len) {
+    if (!is) return -1;
+    return _traced_append(is, &is->main, data, len);
+}
+
+
+int _update_block(ishake_t *is,
+                  ishake_producer_t *p,
+                  ishake_block_t *old,
+                  ishake_block_t *new) {
+    _op_begin(is, p);
+    _hash_and_combine(is, p, old, sub_mod64);
+    _hash_and_combine(is, p, new, add_mod64);
+    _op_end(is, p);
+
+    return 0;
+}
+
+
+int _insert_block(ishake_t *is,
+                  ishake_producer_t *p,
+                  ishake_block_t *new,
+                  ishake_block_t *next) {
     // insert() only available in FULL mode, 16 byte headers required per block
-    if (new->header.length != 16) {
+    if (new->header.length != 16 ||
+        (next != NULL && next->header.length != 16)) {
         return -1;
     }
 
+    _op_begin(is, p);
     if (next != NULL) {
-        if (next->header.length != 16) {
-            return -1;
-        }
-
         // clone the block to change the "next" pointer
         ishake_block_t *new_next = calloc(1, sizeof(ishake_block_t));
         new_next->data_len = next->data_len;
@@ -284,26 +968,52 @@ int ishake_insert(ishake_t *is, ishake_block_t *new, ishake_block_t *next) {
         memcpy(new_next->data, next->data, next->data_len);
 
         // rehash the previous block with "next" pointing to new block
-        ishake_update(is, next, new_next);
+        _update_block(is, p, next, new_next);
     }
 
     // add the new block
-    _hash_and_combine(is, new, add_mod64);
+    _hash_and_combine(is, p, new, add_mod64);
+    _op_end(is, p);
 
     return 0;
 }
 
 
-int ishake_delete(ishake_t *is, ishake_block_t *deleted, ishake_block_t *next) {
+/*
+ * Insert a block for a producer, recording the call if we are tracing.
+ */
+int _traced_insert(ishake_t *is,
+                   ishake_producer_t *p,
+                   ishake_block_t *new,
+                   ishake_block_t *next) {
+    trace_record_t rec = {.op = TRACE_INSERT};
+    _trace_block(is, &rec, new);
+    _trace_block(is, &rec, next);
+    uint64_t start = _trace_now(is);
+    int r = _insert_block(is, p, new, next);
+    _trace_end(is, &rec, start);
+    return r;
+}
+
+
+int ishake_insert(ishake_t *is, ishake_block_t *new, ishake_block_t *next) {
     if (is == NULL) {
         return -1;
     }
+    return _traced_insert(is, &is->main, new, next);
+}
 
-    if (next != NULL) {
-        if ((*next).header.length != 16) {
-            return -1;
-        }
 
+int _delete_block(ishake_t *is,
+                  ishake_producer_t *p,
+                  ishake_block_t *deleted,
+                  ishake_block_t *next) {
+    if (next != NULL && (*next).header.length != 16) {
+        return -1;
+    }
+
+    _op_begin(is, p);
+    if (next != NULL) {
         // clone the block to change the "next" pointer
         ishake_block_t *new_next = calloc(1, sizeof(ishake_block_t));
         new_next->data_len = next->data_len;
@@ -315,88 +1025,599 @@ int ishake_delete(ishake_t *is, ishake_block_t *deleted, ishake_block_t *next) {
 
         // "remove" the previous block, and add it back with the new "next"
         // pointer
-        ishake_update(is, next, new_next);
+        _update_block(is, p, next, new_next);
     }
 
     // delete the block
-    _hash_and_combine(is, deleted, sub_mod64);
+    _hash_and_combine(is, p, deleted, sub_mod64);
+    _op_end(is, p);
 
     return 0;
 }
 
 
+/*
+ * Delete a block for a producer, recording the call if we are tracing.
+ */
+int _traced_delete(ishake_t *is,
+                   ishake_producer_t *p,
+                   ishake_block_t *deleted,
+                   ishake_block_t *next) {
+    trace_record_t rec = {.op = TRACE_DELETE};
+    _trace_block(is, &rec, deleted);
+    _trace_block(is, &rec, next);
+    uint64_t start = _trace_now(is);
+    int r = _delete_block(is, p, deleted, next);
+    _trace_end(is, &rec, start);
+    return r;
+}
+
+
+int ishake_delete(ishake_t *is, ishake_block_t *deleted, ishake_block_t *next) {
+    if (is == NULL) {
+        return -1;
+    }
+    return _traced_delete(is, &is->main, deleted, next);
+}
+
+
+/*
+ * Update a block for a producer, recording the call if we are tracing.
+ */
+int _traced_update(ishake_t *is,
+                   ishake_producer_t *p,
+                   ishake_block_t *old,
+                   ishake_block_t *new) {
+    trace_record_t rec = {.op = TRACE_UPDATE};
+    _trace_block(is, &rec, old);
+    _trace_block(is, &rec, new);
+    uint64_t start = _trace_now(is);
+    int r = _update_block(is, p, old, new);
+    _trace_end(is, &rec, start);
+    return r;
+}
+
+
 int ishake_update(ishake_t *is, ishake_block_t *old, ishake_block_t *new) {
     if (is == NULL) {
         return -1;
     }
+    return _traced_update(is, &is->main, old, new);
+}
+
+
+ishake_producer_t *ishake_producer(ishake_t *is) {
+    if (!is || is->done || is->output != NULL) return NULL;
+
+    ishake_producer_t *p = calloc(1, sizeof(ishake_producer_t));
+    if (p == NULL) return NULL;
+    p->is = is;
+    for (int slot = 0; slot < 2; slot++) {
+        p->hash[slot] = calloc((size_t)is->output_len/64, sizeof(uint64_t));
+        if (p->hash[slot] == NULL) {
+            free(p->hash[0]);
+            free(p);
+            return NULL;
+        }
+    }
+
+    // no locks: producers are only ever added, at the head
+    p->next = __atomic_load_n(&is->producers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&is->producers, &p->next, p, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return p;
+}
 
-    _hash_and_combine(is, old, sub_mod64);
-    _hash_and_combine(is, new, add_mod64);
 
-    return 0;
+int ishake_producer_append(ishake_producer_t *p,
+                           unsigned char *data,
+                           uint64_t len) {
+    if (!p) return -1;
+    return _traced_append(p->is, p, data, len);
 }
 
 
-int ishake_final(ishake_t *is, uint8_t *output) {
-    if (output == NULL || is == NULL) return -1;
+int ishake_producer_insert(ishake_producer_t *p,
+                           ishake_block_t *new,
+                           ishake_block_t *next) {
+    if (!p) return -1;
+    return _traced_insert(p->is, p, new, next);
+}
 
-    uint64_t *empty = calloc((size_t)is->output_len/64, sizeof(uint64_t));
 
-    if (is->mode == ISHAKE_APPEND_ONLY_MODE &&
-         ( // we still need to hash, because either:
-           is->remaining || // there's still data remaining, or
-           ( // we didn't hash anything yet, so we need to hash an empty string
-             (memcmp(is->hash, empty, (size_t)is->output_len/64) == 0) &&
-             !is->proc_bytes
-           )
-         )
-    ) {
-        // hash the last remaining data
-        is->block_no++;
+int ishake_producer_delete(ishake_producer_t *p,
+                           ishake_block_t *deleted,
+                           ishake_block_t *next) {
+    if (!p) return -1;
+    return _traced_delete(p->is, p, deleted, next);
+}
+
+
+int ishake_producer_update(ishake_producer_t *p,
+                           ishake_block_t *old,
+                           ishake_block_t *new) {
+    if (!p) return -1;
+    return _traced_update(p->is, p, old, new);
+}
+
+
+/*
+ * Hash whatever a producer has left of its last block in APPEND mode.
+ */
+void _final_producer(ishake_t *is, ishake_producer_t *p) {
+    if (p->tail) { // the block being filled, or an empty one if nothing else
+        if (p->tail_len > 0 || is->block_no == 0) {
+            _tail_close(is, p);
+        } else {
+            free(p->tail);
+            p->tail = NULL;
+        }
+        return;
+    }
+    if (!p->remaining) {
+        return;
+    }
+
+    ishake_block_t *block = malloc(sizeof(ishake_block_t));
+    block->data = p->buf;
+    block->data_len = p->remaining;
+    block->header.value.idx = ++is->block_no;
+    block->header.length = sizeof(is->block_no);
+
+    _op_begin(is, p);
+    p->op_isolated = is->inline_bytes > 0; // nothing else is coming
+    _hash_and_combine(is, p, block, add_mod64);
+    _op_end(is, p);
+
+    is->proc_bytes += p->remaining;
+    p->remaining = 0;
+    p->buf = NULL;
+}
+
+
+/*
+ * Hash whatever is left at the end of the data in APPEND mode.
+ */
+void _final_block(ishake_t *is) {
+    if (is->mode != ISHAKE_APPEND_ONLY_MODE) {
+        return;
+    }
+    for (ishake_producer_t *p = &is->main; p; p = _next_producer(is, p)) {
+        _final_producer(is, p);
+    }
+
+    // we didn't hash anything yet, so we need to hash an empty string
+    uint64_t *empty = calloc((size_t)is->output_len/64, sizeof(uint64_t));
+    if (is->block_no == 0 && !is->proc_bytes &&
+        memcmp(is->hash, empty, (size_t)is->output_len/64) == 0) {
         ishake_block_t *block = malloc(sizeof(ishake_block_t));
-        block->data = is->buf;
-        block->data = calloc(is->remaining, sizeof(unsigned char));
-        memcpy(block->data, is->buf, is->remaining);
-        block->data_len = is->remaining;
-        block->header.value.idx = is->block_no;
+        block->data = calloc(1, sizeof(unsigned char));
+        block->data_len = 0;
+        block->header.value.idx = ++is->block_no;
         block->header.length = sizeof(is->block_no);
 
-        _hash_and_combine(is, block, add_mod64);
+        _op_begin(is, &is->main);
+        is->main.op_isolated = is->inline_bytes > 0;
+        _hash_and_combine(is, &is->main, block, add_mod64);
+        _op_end(is, &is->main);
+    }
+    free(empty);
+}
+
 
-        is->proc_bytes += is->remaining;
-        is->remaining = 0;
-        free(is->buf);
-        is->buf = NULL;
+/*
+ * Tell the workers to exit once there are no more tasks for them.
+ */
+void _stop_workers(ishake_t *is) {
+    is->done = 1;
+    for (int q = 0; q < is->queue_no; q++) {
+        pthread_mutex_lock(&is->queues[q].lck);
+        is->queues[q].done = 1;
+        pthread_cond_broadcast(&is->queues[q].data_available);
+        pthread_cond_broadcast(&is->queues[q].unparked);
+        pthread_mutex_unlock(&is->queues[q].lck);
     }
+}
 
-    if (is->thrd_no > 0) { // we are using threads, tell them we are done
-        pthread_mutex_lock(&is->stack_lck);
-        is->done = 1;
-        pthread_cond_broadcast(&is->data_available);
-        pthread_mutex_unlock(&is->stack_lck);
 
-        // block until all workers are done
-        for (int i = 0; i < is->thrd_no; i++) {
-            pthread_join(*(is->threads)[i], NULL);
-            free(is->threads[i]);
+/*
+ * Wait for all workers to exit and release everything they used.
+ */
+void _join_workers(ishake_t *is) {
+    for (int i = 0; i < is->thrd_no; i++) {
+        pthread_join(is->workers[i].thread, NULL);
+    }
+    free(is->workers);
+    is->workers = NULL;
+
+    for (int q = 0; q < is->queue_no; q++) {
+        for (uint32_t b = 0; b < is->queues[q].pool_len; b++) {
+            free(is->queues[q].pool[b]);
         }
-        free(is->threads);
+        free(is->queues[q].pool);
+        pthread_mutex_destroy(&is->queues[q].lck);
+        pthread_mutex_destroy(&is->queues[q].pool_lck);
+        pthread_cond_destroy(&is->queues[q].data_available);
+        pthread_cond_destroy(&is->queues[q].unparked);
+    }
+    free(is->queues);
+    is->queues = NULL;
+    pthread_mutex_destroy(&is->combine_lck);
+}
+
+
+int ishake_final(ishake_t *is, uint8_t *output) {
+    if (output == NULL || is == NULL || is->output != NULL) return -1;
+
+    uint64_t start = _trace_now(is);
+    _final_block(is);
+
+    if (is->workers || is->producers) { // what producers hashed themselves
+        _fold_inline(is);
+    }
+    if (is->thrd_no > 0 && is->workers) { // tell the workers we are done
+        _stop_workers(is);
+
+        // block until all workers are done and have added their accumulators
+        _join_workers(is);
     }
 
     // copy the resulting digest into output
     uint64_t2uint8_t(output, is->hash, (unsigned long)is->output_len/64);
 
+    trace_record_t rec = {.op = TRACE_FINAL, .digest = output};
+    _trace_end(is, &rec, start);
+    return 0;
+}
+
+
+int ishake_notify(ishake_t *is, int fd, ishake_callback cb, void *arg) {
+    if (is == NULL) return -1;
+
+    is->notify_fd = fd;
+    is->notify_cb = cb;
+    is->notify_arg = arg;
+    return 0;
+}
+
+
+int ishake_inline_policy(ishake_t *is,
+                         uint32_t max_bytes,
+                         uint64_t max_pending,
+                         uint64_t min_gap) {
+    if (is == NULL) return -1;
+
+    is->inline_bytes = max_bytes;
+    is->inline_pending = max_pending;
+    is->inline_gap = min_gap;
+    return 0;
+}
+
+
+int ishake_stats(ishake_t *is, ishake_stats_t *stats) {
+    if (is == NULL || stats == NULL) return -1;
+
+    stats->inline_blocks = __atomic_load_n(&is->stats.inline_blocks,
+                                           __ATOMIC_RELAXED);
+    stats->bulk_blocks = __atomic_load_n(&is->stats.bulk_blocks,
+                                         __ATOMIC_RELAXED);
+    stats->large_blocks = __atomic_load_n(&is->stats.large_blocks,
+                                          __ATOMIC_RELAXED);
+    stats->busy_blocks = __atomic_load_n(&is->stats.busy_blocks,
+                                         __ATOMIC_RELAXED);
+    stats->burst_blocks = __atomic_load_n(&is->stats.burst_blocks,
+                                          __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+int ishake_trace(ishake_t *is, const char *path, uint8_t what) {
+    if (!is || !path || what > ISHAKE_TRACE_DATA || is->trace) return -1;
+
+    trace_t *t = malloc(sizeof(trace_t));
+    if (t == NULL) return -1;
+    t->what = what;
+    t->mode = is->mode;
+    t->output_len = is->output_len;
+    t->block_size = is->block_size;
+    t->threads = is->adaptive ? ISHAKE_THREADS_AUTO : is->thrd_no;
+    if (trace_create(t, path)) {
+        free(t);
+        return -1;
+    }
+    is->trace = t;
+    return 0;
+}
+
+
+int ishake_submit_append(ishake_t *is, unsigned char *data, uint64_t len) {
+    if (!is || !is->workers || is->done) return -1;
+
+    is->main.op_submitted = 1;
+    int r = ishake_append(is, data, len);
+    is->main.op_submitted = 0;
+    return r;
+}
+
+
+int ishake_submit_insert(ishake_t *is,
+                         ishake_block_t *new,
+                         ishake_block_t *next) {
+    if (!is || !is->workers || is->done) return -1;
+
+    is->main.op_submitted = 1;
+    int r = ishake_insert(is, new, next);
+    is->main.op_submitted = 0;
+    return r;
+}
+
+
+int ishake_submit_delete(ishake_t *is,
+                         ishake_block_t *deleted,
+                         ishake_block_t *next) {
+    if (!is || !is->workers || is->done) return -1;
+
+    is->main.op_submitted = 1;
+    int r = ishake_delete(is, deleted, next);
+    is->main.op_submitted = 0;
+    return r;
+}
+
+
+int ishake_submit_update(ishake_t *is,
+                         ishake_block_t *old,
+                         ishake_block_t *new) {
+    if (!is || !is->workers || is->done) return -1;
+
+    is->main.op_submitted = 1;
+    int r = ishake_update(is, old, new);
+    is->main.op_submitted = 0;
+    return r;
+}
+
+
+int ishake_final_async(ishake_t *is, uint8_t *output) {
+    if (output == NULL || is == NULL || is->output != NULL) return -1;
+
+    // the digest is not there yet when we return, so it's not recorded
+    trace_record_t rec = {.op = TRACE_FINAL};
+    uint64_t start = _trace_now(is);
+    _final_block(is);
+    is->output = output;
+
+    if (is->workers || is->producers) { // what producers hashed themselves
+        _fold_inline(is);
+    }
+    if (is->thrd_no > 0 && is->workers) {
+        // the last worker to exit will write the result and notify
+        _stop_workers(is);
+        _trace_end(is, &rec, start);
+        return 0;
+    }
+
+    // no threads, we already have the result
+    uint64_t2uint8_t(output, is->hash, (unsigned long)is->output_len/64);
+    is->finished = 1;
+    _trace_end(is, &rec, start);
+    _notify(is);
+    return 0;
+}
+
+
+int ishake_ready(ishake_t *is) {
+    if (is == NULL || is->output == NULL) return -1;
+    return __atomic_load_n(&is->finished, __ATOMIC_SEQ_CST);
+}
+
+
+uint64_t ishake_pending(ishake_t *is) {
+    if (is == NULL) return 0;
+    return __atomic_load_n(&is->pending, __ATOMIC_SEQ_CST);
+}
+
+
+int ishake_snapshot(ishake_t *is, uint8_t *output, uint64_t *seq) {
+    if (output == NULL || is == NULL || is->done || is->output != NULL ||
+        is->snap_sum[0] == NULL || is->snap_sum[1] == NULL) return -1;
+
+    uint16_t words = (uint16_t)(is->output_len/64);
+    uint64_t *sum = calloc(words, sizeof(uint64_t));
+    if (sum == NULL) return -1;
+
+    uint64_t start = _trace_now(is);
+    pthread_mutex_lock(&is->snap_lck);
+    uint64_t point;
+    if (is->thrd_no == 0 &&
+        !__atomic_load_n(&is->producers, __ATOMIC_ACQUIRE)) { // all in hash
+        _hash_read(is, sum, &point);
+    } else {
+        // close the current epoch, and wait for the blocks handed over in it
+        uint64_t e = __atomic_fetch_add(&is->epoch, 1, __ATOMIC_SEQ_CST);
+        uint8_t slot = (uint8_t)(e & 1);
+        while (__atomic_load_n(&is->epoch_pending[slot], __ATOMIC_SEQ_CST)) {
+            sched_yield();
+        }
+
+        // nobody touches the accumulators of this parity until the next
+        // snapshot, and those of the other one already had everything from
+        // the previous epoch when we added them up in the last snapshot
+        memset(is->snap_sum[slot], 0, words * sizeof(uint64_t));
+        for (int i = 0; i < is->thrd_no; i++) {
+            uint64_t *acc = __atomic_load_n(&is->workers[i].hash[slot],
+                                            __ATOMIC_ACQUIRE);
+            if (acc) {
+                combine(is->snap_sum[slot], acc, words, add_mod64);
+            }
+        }
+        for (ishake_producer_t *p = &is->main; p;
+             p = _next_producer(is, p)) { // and what producers hashed
+            if (p->hash[slot]) {
+                combine(is->snap_sum[slot], p->hash[slot], words, add_mod64);
+            }
+        }
+
+        // blocks without an accumulator of their own went to the hash, with
+        // the operations of the hash's own producer if there are no threads
+        _hash_read(is, sum, &point);
+        combine(sum, is->snap_sum[0], words, add_mod64);
+        combine(sum, is->snap_sum[1], words, add_mod64);
+        is->snap_seq += __atomic_exchange_n(&is->epoch_ops[slot], 0,
+                                            __ATOMIC_SEQ_CST);
+        point += is->snap_seq;
+    }
+    pthread_mutex_unlock(&is->snap_lck);
+
+    uint64_t2uint8_t(output, sum, (unsigned long)words);
+    if (seq != NULL) {
+        *seq = point;
+    }
+    free(sum);
+
+    trace_record_t rec = {.op = TRACE_SNAPSHOT, .seq = point};
+    _trace_end(is, &rec, start);
     return 0;
 }
 
 
 void ishake_cleanup(ishake_t *is) {
-    if (is->buf) free(is->buf);
+    if (is->workers) {
+        _stop_workers(is);
+        _join_workers(is);
+    }
     if (is->hash) free(is->hash);
+    free(is->main.buf);
+    free(is->main.tail);
+    free(is->main.hash[0]);
+    free(is->main.hash[1]);
+    while (is->producers) {
+        ishake_producer_t *p = is->producers;
+        is->producers = p->next;
+        free(p->buf);
+        free(p->tail);
+        free(p->hash[0]);
+        free(p->hash[1]);
+        free(p);
+    }
+    if (is->trace) {
+        trace_close(is->trace);
+        free(is->trace);
+    }
+    free(is->snap_sum[0]);
+    free(is->snap_sum[1]);
+    pthread_mutex_destroy(&is->snap_lck);
     free(is);
 }
 
 
+/*
+ * The layout of a saved tail, in native byte order.
+ */
+#define ISHAKE_TAIL_MAGIC "iSHAKEtl"
+#define ISHAKE_TAIL_VERSION 1
+#define TAIL_OUTPUT_LEN 12
+#define TAIL_BLOCK_SIZE 16
+#define TAIL_LEN 20
+#define TAIL_BLOCK_NO 24
+#define TAIL_PROC_BYTES 32
+#define TAIL_IO_INDEX 40
+#define TAIL_RATE 44
+#define TAIL_STATE 48
+
+
+int ishake_tail(ishake_t *is, uint8_t *tail) {
+    if (!is || !tail || is->mode != ISHAKE_APPEND_ONLY_MODE ||
+        is->output != NULL || is->done || is->producers) return -1;
+
+    // the Keccak state of the last block, absorbing what we kept of it
+    Keccak_HashInstance keccak;
+    uint32_t tail_len = is->main.tail_len;
+    uint64_t proc_bytes = is->proc_bytes;
+    if (is->main.tail) {
+        keccak = *is->main.tail;
+    } else {
+        _keccak_init(is, &keccak);
+        Keccak_HashUpdate(&keccak, is->main.buf,
+                          (DataLength)is->main.remaining * 8);
+        tail_len = is->main.remaining;
+        proc_bytes += is->main.remaining;
+    }
+
+    uint32_t version = ISHAKE_TAIL_VERSION;
+    memset(tail, 0, ISHAKE_TAIL_LEN);
+    memcpy(tail, ISHAKE_TAIL_MAGIC, 8);
+    memcpy(tail + 8, &version, sizeof(uint32_t));
+    memcpy(tail + TAIL_OUTPUT_LEN, &is->output_len, sizeof(uint16_t));
+    memcpy(tail + TAIL_BLOCK_SIZE, &is->block_size, sizeof(uint32_t));
+    memcpy(tail + TAIL_LEN, &tail_len, sizeof(uint32_t));
+    memcpy(tail + TAIL_BLOCK_NO, &is->block_no, sizeof(uint64_t));
+    memcpy(tail + TAIL_PROC_BYTES, &proc_bytes, sizeof(uint64_t));
+    memcpy(tail + TAIL_IO_INDEX, &keccak.sponge.byteIOIndex,
+           sizeof(uint32_t));
+    memcpy(tail + TAIL_RATE, &keccak.sponge.rate, sizeof(uint32_t));
+    memcpy(tail + TAIL_STATE, keccak.sponge.state,
+           sizeof(keccak.sponge.state));
+    return 0;
+}
+
+
+int ishake_extend(ishake_t *is,
+                  const uint8_t *digest,
+                  const uint8_t *tail,
+                  uint16_t threads) {
+    if (!is || !digest || !tail) return -1;
+
+    uint32_t version, block_size, tail_len, io_index, rate;
+    uint16_t output_len;
+    uint64_t block_no, proc_bytes;
+    memcpy(&version, tail + 8, sizeof(uint32_t));
+    memcpy(&output_len, tail + TAIL_OUTPUT_LEN, sizeof(uint16_t));
+    memcpy(&block_size, tail + TAIL_BLOCK_SIZE, sizeof(uint32_t));
+    memcpy(&tail_len, tail + TAIL_LEN, sizeof(uint32_t));
+    memcpy(&block_no, tail + TAIL_BLOCK_NO, sizeof(uint64_t));
+    memcpy(&proc_bytes, tail + TAIL_PROC_BYTES, sizeof(uint64_t));
+    memcpy(&io_index, tail + TAIL_IO_INDEX, sizeof(uint32_t));
+    memcpy(&rate, tail + TAIL_RATE, sizeof(uint32_t));
+    if (memcmp(tail, ISHAKE_TAIL_MAGIC, 8) != 0 ||
+        version != ISHAKE_TAIL_VERSION) {
+        return -1;
+    }
+
+    if (ishake_init(is, block_size, output_len, ISHAKE_APPEND_ONLY_MODE,
+                    threads)) {
+        return -1;
+    }
+
+    // the state must be the one of a block in the middle of its data
+    Keccak_HashInstance *keccak = malloc(sizeof(Keccak_HashInstance));
+    if (keccak == NULL) return -1;
+    _keccak_init(is, keccak);
+    if (rate != keccak->sponge.rate || io_index >= rate / 8 ||
+        tail_len >= block_size - (uint32_t)sizeof(uint64_t)) {
+        free(keccak);
+        return -1;
+    }
+    keccak->sponge.byteIOIndex = io_index;
+    memcpy(keccak->sponge.state, tail + TAIL_STATE,
+           sizeof(keccak->sponge.state));
+
+    // take the last block out of the digest, if it was in
+    uint8_t2uint64_t(is->hash, (uint8_t *)digest,
+                     (unsigned long)is->output_len/8);
+    if (tail_len > 0 || block_no == 0) {
+        uint64_t hash[16512 / 64];
+        _keccak_finish(is, keccak, block_no + 1, hash);
+        combine(is->hash, hash, (uint16_t)(is->output_len/64), sub_mod64);
+    }
+
+    is->block_no = block_no;
+    is->proc_bytes = proc_bytes;
+    is->main.tail = keccak;
+    is->main.tail_len = tail_len;
+    return 0;
+}
+
+
 int ishake_hash_p(unsigned char *data,
                 uint64_t len,
                 uint8_t *hash,
@@ -438,3 +1659,133 @@ int ishake_hash(unsigned char *data,
                 uint16_t hashbitlen) {
     return ishake_hash_p(data, len, hash, hashbitlen, 0);
 }
+
+
+/*
+ * The messages given to ishake_hash_many(), handed out to its threads in
+ * chunks of consecutive messages.
+ */
+typedef struct {
+    unsigned char **data;
+    const uint64_t *len;
+    uint8_t **hash;
+    size_t count;
+    size_t next; // the first message not handed out yet
+    uint16_t hashbitlen;
+} ishake_many_t;
+
+
+/*
+ * Hash chunks of messages until there are none left. The blocks of the
+ * messages in a chunk are laid out one after the other and hashed four at a
+ * time, each in a lane of the multi-buffer permutation, so that short
+ * messages fill the lanes as well as long ones. Since a message's blocks are
+ * consecutive, a single accumulator is enough, written out to the message's
+ * digest as soon as a block of the next message shows up.
+ */
+void *_hash_many_worker(void *arg) {
+    ishake_many_t *m = (ishake_many_t *) arg;
+    uint32_t data_len = (uint32_t) ISHAKE_BLOCK_SIZE - sizeof(uint64_t);
+    unsigned int rate = m->hashbitlen <= 4160 ? 168 : 136;
+    size_t outlen = (size_t) m->hashbitlen / 8;
+    uint16_t words = (uint16_t) (m->hashbitlen / 64);
+
+    uint64_t acc[16512 / 64], hash[16512 / 64];
+    uint8_t buf[KECCAK_X4_LANES][16512 / 8];
+    uint64_t idx[KECCAK_X4_LANES];
+    const uint8_t *seg[KECCAK_X4_LANES][2];
+    size_t seg_len[KECCAK_X4_LANES][2];
+    const uint8_t **in[KECCAK_X4_LANES];
+    const size_t *len[KECCAK_X4_LANES];
+    unsigned int n[KECCAK_X4_LANES];
+    uint8_t *out[KECCAK_X4_LANES];
+    size_t msg[KECCAK_X4_LANES];
+
+    while (1) {
+        size_t cur = __sync_fetch_and_add(&m->next, ISHAKE_MANY_CHUNK);
+        if (cur >= m->count) {
+            break;
+        }
+        size_t last = cur + ISHAKE_MANY_CHUNK < m->count ?
+                      cur + ISHAKE_MANY_CHUNK : m->count;
+        size_t acc_msg = cur;
+        uint64_t pos = 0, block_no = 0;
+        memset(acc, 0, words * sizeof(uint64_t));
+
+        while (cur < last) {
+            // take the next blocks, as in ishake_append() and _final_block()
+            unsigned int lanes = 0;
+            for (; lanes < KECCAK_X4_LANES && cur < last; lanes++) {
+                uint64_t left = m->len[cur] - pos;
+                uint32_t take = left < data_len ? (uint32_t) left : data_len;
+                idx[lanes] = swap_uint64(++block_no);
+                seg[lanes][0] = m->data[cur] + pos;
+                seg[lanes][1] = (uint8_t *) &idx[lanes];
+                seg_len[lanes][0] = take;
+                seg_len[lanes][1] = sizeof(uint64_t);
+                in[lanes] = seg[lanes];
+                len[lanes] = seg_len[lanes];
+                n[lanes] = 2;
+                out[lanes] = buf[lanes];
+                msg[lanes] = cur;
+
+                pos += take;
+                if (pos == m->len[cur]) { // also true for empty messages
+                    cur++;
+                    pos = 0;
+                    block_no = 0;
+                }
+            }
+            keccak_x4_hash(rate, 24, 0x1F, lanes, in, len, n, out, outlen);
+
+            for (unsigned int l = 0; l < lanes; l++) {
+                if (msg[l] != acc_msg) {
+                    uint64_t2uint8_t(m->hash[acc_msg], acc, words);
+                    memset(acc, 0, words * sizeof(uint64_t));
+                    acc_msg = msg[l];
+                }
+                uint8_t2uint64_t(hash, buf[l], (unsigned long) outlen);
+                combine(acc, hash, words, add_mod64);
+            }
+        }
+        uint64_t2uint8_t(m->hash[acc_msg], acc, words);
+    }
+    return NULL;
+}
+
+
+int ishake_hash_many(unsigned char **data,
+                     const uint64_t *len,
+                     uint8_t **hash,
+                     size_t count,
+                     uint16_t hashbitlen,
+                     uint16_t threadno) {
+    if (!data || !len || !hash) return -1;
+    if (hashbitlen % 64 || hashbitlen < 2688 || hashbitlen > 16512 ||
+        (hashbitlen > 4160 && hashbitlen < 6528)) {
+        return -1;
+    }
+
+    ishake_many_t m = {data, len, hash, count, 0, hashbitlen};
+    if (threadno == 0) {
+        _hash_many_worker(&m);
+        return 0;
+    }
+
+    pthread_t *threads = calloc(threadno, sizeof(pthread_t));
+    if (threads == NULL) return -1;
+    uint16_t started = 0;
+    for (; started < threadno; started++) {
+        if (pthread_create(&threads[started], NULL, _hash_many_worker, &m)) {
+            break;
+        }
+    }
+    if (started == 0) { // no threads at all, do it here
+        _hash_many_worker(&m);
+    }
+    for (uint16_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return 0;
+}
@@ -30,7 +30,9 @@
 #include <math.h>
 #include <pthread.h>
 
+#include "affinity.h"
 #include "modulo_arithmetics.h"
+#include "KeccakHash.h"
 
 #ifndef _ISHAKE_H
 #define _ISHAKE_H
@@ -39,9 +41,54 @@
 #define ISHAKE_BLOCK_SIZE 100*1024 // 100KB by default
 #endif
 
+#ifndef ISHAKE_MANY_CHUNK
+#define ISHAKE_MANY_CHUNK 256 // messages taken at a time by ishake_hash_many()
+#endif
+
 #define ISHAKE_APPEND_ONLY_MODE 0
 #define ISHAKE_FULL_MODE 1
 
+// pass as the amount of threads to size the pool after the CPUs available
+#define ISHAKE_THREADS_AUTO 0xFFFF
+
+// pending tasks per active worker above which another worker is woken up
+#ifndef ISHAKE_ADAPT_GROW
+#define ISHAKE_ADAPT_GROW 2
+#endif
+
+// blocks found with no pending tasks in a row before a worker is parked
+#ifndef ISHAKE_ADAPT_SHRINK
+#define ISHAKE_ADAPT_SHRINK 64
+#endif
+
+// blocks of incremental operations this small may be hashed by the caller...
+#ifndef ISHAKE_INLINE_BYTES
+#define ISHAKE_INLINE_BYTES 16384
+#endif
+
+// ...when the workers have no more than this amount of blocks pending...
+#ifndef ISHAKE_INLINE_PENDING
+#define ISHAKE_INLINE_PENDING 0
+#endif
+
+// ...and the previous operation finished at least this long ago, in ns
+#ifndef ISHAKE_INLINE_GAP
+#define ISHAKE_INLINE_GAP 100000
+#endif
+
+// size of the state saved by ishake_tail() to resume hashing later
+#define ISHAKE_TAIL_LEN 256
+
+// what ishake_trace() records of the data handed over in each call
+#define ISHAKE_TRACE_SIZES 0    // just how long it is
+#define ISHAKE_TRACE_HASHES 1   // and a 64-bit hash to tell it apart
+#define ISHAKE_TRACE_DATA 2     // all of it, so that replaying is exact
+
+// amount of block buffers each worker prepares in its NUMA node
+#ifndef ISHAKE_POOL_BUFFERS
+#define ISHAKE_POOL_BUFFERS 4
+#endif
+
 /**
  * Type definition for a function that obtains the hash of some data.
  */
@@ -69,6 +116,10 @@ typedef struct {
 
 /**
  * A block to be used in the iSHAKE algorithm.
+ *
+ * Blocks (and their data) passed to the interface must be allocated with
+ * malloc(), and belong to iSHAKE afterwards. They will be freed as soon as
+ * they are hashed.
  */
 typedef struct {
     unsigned char *data;
@@ -82,37 +133,161 @@ typedef struct {
 typedef struct _task_t {
     group_op op;
     ishake_block_t *block;
+    uint8_t pooled;
+    uint64_t epoch;
     struct _task_t *prev;
 } ishake_task_t;
 typedef ishake_task_t* ishake_stack_t;
 
+/**
+ * A queue of tasks, shared by all the workers running in the same NUMA node,
+ * and a pool of block buffers allocated in that node. Tasks are pushed onto
+ * the stack without taking lck, which is only needed to take them from it
+ * and to wait for them.
+ */
+typedef struct {
+    pthread_mutex_t lck;
+    pthread_cond_t data_available;
+    pthread_cond_t unparked;
+    ishake_stack_t stack;
+    uint8_t done;
+    pthread_mutex_t pool_lck;
+    unsigned char **pool;
+    uint32_t pool_len;
+    uint32_t pool_cap;
+} ishake_queue_t;
+
+/**
+ * A worker thread, with the CPU it runs on (or -1 if it is not pinned), the
+ * queue it takes tasks from, and its own accumulators, one for the tasks of
+ * even snapshot epochs and another one for the odd ones.
+ */
+typedef struct {
+    struct _ishake_t *is;
+    pthread_t thread;
+    int cpu;
+    uint16_t queue;
+    uint64_t *hash[2];
+} ishake_worker_t;
+
+/**
+ * Where blocks were hashed. With threads, the blocks of an incremental
+ * operation (or the last one appended) are hashed by the caller when it is
+ * small and isolated, and handed over to the workers otherwise, for one of
+ * the reasons counted here. Appended blocks always go to the workers, and so
+ * do those of ishake_submit_*(). Without threads, every block is hashed by
+ * the caller.
+ */
+typedef struct {
+    uint64_t inline_blocks;     // hashed by the caller
+    uint64_t bulk_blocks;       // appended or submitted, and handed over
+    uint64_t large_blocks;      // handed over, larger than the inline limit
+    uint64_t busy_blocks;       // handed over, too many blocks were pending
+    uint64_t burst_blocks;      // handed over, the operations came in a row
+} ishake_stats_t;
+
+/**
+ * One of the callers adding data to a hash at the same time as others, with
+ * what it needs for itself so that producers never wait for each other: the
+ * operation it is in, the data of its last block, and its own accumulators
+ * for the blocks it hashes, by snapshot epoch parity like the workers. The
+ * functions taking just the hash use a producer of its own.
+ */
+typedef struct _ishake_producer_t {
+    struct _ishake_t *is;
+    uint32_t op_depth;
+    uint64_t op_epoch;
+    uint8_t op_isolated;
+    uint8_t op_submitted;       // the workers must hash it, and notify
+
+    // the last block, waiting for data or absorbing it as it comes
+    uint32_t remaining;
+    unsigned char *buf;
+    Keccak_HashInstance *tail;
+    uint32_t tail_len;
+
+    uint64_t *hash[2];
+    struct _ishake_producer_t *next;
+} ishake_producer_t;
+
+/**
+ * Type definition for a function to be called when asynchronous work finishes.
+ */
+typedef void (*ishake_callback)(struct _ishake_t *is, void *arg);
+
 /**
  * Type definition of the ishake main structure. It keeps the status of the
  * algorithm at any given point in time.
  */
-typedef struct {
+typedef struct _ishake_t {
     uint8_t mode;
     uint64_t block_no;
     uint32_t block_size;
     uint16_t output_len;
     uint64_t proc_bytes;
-    uint32_t remaining;
     uint64_t *hash;
-    unsigned char *buf;
+
+    // who adds data: ishake_append() and the like, and ishake_producer()s
+    ishake_producer_t main;
+    ishake_producer_t *producers;
 
     // threading related properties
     uint16_t thrd_no;
-    pthread_t **threads;
+    uint8_t affinity;
     uint8_t done;
-    pthread_mutex_t stack_lck;
+    ishake_worker_t *workers;
+    ishake_queue_t *queues;
+    uint16_t queue_no;
+    uint16_t next_worker;
     pthread_mutex_t combine_lck;
-    pthread_cond_t data_available;
-    ishake_stack_t stack;
+
+    // adaptive pool size, with workers from active on parked
+    uint8_t adaptive;
+    uint16_t active;
+    uint32_t idle_seen;
+
+    // small operations hashed by the caller, with their own accumulators
+    uint32_t inline_bytes;
+    uint64_t inline_pending;
+    uint64_t inline_gap;
+    uint64_t last_op;           // when the previous operation finished, in ns
+    ishake_stats_t stats;
+
+    // the calls recorded so far, if asked to
+    struct _trace_t *trace;
+
+    // asynchronous operation
+    uint64_t pending;
+    uint16_t live;
+    uint8_t finished;
+    uint8_t *output;
+    int notify_fd;
+    ishake_callback notify_cb;
+    void *notify_arg;
+
+    // snapshots
+    uint32_t hash_seq;          // seqlock protecting hash
+    uint64_t seq;               // operations in hash, without threads
+    uint64_t epoch;
+    uint64_t epoch_pending[2];  // tasks not hashed yet, by epoch parity
+    uint64_t epoch_ops[2];      // operations finished, by parity
+    uint64_t *snap_sum[2];      // what the workers had, by parity
+    uint64_t snap_seq;          // operations in the epochs closed so far
+    pthread_mutex_t snap_lck;
 } ishake_t;
 
 
 /**
  * Initialize a hash.
+ *
+ * threads workers will hash blocks in the background, or none if 0. With
+ * ISHAKE_THREADS_AUTO, there are as many as CPUs this process can keep busy
+ * (see affinity_cpus()) minus the one producing the data, and only as many
+ * of them as needed are active at any time: another one is woken up when
+ * more than ISHAKE_ADAPT_GROW blocks per active worker are pending, and one
+ * is parked when ISHAKE_ADAPT_SHRINK blocks in a row find all previous ones
+ * already hashed, as when data arrives slower than it can be hashed. If only
+ * one CPU is available, no threads are used at all.
  */
 int ishake_init(ishake_t *is,
                 uint32_t blk_size,
@@ -120,6 +295,54 @@ int ishake_init(ishake_t *is,
                 uint8_t mode,
                 uint16_t threads);
 
+/**
+ * Initialize a hash, pinning the worker threads to CPUs according to an
+ * affinity policy (one of the ISHAKE_AFFINITY_* constants). cpus is the list
+ * of CPUs to use with ISHAKE_AFFINITY_LIST, and ignored otherwise.
+ *
+ * Workers running in the same NUMA node share a queue of tasks and a pool of
+ * block buffers allocated in that node, and each of them keeps its own
+ * accumulator until ishake_final() is called.
+ */
+int ishake_init_affinity(ishake_t *is,
+                         uint32_t blk_size,
+                         uint16_t hashbitlen,
+                         uint8_t mode,
+                         uint16_t threads,
+                         uint8_t affinity,
+                         const char *cpus);
+
+
+/**
+ * Change when blocks are hashed by the calling thread instead of the workers:
+ * blocks of incremental operations no larger than max_bytes, when the workers
+ * have no more than max_pending blocks pending, and the previous operation
+ * finished at least min_gap nanoseconds before, so that operations coming in
+ * a row are still hashed in parallel. Such a block is in the digest as soon
+ * as the call returns, instead of waiting for a worker to wake up. A
+ * max_bytes of 0 hands every block over. The defaults are
+ * ISHAKE_INLINE_BYTES, ISHAKE_INLINE_PENDING and ISHAKE_INLINE_GAP.
+ */
+int ishake_inline_policy(ishake_t *is,
+                         uint32_t max_bytes,
+                         uint64_t max_pending,
+                         uint64_t min_gap);
+
+/**
+ * Obtain how many blocks have been hashed by the calling thread and how many
+ * were handed over to the workers, and why.
+ */
+int ishake_stats(ishake_t *is, ishake_stats_t *stats);
+
+/**
+ * Record every call made on this structure from now on to a trace file at
+ * path, with when it started and how long it took, so that ishakereplay can
+ * run the same workload again. what tells whether the data handed over is
+ * recorded (ISHAKE_TRACE_DATA), or just a hash of it (ISHAKE_TRACE_HASHES),
+ * or only its length (ISHAKE_TRACE_SIZES). Call it right after initializing
+ * the structure. The trace is closed by ishake_cleanup().
+ */
+int ishake_trace(ishake_t *is, const char *path, uint8_t what);
 
 /**
  * Append data to be hashed. Its size doesn't need to be multiple of the block
@@ -134,7 +357,9 @@ int ishake_append(ishake_t *is, unsigned char *data, uint64_t len);
  *
  * Pass NULL as next when inserting the last block.
  */
-int ishake_insert(ishake_t *is, ishake_block_t *new, ishake_block_t *next);
+int ishake_insert(ishake_t *is,
+                  ishake_block_t *new_block,
+                  ishake_block_t *next);
 
 /**
  * Delete a block, updating the next block in the list to point to the
@@ -147,13 +372,155 @@ int ishake_delete(ishake_t *is, ishake_block_t *deleted, ishake_block_t *next);
 /**
  * Update a block with new data. Old data must be provided too.
  */
-int ishake_update(ishake_t *is, ishake_block_t *old, ishake_block_t *new);
+int ishake_update(ishake_t *is,
+                  ishake_block_t *old,
+                  ishake_block_t *new_block);
+
+/**
+ * Get a producer to add data to a hash at the same time as other threads.
+ * Every thread needs its own: the functions taking a producer are safe to
+ * call while other producers (and one thread using the functions taking
+ * just the hash) call them too, and snapshots can be taken meanwhile. Blocks
+ * are handed over to the workers without a lock, unless one has to be woken
+ * up or a buffer is taken from their pool. Producers are freed by
+ * ishake_cleanup().
+ *
+ * In APPEND mode, the index of each block is taken when it is full, so
+ * blocks of different producers come in the order they were filled, and
+ * data appended by a producer never shares a block with that of another.
+ * What producers have left when ishake_final() is called goes in a last
+ * block each, so they must all be done by then.
+ */
+ishake_producer_t *ishake_producer(ishake_t *is);
+
+/**
+ * Append data to be hashed by a producer, as ishake_append() does.
+ */
+int ishake_producer_append(ishake_producer_t *p,
+                           unsigned char *data,
+                           uint64_t len);
+
+/**
+ * Insert a block from a producer, as ishake_insert() does.
+ */
+int ishake_producer_insert(ishake_producer_t *p,
+                           ishake_block_t *new_block,
+                           ishake_block_t *next);
+
+/**
+ * Delete a block from a producer, as ishake_delete() does.
+ */
+int ishake_producer_delete(ishake_producer_t *p,
+                           ishake_block_t *deleted,
+                           ishake_block_t *next);
+
+/**
+ * Update a block from a producer, as ishake_update() does.
+ */
+int ishake_producer_update(ishake_producer_t *p,
+                           ishake_block_t *old,
+                           ishake_block_t *new_block);
+
+/**
+ * Obtain the hash of a single block, as it would be combined into the digest.
+ * The block is not modified nor freed, and the result must be freed by the
+ * caller. This is safe to call from several threads at the same time.
+ */
+uint64_t *ishake_hash_block(ishake_t *is, ishake_block_t *block);
 
 /**
  * Finalise the process and get the hash result.
  */
 int ishake_final(ishake_t *is, uint8_t *output);
 
+/**
+ * Get notified when asynchronous work completes. Every time all the blocks
+ * submitted so far have been hashed, and once the digest requested with
+ * ishake_final_async() is ready, an 8 byte counter of 1 is written to fd (an
+ * eventfd, or -1 for none) and cb is called with arg (if not NULL).
+ *
+ * The callback runs in one of the worker threads, so it must be quick and
+ * must not call any other function of the interface on the same structure.
+ */
+int ishake_notify(ishake_t *is, int fd, ishake_callback cb, void *arg);
+
+/**
+ * Asynchronous versions of ishake_append(), ishake_insert(), ishake_delete()
+ * and ishake_update(). They hand the blocks over to the workers and return
+ * right away, without waiting for any of them to be hashed, so they are only
+ * available when the structure was initialized with threads. Small blocks
+ * are never hashed by the caller here, whatever ishake_inline_policy() says,
+ * so that ishake_notify() tells when they are done.
+ */
+int ishake_submit_append(ishake_t *is, unsigned char *data, uint64_t len);
+int ishake_submit_insert(ishake_t *is,
+                         ishake_block_t *new_block,
+                         ishake_block_t *next);
+int ishake_submit_delete(ishake_t *is,
+                         ishake_block_t *deleted,
+                         ishake_block_t *next);
+int ishake_submit_update(ishake_t *is,
+                         ishake_block_t *old,
+                         ishake_block_t *new_block);
+
+/**
+ * Finalise the process without waiting for it. The hash result is written to
+ * output once all pending blocks have been hashed, which is notified as
+ * configured with ishake_notify(), and can be checked with ishake_ready().
+ */
+int ishake_final_async(ishake_t *is, uint8_t *output);
+
+/**
+ * Check whether the result requested by ishake_final_async() is ready.
+ * Returns 1 if it is, 0 if it isn't, or -1 if it was never requested.
+ */
+int ishake_ready(ishake_t *is);
+
+/**
+ * Obtain the amount of blocks handed over to the workers and not hashed yet.
+ */
+uint64_t ishake_pending(ishake_t *is);
+
+/**
+ * Get the digest of every operation handed over so far, without finalising
+ * the process, so that more data can be hashed afterwards. Every block
+ * appended, and every call to ishake_insert(), ishake_delete() and
+ * ishake_update(), is an operation, and the digest covers all of them up to
+ * a sequence point, written to seq (if not NULL): the amount of operations
+ * included. Data left over by ishake_append() waiting for a full block is
+ * not included. With producers, operations running at the same time as the
+ * snapshot may be included or not, but never in part.
+ *
+ * This can be called from any thread while others keep handing data over,
+ * and waits for the blocks of the operations included to be hashed, but
+ * never stops the workers. It must not be called once ishake_final() or
+ * ishake_final_async() is.
+ */
+int ishake_snapshot(ishake_t *is, uint8_t *output, uint64_t *seq);
+
+/**
+ * Save what is needed to resume hashing in APPEND mode later on, without
+ * reading any of the data again: the amount of blocks and bytes so far, and
+ * the Keccak state of the last (partial) block with its data absorbed. The
+ * ISHAKE_TAIL_LEN bytes written to tail go with the digest ishake_final()
+ * gives right after, and are only valid for the same build of the library.
+ * There is no tail to save once ishake_producer() has been called.
+ */
+int ishake_tail(ishake_t *is, uint8_t *tail);
+
+/**
+ * Initialize a hash to go on from where ishake_tail() left it, so that
+ * appending more data and calling ishake_final() gives the digest of all the
+ * data, old and new. digest is the one ishake_final() gave after the tail
+ * was saved. The last block is not hashed again from its first byte: the new
+ * data is absorbed into its saved state, and its old hash is taken out of
+ * the digest by just finishing that state once more.
+ */
+int ishake_extend(ishake_t *is,
+                  const uint8_t *digest,
+                  const uint8_t *tail,
+                  uint16_t threads);
+
 /**
  * Obtain the hash corresponding to some piece of data.
  */
@@ -162,6 +529,23 @@ int ishake_hash(unsigned char *data,
                 uint8_t *hash,
                 uint16_t hashbitlen);
 
+/**
+ * Obtain the hashes of count independent pieces of data at once: data[i],
+ * len[i] bytes long, gets its hash (as given by ishake_hash()) written to
+ * hash[i]. The blocks of all the messages are hashed four at a time with the
+ * multi-buffer Keccak permutation, and spread over threadno threads (or
+ * hashed in the calling thread if none), allocating nothing per message.
+ *
+ * Define ISHAKE_MANY_CHUNK to change how many messages a thread takes at a
+ * time.
+ */
+int ishake_hash_many(unsigned char **data,
+                     const uint64_t *len,
+                     uint8_t **hash,
+                     size_t count,
+                     uint16_t hashbitlen,
+                     uint16_t threadno);
+
 /**
  * Obtain the hash corresponding to some piece of data, performing the
  * computation in parallel by threadno threads.
@@ -175,7 +559,8 @@ int ishake_hash_p(unsigned char *data,
                 uint16_t threadno);
 
 /**
- * Cleanup the resources attached to the passed iSHAKE structure.
+ * Cleanup the resources attached to the passed iSHAKE structure. If an
+ * asynchronous result is still being computed, this will wait for it.
  */
 void ishake_cleanup(ishake_t *is);
 
@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ISHAKE_HPP
+#define ISHAKE_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#endif
+
+// the headers ishake.h needs, included with C++ linkage first
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+extern "C" {
+#include "ishake.h"
+}
+
+/**
+ * Header-only C++17 interface to iSHAKE.
+ *
+ * ishake::hasher wraps an ishake_t structure, cleaning it up when it goes out
+ * of scope. Its output length is part of its type, so digests are returned in
+ * a std::array, and errors reported by the library are thrown as
+ * ishake::error.
+ */
+namespace ishake {
+
+enum class variant { shake128 = 128, shake256 = 256 };
+
+enum class mode : std::uint8_t {
+    append_only = ISHAKE_APPEND_ONLY_MODE,
+    full = ISHAKE_FULL_MODE
+};
+
+/**
+ * An error reported by the library.
+ */
+class error : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+#if __cplusplus >= 202002L && __has_include(<span>)
+/**
+ * A view of the bytes to hash.
+ */
+using bytes = std::span<const std::byte>;
+#else
+/**
+ * A view of the bytes to hash, like std::span<const std::byte> in C++20.
+ */
+class bytes {
+public:
+    constexpr bytes() noexcept = default;
+    constexpr bytes(const std::byte *data, std::size_t size) noexcept
+            : data_(data), size_(size) {}
+
+    // contiguous containers of std::byte only, as std::span does: anything
+    // else goes through as_bytes()
+    template <class C, class T = std::remove_const_t<std::remove_pointer_t<
+            decltype(std::data(std::declval<const C &>()))>>,
+              class = std::enable_if_t<std::is_same<T, std::byte>::value>>
+    bytes(const C &c) noexcept : data_(std::data(c)), size_(std::size(c)) {}
+
+    constexpr const std::byte *data() const noexcept { return data_; }
+    constexpr std::size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return size_ == 0; }
+    constexpr const std::byte *begin() const noexcept { return data_; }
+    constexpr const std::byte *end() const noexcept { return data_ + size_; }
+
+private:
+    const std::byte *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+#endif
+
+/**
+ * View the bytes of any contiguous container, like std::vector or
+ * std::string.
+ */
+template <class C>
+bytes as_bytes(const C &c) noexcept {
+    return bytes(reinterpret_cast<const std::byte *>(std::data(c)),
+                 std::size(c) * sizeof(*std::data(c)));
+}
+
+/**
+ * A block: its index in APPEND_ONLY mode, or its nonce and the nonce of the
+ * block before it (0 if none) in FULL mode, and its data.
+ */
+struct block {
+    std::uint64_t nonce;
+    std::uint64_t prev;
+    bytes data;
+};
+
+/**
+ * The least amount of bits in the output of each variant.
+ */
+template <variant V>
+constexpr std::uint16_t default_bits = V == variant::shake256 ? 6528 : 2688;
+
+namespace detail {
+
+template <class R, class = void>
+struct range_value {};
+
+template <class R>
+struct range_value<R, std::void_t<decltype(std::begin(std::declval<R &>())),
+                                  decltype(std::end(std::declval<R &>()))>> {
+    using type = std::decay_t<decltype(*std::begin(std::declval<R &>()))>;
+};
+
+template <class R, class T, class = void>
+struct is_range_of : std::false_type {};
+
+template <class R, class T>
+struct is_range_of<R, T, std::void_t<typename range_value<R>::type>>
+        : std::is_convertible<typename range_value<R>::type, T> {};
+
+// something to hash: a view of bytes, or a contiguous container of them
+template <class T, class = void>
+struct is_byte_source : std::is_convertible<T, bytes> {};
+
+template <class T>
+struct is_byte_source<T, std::void_t<
+        decltype(std::data(std::declval<const T &>())),
+        decltype(std::size(std::declval<const T &>()))>>
+        : std::integral_constant<bool, std::is_convertible<T, bytes>::value ||
+                sizeof(*std::data(std::declval<const T &>())) == 1> {};
+
+template <class R, class = void>
+struct is_byte_source_range : std::false_type {};
+
+template <class R>
+struct is_byte_source_range<R, std::void_t<typename range_value<R>::type>>
+        : is_byte_source<typename range_value<R>::type> {};
+
+inline bytes view(bytes b) noexcept { return b; }
+
+template <class C, std::enable_if_t<!std::is_convertible<C, bytes>::value,
+                                    int> = 0>
+bytes view(const C &c) noexcept { return as_bytes(c); }
+
+}
+
+/**
+ * An iSHAKE hash of Bits bits, computed in mode M.
+ *
+ * Hashers can be moved but not copied. Once final() is called, the hasher is
+ * done, and any other operation on it throws.
+ */
+template <variant V, std::uint16_t Bits = default_bits<V>,
+          mode M = mode::append_only>
+class hasher {
+    static_assert(Bits % 64 == 0, "the output must be a multiple of 64 bits");
+    static_assert(V != variant::shake128 || (Bits >= 2688 && Bits <= 4160),
+                  "iSHAKE128 outputs between 2688 and 4160 bits");
+    static_assert(V != variant::shake256 || (Bits >= 6528 && Bits <= 16512),
+                  "iSHAKE256 outputs between 6528 and 16512 bits");
+
+public:
+    static constexpr std::size_t digest_size = Bits / 8;
+    using digest_type = std::array<std::uint8_t, digest_size>;
+
+    /**
+     * Initialize a hash with the given block size, hashing blocks in
+     * parallel by the given amount of threads (none by default).
+     */
+    explicit hasher(std::uint32_t block_size = ISHAKE_BLOCK_SIZE,
+                    std::uint16_t threads = 0) {
+        is_ = static_cast<ishake_t *>(std::malloc(sizeof(ishake_t)));
+        if (is_ == nullptr) {
+            throw std::bad_alloc();
+        }
+        if (ishake_init(is_, block_size, Bits, static_cast<std::uint8_t>(M),
+                        threads)) {
+            ishake_cleanup(is_);
+            is_ = nullptr;
+            throw error("cannot initialize iSHAKE");
+        }
+    }
+
+    hasher(const hasher &) = delete;
+    hasher &operator=(const hasher &) = delete;
+
+    hasher(hasher &&other) noexcept : is_(std::exchange(other.is_, nullptr)) {}
+
+    hasher &operator=(hasher &&other) noexcept {
+        if (this != &other) {
+            reset();
+            is_ = std::exchange(other.is_, nullptr);
+        }
+        return *this;
+    }
+
+    ~hasher() { reset(); }
+
+    /**
+     * Append data to hash, of any size.
+     */
+    void append(bytes data) {
+        static_assert(M == mode::append_only, "append() needs APPEND_ONLY");
+        check(ishake_append(context(), byte_ptr(data.data()), data.size()));
+    }
+
+    /**
+     * Append every piece of data in a range (views of bytes, or containers
+     * like std::string), in order.
+     */
+    template <class R, std::enable_if_t<
+            detail::is_byte_source_range<R>::value &&
+            !detail::is_byte_source<R>::value, int> = 0>
+    void append(const R &pieces) {
+        for (const auto &piece : pieces) {
+            append(detail::view(piece));
+        }
+    }
+
+    /**
+     * Insert a block right before next, or at the end of the chain if next
+     * is nullptr. The prev of next must still be the prev of the new block.
+     */
+    void insert(const block &added, const block *next = nullptr) {
+        static_assert(M == mode::full, "insert() needs FULL mode");
+        auto blocks = make(added, next);
+        check(ishake_insert(context(), blocks.first, blocks.second));
+    }
+
+    /**
+     * Insert a run of blocks, chained in order after the prev of the first
+     * one, right before next (or at the end of the chain if nullptr).
+     */
+    template <class R, std::enable_if_t<detail::is_range_of<R, block>::value,
+                                        int> = 0>
+    void insert(const R &run, const block *next = nullptr) {
+        static_assert(M == mode::full, "insert() needs FULL mode");
+        auto it = std::begin(run), end = std::end(run);
+        if (it == end) {
+            return;
+        }
+        block b = *it;
+        std::uint64_t first_prev = b.prev;
+        while (++it != end) {
+            insert(b);
+            std::uint64_t prev = b.nonce;
+            b = *it;
+            b.prev = prev;
+        }
+        if (next == nullptr) {
+            insert(b);
+            return;
+        }
+        block old_next = *next;
+        old_next.prev = first_prev;
+        insert(b, &old_next);
+    }
+
+    /**
+     * Delete a block, chaining next (or nothing, if nullptr) to the block
+     * before it. The prev of next must still be the nonce of the deleted
+     * block.
+     */
+    void remove(const block &deleted, const block *next = nullptr) {
+        static_assert(M == mode::full, "remove() needs FULL mode");
+        auto blocks = make(deleted, next);
+        check(ishake_delete(context(), blocks.first, blocks.second));
+    }
+
+    /**
+     * Delete a run of consecutive blocks, chaining next (or nothing, if
+     * nullptr) to the block before the first of them.
+     */
+    template <class R, std::enable_if_t<detail::is_range_of<R, block>::value,
+                                        int> = 0>
+    void remove(const R &run, const block *next = nullptr) {
+        static_assert(M == mode::full, "remove() needs FULL mode");
+        auto it = std::begin(run), end = std::end(run);
+        if (it == end) {
+            return;
+        }
+        std::uint64_t first_prev = block(*it).prev, last = 0;
+        for (; it != end; ++it) {
+            block b = *it;
+            remove(b);
+            last = b.nonce;
+        }
+        if (next != nullptr) {
+            block old_next = *next, new_next = *next;
+            old_next.prev = last;
+            new_next.prev = first_prev;
+            update(old_next, new_next);
+        }
+    }
+
+    /**
+     * Replace the data of a block. Both versions must have the same index
+     * or nonce, and the same prev.
+     */
+    void update(const block &old_block, const block &new_block) {
+        auto blocks = make(old_block, &new_block);
+        check(ishake_update(context(), blocks.first, blocks.second));
+    }
+
+    /**
+     * Replace the data of every block in a range of pairs of old and new
+     * versions.
+     */
+    template <class R, std::enable_if_t<
+            detail::is_range_of<R, std::pair<block, block>>::value, int> = 0>
+    void update(const R &changes) {
+        for (const auto &change : changes) {
+            update(change.first, change.second);
+        }
+    }
+
+    /**
+     * Get the digest of every operation so far, and the amount of them,
+     * without finishing the hash.
+     */
+    std::pair<digest_type, std::uint64_t> snapshot() const {
+        std::pair<digest_type, std::uint64_t> r;
+        check(ishake_snapshot(context(), r.first.data(), &r.second));
+        return r;
+    }
+
+    /**
+     * Finish the hash and get the digest.
+     */
+    digest_type final() {
+        digest_type out;
+        check(ishake_final(context(), out.data()));
+        reset();
+        return out;
+    }
+
+    /**
+     * The underlying structure, or nullptr once the hash is finished.
+     */
+    ishake_t *native_handle() const noexcept { return is_; }
+
+    /**
+     * Obtain the digest of some data.
+     */
+    static digest_type hash(bytes data,
+                            std::uint32_t block_size = ISHAKE_BLOCK_SIZE,
+                            std::uint16_t threads = 0) {
+        hasher h(block_size, threads);
+        h.append(data);
+        return h.final();
+    }
+
+private:
+    ishake_t *is_ = nullptr;
+
+    ishake_t *context() const {
+        if (is_ == nullptr) {
+            throw error("the hash is already finished");
+        }
+        return is_;
+    }
+
+    void reset() noexcept {
+        if (is_ != nullptr) {
+            ishake_cleanup(is_);
+            is_ = nullptr;
+        }
+    }
+
+    static void check(int r) {
+        if (r != 0) {
+            throw error("iSHAKE failed to process data");
+        }
+    }
+
+    static unsigned char *byte_ptr(const std::byte *p) {
+        return reinterpret_cast<unsigned char *>(const_cast<std::byte *>(p));
+    }
+
+    static void release(ishake_block_t *b) noexcept {
+        std::free(b->data);
+        std::free(b);
+    }
+
+    // blocks handed over to the library belong to it, so they are copies
+    static ishake_block_t *make(const block &b) {
+        auto *r = static_cast<ishake_block_t *>(
+                std::malloc(sizeof(ishake_block_t)));
+        if (r == nullptr) {
+            throw std::bad_alloc();
+        }
+        r->data = static_cast<unsigned char *>(
+                std::malloc(b.data.size() ? b.data.size() : 1));
+        if (r->data == nullptr) {
+            std::free(r);
+            throw std::bad_alloc();
+        }
+        if (!b.data.empty()) {
+            std::memcpy(r->data, b.data.data(), b.data.size());
+        }
+        r->data_len = static_cast<std::uint32_t>(b.data.size());
+        if (M == mode::append_only) {
+            r->header.length = 8;
+            r->header.value.idx = b.nonce;
+        } else {
+            r->header.length = 16;
+            r->header.value.nonce.nonce = b.nonce;
+            r->header.value.nonce.prev = b.prev;
+        }
+        return r;
+    }
+
+    // a block and, if other is not nullptr, another one
+    static std::pair<ishake_block_t *, ishake_block_t *> make(
+            const block &b, const block *other) {
+        ishake_block_t *first = make(b);
+        if (other == nullptr) {
+            return {first, nullptr};
+        }
+        try {
+            return {first, make(*other)};
+        } catch (...) {
+            release(first);
+            throw;
+        }
+    }
+};
+
+}
+
+#endif //ISHAKE_HPP
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "ishake_cdc.h"
+#include "utils.h"
+
+// seed for the gear table, changing it changes all block boundaries
+#define ISHAKE_CDC_GEAR_SEED 0x6953484b45ULL
+
+// initial size of the table of blocks found, must be a power of two
+#define ISHAKE_CDC_SEEN_SIZE 1024
+
+
+/*
+ * Build a mask with the given amount of bits set. Bits are taken from the
+ * top of the gear hash (where they depend on the most input bytes), leaving
+ * the topmost bit out so that the mask can be shifted left by one when
+ * rolling two bytes at a time.
+ */
+uint64_t _cdc_mask(unsigned int bits) {
+    return ((1ULL << bits) - 1) << (63 - bits);
+}
+
+
+int ishake_cdc_init(ishake_cdc_t *cdc, uint32_t min, uint32_t avg, uint32_t max) {
+    if (cdc == NULL || min == 0 || min > avg || avg > max || avg < 4) {
+        return -1;
+    }
+
+    // the average size determines how many bits of the hash we look at
+    unsigned int bits = 0;
+    while ((1ULL << (bits + 1)) <= avg) {
+        bits++;
+    }
+    if (bits + 1 > 62) {
+        return -1;
+    }
+
+    cdc->min_size = min;
+    cdc->avg_size = avg;
+    cdc->max_size = max;
+
+    // normalized chunking, harder to cut before avg and easier after it
+    cdc->mask_s = _cdc_mask(bits + 1);
+    cdc->mask_l = _cdc_mask(bits - 1);
+
+    uint64_t seed = ISHAKE_CDC_GEAR_SEED;
+    for (int i = 0; i < 256; i++) {
+        cdc->gear[i] = splitmix64(&seed);
+        cdc->gear_ls[i] = cdc->gear[i] << 1;
+    }
+
+    cdc->buf = malloc(max);
+    cdc->seen = NULL;
+    cdc->seen_count = NULL;
+    if (cdc->buf == NULL) {
+        return -1;
+    }
+    return ishake_cdc_reset(cdc);
+}
+
+
+int ishake_cdc_reset(ishake_cdc_t *cdc) {
+    if (cdc == NULL) {
+        return -1;
+    }
+    free(cdc->seen);
+    free(cdc->seen_count);
+
+    cdc->buffered = 0;
+    cdc->prev = 0;
+    cdc->chunks = 0;
+    cdc->last_key = 0;
+    cdc->seen_size = ISHAKE_CDC_SEEN_SIZE;
+    cdc->seen_used = 0;
+    cdc->seen = calloc(cdc->seen_size, sizeof(uint64_t));
+    cdc->seen_count = calloc(cdc->seen_size, sizeof(uint64_t));
+    if (cdc->seen == NULL || cdc->seen_count == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+
+uint32_t ishake_cdc_cut(ishake_cdc_t *cdc,
+                        const unsigned char *data,
+                        uint32_t len,
+                        int eof) {
+    uint32_t n = len;
+    if (n > cdc->max_size) {
+        n = cdc->max_size;
+    }
+    uint32_t fallback = (eof || n == cdc->max_size) ? n : 0;
+    if (n <= cdc->min_size) {
+        return fallback;
+    }
+
+    uint32_t normal = cdc->avg_size < n ? cdc->avg_size : n;
+    uint64_t h = 0;
+    uint64_t mask = cdc->mask_s;
+    uint64_t mask_ls = mask << 1;
+    uint32_t i = cdc->min_size;
+
+    /*
+     * The gear hash is a serial recurrence, so instead of vector lanes we roll
+     * two bytes per iteration: shifting by two and adding the pre-shifted
+     * gear value of the first byte saves a shift and lets us check the hash
+     * of the first byte against the shifted mask.
+     */
+    for (; i + 1 < normal; i += 2) {
+        h = (h << 2) + cdc->gear_ls[data[i]];
+        if (!(h & mask_ls)) return i + 1;
+        h += cdc->gear[data[i + 1]];
+        if (!(h & mask)) return i + 2;
+    }
+    if (i < normal) {
+        h = (h << 1) + cdc->gear[data[i]];
+        if (!(h & mask)) return i + 1;
+        i++;
+    }
+
+    mask = cdc->mask_l;
+    mask_ls = mask << 1;
+    for (; i + 1 < n; i += 2) {
+        h = (h << 2) + cdc->gear_ls[data[i]];
+        if (!(h & mask_ls)) return i + 1;
+        h += cdc->gear[data[i + 1]];
+        if (!(h & mask)) return i + 2;
+    }
+    if (i < n) {
+        h = (h << 1) + cdc->gear[data[i]];
+        if (!(h & mask)) return i + 1;
+    }
+
+    return fallback;
+}
+
+
+uint64_t ishake_cdc_nonce(const unsigned char *data, uint32_t len) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+    uint64_t w;
+    uint32_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ swap_uint64(w)) * 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 29;
+    }
+    w = 0;
+    for (; i < len; i++) {
+        w = (w << 8) | data[i];
+    }
+    h = (h ^ w) * 0x94D049BB133111EBULL;
+
+    // 0 means there is no block, never use it as a nonce
+    h = splitmix64(&h);
+    return h ? h : 1;
+}
+
+
+uint64_t _cdc_seen_slot(uint64_t *seen, uint64_t size, uint64_t key) {
+    uint64_t i = ((key * 0x9E3779B97F4A7C15ULL) >> 17) & (size - 1);
+    while (seen[i] != 0 && seen[i] != key) {
+        i = (i + 1) & (size - 1);
+    }
+    return i;
+}
+
+
+int _cdc_seen_grow(ishake_cdc_t *cdc) {
+    uint64_t size = cdc->seen_size * 2;
+    uint64_t *seen = calloc(size, sizeof(uint64_t));
+    uint64_t *count = calloc(size, sizeof(uint64_t));
+    if (seen == NULL || count == NULL) {
+        free(seen);
+        free(count);
+        return -1;
+    }
+
+    // move all the blocks found to the new table
+    for (uint64_t i = 0; i < cdc->seen_size; i++) {
+        if (cdc->seen[i] != 0) {
+            uint64_t j = _cdc_seen_slot(seen, size, cdc->seen[i]);
+            seen[j] = cdc->seen[i];
+            count[j] = cdc->seen_count[i];
+        }
+    }
+    free(cdc->seen);
+    free(cdc->seen_count);
+    cdc->seen = seen;
+    cdc->seen_count = count;
+    cdc->seen_size = size;
+    return 0;
+}
+
+
+uint64_t ishake_cdc_next_nonce(ishake_cdc_t *cdc,
+                               const unsigned char *data,
+                               uint32_t len) {
+    // keep the table at most half full
+    if (cdc->seen_used * 2 >= cdc->seen_size && _cdc_seen_grow(cdc)) {
+        return 0;
+    }
+
+    uint64_t key = ishake_cdc_nonce(data, len);
+    uint64_t state = cdc->last_key;
+    uint64_t pair = key ^ splitmix64(&state);
+    pair = pair ? pair : 1; // 0 means an empty slot
+    cdc->last_key = key;
+
+    uint64_t i = _cdc_seen_slot(cdc->seen, cdc->seen_size, pair);
+    if (cdc->seen[i] == 0) {
+        cdc->seen[i] = pair;
+        cdc->seen_used++;
+    }
+    uint64_t occurrence = cdc->seen_count[i]++;
+
+    // 0 means there is no block, never use it as a nonce
+    state = pair + occurrence;
+    uint64_t nonce = splitmix64(&state);
+    return nonce ? nonce : 1;
+}
+
+
+/*
+ * Hash a block with the given data, chaining it to the last one.
+ */
+int _cdc_emit(ishake_t *is,
+              ishake_cdc_t *cdc,
+              unsigned char *data,
+              uint32_t len) {
+    ishake_block_t *block = malloc(sizeof(ishake_block_t));
+    if (block == NULL) {
+        return -1;
+    }
+    block->data = malloc(len ? len : 1);
+    if (block->data == NULL) {
+        free(block);
+        return -1;
+    }
+    memcpy(block->data, data, len);
+    block->data_len = len;
+    block->header.length = 16;
+    block->header.value.nonce.nonce = ishake_cdc_next_nonce(cdc, data, len);
+    block->header.value.nonce.prev = cdc->prev;
+    if (block->header.value.nonce.nonce == 0) {
+        free(block->data);
+        free(block);
+        return -1;
+    }
+
+    cdc->prev = block->header.value.nonce.nonce;
+    cdc->chunks++;
+    is->proc_bytes += len;
+
+    return ishake_insert(is, block, NULL);
+}
+
+
+/*
+ * Hash as many blocks as we can find in the buffer.
+ */
+int _cdc_flush(ishake_t *is, ishake_cdc_t *cdc, int eof) {
+    uint32_t start = 0;
+    while (start < cdc->buffered) {
+        uint32_t cut = ishake_cdc_cut(cdc, cdc->buf + start,
+                                      cdc->buffered - start, eof);
+        if (cut == 0) { // need more data
+            break;
+        }
+        if (_cdc_emit(is, cdc, cdc->buf + start, cut)) {
+            return -1;
+        }
+        start += cut;
+    }
+
+    // keep the remaining data at the beginning of the buffer
+    cdc->buffered -= start;
+    memmove(cdc->buf, cdc->buf + start, cdc->buffered);
+    return 0;
+}
+
+
+int ishake_cdc_append(ishake_t *is,
+                      ishake_cdc_t *cdc,
+                      unsigned char *data,
+                      uint64_t len) {
+    if (!is || !cdc || (!data && len) || is->mode != ISHAKE_FULL_MODE) {
+        return -1;
+    }
+
+    while (len > 0) {
+        uint32_t room = cdc->max_size - cdc->buffered;
+        uint32_t n = len < room ? (uint32_t)len : room;
+        memcpy(cdc->buf + cdc->buffered, data, n);
+        cdc->buffered += n;
+        data += n;
+        len -= n;
+
+        // a full buffer always contains at least one boundary
+        if (cdc->buffered == cdc->max_size && _cdc_flush(is, cdc, 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+int ishake_cdc_final(ishake_t *is, ishake_cdc_t *cdc) {
+    if (!is || !cdc) {
+        return -1;
+    }
+    return _cdc_flush(is, cdc, 1);
+}
+
+
+void ishake_cdc_cleanup(ishake_cdc_t *cdc) {
+    if (cdc->buf) free(cdc->buf);
+    free(cdc->seen);
+    free(cdc->seen_count);
+    free(cdc);
+}
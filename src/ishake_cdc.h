@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+
+#include "ishake.h"
+
+#ifndef _ISHAKE_CDC_H
+#define _ISHAKE_CDC_H
+
+/**
+ * A content-defined chunker, based on FastCDC. It splits input into blocks of
+ * variable size, whose boundaries depend only on the data around them, so
+ * that inserting or removing data in the middle of the input changes only
+ * the blocks around the edit.
+ *
+ * Blocks are hashed in FULL mode, using a nonce derived from their contents
+ * and pointing to the previous block in the input. Blocks that repeat get a
+ * different nonce each time, so that the chain still tells their order.
+ */
+typedef struct {
+    uint32_t min_size;
+    uint32_t avg_size;
+    uint32_t max_size;
+    uint64_t mask_s;
+    uint64_t mask_l;
+    uint64_t gear[256];
+    uint64_t gear_ls[256];
+
+    // streaming state
+    unsigned char *buf;
+    uint32_t buffered;
+    uint64_t prev;
+    uint64_t chunks;
+
+    // how many times each block was found after the one before it
+    uint64_t last_key;
+    uint64_t *seen;
+    uint64_t *seen_count;
+    uint64_t seen_size;
+    uint64_t seen_used;
+} ishake_cdc_t;
+
+
+/**
+ * Initialize a chunker that will produce blocks of at least min bytes, at
+ * most max bytes, and around avg bytes on average.
+ */
+int ishake_cdc_init(ishake_cdc_t *cdc, uint32_t min, uint32_t avg, uint32_t max);
+
+/**
+ * Find the first boundary in data, and return the length of the block that
+ * ends there. If no boundary can be found yet because len is smaller than
+ * the maximum block size, return 0. Pass eof != 0 when there is no more data
+ * after this, so that all data is returned as the last block.
+ */
+uint32_t ishake_cdc_cut(ishake_cdc_t *cdc,
+                        const unsigned char *data,
+                        uint32_t len,
+                        int eof);
+
+/**
+ * Compute a 64-bit key for a block with the given data, the same for all
+ * blocks with the same contents.
+ */
+uint64_t ishake_cdc_nonce(const unsigned char *data, uint32_t len);
+
+/**
+ * Compute the nonce of the next block of the input, with the given data. It
+ * depends on its contents, on those of the block before it, and on how many
+ * times that same pair of blocks was found before, so that no two blocks of
+ * the same input share a nonce, and an edit only changes the nonces of the
+ * blocks around it (and of later repetitions of those). Returns 0 if there
+ * is no memory left to keep track of the blocks found.
+ */
+uint64_t ishake_cdc_next_nonce(ishake_cdc_t *cdc,
+                               const unsigned char *data,
+                               uint32_t len);
+
+/**
+ * Forget the blocks found so far, to start splitting another input.
+ */
+int ishake_cdc_reset(ishake_cdc_t *cdc);
+
+/**
+ * Split data into blocks and add them to the hash. Its size doesn't need to
+ * match any block boundary, data after the last boundary found will be kept
+ * until more data arrives or ishake_cdc_final() is called.
+ *
+ * The ishake_t structure must have been initialized in FULL mode.
+ */
+int ishake_cdc_append(ishake_t *is,
+                      ishake_cdc_t *cdc,
+                      unsigned char *data,
+                      uint64_t len);
+
+/**
+ * Add any pending data to the hash as the last block. Call this before
+ * ishake_final().
+ */
+int ishake_cdc_final(ishake_t *is, ishake_cdc_t *cdc);
+
+/**
+ * Cleanup the resources attached to the chunker, including the chunker
+ * itself.
+ */
+void ishake_cdc_cleanup(ishake_cdc_t *cdc);
+
+#endif // _ISHAKE_CDC_H
@@ -0,0 +1,666 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ishake_doc.h"
+#include "utils.h"
+
+#define ISHAKE_DOC_INDEX_SIZE 1024
+#define ISHAKE_DOC_HEADER_LEN 16
+
+
+/*
+ * Obtain a random seed for the nonce generator.
+ */
+uint64_t _doc_seed(ishake_doc_t *doc) {
+    uint64_t seed = 0;
+    FILE *fp = fopen("/dev/urandom", "r");
+    if (fp != NULL) {
+        if (fread(&seed, sizeof(seed), 1, fp) != 1) {
+            seed = 0;
+        }
+        fclose(fp);
+    }
+    if (seed == 0) { // no entropy source available, do our best
+        seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32) ^
+               (uint64_t)(uintptr_t)doc;
+    }
+    return seed;
+}
+
+
+/**************
+ | Nonce index |
+ **************/
+
+
+uint64_t _doc_index_bucket(ishake_doc_t *doc, uint64_t nonce) {
+    return ((nonce * 0x9E3779B97F4A7C15ULL) >> 17) & (doc->index_size - 1);
+}
+
+
+ishake_doc_node_t *_doc_index_get(ishake_doc_t *doc, uint64_t nonce) {
+    ishake_doc_node_t *node = doc->index[_doc_index_bucket(doc, nonce)];
+    while (node != NULL && node->nonce != nonce) {
+        node = node->hnext;
+    }
+    return node;
+}
+
+
+int _doc_index_grow(ishake_doc_t *doc) {
+    uint64_t old_size = doc->index_size;
+    ishake_doc_node_t **old = doc->index;
+
+    doc->index_size = old_size * 2;
+    doc->index = calloc(doc->index_size, sizeof(ishake_doc_node_t *));
+    if (doc->index == NULL) {
+        doc->index = old;
+        doc->index_size = old_size;
+        return -1;
+    }
+
+    // rehash all the nodes into the new table
+    for (uint64_t i = 0; i < old_size; i++) {
+        ishake_doc_node_t *node = old[i];
+        while (node != NULL) {
+            ishake_doc_node_t *next = node->hnext;
+            uint64_t b = _doc_index_bucket(doc, node->nonce);
+            node->hnext = doc->index[b];
+            doc->index[b] = node;
+            node = next;
+        }
+    }
+    free(old);
+    return 0;
+}
+
+
+int _doc_index_put(ishake_doc_t *doc, ishake_doc_node_t *node) {
+    if (doc->count >= doc->index_size && _doc_index_grow(doc)) {
+        return -1;
+    }
+    uint64_t b = _doc_index_bucket(doc, node->nonce);
+    node->hnext = doc->index[b];
+    doc->index[b] = node;
+    return 0;
+}
+
+
+void _doc_index_remove(ishake_doc_t *doc, ishake_doc_node_t *node) {
+    ishake_doc_node_t **ptr = &doc->index[_doc_index_bucket(doc, node->nonce)];
+    while (*ptr != NULL && *ptr != node) {
+        ptr = &(*ptr)->hnext;
+    }
+    if (*ptr != NULL) {
+        *ptr = node->hnext;
+    }
+    node->hnext = NULL;
+}
+
+
+/*
+ * Generate a new, non-zero nonce not used by any block in the document.
+ */
+uint64_t _doc_nonce(ishake_doc_t *doc) {
+    uint64_t nonce;
+    do {
+        nonce = splitmix64(&doc->seed);
+    } while (nonce == 0 || _doc_index_get(doc, nonce) != NULL);
+    return nonce;
+}
+
+
+/*************************
+ | Order-statistics treap |
+ *************************/
+
+
+uint64_t _doc_size(ishake_doc_node_t *node) {
+    return node ? node->size : 0;
+}
+
+
+void _doc_pull(ishake_doc_node_t *node) {
+    node->size = 1 + _doc_size(node->left) + _doc_size(node->right);
+    if (node->left) node->left->parent = node;
+    if (node->right) node->right->parent = node;
+}
+
+
+ishake_doc_node_t *_doc_merge(ishake_doc_node_t *a, ishake_doc_node_t *b) {
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+    if (a->priority > b->priority) {
+        a->right = _doc_merge(a->right, b);
+        _doc_pull(a);
+        return a;
+    }
+    b->left = _doc_merge(a, b->left);
+    _doc_pull(b);
+    return b;
+}
+
+
+/*
+ * Split a treap in two, the first one with the first k nodes.
+ */
+void _doc_split(ishake_doc_node_t *t,
+            uint64_t k,
+            ishake_doc_node_t **l,
+            ishake_doc_node_t **r) {
+    if (t == NULL) {
+        *l = *r = NULL;
+        return;
+    }
+    t->parent = NULL;
+    if (_doc_size(t->left) < k) {
+        _doc_split(t->right, k - _doc_size(t->left) - 1, &t->right, r);
+        _doc_pull(t);
+        *l = t;
+    } else {
+        _doc_split(t->left, k, l, &t->left);
+        _doc_pull(t);
+        *r = t;
+    }
+    if (*l) (*l)->parent = NULL;
+    if (*r) (*r)->parent = NULL;
+}
+
+
+ishake_doc_node_t *_doc_node_at(ishake_doc_t *doc, uint64_t pos) {
+    ishake_doc_node_t *node = doc->root;
+    while (node != NULL) {
+        uint64_t left = _doc_size(node->left);
+        if (pos == left) {
+            return node;
+        }
+        if (pos < left) {
+            node = node->left;
+        } else {
+            pos -= left + 1;
+            node = node->right;
+        }
+    }
+    return NULL;
+}
+
+
+uint64_t _doc_node_position(ishake_doc_node_t *node) {
+    uint64_t pos = _doc_size(node->left);
+    while (node->parent != NULL) {
+        if (node == node->parent->right) {
+            pos += _doc_size(node->parent->left) + 1;
+        }
+        node = node->parent;
+    }
+    return pos;
+}
+
+
+/*
+ * The nonce of the block before position pos, or 0 if this is the first one.
+ */
+uint64_t _doc_prev_nonce(ishake_doc_t *doc, uint64_t pos) {
+    if (pos == 0) {
+        return 0;
+    }
+    return _doc_node_at(doc, pos - 1)->nonce;
+}
+
+
+/***********************
+ | Hashing of the chain |
+ ***********************/
+
+
+/*
+ * Build an iSHAKE block with a copy of some data, ready to be handed to the
+ * library.
+ */
+ishake_block_t *_doc_block_of(uint64_t nonce,
+                              uint64_t prev,
+                              unsigned char *data,
+                              uint32_t len) {
+    ishake_block_t *block = malloc(sizeof(ishake_block_t));
+    if (block == NULL) {
+        return NULL;
+    }
+    block->data = malloc(len ? len : 1);
+    if (block->data == NULL) {
+        free(block);
+        return NULL;
+    }
+    memcpy(block->data, data, len);
+    block->data_len = len;
+    block->header.length = ISHAKE_DOC_HEADER_LEN;
+    block->header.value.nonce.nonce = nonce;
+    block->header.value.nonce.prev = prev;
+    return block;
+}
+
+
+/*
+ * Build an iSHAKE block out of a node, ready to be handed to the library.
+ */
+ishake_block_t *_doc_block(ishake_doc_node_t *node, uint64_t prev) {
+    return _doc_block_of(node->nonce, prev, node->data, node->data_len);
+}
+
+
+void _doc_free_block(ishake_block_t *block) {
+    if (block != NULL) {
+        free(block->data);
+        free(block);
+    }
+}
+
+
+/*
+ * Put a node at a given position of the chain, hashing it and rehashing the
+ * block that follows, if any.
+ */
+int _doc_link(ishake_doc_t *doc, uint64_t pos, ishake_doc_node_t *node) {
+    uint64_t prev = _doc_prev_nonce(doc, pos);
+    ishake_doc_node_t *next = _doc_node_at(doc, pos);
+
+    ishake_block_t *new_b = _doc_block(node, prev);
+    ishake_block_t *next_b = NULL;
+    if (new_b == NULL) {
+        return -1;
+    }
+    if (next != NULL) {
+        // the next block still points to our previous block
+        next_b = _doc_block(next, prev);
+        if (next_b == NULL) {
+            _doc_free_block(new_b);
+            return -1;
+        }
+    }
+
+    // the chain only changes once the hash does
+    if (ishake_insert(doc->is, new_b, next_b)) {
+        return -1;
+    }
+    ishake_doc_node_t *l, *r;
+    _doc_split(doc->root, pos, &l, &r);
+    doc->root = _doc_merge(_doc_merge(l, node), r);
+    doc->count++;
+    return 0;
+}
+
+
+/*
+ * Take the node at a given position out of the chain, removing its hash and
+ * rehashing the block that follows, if any.
+ */
+ishake_doc_node_t *_doc_unlink(ishake_doc_t *doc, uint64_t pos) {
+    uint64_t prev = _doc_prev_nonce(doc, pos);
+    ishake_doc_node_t *node = _doc_node_at(doc, pos);
+    ishake_doc_node_t *next = _doc_node_at(doc, pos + 1);
+
+    ishake_block_t *del_b = _doc_block(node, prev);
+    ishake_block_t *next_b = NULL;
+    if (del_b == NULL) {
+        return NULL;
+    }
+    if (next != NULL) {
+        next_b = _doc_block(next, node->nonce);
+        if (next_b == NULL) {
+            _doc_free_block(del_b);
+            return NULL;
+        }
+    }
+    if (ishake_delete(doc->is, del_b, next_b)) {
+        return NULL;
+    }
+
+    ishake_doc_node_t *l, *m, *r;
+    _doc_split(doc->root, pos, &l, &r);
+    _doc_split(r, 1, &m, &r);
+    doc->root = _doc_merge(l, r);
+    doc->count--;
+
+    node->left = node->right = node->parent = NULL;
+    node->size = 1;
+    return node;
+}
+
+
+/*
+ * Replace the data of a node, updating the hash accordingly.
+ */
+int _doc_replace(ishake_doc_t *doc,
+             uint64_t pos,
+             ishake_doc_node_t *node,
+             unsigned char *data,
+             uint32_t len) {
+    uint64_t prev = _doc_prev_nonce(doc, pos);
+    unsigned char *copy = malloc(len ? len : 1);
+    ishake_block_t *old_b = _doc_block(node, prev);
+    ishake_block_t *new_b = _doc_block_of(node->nonce, prev, data, len);
+    if (copy == NULL || old_b == NULL || new_b == NULL) {
+        free(copy);
+        _doc_free_block(old_b);
+        _doc_free_block(new_b);
+        return -1;
+    }
+    memcpy(copy, data, len);
+
+    // the node only changes once the hash does
+    if (ishake_update(doc->is, old_b, new_b)) {
+        free(copy);
+        return -1;
+    }
+    free(node->data);
+    node->data = copy;
+    node->data_len = len;
+    return 0;
+}
+
+
+ishake_doc_node_t *_doc_new_node(ishake_doc_t *doc,
+                             uint64_t nonce,
+                             unsigned char *data,
+                             uint32_t len) {
+    ishake_doc_node_t *node = calloc(1, sizeof(ishake_doc_node_t));
+    if (node == NULL) {
+        return NULL;
+    }
+    node->data = malloc(len ? len : 1);
+    if (node->data == NULL) {
+        free(node);
+        return NULL;
+    }
+    memcpy(node->data, data, len);
+    node->data_len = len;
+    node->nonce = nonce;
+    node->priority = splitmix64(&doc->seed);
+    node->size = 1;
+    if (_doc_index_put(doc, node)) {
+        free(node->data);
+        free(node);
+        return NULL;
+    }
+    return node;
+}
+
+
+/*
+ * Forget a node that never made it to the chain.
+ */
+void _doc_drop_node(ishake_doc_t *doc, ishake_doc_node_t *node) {
+    _doc_index_remove(doc, node);
+    free(node->data);
+    free(node);
+}
+
+
+void _doc_free_nodes(ishake_doc_node_t *node) {
+    if (node == NULL) {
+        return;
+    }
+    _doc_free_nodes(node->left);
+    _doc_free_nodes(node->right);
+    free(node->data);
+    free(node);
+}
+
+
+/****************************
+ | iSHAKE document interface |
+ ****************************/
+
+
+int ishake_doc_init(ishake_doc_t *doc,
+                    uint32_t blk_size,
+                    uint16_t hashbitlen,
+                    uint16_t threads) {
+    if (doc == NULL || blk_size <= ISHAKE_DOC_HEADER_LEN) {
+        return -1;
+    }
+
+    doc->max_data_len = blk_size - ISHAKE_DOC_HEADER_LEN;
+    doc->count = 0;
+    doc->root = NULL;
+    doc->seed = _doc_seed(doc);
+    doc->index_size = ISHAKE_DOC_INDEX_SIZE;
+    doc->index = calloc(doc->index_size, sizeof(ishake_doc_node_t *));
+    doc->is = malloc(sizeof(ishake_t));
+    if (doc->index == NULL || doc->is == NULL) {
+        return -1;
+    }
+
+    return ishake_init(doc->is, blk_size, hashbitlen, ISHAKE_FULL_MODE,
+                       threads);
+}
+
+
+int ishake_doc_insert_at(ishake_doc_t *doc,
+                         uint64_t pos,
+                         unsigned char *data,
+                         uint32_t len,
+                         uint64_t *nonce) {
+    if (doc == NULL || pos > doc->count || len > doc->max_data_len) {
+        return -1;
+    }
+    if (data == NULL && len) {
+        return -1;
+    }
+
+    uint64_t n = (nonce != NULL) ? *nonce : 0;
+    if (n == 0) {
+        n = _doc_nonce(doc);
+    } else if (_doc_index_get(doc, n) != NULL) { // nonces must be unique
+        return -1;
+    }
+
+    ishake_doc_node_t *node = _doc_new_node(doc, n, data, len);
+    if (node == NULL) {
+        return -1;
+    }
+    if (_doc_link(doc, pos, node)) {
+        _doc_drop_node(doc, node);
+        return -1;
+    }
+    if (nonce != NULL) {
+        *nonce = n;
+    }
+    return 0;
+}
+
+
+int ishake_doc_delete_at(ishake_doc_t *doc, uint64_t pos) {
+    if (doc == NULL || pos >= doc->count) {
+        return -1;
+    }
+
+    ishake_doc_node_t *node = _doc_unlink(doc, pos);
+    if (node == NULL) {
+        return -1;
+    }
+    _doc_drop_node(doc, node);
+    return 0;
+}
+
+
+int ishake_doc_update_at(ishake_doc_t *doc,
+                         uint64_t pos,
+                         unsigned char *data,
+                         uint32_t len) {
+    if (doc == NULL || pos >= doc->count || len > doc->max_data_len) {
+        return -1;
+    }
+    if (data == NULL && len) {
+        return -1;
+    }
+    return _doc_replace(doc, pos, _doc_node_at(doc, pos), data, len);
+}
+
+
+int ishake_doc_move(ishake_doc_t *doc, uint64_t from, uint64_t to) {
+    if (doc == NULL || from >= doc->count || to >= doc->count) {
+        return -1;
+    }
+    if (from == to) {
+        return 0;
+    }
+
+    // take it out of the chain, then put it back where it belongs
+    ishake_doc_node_t *node = _doc_unlink(doc, from);
+    if (node == NULL) {
+        return -1;
+    }
+    if (_doc_link(doc, to, node)) { // put it back where it was
+        if (_doc_link(doc, from, node)) {
+            _doc_drop_node(doc, node);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+
+int ishake_doc_split(ishake_doc_t *doc, uint64_t pos, uint32_t offset) {
+    if (doc == NULL || pos >= doc->count) {
+        return -1;
+    }
+
+    ishake_doc_node_t *node = _doc_node_at(doc, pos);
+    if (offset == 0 || offset >= node->data_len) {
+        return -1;
+    }
+
+    // the tail goes to a new block right after this one
+    uint32_t len = node->data_len;
+    unsigned char *whole = malloc(len);
+    ishake_doc_node_t *tail = _doc_new_node(doc, _doc_nonce(doc),
+                                        node->data + offset,
+                                        len - offset);
+    if (whole == NULL || tail == NULL) {
+        free(whole);
+        if (tail != NULL) {
+            _doc_drop_node(doc, tail);
+        }
+        return -1;
+    }
+    memcpy(whole, node->data, len);
+
+    // truncate the block, and then link the tail after it
+    if (_doc_replace(doc, pos, node, node->data, offset)) {
+        free(whole);
+        _doc_drop_node(doc, tail);
+        return -1;
+    }
+    if (_doc_link(doc, pos + 1, tail)) { // put the block back as it was
+        _doc_replace(doc, pos, node, whole, len);
+        free(whole);
+        _doc_drop_node(doc, tail);
+        return -1;
+    }
+    free(whole);
+    return 0;
+}
+
+
+int ishake_doc_merge(ishake_doc_t *doc, uint64_t pos) {
+    if (doc == NULL || pos + 1 >= doc->count) {
+        return -1;
+    }
+
+    ishake_doc_node_t *node = _doc_node_at(doc, pos);
+    ishake_doc_node_t *next = _doc_node_at(doc, pos + 1);
+    uint32_t len = node->data_len + next->data_len;
+    if (len > doc->max_data_len || len < node->data_len) {
+        return -1;
+    }
+
+    unsigned char *data = malloc(len ? len : 1);
+    if (data == NULL) {
+        return -1;
+    }
+    memcpy(data, node->data, node->data_len);
+    memcpy(data + node->data_len, next->data, next->data_len);
+
+    // remove the second block, then append its data to the first one
+    if (_doc_unlink(doc, pos + 1) == NULL) {
+        free(data);
+        return -1;
+    }
+    if (_doc_replace(doc, pos, node, data, len)) { // put the block back
+        if (_doc_link(doc, pos + 1, next)) {
+            _doc_drop_node(doc, next);
+        }
+        free(data);
+        return -1;
+    }
+    _doc_drop_node(doc, next);
+    free(data);
+    return 0;
+}
+
+
+int ishake_doc_nonce(ishake_doc_t *doc, uint64_t pos, uint64_t *nonce) {
+    if (doc == NULL || nonce == NULL || pos >= doc->count) {
+        return -1;
+    }
+    *nonce = _doc_node_at(doc, pos)->nonce;
+    return 0;
+}
+
+
+int ishake_doc_position(ishake_doc_t *doc, uint64_t nonce, uint64_t *pos) {
+    if (doc == NULL || pos == NULL) {
+        return -1;
+    }
+    ishake_doc_node_t *node = _doc_index_get(doc, nonce);
+    if (node == NULL) {
+        return -1;
+    }
+    *pos = _doc_node_position(node);
+    return 0;
+}
+
+
+int ishake_doc_final(ishake_doc_t *doc, uint8_t *output) {
+    if (doc == NULL) {
+        return -1;
+    }
+    return ishake_final(doc->is, output);
+}
+
+
+void ishake_doc_cleanup(ishake_doc_t *doc) {
+    _doc_free_nodes(doc->root);
+    if (doc->index) free(doc->index);
+    if (doc->is) ishake_cleanup(doc->is);
+    free(doc);
+}
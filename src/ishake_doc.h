@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+
+#include "ishake.h"
+
+#ifndef _ISHAKE_DOC_H
+#define _ISHAKE_DOC_H
+
+/**
+ * A block in a document. Nodes are kept both in a treap ordered by position
+ * (so that we can find the n-th block or the position of a block in
+ * logarithmic time) and in a hash table indexed by nonce.
+ */
+typedef struct _doc_node_t {
+    uint64_t nonce;
+    unsigned char *data;
+    uint32_t data_len;
+
+    // order-statistics treap
+    uint64_t priority;
+    uint64_t size;
+    struct _doc_node_t *left;
+    struct _doc_node_t *right;
+    struct _doc_node_t *parent;
+
+    // nonce index chaining
+    struct _doc_node_t *hnext;
+} ishake_doc_node_t;
+
+/**
+ * A document hashed with iSHAKE in FULL mode. It owns the chain of blocks,
+ * their nonces and the underlying ishake_t structure, so that callers can
+ * edit the document by position and let the document figure out which
+ * blocks need to be rehashed.
+ */
+typedef struct {
+    ishake_t *is;
+    uint32_t max_data_len;
+    uint64_t count;
+    ishake_doc_node_t *root;
+
+    // nonce index
+    ishake_doc_node_t **index;
+    uint64_t index_size;
+
+    // nonce generator state
+    uint64_t seed;
+} ishake_doc_t;
+
+
+/**
+ * Initialize an empty document. The underlying ishake_t structure will be
+ * initialized in FULL mode with the given parameters. Blocks can hold up to
+ * blk_size - 16 bytes of data.
+ */
+int ishake_doc_init(ishake_doc_t *doc,
+                    uint32_t blk_size,
+                    uint16_t hashbitlen,
+                    uint16_t threads);
+
+/**
+ * Insert a new block with the given data at position pos (starting at 0),
+ * shifting the block at that position, if any, one position to the right.
+ * Pass the number of blocks in the document as pos to append.
+ *
+ * If nonce is not NULL and points to a non-zero value, that value will be
+ * used as the nonce for the new block. Otherwise, a new nonce is generated
+ * and stored there.
+ */
+int ishake_doc_insert_at(ishake_doc_t *doc,
+                         uint64_t pos,
+                         unsigned char *data,
+                         uint32_t len,
+                         uint64_t *nonce);
+
+/**
+ * Delete the block at position pos.
+ */
+int ishake_doc_delete_at(ishake_doc_t *doc, uint64_t pos);
+
+/**
+ * Replace the data of the block at position pos.
+ */
+int ishake_doc_update_at(ishake_doc_t *doc,
+                         uint64_t pos,
+                         unsigned char *data,
+                         uint32_t len);
+
+/**
+ * Move the block at position from so that it ends up at position to.
+ */
+int ishake_doc_move(ishake_doc_t *doc, uint64_t from, uint64_t to);
+
+/**
+ * Split the block at position pos in two, the first one keeping the first
+ * offset bytes of data and its nonce, and the second one with the rest of
+ * the data and a new nonce.
+ */
+int ishake_doc_split(ishake_doc_t *doc, uint64_t pos, uint32_t offset);
+
+/**
+ * Merge the block at position pos with the block right after it. The
+ * resulting block keeps the nonce of the first one.
+ */
+int ishake_doc_merge(ishake_doc_t *doc, uint64_t pos);
+
+/**
+ * Get the nonce of the block at position pos.
+ */
+int ishake_doc_nonce(ishake_doc_t *doc, uint64_t pos, uint64_t *nonce);
+
+/**
+ * Get the position of the block identified by nonce.
+ */
+int ishake_doc_position(ishake_doc_t *doc, uint64_t nonce, uint64_t *pos);
+
+/**
+ * Finalise the process and get the hash of the document.
+ */
+int ishake_doc_final(ishake_doc_t *doc, uint8_t *output);
+
+/**
+ * Cleanup the resources attached to the document, including the document
+ * itself and its ishake_t structure.
+ */
+void ishake_doc_cleanup(ishake_doc_t *doc);
+
+#endif // _ISHAKE_DOC_H
@@ -0,0 +1,290 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ishake.h"
+#include "trace.h"
+#include "utils.h"
+
+// the names of the calls in a trace, by op
+static const char *OPS[] = {
+        NULL, "append", "insert", "delete", "update", "snapshot", "final"
+};
+#define OP_COUNT 7
+
+
+/*
+ * Print help on how to use this program and exit.
+ */
+void usage(char *program) {
+    printf("Usage:\t%s [--max-speed] [--threads N|auto] [--help] trace\n\n",
+           program);
+    printf("\t--max-speed\tMake every call as soon as the previous one "
+                   "returns, instead of when it was made originally.\n");
+    printf("\t--threads\tThe number of threads to use, or 'auto'. Defaults "
+                   "to those used when the trace was recorded.\n");
+    printf("\t--help\t\tPrint this help.\n");
+    printf("\ttrace\t\tThe trace to replay, as recorded by ishake_trace()."
+                   "\n");
+
+    exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Write a message to stderr and exit.
+ */
+void panic(char *program, char *format, int argc, ...) {
+    va_list valist;
+    va_start(valist, argc);
+
+    fprintf(stderr, "%s: ", program);
+    if (argc > 0) {
+        vfprintf(stderr, format, valist);
+    } else {
+        fprintf(stderr, "%s\n", format);
+    }
+
+    usage(program);
+    exit(EXIT_FAILURE);
+}
+
+
+/*
+ * How long the calls of one kind took, when recorded and when replayed.
+ */
+typedef struct {
+    uint64_t *recorded;
+    uint64_t *replayed;
+    size_t count;
+    size_t size;
+} timings_t;
+
+
+/*
+ * Tell the time, in nanoseconds.
+ */
+uint64_t _monotonic(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+
+void _add_timing(timings_t *t, uint64_t recorded, uint64_t replayed) {
+    if (t->count == t->size) {
+        t->size = t->size ? t->size * 2 : 1024;
+        t->recorded = realloc(t->recorded, t->size * sizeof(uint64_t));
+        t->replayed = realloc(t->replayed, t->size * sizeof(uint64_t));
+    }
+    t->recorded[t->count] = recorded;
+    t->replayed[t->count] = replayed;
+    t->count++;
+}
+
+
+int _cmp_uint64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Sort some timings, and get the given percentile and their total, in us.
+ */
+double _percentile(uint64_t *v, size_t n, double p, double *total) {
+    qsort(v, n, sizeof(uint64_t), _cmp_uint64);
+    *total = 0;
+    for (size_t i = 0; i < n; i++) {
+        *total += v[i] / 1000.0;
+    }
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return v[i] / 1000.0;
+}
+
+
+/*
+ * Build the block of a call, with zeros if its data was not recorded.
+ */
+ishake_block_t *_block(trace_record_t *r, int i) {
+    ishake_block_t *block = malloc(sizeof(ishake_block_t));
+    block->data_len = (uint32_t)r->part[i].length;
+    block->data = calloc(block->data_len ? block->data_len : 1, 1);
+    if (r->part[i].data) {
+        memcpy(block->data, r->part[i].data, block->data_len);
+    }
+    block->header = r->header[i];
+    return block;
+}
+
+
+int main(int argc, char *argv[]) {
+    int max_speed = 0, thrno = -1;
+    char *filename = NULL;
+
+    // parse arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--max-speed", argv[i]) == 0) {
+            max_speed = 1;
+        } else if (strcmp("--threads", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--threads must be followed by the amount of "
+                        "threads to use.", 0);
+            }
+            thrno = strcmp("auto", argv[i + 1]) == 0 ? ISHAKE_THREADS_AUTO
+                                                     : atoi(argv[i + 1]);
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--help", argv[i]) == 0) {
+            usage(argv[0]);
+        } else {
+            if (strlen(argv[i]) > 2) {
+                if ((argv[i][0] == '-') && (argv[i][1] == '-')) {
+                    panic(argv[0], "unknown option '%s'\n", 1, argv[i]);
+                }
+            }
+            if (filename) {
+                panic(argv[0], "cannot specify more than one trace.", 0);
+            }
+            filename = argv[i];
+        }
+    }
+    if (filename == NULL) {
+        panic(argv[0], "a trace to replay is needed.", 0);
+    }
+
+    trace_t trace;
+    if (trace_open(&trace, filename)) {
+        panic(argv[0], "cannot read the trace from '%s'.\n", 1, filename);
+    }
+    if (thrno < 0) {
+        thrno = trace.threads;
+    }
+
+    ishake_t *is = malloc(sizeof(ishake_t));
+    if (ishake_init(is, trace.block_size, trace.output_len, trace.mode,
+                    (uint16_t)thrno)) {
+        panic(argv[0], "cannot initialize iSHAKE.", 0);
+    }
+
+    // data appended is only used if recorded, zeros otherwise
+    unsigned char *zeros = NULL;
+    uint64_t zeros_len = 0;
+    uint8_t *output = malloc((size_t)trace.output_len / 8);
+    timings_t timings[OP_COUNT];
+    memset(timings, 0, sizeof(timings));
+    int finished = 0, digest = -1; // not checked, differs, matches
+    uint64_t recorded_end = 0, lag = 0;
+
+    trace_record_t r;
+    int res = 0, failed;
+    uint64_t start = _monotonic();
+    while (!finished && (res = trace_next(&trace, &r)) == 1) {
+        if (!max_speed) { // wait until the call is due
+            uint64_t now = _monotonic() - start;
+            if (now < r.at) {
+                struct timespec ts;
+                ts.tv_sec = (time_t)((r.at - now) / 1000000000ULL);
+                ts.tv_nsec = (long)((r.at - now) % 1000000000ULL);
+                nanosleep(&ts, NULL);
+            } else if (now - r.at > lag) {
+                lag = now - r.at;
+            }
+        }
+        if (r.at + r.took > recorded_end) {
+            recorded_end = r.at + r.took;
+        }
+
+        ishake_block_t *b[2] = {NULL, NULL};
+        unsigned char *data = (unsigned char *)r.part[0].data;
+        if (r.op == TRACE_APPEND && data == NULL) {
+            if (r.part[0].length > zeros_len) {
+                free(zeros);
+                zeros_len = r.part[0].length;
+                zeros = calloc(zeros_len, 1);
+            }
+            data = zeros ? zeros : (unsigned char *)"";
+        } else if (r.op != TRACE_APPEND) {
+            for (int i = 0; i < r.parts; i++) {
+                b[i] = _block(&r, i);
+            }
+        }
+
+        uint64_t begin = _monotonic();
+        failed = 0;
+        switch (r.op) {
+            case TRACE_APPEND:
+                failed = ishake_append(is, data, r.part[0].length);
+                break;
+            case TRACE_INSERT:
+                failed = ishake_insert(is, b[0], b[1]);
+                break;
+            case TRACE_DELETE:
+                failed = ishake_delete(is, b[0], b[1]);
+                break;
+            case TRACE_UPDATE:
+                failed = ishake_update(is, b[0], b[1]);
+                break;
+            case TRACE_SNAPSHOT:
+                failed = ishake_snapshot(is, output, NULL);
+                break;
+            case TRACE_FINAL:
+                failed = ishake_final(is, output);
+                finished = 1;
+                break;
+        }
+        uint64_t took = _monotonic() - begin;
+        if (failed) {
+            panic(argv[0], "call %lu (%s) failed.\n", 2,
+                  (unsigned long)trace.count, OPS[r.op]);
+        }
+        _add_timing(&timings[r.op], r.took, took);
+
+        if (r.op == TRACE_FINAL && r.digest && trace.what == TRACE_DATA) {
+            digest = memcmp(r.digest, output, trace.output_len / 8) == 0;
+        }
+    }
+    uint64_t replayed_end = _monotonic() - start;
+    if (res < 0) {
+        panic(argv[0], "the trace is not valid after %lu calls.\n", 1,
+              (unsigned long)trace.count);
+    }
+
+    // report how long each kind of call took, then and now
+    printf("%-9s %10s %12s %12s %12s %12s %12s %12s %8s\n", "call", "count",
+           "rec p50 us", "rec p99 us", "rec total", "rep p50 us",
+           "rep p99 us", "rep total", "change");
+    for (int op = 1; op < OP_COUNT; op++) {
+        timings_t *t = &timings[op];
+        if (t->count == 0) {
+            continue;
+        }
+        double rec_total, rep_total;
+        double rec_p50 = _percentile(t->recorded, t->count, 0.5, &rec_total);
+        double rec_p99 = _percentile(t->recorded, t->count, 0.99, &rec_total);
+        double rep_p50 = _percentile(t->replayed, t->count, 0.5, &rep_total);
+        double rep_p99 = _percentile(t->replayed, t->count, 0.99, &rep_total);
+        printf("%-9s %10zu %12.1f %12.1f %12.1f %12.1f %12.1f %12.1f %+7.1f%%"
+               "\n", OPS[op], t->count, rec_p50, rec_p99, rec_total, rep_p50,
+               rep_p99, rep_total,
+               rec_total > 0 ? (rep_total / rec_total - 1) * 100 : 0);
+        free(t->recorded);
+        free(t->replayed);
+    }
+    printf("Wall time: recorded %f, replayed %f\n",
+           recorded_end / 1000000000.0, replayed_end / 1000000000.0);
+    if (!max_speed) {
+        printf("Most behind schedule: %f\n", lag / 1000000000.0);
+    }
+    if (digest >= 0) {
+        printf("Digest: %s\n", digest ? "matches" : "DIFFERS");
+    }
+
+    ishake_cleanup(is);
+    trace_close(&trace);
+    free(output);
+    free(zeros);
+    return digest == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,522 @@
+#include <dirent.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "blockstore.h"
+#include "ishake.h"
+#include "utils.h"
+
+// default block size
+#define BLOCK_SIZE 32768
+
+// amount of records a thread takes at once when hashing a store
+#define STORE_BATCH 256
+
+
+/*
+ * Print help on how to use this program and exit.
+ */
+void usage(char *program) {
+    printf("Usage:\t%s [--128|--256] [--bits N] [--block-size N] "
+                   "[--build DIR] [--insert NONCE FILE [--after PREV]] "
+                   "[--update NONCE FILE] [--delete NONCE] [--no-cache] "
+                   "[--threads N] [--quiet] [--help] store\n\n",
+           program);
+    printf("\t--128\t\tUse 128 bit equivalent iSHAKE. Default.\n");
+    printf("\t--256\t\tUse 256 bit equivalent iSHAKE.\n");
+    printf("\t--bits\t\tThe number of bits desired in the output. Must be a "
+                   "multiple of 64. Between 2688 and 4160 for iSHAKE 128, and "
+                   "between 6528 and 16512 for iSHAKE 256. The lowest "
+                   "number for each version is the default. Stores that "
+                   "cache digests always use the amount of bits they were "
+                   "built with.\n");
+    printf("\t--block-size\tThe size in bytes of the iSHAKE internal blocks, "
+                   "when building a store.\n");
+    printf("\t--build\t\tBuild the store from the files in DIR, named after "
+                   "the nonces of their blocks and chained in numerical "
+                   "order.\n");
+    printf("\t--insert\tInsert the contents of FILE as a new block with "
+                   "nonce NONCE.\n");
+    printf("\t--after\t\tThe nonce of the block after which to insert. The "
+                   "new block goes first if not given.\n");
+    printf("\t--update\tReplace the contents of the block with nonce NONCE "
+                   "with those of FILE.\n");
+    printf("\t--delete\tDelete the block with nonce NONCE.\n");
+    printf("\t--no-cache\tDo not keep the digest of every block in the "
+                   "store when building it, or ignore them and hash every "
+                   "block again otherwise.\n");
+    printf("\t--threads\tThe number of threads to use. No threads are used "
+                   "by default.\n");
+    printf("\t--quiet\t\tOutput only the resulting hash string.\n");
+    printf("\t--help\t\tPrint this help.\n");
+    printf("\tstore\t\tThe block store file.\n");
+
+    exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Write a message to stderr and exit.
+ */
+void panic(char *program, char *format, int argc, ...) {
+    va_list valist;
+    va_start(valist, argc);
+
+    fprintf(stderr, "%s: ", program);
+    if (argc > 0) {
+        vfprintf(stderr, format, valist);
+    } else {
+        fprintf(stderr, "%s\n", format);
+    }
+
+    usage(program);
+    exit(EXIT_FAILURE);
+}
+
+
+/*
+ * Work shared by the threads hashing the blocks of a store.
+ */
+typedef struct {
+    ishake_t *is;
+    blockstore_t *bs;
+    uint64_t from;
+    uint64_t to;
+    uint64_t next;
+    int cache;
+    uint64_t *total;
+    pthread_mutex_t lck;
+} store_jobs_t;
+
+
+/*
+ * Worker thread hashing blocks of a store straight from its mapping, using
+ * and filling the cached digests if asked to.
+ */
+void *_store_worker(void *arg) {
+    store_jobs_t *jobs = (store_jobs_t *) arg;
+    uint16_t words = jobs->is->output_len / 64;
+    uint64_t *sum = calloc(words, sizeof(uint64_t));
+    while (1) {
+        pthread_mutex_lock(&jobs->lck);
+        uint64_t from = jobs->next;
+        jobs->next += STORE_BATCH;
+        pthread_mutex_unlock(&jobs->lck);
+        if (from >= jobs->to) {
+            break;
+        }
+
+        uint64_t to = from + STORE_BATCH < jobs->to ? from + STORE_BATCH :
+                      jobs->to;
+        for (uint64_t i = from; i < to; i++) {
+            blockstore_record_t *r = blockstore_record(jobs->bs, i);
+            if (jobs->cache && (r->flags & BLOCKSTORE_DIGEST)) {
+                combine(sum, r->digest, words, add_mod64);
+                continue;
+            }
+
+            ishake_block_t block;
+            block.data = blockstore_data(jobs->bs, r);
+            block.data_len = r->length;
+            block.header.length = 16;
+            block.header.value.nonce.nonce = r->nonce;
+            block.header.value.nonce.prev = r->prev;
+            uint64_t *digest = ishake_hash_block(jobs->is, &block);
+            combine(sum, digest, words, add_mod64);
+            if (jobs->cache) {
+                memcpy(r->digest, digest, words * sizeof(uint64_t));
+                r->flags |= BLOCKSTORE_DIGEST;
+            }
+            free(digest);
+        }
+    }
+
+    pthread_mutex_lock(&jobs->lck);
+    combine(jobs->total, sum, words, add_mod64);
+    pthread_mutex_unlock(&jobs->lck);
+    free(sum);
+    return NULL;
+}
+
+
+/*
+ * Hash the blocks in a range of slots of a store in parallel, adding their
+ * digests to total.
+ */
+void _store_hash(ishake_t *is, blockstore_t *bs, uint64_t from, uint64_t to,
+                 int thrno, int cache, uint64_t *total) {
+    store_jobs_t jobs;
+    memset(&jobs, 0, sizeof(store_jobs_t));
+    jobs.is = is;
+    jobs.bs = bs;
+    jobs.from = from;
+    jobs.to = to;
+    jobs.next = from;
+    jobs.cache = cache;
+    jobs.total = total;
+    pthread_mutex_init(&jobs.lck, NULL);
+
+    uint64_t batches = (to - from + STORE_BATCH - 1) / STORE_BATCH;
+    int threads = thrno > 0 ? thrno : 1;
+    if ((uint64_t)threads > batches) {
+        threads = batches ? (int)batches : 1;
+    }
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    for (int t = 1; t < threads; t++) {
+        pthread_create(&tids[t], NULL, _store_worker, &jobs);
+    }
+    _store_worker(&jobs);
+    for (int t = 1; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    free(tids);
+    pthread_mutex_destroy(&jobs.lck);
+}
+
+
+/*
+ * Subtract the cached digest of the block in a slot from the total of a
+ * store, and invalidate it.
+ */
+void _store_forget(blockstore_t *bs, int64_t slot) {
+    uint16_t words = bs->hdr->bits / 64;
+    if (slot < 0) {
+        return;
+    }
+    blockstore_record_t *r = blockstore_record(bs, (uint64_t)slot);
+    if (r->flags & BLOCKSTORE_DIGEST) {
+        combine(blockstore_total(bs), r->digest, words, sub_mod64);
+        r->flags &= ~BLOCKSTORE_DIGEST;
+    }
+}
+
+
+/*
+ * Read a whole file, which must fit in len bytes. Returns the amount of
+ * bytes read, or -1 on error.
+ */
+long _read_block(char *path, uint8_t *buf, uint32_t len) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    size_t r = fread(buf, 1, len, fp);
+    int more = fgetc(fp) != EOF;
+    fclose(fp);
+    return more ? -1 : (long)r;
+}
+
+
+/*
+ * A file in a directory, named after the nonce of a block.
+ */
+typedef struct {
+    uint64_t nonce;
+    char *name;
+} blockfile_t;
+
+
+int _nonce_cmp(const void *a, const void *b) {
+    uint64_t x = ((blockfile_t *)a)->nonce, y = ((blockfile_t *)b)->nonce;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Add the files in a directory named after block nonces to an empty store,
+ * in numerical order.
+ */
+int _store_build(blockstore_t *bs, char *dirname, char **failed) {
+    DIR *dfd = opendir(dirname);
+    struct dirent *dp;
+    if (dfd == NULL) {
+        return -1;
+    }
+
+    size_t count = 0, cap = 1024;
+    blockfile_t *files = malloc(cap * sizeof(blockfile_t));
+    while ((dp = readdir(dfd)) != NULL) {
+        char *end;
+        if (dp->d_name[0] < '0' || dp->d_name[0] > '9') {
+            continue;
+        }
+        uint64_t nonce = strtoull(dp->d_name, &end, 10);
+        if (*end != '\0') {
+            continue;
+        }
+        if (count == cap) {
+            cap *= 2;
+            files = realloc(files, cap * sizeof(blockfile_t));
+        }
+        files[count].nonce = nonce;
+        files[count++].name = strdup(dp->d_name);
+    }
+    closedir(dfd);
+    qsort(files, count, sizeof(blockfile_t), _nonce_cmp);
+
+    uint32_t datalen = bs->hdr->block_size - 16;
+    uint8_t *buf = malloc(datalen);
+    int64_t last = -1;
+    int r = 0;
+    for (size_t i = 0; i < count; i++) {
+        char *path;
+        resolve_file_path(&path, dirname, files[i].name);
+        long len = r ? -1 : _read_block(path, buf, datalen);
+        if (r == 0 && (len < 0 || (i > 0 && files[i].nonce ==
+                                            files[i - 1].nonce) ||
+                       (last = blockstore_insert(bs, last, files[i].nonce,
+                                                 buf, (uint32_t)len)) < 0)) {
+            *failed = strdup(path);
+            r = -1;
+        }
+        free(path);
+        free(files[i].name);
+    }
+    free(buf);
+    free(files);
+    return r;
+}
+
+
+int main(int argc, char **argv) {
+    char *storefile = NULL, *builddir = NULL, *file = NULL, *ho;
+    int shake = 0, quiet = 0, thrno = 0, cache = 1, after_set = 0;
+    unsigned long bits = 0;
+    uint32_t block_size = BLOCK_SIZE;
+    uint64_t nonce = 0, after = 0;
+    enum {NONE, INSERT, UPDATE, DELETE} op = NONE;
+
+    // parse arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--128", argv[i]) == 0) {
+            shake = 128;
+        } else if (strcmp("--256", argv[i]) == 0) {
+            shake = 256;
+        } else if (strcmp("--quiet", argv[i]) == 0) {
+            quiet = 1;
+        } else if (strcmp("--no-cache", argv[i]) == 0) {
+            cache = 0;
+        } else if (strcmp("--bits", argv[i]) == 0) {
+            char *bits_str;
+            if (i == argc - 1) {
+                panic(argv[0], "--bits must be followed by the amount of bits "
+                        "desired as output.", 0);
+            }
+            bits = strtoul(argv[i + 1], &bits_str, 10);
+            if (argv[i + 1] == bits_str || bits == 0 || bits % 64) {
+                panic(argv[0], "--bits must be followed by a multiple of 64.",
+                      0);
+            }
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--block-size", argv[i]) == 0) {
+            char *block_str;
+            if (i == argc - 1) {
+                panic(argv[0], "--block-size must be followed by the amount of "
+                        "bytes desired as block size.", 0);
+            }
+            block_size = (uint32_t)strtoul(argv[i + 1], &block_str, 10);
+            if (argv[i + 1] == block_str || block_size <= 24) {
+                panic(argv[0], "--block-size must be followed by the amount of "
+                        "bytes desired as block size, more than 24.", 0);
+            }
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--build", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--build must be followed by a directory.", 0);
+            }
+            builddir = argv[i + 1];
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--insert", argv[i]) == 0 ||
+                   strcmp("--update", argv[i]) == 0) {
+            if (i >= argc - 2) {
+                panic(argv[0], "%s must be followed by a nonce and a file.\n",
+                      1, argv[i]);
+            }
+            op = strcmp("--insert", argv[i]) == 0 ? INSERT : UPDATE;
+            nonce = str2uint64_t(argv[i + 1], 10);
+            file = argv[i + 2];
+            i += 2; // three arguments consumed, advance the pointer!
+        } else if (strcmp("--delete", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--delete must be followed by a nonce.", 0);
+            }
+            op = DELETE;
+            nonce = str2uint64_t(argv[i + 1], 10);
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--after", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--after must be followed by a nonce.", 0);
+            }
+            after = str2uint64_t(argv[i + 1], 10);
+            after_set = 1;
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--threads", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--threads must be followed by the amount of "
+                        "threads to use.", 0);
+            }
+            thrno = atoi(argv[i + 1]);
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--help", argv[i]) == 0) {
+            usage(argv[0]);
+        } else {
+            if (strlen(argv[i]) > 2 && argv[i][0] == '-' && argv[i][1] == '-') {
+                panic(argv[0], "unknown option '%s'\n", 1, argv[i]);
+            }
+            if (storefile) {
+                panic(argv[0], "cannot specify more than one store.", 0);
+            }
+            storefile = argv[i];
+        }
+    }
+
+    if (storefile == NULL) {
+        panic(argv[0], "a block store must be specified.", 0);
+    }
+    if (builddir && op != NONE) {
+        panic(argv[0], "cannot modify a store while building it.", 0);
+    }
+    if (after_set && op != INSERT) {
+        panic(argv[0], "--after can only be used with --insert.", 0);
+    }
+
+    // validate output bits and algorithm version
+    if (bits == 0) {
+        bits = shake == 256 ? 6528 : 2688;
+    }
+    if ((shake == 256 && (bits < 6528 || bits > 16512)) ||
+        (shake != 256 && (bits < 2688 || bits > 4160) &&
+         (shake == 128 || bits < 6528 || bits > 16512))) {
+        panic(argv[0], "--bits must be between 2688 and 4160 for iSHAKE128, "
+                "or between 6528 and 16512 for iSHAKE256.", 0);
+    }
+
+    blockstore_t *bs = malloc(sizeof(blockstore_t));
+    if (builddir) {
+        if (blockstore_create(bs, storefile, block_size,
+                              cache ? (uint16_t)bits : 0)) {
+            panic(argv[0], "cannot create store '%s'.", 1, storefile);
+        }
+        char *failed = NULL;
+        if (_store_build(bs, builddir, &failed)) {
+            if (failed) {
+                panic(argv[0], "cannot read file '%s', it does not fit in a "
+                        "block, or another file has the same number.\n", 1,
+                      failed);
+            }
+            panic(argv[0], "cannot find directory '%s' or read access "
+                    "denied.\n", 1, builddir);
+        }
+    } else if (blockstore_open(bs, storefile, op != NONE)) {
+        panic(argv[0], "cannot open store '%s', or it is not a valid block "
+                "store.\n", 1, storefile);
+    }
+
+    // stores that cache digests are hashed with the bits they cache
+    if (bs->hdr->bits && (cache || op != NONE)) {
+        bits = bs->hdr->bits;
+        cache = 1;
+    } else {
+        cache = 0;
+    }
+    block_size = bs->hdr->block_size;
+
+    ishake_t *is = malloc(sizeof(ishake_t));
+    if (ishake_init(is, block_size, (uint16_t) bits, ISHAKE_FULL_MODE, 0)) {
+        panic(argv[0], "cannot initialize iSHAKE.", 0);
+    }
+
+    if (op != NONE) {
+        uint32_t datalen = block_size - 16;
+        uint8_t *buf = malloc(datalen);
+        long len = 0;
+        int64_t slot = blockstore_find(bs, nonce), prev = -1, next;
+        if (op == INSERT) {
+            if (slot >= 0 || nonce == 0) {
+                panic(argv[0], "there is a block with that nonce already, or "
+                        "it is zero.", 0);
+            }
+            if (after_set && (prev = blockstore_find(bs, after)) < 0) {
+                panic(argv[0], "there is no block to insert after.", 0);
+            }
+            next = prev >= 0 ? blockstore_next(bs, (uint64_t)prev) :
+                   (int64_t)bs->hdr->first - 1;
+        } else if (slot < 0) {
+            panic(argv[0], "there is no block with that nonce.", 0);
+        } else {
+            next = blockstore_next(bs, (uint64_t)slot);
+        }
+        if (op != DELETE && (len = _read_block(file, buf, datalen)) < 0) {
+            panic(argv[0], "cannot read file '%s' or it does not fit in a "
+                    "block.\n", 1, file);
+        }
+
+        // the block and the one following it are the only ones that change,
+        // and records move, so they are found again by nonce afterwards
+        uint64_t changed[2];
+        int nchanged = 0, r;
+        if (op != DELETE) {
+            changed[nchanged++] = nonce;
+        }
+        if (next >= 0) {
+            changed[nchanged++] = blockstore_record(bs, (uint64_t)next)->nonce;
+        }
+        if (cache) {
+            bs->hdr->flags &= ~BLOCKSTORE_DIGEST;
+            _store_forget(bs, slot);
+            _store_forget(bs, next);
+        }
+        if (op == INSERT) {
+            r = blockstore_insert(bs, prev, nonce, buf, (uint32_t)len) < 0;
+        } else if (op == UPDATE) {
+            r = blockstore_update(bs, (uint64_t)slot, buf, (uint32_t)len);
+        } else {
+            r = blockstore_delete(bs, (uint64_t)slot);
+        }
+        if (r) {
+            panic(argv[0], "cannot modify store '%s'.", 1, storefile);
+        }
+        if (cache) {
+            for (int c = 0; c < nchanged; c++) {
+                uint64_t s = (uint64_t)blockstore_find(bs, changed[c]);
+                _store_hash(is, bs, s, s + 1, thrno, 1, blockstore_total(bs));
+            }
+            bs->hdr->flags |= BLOCKSTORE_DIGEST;
+        }
+        free(buf);
+    } else if (builddir && cache) {
+        _store_hash(is, bs, 0, bs->hdr->count, thrno, 1, blockstore_total(bs));
+    }
+
+    // the digest of the store, cached or computed from every block
+    uint64_t *total = calloc(bits / 64, sizeof(uint64_t));
+    if (cache && (bs->hdr->flags & BLOCKSTORE_DIGEST)) {
+        memcpy(total, blockstore_total(bs), bits / 8);
+    } else {
+        _store_hash(is, bs, 0, bs->hdr->count, thrno, 0, total);
+    }
+
+    uint8_t *bo = malloc(bits / 8);
+    uint64_t2uint8_t(bo, total, bits / 64);
+    bin2hex(&ho, bo, bits / 8);
+    if (quiet) {
+        printf("%s\n", ho);
+    } else {
+        printf("%s - %s\n", ho, storefile);
+    }
+
+    // clean
+    if (blockstore_close(bs)) {
+        panic(argv[0], "cannot write store '%s'.", 1, storefile);
+    }
+    ishake_cleanup(is);
+    free(bs);
+    free(total);
+    free(bo);
+    free(ho);
+    return EXIT_SUCCESS;
+}
@@ -1,22 +1,33 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "ishake.h"
+#include "ishake_cdc.h"
 #include "utils.h"
 
 // default block size
 #define BLOCK_SIZE 32768
 
+// amount of data read at once from each file when checking a manifest
+#define CHECK_READ_SIZE 4*1024*1024
+
 
 /*
  * Print help on how to use this program and exit.
  */
 void usage(char *program) {
     printf("Usage:\t%s [--128|--256] [--hex] [--bits N] [--block-size N] "
-                   "[--quiet] [--help] [file]\n\n",
+                   "[--cdc MIN:AVG:MAX] [--rehash H --from OLD] [--check MANIFEST] "
+                   "[--extend H --tail TAIL] [--save-tail TAIL] [--follow] "
+                   "[--threads N|auto] "
+                   "[--affinity POLICY] [--quiet] "
+                   "[--help] [file]\n\n",
            program);
     printf("\t--128\t\tUse 128 bit equivalent iSHAKE. Default.\n");
     printf("\t--256\t\tUse 256 bit equivalent iSHAKE.\n");
@@ -27,8 +38,35 @@ void usage(char *program) {
                    "number for each version is the default.\n");
     printf("\t--block-size\tThe size in bytes of the iSHAKE internal blocks."
                    "\n");
-    printf("\t--threads\tThe number of threads to use. No threads are used "
-                   "by default.\n");
+    printf("\t--cdc\t\tSplit the input in blocks of variable size depending "
+                   "on its contents, between MIN and MAX bytes and around AVG "
+                   "bytes on average. Blocks are hashed in FULL mode.\n");
+    printf("\t--rehash\tThe hash of the file passed to --from, to use as "
+                   "base, computing only those blocks that have changed.\n");
+    printf("\t--from\t\tThe old version of the file, whose hash was passed "
+                   "to --rehash.\n");
+    printf("\t--check\t\tRead hashes and file names from MANIFEST, as "
+                   "printed by this program, and verify them. Files are "
+                   "checked in parallel by --threads threads, as many as CPUs "
+                   "available by default.\n");
+    printf("\t--extend\tThe hash of a file that has grown since, to use "
+                   "as base, hashing only the data appended to it. The hash "
+                   "must have been printed with --save-tail, and the file "
+                   "is read from where it ended then. Data piped into the "
+                   "program is taken as new data only.\n");
+    printf("\t--tail\t\tThe state saved with --save-tail along with the "
+                   "hash passed to --extend.\n");
+    printf("\t--save-tail\tSave the state needed to --extend the hash "
+                   "later on, without reading any of the data again.\n");
+    printf("\t--follow\tKeep hashing the file as it grows, printing a new "
+                   "hash after each change. Only new data is read.\n");
+    printf("\t--threads\tThe number of threads to use, or 'auto' to use "
+                   "as many as CPUs available (after affinity and cgroup "
+                   "quotas), waking them up only as needed. No threads are "
+                   "used by default.\n");
+    printf("\t--affinity\tPin threads to CPUs: 'compact' fills one NUMA "
+                   "node before moving to the next, 'scatter' spreads them "
+                   "across nodes, or a list of CPUs like '0-3,8'.\n");
     printf("\t--profile\tMeasure the performance of the operation(s) to run"
                    ".\n");
     printf("\t--quiet\t\tOutput only the resulting hash string.\n");
@@ -59,6 +97,562 @@ void panic(char *program, char *format, int argc, ...) {
 }
 
 
+/*
+ * A content-defined block found in a file.
+ */
+typedef struct {
+    uint64_t nonce;
+    uint64_t prev;
+    uint64_t offset;
+    uint32_t len;
+} chunk_t;
+
+
+/*
+ * Build an iSHAKE block with the given data and header.
+ */
+ishake_block_t *_block(uint8_t *data, uint32_t len, ishake_header header) {
+    ishake_block_t *block = malloc(sizeof(ishake_block_t));
+    block->data = malloc(len ? len : 1);
+    memcpy(block->data, data, len);
+    block->data_len = len;
+    block->header = header;
+    return block;
+}
+
+
+/*
+ * Update the hash of oldfp so that it becomes the hash of newfp, comparing
+ * both files block by block and hashing only those blocks that differ.
+ *
+ * Blocks past the end of the new file are subtracted, and blocks past the
+ * end of the old file are appended.
+ */
+int _rehash_from(ishake_t *is, FILE *oldfp, FILE *newfp, uint32_t datalen) {
+    uint8_t *ob = malloc(datalen);
+    uint8_t *nb = malloc(datalen);
+    size_t o_read, n_read;
+    uint64_t idx = 0;
+    ishake_header h;
+    h.length = 8;
+
+    do {
+        idx++;
+        o_read = fread(ob, 1, datalen, oldfp);
+        n_read = fread(nb, 1, datalen, newfp);
+
+        // an empty file is hashed as a single empty block
+        int o_blk = o_read > 0 || idx == 1;
+        int n_blk = n_read > 0 || idx == 1;
+        if (o_blk && n_blk && o_read == n_read &&
+            memcmp(ob, nb, o_read) == 0) {
+            continue;
+        }
+
+        h.value.idx = idx;
+        if (o_blk && n_blk) { // the block changed
+            if (ishake_update(is, _block(ob, (uint32_t)o_read, h),
+                              _block(nb, (uint32_t)n_read, h))) {
+                return -1;
+            }
+        } else if (o_blk) { // the new file was truncated
+            if (ishake_delete(is, _block(ob, (uint32_t)o_read, h), NULL)) {
+                return -1;
+            }
+        } else if (n_blk) { // the new file grew, append the rest of it
+            is->block_no = idx - 1;
+            do {
+                if (ishake_append(is, nb, n_read)) {
+                    return -1;
+                }
+                n_read = fread(nb, 1, datalen, newfp);
+            } while (n_read > 0);
+            break;
+        }
+    } while (o_read == datalen || n_read == datalen);
+
+    free(ob);
+    free(nb);
+    return 0;
+}
+
+
+/*
+ * Split a file in content-defined blocks, and return the list of blocks, or
+ * NULL if we run out of memory.
+ */
+chunk_t *_cdc_chunks(ishake_cdc_t *cdc, FILE *fp, uint64_t *count) {
+    uint8_t *buf = malloc(cdc->max_size);
+    uint32_t filled = 0;
+    uint64_t offset = 0, prev = 0, size = 1024;
+    chunk_t *chunks = malloc(size * sizeof(chunk_t));
+
+    *count = 0;
+    if (ishake_cdc_reset(cdc)) {
+        free(buf);
+        free(chunks);
+        return NULL;
+    }
+    while (1) {
+        filled += fread(buf + filled, 1, cdc->max_size - filled, fp);
+        if (filled == 0) {
+            break;
+        }
+
+        uint32_t cut = ishake_cdc_cut(cdc, buf, filled,
+                                      filled < cdc->max_size);
+        if (*count == size) {
+            size *= 2;
+            chunks = realloc(chunks, size * sizeof(chunk_t));
+        }
+        chunks[*count].nonce = ishake_cdc_next_nonce(cdc, buf, cut);
+        if (chunks[*count].nonce == 0) {
+            free(buf);
+            free(chunks);
+            return NULL;
+        }
+        chunks[*count].prev = prev;
+        chunks[*count].offset = offset;
+        chunks[*count].len = cut;
+        prev = chunks[*count].nonce;
+        offset += cut;
+        (*count)++;
+
+        filled -= cut;
+        memmove(buf, buf + cut, filled);
+    }
+    free(buf);
+    return chunks;
+}
+
+
+int _chunk_cmp(const void *a, const void *b) {
+    const chunk_t *ca = a, *cb = b;
+    if (ca->nonce != cb->nonce) return ca->nonce < cb->nonce ? -1 : 1;
+    if (ca->prev != cb->prev) return ca->prev < cb->prev ? -1 : 1;
+    if (ca->len != cb->len) return ca->len < cb->len ? -1 : 1;
+    return 0;
+}
+
+
+/*
+ * Read a content-defined block from a file and build the iSHAKE block.
+ */
+ishake_block_t *_chunk_block(FILE *fp, chunk_t *chunk) {
+    ishake_block_t *block = malloc(sizeof(ishake_block_t));
+    block->data = malloc(chunk->len ? chunk->len : 1);
+    block->data_len = chunk->len;
+    block->header.length = 16;
+    block->header.value.nonce.nonce = chunk->nonce;
+    block->header.value.nonce.prev = chunk->prev;
+    fseeko(fp, (off_t)chunk->offset, SEEK_SET);
+    if (fread(block->data, 1, chunk->len, fp) != chunk->len) {
+        free(block->data);
+        free(block);
+        return NULL;
+    }
+    return block;
+}
+
+
+/*
+ * Update the hash of oldfp so that it becomes the hash of newfp, when both
+ * are split in content-defined blocks. Blocks are identified by their nonce
+ * and the nonce of the previous block, unique within each file, so only
+ * blocks that are not present in both files need to be hashed.
+ */
+int _rehash_from_cdc(ishake_t *is,
+                     ishake_cdc_t *cdc,
+                     FILE *oldfp,
+                     FILE *newfp) {
+    uint64_t o_count, n_count, o = 0, n = 0;
+    chunk_t *o_chunks = _cdc_chunks(cdc, oldfp, &o_count);
+    chunk_t *n_chunks = _cdc_chunks(cdc, newfp, &n_count);
+    if (o_chunks == NULL || n_chunks == NULL) {
+        free(o_chunks);
+        free(n_chunks);
+        return -1;
+    }
+    qsort(o_chunks, o_count, sizeof(chunk_t), _chunk_cmp);
+    qsort(n_chunks, n_count, sizeof(chunk_t), _chunk_cmp);
+
+    while (o < o_count || n < n_count) {
+        int cmp;
+        if (o == o_count) {
+            cmp = 1;
+        } else if (n == n_count) {
+            cmp = -1;
+        } else {
+            cmp = _chunk_cmp(&o_chunks[o], &n_chunks[n]);
+        }
+
+        if (cmp == 0) { // same block in both files
+            o++;
+            n++;
+            continue;
+        }
+
+        ishake_block_t *block;
+        if (cmp < 0) { // block gone from the new file
+            block = _chunk_block(oldfp, &o_chunks[o++]);
+            if (block == NULL || ishake_delete(is, block, NULL)) {
+                return -1;
+            }
+        } else { // block not present in the old file
+            block = _chunk_block(newfp, &n_chunks[n++]);
+            if (block == NULL || ishake_insert(is, block, NULL)) {
+                return -1;
+            }
+        }
+    }
+
+    free(o_chunks);
+    free(n_chunks);
+    return 0;
+}
+
+
+/*
+ * Append data to the hash, splitting it with the chunker if we have one.
+ */
+int _append(ishake_t *is, ishake_cdc_t *cdc, uint8_t *data, uint64_t len) {
+    if (cdc) {
+        return ishake_cdc_append(is, cdc, data, len);
+    }
+    return ishake_append(is, data, len);
+}
+
+
+/*
+ * Read a tail saved by --save-tail.
+ */
+int _load_tail(char *path, uint8_t *tail) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    size_t r = fread(tail, 1, ISHAKE_TAIL_LEN, fp);
+    fclose(fp);
+    return r == ISHAKE_TAIL_LEN ? 0 : -1;
+}
+
+
+/*
+ * Write the tail of a hash, replacing the previous one atomically so that
+ * it never goes out of sync with the hash printed.
+ */
+int _save_tail(char *path, uint8_t *tail) {
+    char *tmp = malloc(strlen(path) + 5);
+    sprintf(tmp, "%s.new", path);
+    FILE *fp = fopen(tmp, "w");
+    int r = -1;
+    if (fp != NULL) {
+        r = fwrite(tail, 1, ISHAKE_TAIL_LEN, fp) == ISHAKE_TAIL_LEN ? 0 : -1;
+        if (fclose(fp) || r || rename(tmp, path)) {
+            unlink(tmp);
+            r = -1;
+        }
+    }
+    free(tmp);
+    return r;
+}
+
+
+/*
+ * Wait for a file to grow and hash the new data each time it does, going on
+ * from the last digest and tail. Returns only if something goes wrong.
+ */
+int _follow(FILE *fp,
+            char *filename,
+            uint8_t *digest,
+            uint8_t *tail,
+            char *tailfile,
+            unsigned long bits,
+            uint16_t thrno,
+            int quiet) {
+    uint8_t *buf = malloc(CHECK_READ_SIZE);
+    off_t offset = ftello(fp);
+    struct stat st;
+    char *ho;
+
+    while (1) {
+        fflush(stdout);
+        sleep(1);
+        if (fstat(fileno(fp), &st)) {
+            return -1;
+        }
+        if (st.st_size < offset) { // we cannot take data out of the hash
+            return -1;
+        }
+        if (st.st_size == offset) {
+            continue;
+        }
+
+        ishake_t *is = malloc(sizeof(ishake_t));
+        if (ishake_extend(is, digest, tail, thrno)) {
+            return -1;
+        }
+        size_t b_read;
+        clearerr(fp);
+        fseeko(fp, offset, SEEK_SET);
+        while ((b_read = fread(buf, 1, CHECK_READ_SIZE, fp)) > 0) {
+            if (ishake_append(is, buf, b_read)) {
+                return -1;
+            }
+        }
+        offset = ftello(fp);
+        if (ishake_tail(is, tail) || ishake_final(is, digest)) {
+            return -1;
+        }
+        ishake_cleanup(is);
+        if (tailfile && _save_tail(tailfile, tail)) {
+            return -1;
+        }
+
+        bin2hex(&ho, digest, bits / 8);
+        if (quiet) {
+            printf("%s\n", ho);
+        } else {
+            printf("%s - %s\n", ho, filename);
+        }
+        free(ho);
+    }
+}
+
+
+/*
+ * A file to verify, and the result once a worker is done with it.
+ */
+typedef struct {
+    char *name;
+    char *hash;
+    int status; // 0 pending, 1 OK, -1 FAILED, -2 cannot be read
+} check_entry_t;
+
+/*
+ * The contents of a manifest, shared by all workers verifying them.
+ */
+typedef struct {
+    check_entry_t *entries;
+    size_t count;
+    size_t next;
+    uint32_t block_size;
+    unsigned int cdc_min;
+    unsigned int cdc_avg;
+    unsigned int cdc_max;
+    pthread_mutex_t lck;
+    pthread_cond_t checked;
+} check_jobs_t;
+
+
+/*
+ * Read a manifest with one "HASH - FILE" line per file.
+ */
+check_entry_t *_read_manifest(FILE *fp, size_t *count) {
+    check_entry_t *entries = NULL;
+    size_t cap = 0;
+    char *line = NULL;
+    size_t n = 0;
+    ssize_t len;
+
+    *count = 0;
+    while ((len = getline(&line, &n, fp)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        char *sep = strchr(line, ' ');
+        if (sep == NULL) {
+            continue;
+        }
+        *sep = '\0';
+        char *name = sep + 1;
+        if (strncmp(name, "- ", 2) == 0) {
+            name += 2;
+        } else {
+            while (*name == ' ') name++;
+        }
+
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            entries = realloc(entries, cap * sizeof(check_entry_t));
+        }
+        entries[*count].hash = strdup(line);
+        entries[*count].name = strdup(name);
+        entries[*count].status = 0;
+        (*count)++;
+    }
+    free(line);
+    return entries;
+}
+
+
+/*
+ * Compute the hash of a file and compare it with the one in the manifest.
+ */
+int _check_entry(check_jobs_t *jobs, check_entry_t *entry, uint8_t *buf) {
+    size_t hexlen = strlen(entry->hash);
+    unsigned long bits = hexlen * 4;
+    if (bits % 64 || bits < 2688 || bits > 16512) {
+        return -1;
+    }
+
+    FILE *fp = fopen(entry->name, "r");
+    if (fp == NULL) {
+        return -2;
+    }
+
+    // one file per worker, so each of them hashes without extra threads
+    ishake_t *is = malloc(sizeof(ishake_t));
+    ishake_cdc_t *cdc = NULL;
+    if (ishake_init(is, jobs->block_size, (uint16_t) bits,
+                    jobs->cdc_max ? ISHAKE_FULL_MODE
+                                  : ISHAKE_APPEND_ONLY_MODE, 0)) {
+        fclose(fp);
+        ishake_cleanup(is);
+        return -1;
+    }
+    if (jobs->cdc_max) {
+        cdc = malloc(sizeof(ishake_cdc_t));
+        ishake_cdc_init(cdc, jobs->cdc_min, jobs->cdc_avg, jobs->cdc_max);
+    }
+
+    size_t b_read;
+    int r = 0;
+    while ((b_read = fread(buf, 1, CHECK_READ_SIZE, fp)) > 0) {
+        if (_append(is, cdc, buf, b_read)) {
+            r = -1;
+            break;
+        }
+    }
+    if (ferror(fp)) {
+        r = -2;
+    }
+    fclose(fp);
+    if (cdc && r == 0 && ishake_cdc_final(is, cdc)) {
+        r = -1;
+    }
+
+    uint8_t *bo = malloc(bits / 8);
+    char *ho = NULL;
+    if (ishake_final(is, bo) == 0 && r == 0) {
+        bin2hex(&ho, bo, bits / 8);
+        r = strcasecmp(ho, entry->hash) == 0 ? 1 : -1;
+    }
+
+    if (cdc) ishake_cdc_cleanup(cdc);
+    ishake_cleanup(is);
+    free(bo);
+    free(ho);
+    return r;
+}
+
+
+/*
+ * Worker thread verifying files from the manifest until there are no more.
+ */
+void *_check_worker(void *arg) {
+    check_jobs_t *jobs = (check_jobs_t *) arg;
+    uint8_t *buf = malloc(CHECK_READ_SIZE);
+
+    while (1) {
+        pthread_mutex_lock(&jobs->lck);
+        if (jobs->next == jobs->count) {
+            pthread_mutex_unlock(&jobs->lck);
+            break;
+        }
+        check_entry_t *entry = &jobs->entries[jobs->next++];
+        pthread_mutex_unlock(&jobs->lck);
+
+        int status = _check_entry(jobs, entry, buf);
+
+        pthread_mutex_lock(&jobs->lck);
+        entry->status = status;
+        pthread_cond_broadcast(&jobs->checked);
+        pthread_mutex_unlock(&jobs->lck);
+    }
+
+    free(buf);
+    pthread_exit(NULL);
+}
+
+
+/*
+ * Verify all files in a manifest, printing the results in the same order.
+ * Returns the amount of files that could not be verified.
+ */
+size_t _check(char *manifest,
+              uint32_t block_size,
+              unsigned int cdc_min,
+              unsigned int cdc_avg,
+              unsigned int cdc_max,
+              long thrno,
+              int quiet,
+              size_t *unreadable) {
+    FILE *fp = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (fp == NULL) {
+        return (size_t)-1;
+    }
+
+    check_jobs_t jobs;
+    jobs.entries = _read_manifest(fp, &jobs.count);
+    jobs.next = 0;
+    jobs.block_size = block_size;
+    jobs.cdc_min = cdc_min;
+    jobs.cdc_avg = cdc_avg;
+    jobs.cdc_max = cdc_max;
+    pthread_mutex_init(&jobs.lck, NULL);
+    pthread_cond_init(&jobs.checked, NULL);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+
+    if (thrno <= 0 || thrno == ISHAKE_THREADS_AUTO) {
+        thrno = affinity_cpus();
+    }
+    if ((size_t)thrno > jobs.count) {
+        thrno = (long)jobs.count;
+    }
+    pthread_t *threads = malloc(thrno * sizeof(pthread_t));
+    for (long t = 0; t < thrno; t++) {
+        pthread_create(&threads[t], NULL, _check_worker, &jobs);
+    }
+
+    size_t failed = 0;
+    *unreadable = 0;
+    for (size_t e = 0; e < jobs.count; e++) {
+        check_entry_t *entry = &jobs.entries[e];
+        pthread_mutex_lock(&jobs.lck);
+        while (entry->status == 0) {
+            pthread_cond_wait(&jobs.checked, &jobs.lck);
+        }
+        pthread_mutex_unlock(&jobs.lck);
+
+        if (entry->status == 1) {
+            if (!quiet) {
+                printf("%s: OK\n", entry->name);
+            }
+        } else if (entry->status == -2) {
+            printf("%s: FAILED open or read\n", entry->name);
+            (*unreadable)++;
+        } else {
+            printf("%s: FAILED\n", entry->name);
+            failed++;
+        }
+        free(entry->name);
+        free(entry->hash);
+    }
+
+    for (long t = 0; t < thrno; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    free(jobs.entries);
+    pthread_mutex_destroy(&jobs.lck);
+    pthread_cond_destroy(&jobs.checked);
+    return failed;
+}
+
+
 int main(int argc, char *argv[]) {
     FILE *fp;
     uint8_t *buf;
@@ -68,7 +662,16 @@ int main(int argc, char *argv[]) {
     uint32_t datalen;
 
     int shake = 0, blocks = 0, hex_input = 0, quiet = 0, thrno = 0, profile = 0;
+    uint8_t affinity = ISHAKE_AFFINITY_NONE;
+    char *cpus = NULL;
     unsigned long bits = 0;
+    unsigned int cdc_min = 0, cdc_avg = 0, cdc_max = 0;
+    ishake_cdc_t *cdc = NULL;
+    char *oldhash = NULL, *oldfile = NULL, *manifest = NULL;
+    char *exthash = NULL, *tailfile = NULL, *savetail = NULL;
+    int follow = 0;
+    uint8_t tail[ISHAKE_TAIL_LEN];
+    FILE *oldfp = NULL;
     char *filename = "";
 
     // parse arguments
@@ -108,12 +711,83 @@ int main(int argc, char *argv[]) {
                 panic(argv[0], "--block-size can't be zero.", 0);
             }
             i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--cdc", argv[i]) == 0) {
+            if (i == argc - 1 || sscanf(argv[i + 1], "%u:%u:%u", &cdc_min,
+                                        &cdc_avg, &cdc_max) != 3) {
+                panic(argv[0], "--cdc must be followed by the minimum, "
+                        "average and maximum block sizes, as MIN:AVG:MAX.", 0);
+            }
+            if (!cdc_min || cdc_min > cdc_avg || cdc_avg > cdc_max) {
+                panic(argv[0], "--cdc sizes must satisfy 0 < MIN <= AVG <= "
+                        "MAX.", 0);
+            }
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--rehash", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--rehash must be followed by the old hash to "
+                        "use as base for the computation, hex-encoded.", 0);
+            }
+            oldhash = argv[i + 1];
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--from", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--from must be followed by the old version "
+                        "of the file.", 0);
+            }
+            oldfile = argv[i + 1];
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--extend", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--extend must be followed by the hash to "
+                        "go on from, hex-encoded.", 0);
+            }
+            exthash = argv[i + 1];
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--tail", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--tail must be followed by the file saved "
+                        "with --save-tail.", 0);
+            }
+            tailfile = argv[i + 1];
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--save-tail", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--save-tail must be followed by the file to "
+                        "save the tail to.", 0);
+            }
+            savetail = argv[i + 1];
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--follow", argv[i]) == 0) {
+            follow = 1;
         } else if (strcmp("--threads", argv[i]) == 0) {
             if (i == argc - 1) {
                 panic(argv[0], "--threads must be followed by the amount of "
                         "threads to use.", 0);
             }
-            thrno = atoi(argv[i + 1]);
+            thrno = strcmp("auto", argv[i + 1]) == 0 ? ISHAKE_THREADS_AUTO
+                                                     : atoi(argv[i + 1]);
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--affinity", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--affinity must be followed by compact, "
+                        "scatter or a list of CPUs.", 0);
+            }
+            if (strcmp("compact", argv[i + 1]) == 0) {
+                affinity = ISHAKE_AFFINITY_COMPACT;
+            } else if (strcmp("scatter", argv[i + 1]) == 0) {
+                affinity = ISHAKE_AFFINITY_SCATTER;
+            } else {
+                affinity = ISHAKE_AFFINITY_LIST;
+                cpus = argv[i + 1];
+            }
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--check", argv[i]) == 0 ||
+                   strcmp("-c", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--check must be followed by the manifest to "
+                        "verify.", 0);
+            }
+            manifest = argv[i + 1];
             i++; // two arguments consumed, advance the pointer!
         } else if (strcmp("--help", argv[i]) == 0) {
             usage(argv[0]);
@@ -138,6 +812,65 @@ int main(int argc, char *argv[]) {
     datalen = block_size - 8;
     datalen = datalen + (datalen * hex_input);
 
+    // verify a manifest instead of computing a hash
+    if (manifest) {
+        if (hex_input || oldhash || oldfile || strlen(filename)) {
+            panic(argv[0], "--check cannot be used with other input.", 0);
+        }
+        size_t unreadable;
+        size_t failed = _check(manifest, block_size, cdc_min, cdc_avg,
+                               cdc_max, thrno, quiet, &unreadable);
+        if (failed == (size_t)-1) {
+            panic(argv[0], "cannot find file '%s' or read access denied.",
+                  1, manifest);
+        }
+        fflush(stdout);
+        if (unreadable) {
+            fprintf(stderr, "%s: WARNING: %zu listed file%s could not be "
+                    "read\n", argv[0], unreadable, unreadable > 1 ? "s" : "");
+        }
+        if (failed) {
+            fprintf(stderr, "%s: WARNING: %zu computed checksum%s did NOT "
+                    "match\n", argv[0], failed, failed > 1 ? "s" : "");
+        }
+        return failed || unreadable ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    // rehashing needs both versions of the file, and binary input
+    if ((oldhash == NULL) != (oldfile == NULL)) {
+        panic(argv[0], "--rehash and --from must be used together.", 0);
+    }
+    if (oldfile) {
+        if (hex_input) {
+            panic(argv[0], "--hex cannot be used with --rehash.", 0);
+        }
+        if (strlen(filename) == 0) {
+            panic(argv[0], "--rehash needs the new version of the file.", 0);
+        }
+        if (access(oldfile, R_OK) == -1) {
+            panic(argv[0], "cannot find file '%s' or read access denied.",
+                  1, oldfile);
+        }
+        oldfp = fopen(oldfile, "r");
+    }
+
+    // going on from a previous hash works on raw data split in fixed blocks
+    if ((exthash == NULL) != (tailfile == NULL)) {
+        panic(argv[0], "--extend and --tail must be used together.", 0);
+    }
+    if (exthash || savetail || follow) {
+        if (hex_input || cdc_max || oldhash) {
+            panic(argv[0], "--extend, --save-tail and --follow cannot be "
+                    "used with --hex, --cdc or --rehash.", 0);
+        }
+    }
+    if (follow && strlen(filename) == 0) {
+        panic(argv[0], "--follow needs a file to watch.", 0);
+    }
+    if (tailfile && _load_tail(tailfile, tail)) {
+        panic(argv[0], "cannot read the tail from '%s'.", 1, tailfile);
+    }
+
     // open appropriate input source
     if (strlen(filename) == 0) {
         fp = stdin;
@@ -149,6 +882,14 @@ int main(int argc, char *argv[]) {
         fp = fopen(filename, "r");
     }
 
+    // the hash to extend tells how many bits we need, if not given
+    if (exthash && bits == 0) {
+        bits = strlen(exthash) * 4;
+        if (shake == 0) {
+            shake = bits > 4160 ? 256 : 128;
+        }
+    }
+
     // validate output bits and algorithm version
     switch (shake) {
         case 256:
@@ -177,6 +918,16 @@ int main(int argc, char *argv[]) {
             }
     }
 
+    // verify the length of the old hash if we are rehashing
+    if (oldhash && bits != strlen(oldhash) * 4) {
+        panic(argv[0], "the length of the old hash does not match with "
+                "the requested amount of bits.", 0);
+    }
+    if (exthash && bits != strlen(exthash) * 4) {
+        panic(argv[0], "the length of the hash to extend does not match "
+                "with the requested amount of bits.", 0);
+    }
+
     // start measuring performance
     clock_t start_cpu = 0, end_cpu = 0;
     struct timespec start_wall, end_wall;
@@ -190,35 +941,93 @@ int main(int argc, char *argv[]) {
     // initialize ishake
     ishake_t *is;
     is = malloc(sizeof(ishake_t));
-    if (ishake_init(is,
-                    block_size,
-                    (uint16_t) bits,
-                    ISHAKE_APPEND_ONLY_MODE,
-                    thrno)
+    if (exthash) { // the block size and bits are those of the old hash
+        uint8_t *bin;
+        hex2bin((char **)&bin, (uint8_t *)exthash, strlen(exthash));
+        if (ishake_extend(is, bin, tail, thrno)) {
+            panic(argv[0], "cannot extend the hash with the given tail.", 0);
+        }
+        free(bin);
+
+        // skip the data we already hashed, unless we only get the new one
+        struct stat st;
+        if (fp != stdin) {
+            if (fstat(fileno(fp), &st) ||
+                (uint64_t)st.st_size < is->proc_bytes) {
+                panic(argv[0], "'%s' is shorter than when it was hashed.",
+                      1, filename);
+            }
+            fseeko(fp, (off_t)is->proc_bytes, SEEK_SET);
+        }
+    } else if (ishake_init_affinity(is,
+                             block_size,
+                             (uint16_t) bits,
+                             cdc_max ? ISHAKE_FULL_MODE
+                                     : ISHAKE_APPEND_ONLY_MODE,
+                             thrno,
+                             affinity,
+                             cpus)
     ) {
         panic(argv[0], "cannot initialize iSHAKE.", 0);
     }
 
-    // read input and process it on the go
-    buf = malloc(datalen);
-    unsigned long b_read;
+    // initialize the chunker, if we are asked to use content-defined blocks
+    if (cdc_max) {
+        cdc = malloc(sizeof(ishake_cdc_t));
+        if (ishake_cdc_init(cdc, cdc_min, cdc_avg, cdc_max)) {
+            panic(argv[0], "cannot initialize the chunker.", 0);
+        }
+    }
 
-    do {
-        blocks++;
-        b_read = fread(buf, 1, datalen, fp);
-        if (hex_input) {
-            uint8_t *raw_data;
-            hex2bin((char **)&raw_data, buf, b_read);
-            if (ishake_append(is, raw_data, b_read / 2)) {
-                panic(argv[0], "iSHAKE failed to process data.", 0);
-            }
-            free(raw_data);
-        } else {
-            if (ishake_append(is, buf, b_read)) {
-                panic(argv[0], "iSHAKE failed to process data.", 0);
+    if (oldhash) { // start from the old hash, and compare both files
+        uint8_t *bin;
+        hex2bin((char **)&bin, (uint8_t *)oldhash, strlen(oldhash));
+        uint8_t2uint64_t(is->hash, bin, bits / 8);
+        free(bin);
+
+        setvbuf(oldfp, NULL, _IOFBF, 1 << 20);
+        setvbuf(fp, NULL, _IOFBF, 1 << 20);
+        int r = cdc ? _rehash_from_cdc(is, cdc, oldfp, fp)
+                    : _rehash_from(is, oldfp, fp, datalen);
+        if (r) {
+            panic(argv[0], "iSHAKE failed to process data.", 0);
+        }
+        fclose(oldfp);
+    } else { // read input and process it on the go
+        buf = malloc(datalen);
+        unsigned long b_read;
+
+        do {
+            blocks++;
+            b_read = fread(buf, 1, datalen, fp);
+            if (hex_input) {
+                uint8_t *raw_data;
+                hex2bin((char **)&raw_data, buf, b_read);
+                if (_append(is, cdc, raw_data, b_read / 2)) {
+                    panic(argv[0], "iSHAKE failed to process data.", 0);
+                }
+                free(raw_data);
+            } else {
+                if (_append(is, cdc, buf, b_read)) {
+                    panic(argv[0], "iSHAKE failed to process data.", 0);
+                }
             }
+        } while (b_read == datalen);
+        free(buf);
+
+        // the last content-defined block is still pending
+        if (cdc && ishake_cdc_final(is, cdc)) {
+            panic(argv[0], "iSHAKE failed to process data.", 0);
         }
-    } while (b_read == datalen);
+    }
+
+    // keep what we need to go on from here later
+    if ((savetail || follow) && ishake_tail(is, tail)) {
+        panic(argv[0], "cannot save the tail of the hash.", 0);
+    }
+    if (savetail && _save_tail(savetail, tail)) {
+        panic(argv[0], "cannot write the tail to '%s'.", 1, savetail);
+    }
 
     // finish computations and get the hash
     bo = malloc(bits / 8);
@@ -248,9 +1057,15 @@ int main(int argc, char *argv[]) {
     }
 
     // clean
+    if (cdc) ishake_cdc_cleanup(cdc);
     ishake_cleanup(is);
+
+    if (follow && _follow(fp, filename, bo, tail, savetail, bits,
+                          (uint16_t)thrno, quiet)) {
+        panic(argv[0], "cannot go on hashing '%s', was it truncated?", 1,
+              filename);
+    }
     fclose(fp);
-    free(buf);
     free(bo);
     free(ho);
     return EXIT_SUCCESS;
@@ -1,86 +1,1798 @@
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#endif
+
+#include "dirstate.h"
 #include "ishake.h"
+#include "journal.h"
 #include "utils.h"
 
-// default block size
-#define BLOCK_SIZE 32768
+// default block size
+#define BLOCK_SIZE 32768
+
+// size of the buffer used to list directory entries in batches
+#define SCAN_BUF_SIZE 65536
+
+// size of the buffer where tar archives are read and hashed from
+#define TAR_BUF_SIZE 16777216
+
+// journal records applied at once, and terms taken by a thread at a time
+#define JOURNAL_BATCH 262144
+#define JOURNAL_RUN 256
+
+// the least amount of files worth a thread when reading their metadata
+#define SCAN_MIN_STAT 4096
+
+// how long to wait for more changes before hashing again, in milliseconds
+#define WATCH_DEBOUNCE 200
+
+// the longest a batch of changes can be delayed, in debounce periods
+#define WATCH_MAX_DELAY 10
+
+
+/*
+ * Print help on how to use this program and exit.
+ */
+void usage(char *program) {
+    printf("Usage:\t%s [--128|--256] [--bits N] [--block-size N] [--mode M] "
+                   "[--rehash H] [--apply-journal FILE] [--state FILE] "
+                   "[--watch] [--debounce MS] [--publish PATH] [--tar FILE] "
+                   "[--threads N|auto] "
+                   "[--affinity POLICY] [--quiet] [--help] [dir]\n\n",
+           program);
+    printf("\t--128\t\tUse 128 bit equivalent iSHAKE. Default.\n");
+    printf("\t--256\t\tUse 256 bit equivalent iSHAKE.\n");
+    printf("\t--bits\t\tThe number of bits desired in the output. Must be a "
+                   "multiple of 64. Between 2688 and 4160 for iSHAKE 128, and "
+                   "between 6528 and 16512 for iSHAKE 256. The lowest "
+                   "number for each version is the default.\n");
+    printf("\t--block-size\tThe size in bytes of the iSHAKE internal blocks."
+                   "\n");
+    printf("\t--mode\t\tThe mode of operation, one of FULL or APPEND_ONLY. "
+                   "Defaults to APPEND_ONLY.\n");
+    printf("\t--rehash\tThe hash to use as base, computing only those "
+                   "blocks that have changed.\n");
+    printf("\t--apply-journal\tApply the changes recorded in FILE to the "
+                   "hash given with --rehash, instead of looking for changed "
+                   "files in the directory, which is only used to find the "
+                   "files the journal refers to.\n");
+    printf("\t--state\t\tKeep the metadata and hash of every file in FILE, "
+                   "and use it to hash only the files that changed since the "
+                   "last run.\n");
+    printf("\t--watch\t\tKeep running after hashing the directory, and "
+                   "print its hash again every time its files change, "
+                   "hashing only the files that changed.\n");
+    printf("\t--debounce\tHow long to wait for more changes before "
+                   "computing the hash again while watching, in "
+                   "milliseconds. Defaults to %d.\n", WATCH_DEBOUNCE);
+    printf("\t--publish\tWrite the hash to PATH every time it changes "
+                   "while watching, or send it if PATH is a UNIX socket.\n");
+    printf("\t--tar\t\tRead the blocks from the members of a tar archive "
+                   "named after block numbers, instead of from a directory, "
+                   "or from standard input if FILE is '-'.\n");
+    printf("\t--threads\tThe number of threads to use to read and hash "
+                   "files, or 'auto' to use as many as CPUs available (after "
+                   "affinity and cgroup quotas). No threads are used by "
+                   "default.\n");
+    printf("\t--affinity\tPin threads to CPUs: 'compact' fills one NUMA "
+                   "node before moving to the next, 'scatter' spreads them "
+                   "across nodes, or a list of CPUs like '0-3,8'.\n");
+    printf("\t--profile\tMeasure the performance of the operation(s) to run"
+                   ".\n");
+    printf("\t--quiet\t\tOutput only the resulting hash string.\n");
+    printf("\t--help\t\tPrint this help.\n");
+    printf("\tdir\t\tThe path to a directory whose contents will be hashed. "
+                   "Every file in the directory or its subdirectories named "
+                   "after a block number will be read and incorporated into "
+                   "the input as that block.\n");
+
+    exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Write a message to stderr and exit.
+ */
+void panic(char *program, char *format, int argc, ...) {
+    va_list valist;
+    va_start(valist, argc);
+
+    fprintf(stderr, "%s: ", program);
+    if (argc > 0) {
+        vfprintf(stderr, format, valist);
+    } else {
+        fprintf(stderr, "%s\n", format);
+    }
+
+    usage(program);
+    exit(EXIT_FAILURE);
+}
+
+
+/*
+ * A block file found in a directory, with its nonce parsed from its name,
+ * and its path relative to the directory.
+ */
+typedef struct {
+    uint64_t nonce;
+    char *name;
+    struct stat st;
+} blockfile_t;
+
+/*
+ * Work shared by the threads hashing the files that changed.
+ */
+typedef struct {
+    ishake_t *is;
+    dirstate_t *state;
+    int dirfd;
+    blockfile_t *files;
+    size_t *changed;
+    size_t count;
+    size_t next;
+    uint32_t datalen;
+    char *failed;
+    pthread_mutex_t lck;
+} state_jobs_t;
+
+/*
+ * The block files found so far while scanning a directory tree.
+ */
+typedef struct {
+    int dirfd;
+    blockfile_t *files;
+    size_t count;
+    size_t cap;
+} scan_t;
+
+/*
+ * A range of block files to stat.
+ */
+typedef struct {
+    scan_t *scan;
+    size_t from;
+    size_t to;
+} scan_range_t;
+
+#ifdef __linux__
+/*
+ * A directory entry, as returned by getdents64().
+ */
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+
+int _nonce_cmp(const void *a, const void *b) {
+    uint64_t x = ((blockfile_t *)a)->nonce, y = ((blockfile_t *)b)->nonce;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Parse the name of a block file into its nonce. Only names made of decimal
+ * digits are accepted.
+ */
+int _parse_nonce(const char *name, uint64_t *nonce) {
+    char *end;
+    if (name[0] < '0' || name[0] > '9') {
+        return -1;
+    }
+    *nonce = strtoull(name, &end, 10);
+    return *end != '\0' ? -1 : 0;
+}
+
+
+int _scan_dir(scan_t *scan, const char *path);
+
+/*
+ * Look at an entry found while listing a directory: block files are kept,
+ * and subdirectories are listed in turn.
+ */
+int _scan_entry(scan_t *scan, const char *path, const char *name,
+                unsigned char type) {
+    uint64_t nonce;
+    if (name[0] == '.') { // dot files, the directory itself and its parent
+        return 0;
+    }
+
+    char *rel;
+    if (path) {
+        rel = malloc(strlen(path) + strlen(name) + 2);
+        sprintf(rel, "%s/%s", path, name);
+    } else {
+        rel = strdup(name);
+    }
+    if (type == DT_UNKNOWN) { // not every file system tells
+        struct stat st;
+        if (fstatat(scan->dirfd, rel, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            S_ISDIR(st.st_mode)) {
+            type = DT_DIR;
+        }
+    }
+    if (type == DT_DIR) {
+        int r = _scan_dir(scan, rel);
+        free(rel);
+        return r;
+    }
+    if (_parse_nonce(name, &nonce)) {
+        free(rel);
+        return 0;
+    }
+
+    if (scan->count == scan->cap) {
+        scan->cap = scan->cap ? scan->cap * 2 : 1024;
+        scan->files = realloc(scan->files, scan->cap * sizeof(blockfile_t));
+    }
+    scan->files[scan->count].nonce = nonce;
+    scan->files[scan->count].name = rel;
+    scan->count++;
+    return 0;
+}
+
+
+/*
+ * List a directory, relative to the one being scanned (or the latter itself
+ * if path is NULL), in batches of entries.
+ */
+int _scan_dir(scan_t *scan, const char *path) {
+    int fd = openat(scan->dirfd, path ? path : ".",
+                    O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+
+#ifdef __linux__
+    char *buf = malloc(SCAN_BUF_SIZE);
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buf, SCAN_BUF_SIZE)) > 0) {
+        for (long off = 0; off < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + off);
+            off += d->d_reclen;
+            if (_scan_entry(scan, path, d->d_name, d->d_type)) {
+                n = -1;
+                break;
+            }
+        }
+        if (n < 0) {
+            break;
+        }
+    }
+    free(buf);
+    close(fd);
+    return n < 0 ? -1 : 0;
+#else
+    DIR *dfd = fdopendir(fd);
+    struct dirent *dp;
+    int r = 0;
+    if (dfd == NULL) {
+        close(fd);
+        return -1;
+    }
+    while (r == 0 && (dp = readdir(dfd)) != NULL) {
+        r = _scan_entry(scan, path, dp->d_name, dp->d_type);
+    }
+    closedir(dfd);
+    return r;
+#endif
+}
+
+
+/*
+ * Worker thread getting the metadata of a range of block files.
+ */
+void *_scan_stat(void *arg) {
+    scan_range_t *range = (scan_range_t *) arg;
+    blockfile_t *files = range->scan->files;
+    for (size_t f = range->from; f < range->to; f++) {
+        if (fstatat(range->scan->dirfd, files[f].name, &files[f].st, 0) ||
+            !S_ISREG(files[f].st.st_mode)) {
+            files[f].st.st_mode = 0; // not a block file
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * List the regular files in a directory and its subdirectories whose names
+ * are block numbers, sorted by number. Their metadata is read in parallel.
+ *
+ * Returns 0 on success, or -1 on error, with the name of a file whose block
+ * number was already taken by another (if that was the case) in dup.
+ */
+int _scan(int dirfd, int thrno, blockfile_t **files, size_t *count,
+          char **dup) {
+    scan_t scan = {dirfd, NULL, 0, 0};
+    if (_scan_dir(&scan, NULL)) {
+        for (size_t f = 0; f < scan.count; f++) {
+            free(scan.files[f].name);
+        }
+        free(scan.files);
+        return -1;
+    }
+
+    size_t threads = thrno > 1 ? (size_t)thrno : 1;
+    if (threads > scan.count / SCAN_MIN_STAT + 1) {
+        threads = scan.count / SCAN_MIN_STAT + 1;
+    }
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    scan_range_t *ranges = malloc(threads * sizeof(scan_range_t));
+    for (size_t t = 0; t < threads; t++) {
+        ranges[t].scan = &scan;
+        ranges[t].from = scan.count * t / threads;
+        ranges[t].to = scan.count * (t + 1) / threads;
+        if (t > 0) {
+            pthread_create(&tids[t], NULL, _scan_stat, &ranges[t]);
+        }
+    }
+    _scan_stat(&ranges[0]);
+    for (size_t t = 1; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    free(ranges);
+    free(tids);
+
+    // keep only regular files
+    size_t k = 0;
+    for (size_t f = 0; f < scan.count; f++) {
+        if (scan.files[f].st.st_mode == 0) {
+            free(scan.files[f].name);
+        } else {
+            scan.files[k++] = scan.files[f];
+        }
+    }
+    scan.count = k;
+
+    qsort(scan.files, scan.count, sizeof(blockfile_t), _nonce_cmp);
+    *files = scan.files;
+    *count = scan.count;
+    for (size_t f = 1; f < scan.count; f++) {
+        if (scan.files[f].nonce == scan.files[f - 1].nonce) {
+            *dup = strdup(scan.files[f].name);
+            for (f = 0; f < scan.count; f++) {
+                free(scan.files[f].name);
+            }
+            free(scan.files);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Read a block file and compute the hash of the corresponding block.
+ */
+int _state_hash_file(state_jobs_t *jobs, size_t f) {
+    blockfile_t *file = &jobs->files[f];
+    dirstate_entry_t *e = dirstate_find(jobs->state, file->nonce);
+    if (file->st.st_size > jobs->datalen) {
+        return -1; // one file, one block
+    }
+
+    int fd = openat(jobs->dirfd, file->name, O_RDONLY | O_CLOEXEC);
+    FILE *fp = fd < 0 ? NULL : fdopen(fd, "r");
+    if (fp == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    ishake_block_t block;
+    block.data = malloc(jobs->datalen);
+    block.data_len = (uint32_t)fread(block.data, 1, jobs->datalen, fp);
+    fclose(fp);
+    if (jobs->state->mode == ISHAKE_APPEND_ONLY_MODE) {
+        block.header.length = 8;
+        block.header.value.idx = file->nonce;
+    } else {
+        block.header.length = 16;
+        block.header.value.nonce.nonce = file->nonce;
+        block.header.value.nonce.prev = e->prev;
+    }
+
+    uint64_t *digest = ishake_hash_block(jobs->is, &block);
+    free(block.data);
+    if (digest == NULL) {
+        return -1;
+    }
+    memcpy(e->digest, digest, jobs->state->bits / 8);
+    free(digest);
+
+    // what we know now about the file
+    e->ino = (uint64_t)file->st.st_ino;
+    e->size = block.data_len;
+    e->mtime_ns = (int64_t)file->st.st_mtim.tv_sec * 1000000000 +
+                  file->st.st_mtim.tv_nsec;
+    e->ctime_ns = (int64_t)file->st.st_ctim.tv_sec * 1000000000 +
+                  file->st.st_ctim.tv_nsec;
+    if (e->name == NULL || strcmp(e->name, file->name) != 0) {
+        free(e->name);
+        e->name = strdup(file->name);
+    }
+    return 0;
+}
+
+
+/*
+ * Worker thread hashing the files that changed.
+ */
+void *_state_worker(void *arg) {
+    state_jobs_t *jobs = (state_jobs_t *) arg;
+    while (1) {
+        pthread_mutex_lock(&jobs->lck);
+        size_t i = jobs->next++;
+        pthread_mutex_unlock(&jobs->lck);
+        if (i >= jobs->count) {
+            break;
+        }
+        if (_state_hash_file(jobs, jobs->changed[i])) {
+            pthread_mutex_lock(&jobs->lck);
+            if (jobs->failed == NULL) {
+                jobs->failed = strdup(jobs->files[jobs->changed[i]].name);
+            }
+            pthread_mutex_unlock(&jobs->lck);
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Tell whether a file still has the metadata it had when it was hashed.
+ */
+int _state_unchanged(dirstate_entry_t *e, struct stat *st) {
+    return e->ino == (uint64_t)st->st_ino &&
+           e->size == (uint64_t)st->st_size &&
+           e->mtime_ns == (int64_t)st->st_mtim.tv_sec * 1000000000 +
+                          st->st_mtim.tv_nsec &&
+           e->ctime_ns == (int64_t)st->st_ctim.tv_sec * 1000000000 +
+                          st->st_ctim.tv_nsec;
+}
+
+
+/*
+ * Hash the given files in parallel, and add their digests to the total.
+ *
+ * Returns 0 on success, or -1 with the name of the first file that could not
+ * be hashed in failed.
+ */
+int _state_hash_files(ishake_t *is, dirstate_t *state, int dirfd,
+                      blockfile_t *files, size_t *changed, size_t nchanged,
+                      uint32_t datalen, int thrno, char **failed) {
+    state_jobs_t jobs;
+    jobs.is = is;
+    jobs.state = state;
+    jobs.dirfd = dirfd;
+    jobs.files = files;
+    jobs.changed = changed;
+    jobs.count = nchanged;
+    jobs.next = 0;
+    jobs.datalen = datalen;
+    jobs.failed = NULL;
+    pthread_mutex_init(&jobs.lck, NULL);
+
+    int threads = thrno > 0 ? thrno : 1;
+    if ((size_t)threads > nchanged) {
+        threads = nchanged ? (int)nchanged : 1;
+    }
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    for (int t = 1; t < threads; t++) {
+        pthread_create(&tids[t], NULL, _state_worker, &jobs);
+    }
+    _state_worker(&jobs);
+    for (int t = 1; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    free(tids);
+    pthread_mutex_destroy(&jobs.lck);
+
+    uint16_t words = state->bits / 64;
+    for (size_t c = 0; c < nchanged; c++) {
+        dirstate_entry_t *e = dirstate_find(state, files[changed[c]].nonce);
+        combine(state->total, e->digest, words, add_mod64);
+    }
+    *failed = jobs.failed;
+    return jobs.failed ? -1 : 0;
+}
+
+
+/*
+ * Bring the state of a directory up to date: drop the files that are gone,
+ * and hash those that are new or whose metadata changed, fixing the total
+ * digest up with the difference.
+ *
+ * Returns the amount of files hashed, or -1 on error, with the name of the
+ * file that could not be hashed (if any) in failed.
+ */
+long _state_update(ishake_t *is, dirstate_t *state, char *dirname,
+                   uint32_t datalen, int thrno, char **failed) {
+    blockfile_t *files;
+    size_t count;
+    uint16_t words = state->bits / 64;
+    int dirfd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        return -1;
+    }
+    if (_scan(dirfd, thrno, &files, &count, failed)) {
+        close(dirfd);
+        return -1;
+    }
+
+    // merge both sorted lists into a new list of entries
+    dirstate_entry_t *entries = malloc((count ? count : 1) *
+                                       sizeof(dirstate_entry_t));
+    size_t *changed = malloc((count ? count : 1) * sizeof(size_t));
+    size_t e = 0, nchanged = 0;
+    for (size_t f = 0; f < count; f++) {
+        // files that are gone are subtracted
+        while (e < state->count && state->entries[e].nonce < files[f].nonce) {
+            combine(state->total, state->entries[e].digest, words, sub_mod64);
+            free(state->entries[e].name);
+            free(state->entries[e++].digest);
+        }
+
+        dirstate_entry_t *entry = &entries[f];
+        uint64_t prev = f > 0 ? files[f - 1].nonce : 0;
+        if (e < state->count && state->entries[e].nonce == files[f].nonce) {
+            *entry = state->entries[e++];
+            if (_state_unchanged(entry, &files[f].st) &&
+                (state->mode == ISHAKE_APPEND_ONLY_MODE ||
+                 entry->prev == prev)) {
+                continue; // unchanged, keep its digest
+            }
+            // changed, subtract the old digest and hash it again
+            combine(state->total, entry->digest, words, sub_mod64);
+        } else { // a new file
+            memset(entry, 0, sizeof(dirstate_entry_t));
+            entry->nonce = files[f].nonce;
+            entry->digest = calloc(words, sizeof(uint64_t));
+        }
+        entry->prev = state->mode == ISHAKE_FULL_MODE ? prev : 0;
+        changed[nchanged++] = f;
+    }
+    while (e < state->count) {
+        combine(state->total, state->entries[e].digest, words, sub_mod64);
+        free(state->entries[e].name);
+        free(state->entries[e++].digest);
+    }
+    free(state->entries);
+    state->entries = entries;
+    state->count = count;
+    state->cap = count ? count : 1;
+
+    // hash whatever changed
+    int err = _state_hash_files(is, state, dirfd, files, changed, nchanged,
+                                datalen, thrno, failed);
+    for (size_t f = 0; f < count; f++) {
+        free(files[f].name);
+    }
+    close(dirfd);
+    free(files);
+    free(changed);
+    return err ? -1 : (long)nchanged;
+}
+
+
+/*
+ * Subtract the digest of an entry from the total and forget everything we
+ * knew about its file, so that it is hashed again.
+ */
+void _state_forget(dirstate_t *state, dirstate_entry_t *e) {
+    uint16_t words = state->bits / 64;
+    combine(state->total, e->digest, words, sub_mod64);
+    memset(e->digest, 0, words * sizeof(uint64_t));
+    e->ino = 0;
+    e->size = UINT64_MAX;
+}
+
+
+int _uint64_cmp(const void *a, const void *b) {
+    uint64_t x = *(uint64_t *)a, y = *(uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Apply the changes to a list of block files (relative to the directory) to
+ * the state of a directory, looking only at those files and, in FULL mode, at
+ * the blocks that follow them. Files that are gone are subtracted, and files that are new or whose
+ * metadata changed are hashed again.
+ *
+ * Returns the amount of files hashed, or -1 on error, with the name of the
+ * file that could not be hashed (if any) in failed.
+ */
+long _state_apply(ishake_t *is, dirstate_t *state, char *dirname,
+                  char **names, size_t n, uint32_t datalen, int thrno,
+                  char **failed) {
+    int dirfd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        return -1;
+    }
+
+    // at most the files touched and the ones following them need hashing
+    size_t cap = n * 2 + 1, ntouched = 0, nrehash = 0;
+    uint64_t *touched = malloc(cap * sizeof(uint64_t));
+    uint64_t *rehash = malloc(cap * sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++) {
+        uint64_t nonce;
+        struct stat st;
+        char *base = strrchr(names[i], '/');
+        if (_parse_nonce(base ? base + 1 : names[i], &nonce)) {
+            continue;
+        }
+        int exists = fstatat(dirfd, names[i], &st, 0) == 0 &&
+                     S_ISREG(st.st_mode);
+        dirstate_entry_t *e = dirstate_find(state, nonce);
+        touched[ntouched++] = nonce;
+        if (!exists) {
+            if (e && strcmp(e->name, names[i]) == 0) { // deleted
+                _state_forget(state, e);
+                dirstate_remove(state, nonce);
+            }
+            continue;
+        }
+        if (e == NULL) { // inserted
+            e = dirstate_add(state, nonce);
+        } else if (strcmp(e->name, names[i]) == 0 &&
+                   _state_unchanged(e, &st)) {
+            continue;
+        } else { // updated
+            _state_forget(state, e);
+        }
+        free(e->name);
+        e->name = strdup(names[i]);
+        rehash[nrehash++] = nonce;
+    }
+
+    // in FULL mode, blocks are chained to the previous one
+    for (size_t i = 0; state->mode == ISHAKE_FULL_MODE && i < ntouched; i++) {
+        size_t pos = dirstate_pos(state, touched[i]);
+        for (size_t p = pos; p < pos + 2 && p < state->count; p++) {
+            dirstate_entry_t *e = &state->entries[p];
+            uint64_t prev = p > 0 ? state->entries[p - 1].nonce : 0;
+            if (e->prev != prev) {
+                _state_forget(state, e);
+                e->prev = prev;
+                rehash[nrehash++] = e->nonce;
+            }
+        }
+    }
+    free(touched);
+
+    // the same file may have been touched many times in a batch
+    qsort(rehash, nrehash, sizeof(uint64_t), _uint64_cmp);
+    blockfile_t *files = malloc(cap * sizeof(blockfile_t));
+    size_t *changed = malloc(cap * sizeof(size_t));
+    size_t count = 0;
+    for (size_t i = 0; i < nrehash; i++) {
+        dirstate_entry_t *e = dirstate_find(state, rehash[i]);
+        if ((count && files[count - 1].nonce == rehash[i]) || e == NULL) {
+            continue;
+        }
+        if (fstatat(dirfd, e->name, &files[count].st, 0)) {
+            continue; // gone already, we will hear about it
+        }
+        files[count].nonce = rehash[i];
+        files[count].name = strdup(e->name);
+        changed[count] = count;
+        count++;
+    }
+    free(rehash);
+
+    int err = _state_hash_files(is, state, dirfd, files, changed, count,
+                                datalen, thrno, failed);
+    for (size_t f = 0; f < count; f++) {
+        free(files[f].name);
+    }
+    close(dirfd);
+    free(files);
+    free(changed);
+    return err ? -1 : (long)count;
+}
+
+
+/*
+ * Compute the digest of a directory from its state, as if every file had
+ * been processed.
+ */
+int _state_digest(ishake_t *is, dirstate_t *state, uint8_t *output) {
+    uint16_t words = state->bits / 64;
+    if (state->mode == ISHAKE_APPEND_ONLY_MODE && state->count == 0) {
+        // nothing was hashed, so we hash an empty string
+        ishake_block_t block;
+        block.data = calloc(1, 1);
+        block.data_len = 0;
+        block.header.length = 8;
+        block.header.value.idx = 1;
+        uint64_t *digest = ishake_hash_block(is, &block);
+        free(block.data);
+        if (digest == NULL) {
+            return -1;
+        }
+        uint64_t2uint8_t(output, digest, words);
+        free(digest);
+        return 0;
+    }
+    uint64_t2uint8_t(output, state->total, words);
+    return 0;
+}
+
+
+/*
+ * A member of a tar archive, to be hashed straight from the read buffer.
+ */
+typedef struct {
+    uint64_t nonce;
+    uint64_t prev;
+    unsigned char *data;
+    uint32_t len;
+} tar_member_t;
+
+/*
+ * A tar archive being read, and the members found in it that are still to
+ * be hashed.
+ */
+typedef struct {
+    ishake_t *is;
+    FILE *fp;
+    unsigned char *buf;
+    size_t cap;
+    size_t len;
+    size_t pos;
+    tar_member_t *members;
+    size_t count;
+    size_t next;
+    int thrno;
+    int failed;
+    pthread_mutex_t lck;
+} tar_stream_t;
+
+
+/*
+ * Worker thread hashing members of a tar archive, adding their digests to
+ * its own sum first, and to the hash of iSHAKE at the end.
+ */
+void *_tar_worker(void *arg) {
+    tar_stream_t *ts = (tar_stream_t *) arg;
+    uint16_t words = ts->is->output_len / 64;
+    uint64_t *sum = calloc(words, sizeof(uint64_t));
+    while (1) {
+        pthread_mutex_lock(&ts->lck);
+        size_t i = ts->next++;
+        pthread_mutex_unlock(&ts->lck);
+        if (i >= ts->count) {
+            break;
+        }
+
+        tar_member_t *m = &ts->members[i];
+        ishake_block_t block;
+        block.data = m->data;
+        block.data_len = m->len;
+        if (ts->is->mode == ISHAKE_APPEND_ONLY_MODE) {
+            block.header.length = 8;
+            block.header.value.idx = m->nonce;
+        } else {
+            block.header.length = 16;
+            block.header.value.nonce.nonce = m->nonce;
+            block.header.value.nonce.prev = m->prev;
+        }
+        uint64_t *digest = ishake_hash_block(ts->is, &block);
+        if (digest == NULL) {
+            ts->failed = 1;
+            continue;
+        }
+        combine(sum, digest, words, add_mod64);
+        free(digest);
+    }
+
+    pthread_mutex_lock(&ts->lck);
+    combine(ts->is->hash, sum, words, add_mod64);
+    pthread_mutex_unlock(&ts->lck);
+    free(sum);
+    return NULL;
+}
+
+
+/*
+ * Hash the members found so far, which point into the read buffer, so that
+ * it can be reused.
+ */
+int _tar_flush(tar_stream_t *ts) {
+    int threads = ts->thrno > 0 ? ts->thrno : 1;
+    if ((size_t)threads > ts->count) {
+        threads = ts->count ? (int)ts->count : 1;
+    }
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    ts->next = 0;
+    for (int t = 1; t < threads; t++) {
+        pthread_create(&tids[t], NULL, _tar_worker, ts);
+    }
+    _tar_worker(ts);
+    for (int t = 1; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    free(tids);
+    ts->count = 0;
+    return ts->failed ? -1 : 0;
+}
+
+
+/*
+ * Make sure that there are at least n bytes to read in the buffer.
+ */
+int _tar_fill(tar_stream_t *ts, size_t n) {
+    if (ts->len - ts->pos >= n) {
+        return 0;
+    }
+    if (n > ts->cap) {
+        return -1;
+    }
+    if (ts->pos + n > ts->cap) { // no room, move what's left to the start
+        if (_tar_flush(ts)) {
+            return -1;
+        }
+        memmove(ts->buf, ts->buf + ts->pos, ts->len - ts->pos);
+        ts->len -= ts->pos;
+        ts->pos = 0;
+    }
+    while (ts->len - ts->pos < n) {
+        size_t r = fread(ts->buf + ts->len, 1, ts->cap - ts->len, ts->fp);
+        if (r == 0) {
+            return -1;
+        }
+        ts->len += r;
+    }
+    return 0;
+}
+
+
+/*
+ * Skip n bytes of the archive, however large.
+ */
+int _tar_skip(tar_stream_t *ts, uint64_t n) {
+    while (n > 0) {
+        if (ts->pos == ts->len && _tar_fill(ts, 1)) {
+            return -1;
+        }
+        size_t avail = ts->len - ts->pos;
+        size_t skip = n < avail ? (size_t)n : avail;
+        ts->pos += skip;
+        n -= skip;
+    }
+    return 0;
+}
+
+
+/*
+ * Parse a numeric field of a tar header, in octal or base-256.
+ */
+uint64_t _tar_number(const unsigned char *field, size_t len) {
+    uint64_t n = 0;
+    if (field[0] & 0x80) { // base-256, for large values
+        for (size_t i = 1; i < len; i++) {
+            n = (n << 8) | field[i];
+        }
+        return n;
+    }
+    for (size_t i = 0; i < len && field[i]; i++) {
+        if (field[i] >= '0' && field[i] <= '7') {
+            n = (n << 3) | (uint64_t)(field[i] - '0');
+        }
+    }
+    return n;
+}
+
+
+/*
+ * Look for the path and size of the next member in the records of a pax
+ * extended header.
+ */
+void _tar_pax(const unsigned char *data, size_t len, char **path,
+              uint64_t *size) {
+    size_t pos = 0;
+    while (pos < len) {
+        char *end;
+        unsigned long reclen = strtoul((const char *)data + pos, &end, 10);
+        const char *kv = end + 1;
+        if (reclen == 0 || pos + reclen > len || *end != ' ') {
+            return;
+        }
+        size_t kvlen = data + pos + reclen - 1 - (const unsigned char *)kv;
+        if (kvlen > 5 && strncmp(kv, "path=", 5) == 0) {
+            free(*path);
+            *path = strndup(kv + 5, kvlen - 5);
+        } else if (kvlen > 5 && strncmp(kv, "size=", 5) == 0) {
+            *size = strtoull(kv + 5, NULL, 10);
+        }
+        pos += reclen;
+    }
+}
+
+
+/*
+ * Read a tar archive (ustar, pax or GNU) and hash each regular member
+ * named after a block number as that block, adding its hash to the one of
+ * iSHAKE. Members are hashed in parallel by thrno threads, straight from the
+ * buffer where they were read.
+ *
+ * Returns the amount of blocks hashed, or -1 on error, with the name of the
+ * member that could not be hashed (if any) in failed.
+ */
+long _tar_hash(ishake_t *is, FILE *fp, uint32_t datalen, int thrno,
+               char **failed) {
+    tar_stream_t ts;
+    ts.is = is;
+    ts.fp = fp;
+    ts.cap = TAR_BUF_SIZE;
+    if (ts.cap < (size_t)datalen + 1024) {
+        ts.cap = ((size_t)datalen + 1024 + 511) / 512 * 512;
+    }
+    ts.buf = malloc(ts.cap);
+    ts.len = 0;
+    ts.pos = 0;
+    ts.members = malloc((ts.cap / 512) * sizeof(tar_member_t));
+    ts.count = 0;
+    ts.thrno = thrno;
+    ts.failed = 0;
+    pthread_mutex_init(&ts.lck, NULL);
+
+    size_t ncap = 1024, n = 0;
+    uint64_t *nonces = malloc(ncap * sizeof(uint64_t));
+    char *path = NULL;
+    uint64_t pax_size = UINT64_MAX, last = 0;
+    int err = 0;
+    while (!err) {
+        if (_tar_fill(&ts, 512)) {
+            err = -1; // truncated
+            break;
+        }
+        unsigned char *h = ts.buf + ts.pos;
+        int zero = 1;
+        for (int i = 0; i < 512 && zero; i++) {
+            zero = h[i] == 0;
+        }
+        if (zero) { // end of archive
+            break;
+        }
+
+        // check the header is sane
+        uint64_t chksum = _tar_number(h + 148, 8), sum = 0;
+        for (int i = 0; i < 512; i++) {
+            sum += (i >= 148 && i < 156) ? ' ' : h[i];
+        }
+        if (sum != chksum) {
+            err = -1;
+            break;
+        }
+
+        char type = (char)h[156];
+        uint64_t size = _tar_number(h + 124, 12);
+        if (pax_size != UINT64_MAX && type != 'x' && type != 'L') {
+            size = pax_size;
+        }
+        uint64_t padded = (size + 511) / 512 * 512;
+
+        if (type == 'g') { // about every member, nothing we need
+            ts.pos += 512;
+            err = _tar_skip(&ts, padded);
+            continue;
+        }
+        if (type == 'x' || type == 'L') { // about the next member
+            if (_tar_fill(&ts, 512 + padded)) {
+                err = -1;
+                break;
+            }
+            unsigned char *data = ts.buf + ts.pos + 512;
+            if (type == 'x') {
+                _tar_pax(data, (size_t)size, &path, &pax_size);
+            } else {
+                free(path);
+                path = strndup((const char *)data, (size_t)size);
+            }
+            ts.pos += 512 + padded;
+            continue;
+        }
+
+        // the name of the member, unless we were given a longer one
+        char name[257];
+        if (path == NULL) {
+            if (memcmp(h + 257, "ustar", 5) == 0 && h[345]) {
+                snprintf(name, sizeof(name), "%.155s/%.100s", h + 345, h);
+            } else {
+                snprintf(name, sizeof(name), "%.100s", h);
+            }
+        }
+        char *member = path ? path : name;
+        char *base = strrchr(member, '/');
+        base = base ? base + 1 : member;
+
+        uint64_t nonce;
+        if ((type != '0' && type != '\0' && type != '7') ||
+            _parse_nonce(base, &nonce)) { // not a block
+            ts.pos += 512;
+            err = _tar_skip(&ts, padded);
+        } else if (size > datalen ||
+                   (is->mode == ISHAKE_FULL_MODE && n && nonce <= last)) {
+            *failed = strdup(member);
+            err = -1;
+        } else if (_tar_fill(&ts, 512 + padded)) {
+            err = -1; // truncated
+        } else {
+            tar_member_t *m = &ts.members[ts.count++];
+            m->nonce = nonce;
+            m->prev = is->mode == ISHAKE_FULL_MODE ? (n ? last : 0) : 0;
+            m->data = ts.buf + ts.pos + 512;
+            m->len = (uint32_t)size;
+            ts.pos += 512 + padded;
+
+            if (n == ncap) {
+                ncap *= 2;
+                nonces = realloc(nonces, ncap * sizeof(uint64_t));
+            }
+            nonces[n++] = nonce;
+            last = nonce;
+        }
+        free(path);
+        path = NULL;
+        pax_size = UINT64_MAX;
+    }
+    if (_tar_flush(&ts)) {
+        err = -1;
+    }
+
+    // every block must be in the archive just once
+    qsort(nonces, n, sizeof(uint64_t), _uint64_cmp);
+    for (size_t i = 1; i < n && !err; i++) {
+        if (nonces[i] == nonces[i - 1]) {
+            *failed = malloc(21);
+            snprintf(*failed, 21, "%" PRIu64, nonces[i]);
+            err = -1;
+        }
+    }
+
+    free(path);
+    free(nonces);
+    free(ts.members);
+    free(ts.buf);
+    pthread_mutex_destroy(&ts.lck);
+    return err ? -1 : (long)n;
+}
+
+
+/*
+ * A block to add to the digest (or subtract, if weight is negative) when
+ * applying a journal, and the record it comes from.
+ */
+typedef struct {
+    uint64_t nonce;
+    uint64_t prev;
+    journal_part_t part;
+    int64_t weight;
+    uint64_t record;
+} journal_term_t;
+
+/*
+ * Work shared by the threads hashing a batch of journal terms.
+ */
+typedef struct {
+    ishake_t *is;
+    int dirfd;
+    journal_term_t *terms;
+    size_t count;
+    size_t next;
+    uint32_t datalen;
+    uint64_t failed;
+    pthread_mutex_t lck;
+} journal_jobs_t;
+
+
+/*
+ * Order journal terms by block, and then by data, so that terms adding and
+ * subtracting the same block end up together.
+ */
+int _journal_cmp(const void *a, const void *b) {
+    const journal_term_t *x = a, *y = b;
+    if (x->nonce != y->nonce) {
+        return x->nonce < y->nonce ? -1 : 1;
+    }
+    if (x->prev != y->prev) {
+        return x->prev < y->prev ? -1 : 1;
+    }
+    if (x->part.length != y->part.length) {
+        return x->part.length < y->part.length ? -1 : 1;
+    }
+    if (x->part.pathlen != y->part.pathlen) {
+        return x->part.pathlen < y->part.pathlen ? -1 : 1;
+    }
+    if (x->part.pathlen == 0) {
+        return memcmp(x->part.data, y->part.data, x->part.length);
+    }
+    int c = memcmp(x->part.path, y->part.path, x->part.pathlen);
+    if (c == 0 && x->part.offset != y->part.offset) {
+        return x->part.offset < y->part.offset ? -1 : 1;
+    }
+    return c;
+}
+
+
+/*
+ * Order journal terms by where their data is, so that the files they refer
+ * to are read sequentially.
+ */
+int _journal_data_cmp(const void *a, const void *b) {
+    const journal_term_t *x = a, *y = b;
+    if (x->part.pathlen == 0 || y->part.pathlen == 0) {
+        if (x->part.pathlen != y->part.pathlen) {
+            return x->part.pathlen ? 1 : -1;
+        }
+        return x->part.data < y->part.data ? -1 : x->part.data > y->part.data;
+    }
+    size_t len = x->part.pathlen < y->part.pathlen ? x->part.pathlen :
+                 y->part.pathlen;
+    int c = memcmp(x->part.path, y->part.path, len);
+    if (c != 0 || x->part.pathlen != y->part.pathlen) {
+        return c ? c : (x->part.pathlen < y->part.pathlen ? -1 : 1);
+    }
+    return x->part.offset < y->part.offset ? -1 :
+           x->part.offset > y->part.offset;
+}
+
+
+/*
+ * Hash the block in a journal term, reading its data from the file it
+ * refers to if needed. The last file opened is kept open in fd, and its
+ * path in path, since terms referring to the same file come together.
+ */
+uint64_t *_journal_hash_term(journal_jobs_t *jobs, journal_term_t *t,
+                             unsigned char *buf, int *fd, char **path) {
+    ishake_block_t block;
+    block.data_len = t->part.length;
+    if (t->part.pathlen == 0) {
+        block.data = (unsigned char *)t->part.data;
+    } else {
+        if (*path == NULL || strlen(*path) != t->part.pathlen ||
+            memcmp(*path, t->part.path, t->part.pathlen) != 0) {
+            if (*fd >= 0) {
+                close(*fd);
+            }
+            free(*path);
+            *path = strndup(t->part.path, t->part.pathlen);
+            *fd = openat(jobs->dirfd, *path, O_RDONLY | O_CLOEXEC);
+        }
+        if (*fd < 0) {
+            return NULL;
+        }
+        size_t done = 0;
+        while (done < t->part.length) {
+            ssize_t r = pread(*fd, buf + done, t->part.length - done,
+                              (off_t)(t->part.offset + done));
+            if (r <= 0) {
+                return NULL;
+            }
+            done += (size_t)r;
+        }
+        block.data = buf;
+    }
+
+    if (jobs->is->mode == ISHAKE_APPEND_ONLY_MODE) {
+        block.header.length = 8;
+        block.header.value.idx = t->nonce;
+    } else {
+        block.header.length = 16;
+        block.header.value.nonce.nonce = t->nonce;
+        block.header.value.nonce.prev = t->prev;
+    }
+    return ishake_hash_block(jobs->is, &block);
+}
+
+
+/*
+ * Worker thread hashing journal terms, in runs of consecutive terms, and
+ * adding or subtracting their digests to its own sums first, and to the
+ * hash of iSHAKE at the end.
+ */
+void *_journal_worker(void *arg) {
+    journal_jobs_t *jobs = (journal_jobs_t *) arg;
+    uint16_t words = jobs->is->output_len / 64;
+    uint64_t *add = calloc(words, sizeof(uint64_t));
+    uint64_t *sub = calloc(words, sizeof(uint64_t));
+    unsigned char *buf = malloc(jobs->datalen);
+    char *path = NULL;
+    int fd = -1;
+    while (1) {
+        pthread_mutex_lock(&jobs->lck);
+        size_t from = jobs->next;
+        jobs->next += JOURNAL_RUN;
+        pthread_mutex_unlock(&jobs->lck);
+        if (from >= jobs->count) {
+            break;
+        }
+        size_t to = from + JOURNAL_RUN < jobs->count ? from + JOURNAL_RUN :
+                    jobs->count;
+
+        for (size_t i = from; i < to; i++) {
+            journal_term_t *t = &jobs->terms[i];
+            uint64_t *digest = _journal_hash_term(jobs, t, buf, &fd, &path);
+            if (digest == NULL) {
+                pthread_mutex_lock(&jobs->lck);
+                if (jobs->failed == 0 || t->record < jobs->failed) {
+                    jobs->failed = t->record;
+                }
+                pthread_mutex_unlock(&jobs->lck);
+                continue;
+            }
+            for (int64_t w = t->weight; w > 0; w--) {
+                combine(add, digest, words, add_mod64);
+            }
+            for (int64_t w = t->weight; w < 0; w++) {
+                combine(sub, digest, words, add_mod64);
+            }
+            free(digest);
+        }
+    }
+
+    pthread_mutex_lock(&jobs->lck);
+    combine(jobs->is->hash, add, words, add_mod64);
+    combine(jobs->is->hash, sub, words, sub_mod64);
+    pthread_mutex_unlock(&jobs->lck);
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(path);
+    free(buf);
+    free(add);
+    free(sub);
+    return NULL;
+}
 
 
 /*
- * Print help on how to use this program and exit.
+ * Hash a batch of journal terms in parallel. Terms for the same block and
+ * data are merged first, so that changes undone later in the batch are
+ * never hashed.
  */
-void usage(char *program) {
-    printf("Usage:\t%s [--128|--256] [--bits N] [--block-size N] [--mode M] "
-                   "[--rehash H] [--threads N] [--quiet] [--help] [dir]\n\n",
-           program);
-    printf("\t--128\t\tUse 128 bit equivalent iSHAKE. Default.\n");
-    printf("\t--256\t\tUse 256 bit equivalent iSHAKE.\n");
-    printf("\t--bits\t\tThe number of bits desired in the output. Must be a "
-                   "multiple of 64. Between 2688 and 4160 for iSHAKE 128, and "
-                   "between 6528 and 16512 for iSHAKE 256. The lowest "
-                   "number for each version is the default.\n");
-    printf("\t--block-size\tThe size in bytes of the iSHAKE internal blocks."
-                   "\n");
-    printf("\t--mode\t\tThe mode of operation, one of FULL or APPEND_ONLY. "
-                   "Defaults to APPEND_ONLY.\n");
-    printf("\t--rehash\tThe hash to use as base, computing only those "
-                   "blocks that have changed.\n");
-    printf("\t--threads\tThe number of threads to use. No threads are used "
-                   "by default.\n");
-    printf("\t--profile\tMeasure the performance of the operation(s) to run"
-                   ".\n");
-    printf("\t--quiet\t\tOutput only the resulting hash string.\n");
-    printf("\t--help\t\tPrint this help.\n");
-    printf("\tdir\t\tThe path to a directory whose contents will be hashed in "
-                   "order. Every file in the directory will be read and "
-                   "incorporated into the input, in the same order as they "
-                   "appear in the directory.\n");
+int _journal_flush(journal_jobs_t *jobs, int thrno) {
+    journal_term_t *terms = jobs->terms;
+    size_t n = 0, m = 0;
+    qsort(terms, jobs->count, sizeof(journal_term_t), _journal_cmp);
+    for (size_t i = 0; i < jobs->count; i++) {
+        if (n && _journal_cmp(&terms[n - 1], &terms[i]) == 0) {
+            terms[n - 1].weight += terms[i].weight;
+            if (terms[i].record < terms[n - 1].record) {
+                terms[n - 1].record = terms[i].record;
+            }
+        } else {
+            terms[n++] = terms[i];
+        }
+    }
+    for (size_t i = 0; i < n; i++) { // drop the terms that cancelled out
+        if (terms[i].weight != 0) {
+            terms[m++] = terms[i];
+        }
+    }
+    n = m;
+    qsort(terms, n, sizeof(journal_term_t), _journal_data_cmp);
+    jobs->count = n;
 
-    exit(EXIT_SUCCESS);
+    int threads = thrno > 0 ? thrno : 1;
+    if ((size_t)threads > (n + JOURNAL_RUN - 1) / JOURNAL_RUN) {
+        threads = n ? (int)((n + JOURNAL_RUN - 1) / JOURNAL_RUN) : 1;
+    }
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    jobs->next = 0;
+    for (int t = 1; t < threads; t++) {
+        pthread_create(&tids[t], NULL, _journal_worker, jobs);
+    }
+    _journal_worker(jobs);
+    for (int t = 1; t < threads; t++) {
+        pthread_join(tids[t], NULL);
+    }
+    free(tids);
+    jobs->count = 0;
+    return jobs->failed ? -1 : 0;
 }
 
 
 /*
- * Write a message to stderr and exit.
+ * Add a block to a batch of journal terms.
  */
-void panic(char *program, char *format, int argc, ...) {
-    va_list valist;
-    va_start(valist, argc);
+void _journal_term(journal_jobs_t *jobs, uint64_t nonce, uint64_t prev,
+                   journal_part_t *part, int64_t weight, uint64_t record) {
+    journal_term_t *t = &jobs->terms[jobs->count++];
+    t->nonce = nonce;
+    t->prev = jobs->is->mode == ISHAKE_FULL_MODE ? prev : 0;
+    t->part = *part;
+    t->weight = weight;
+    t->record = record;
+}
 
-    fprintf(stderr, "%s: ", program);
-    if (argc > 0) {
-        vfprintf(stderr, format, valist);
-    } else {
-        fprintf(stderr, "%s\n", format);
+
+/*
+ * Apply the changes recorded in a journal to the hash, reading the files
+ * it refers to from a directory. Records are read in batches, and the
+ * blocks of every batch are hashed in parallel by thrno threads.
+ *
+ * Returns the amount of records applied, or -1 with the number of the
+ * first record that is not valid or whose data cannot be read in failed
+ * (or 0 if the journal itself cannot be read).
+ */
+long _journal_apply(ishake_t *is, char *path, char *dirname, uint32_t datalen,
+                    int thrno, uint64_t *failed) {
+    journal_t j;
+    journal_record_t r;
+    *failed = 0;
+    if (journal_open(&j, path)) {
+        return -1;
+    }
+    int dirfd = open(strlen(dirname) ? dirname : ".",
+                     O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        journal_close(&j);
+        return -1;
     }
 
-    usage(program);
-    exit(EXIT_FAILURE);
+    journal_jobs_t jobs;
+    jobs.is = is;
+    jobs.dirfd = dirfd;
+    jobs.terms = malloc(3 * JOURNAL_BATCH * sizeof(journal_term_t));
+    jobs.count = 0;
+    jobs.datalen = datalen;
+    jobs.failed = 0;
+    pthread_mutex_init(&jobs.lck, NULL);
+
+    int got, err = 0, full = is->mode == ISHAKE_FULL_MODE;
+    while (!err && (got = journal_next(&j, &r)) != 0) {
+        uint64_t rec = j.count;
+        if (got < 0 || r.nonce == 0 ||
+            r.part[0].length > datalen ||
+            (r.parts > 1 && r.part[1].length > datalen) ||
+            (full && r.op == JOURNAL_APPEND) ||
+            (!full && (r.op == JOURNAL_INSERT || r.op == JOURNAL_DELETE))) {
+            *failed = j.count + (got < 0);
+            err = -1;
+            break;
+        }
+
+        switch (r.op) {
+            case JOURNAL_APPEND:
+                _journal_term(&jobs, r.nonce, 0, &r.part[0], 1, rec);
+                break;
+            case JOURNAL_UPDATE:
+                _journal_term(&jobs, r.nonce, r.prev, &r.part[0], -1, rec);
+                _journal_term(&jobs, r.nonce, r.prev, &r.part[1], 1, rec);
+                break;
+            case JOURNAL_INSERT: // the next block now follows the new one
+                _journal_term(&jobs, r.nonce, r.prev, &r.part[0], 1, rec);
+                if (r.next) {
+                    _journal_term(&jobs, r.next, r.prev, &r.part[1], -1, rec);
+                    _journal_term(&jobs, r.next, r.nonce, &r.part[1], 1, rec);
+                }
+                break;
+            case JOURNAL_DELETE: // the next block now follows the previous
+                _journal_term(&jobs, r.nonce, r.prev, &r.part[0], -1, rec);
+                if (r.next) {
+                    _journal_term(&jobs, r.next, r.nonce, &r.part[1], -1, rec);
+                    _journal_term(&jobs, r.next, r.prev, &r.part[1], 1, rec);
+                }
+                break;
+        }
+
+        if (rec % JOURNAL_BATCH == 0 && _journal_flush(&jobs, thrno)) {
+            *failed = jobs.failed;
+            err = -1;
+        }
+    }
+    if (!err && _journal_flush(&jobs, thrno)) {
+        *failed = jobs.failed;
+        err = -1;
+    }
+
+    long applied = (long)j.count;
+    pthread_mutex_destroy(&jobs.lck);
+    free(jobs.terms);
+    close(dirfd);
+    journal_close(&j);
+    return err ? -1 : applied;
+}
+
+
+#ifdef __linux__
+
+// events watched in the directory and each of its subdirectories
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | \
+                      IN_DELETE | IN_ATTRIB | IN_CREATE | IN_DELETE_SELF | \
+                      IN_MOVE_SELF)
+
+/*
+ * The inotify watches on a directory tree, and the path of the directory
+ * each of them is on, relative to the top one (NULL for the latter). Watch
+ * descriptors only grow, so they are kept sorted.
+ */
+typedef struct {
+    int fd;
+    char *dirname;
+    int *wds;
+    char **paths;
+    size_t count;
+    size_t cap;
+} watch_t;
+
+static volatile sig_atomic_t _watch_stop = 0;
+
+void _watch_signal(int sig) {
+    (void)sig;
+    _watch_stop = 1;
+}
+
+
+/*
+ * Publish a digest: send it if path is a UNIX socket, or replace the
+ * contents of the file otherwise.
+ */
+int _publish(char *path, char *line) {
+    struct stat st;
+    size_t len = strlen(line);
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+        int types[2] = {SOCK_STREAM, SOCK_DGRAM};
+        for (int t = 0; t < 2; t++) {
+            int fd = socket(AF_UNIX, types[t], 0);
+            if (fd < 0) {
+                return -1;
+            }
+            if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+                ssize_t w = send(fd, line, len, MSG_NOSIGNAL);
+                close(fd);
+                return w == (ssize_t)len ? 0 : -1;
+            }
+            close(fd);
+            if (errno != EPROTOTYPE) {
+                return -1;
+            }
+        }
+        return -1;
+    }
+
+    char *tmp = malloc(strlen(path) + 5);
+    sprintf(tmp, "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        free(tmp);
+        return -1;
+    }
+    int err = fwrite(line, 1, len, fp) != len;
+    err |= fclose(fp);
+    if (err || rename(tmp, path)) {
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+
+int _watch_subdirs(watch_t *w, const char *rel);
+
+/*
+ * Watch a directory, relative to the top one (or the latter itself if rel is
+ * NULL), and its subdirectories. Directories that are gone by the time we
+ * get to them are skipped, their parents will tell.
+ */
+int _watch_add(watch_t *w, const char *rel) {
+    char *path = malloc(strlen(w->dirname) + (rel ? strlen(rel) : 0) + 2);
+    sprintf(path, "%s/%s", w->dirname, rel ? rel : "");
+    int wd = inotify_add_watch(w->fd, path, WATCH_EVENTS | IN_ONLYDIR |
+                               (rel ? IN_DONT_FOLLOW : 0));
+    free(path);
+    if (wd < 0) {
+        return errno == ENOENT || errno == ENOTDIR ? 0 : -1;
+    }
+
+    if (w->count == 0 || wd > w->wds[w->count - 1]) {
+        if (w->count == w->cap) {
+            w->cap = w->cap ? w->cap * 2 : 64;
+            w->wds = realloc(w->wds, w->cap * sizeof(int));
+            w->paths = realloc(w->paths, w->cap * sizeof(char *));
+        }
+        w->wds[w->count] = wd;
+        w->paths[w->count++] = rel ? strdup(rel) : NULL;
+    }
+    return _watch_subdirs(w, rel);
+}
+
+
+/*
+ * Watch the subdirectories of a directory, relative to the top one.
+ */
+int _watch_subdirs(watch_t *w, const char *rel) {
+    char *path = malloc(strlen(w->dirname) + (rel ? strlen(rel) : 0) + 2);
+    sprintf(path, "%s/%s", w->dirname, rel ? rel : "");
+    DIR *dfd = opendir(path);
+    free(path);
+    if (dfd == NULL) {
+        return 0;
+    }
+
+    struct dirent *dp;
+    int r = 0;
+    while (r == 0 && (dp = readdir(dfd)) != NULL) {
+        if (dp->d_name[0] == '.' || (dp->d_type != DT_DIR &&
+                                     dp->d_type != DT_UNKNOWN)) {
+            continue; // not a directory, or one we don't scan either
+        }
+        char *sub = malloc((rel ? strlen(rel) : 0) + strlen(dp->d_name) + 2);
+        if (rel) {
+            sprintf(sub, "%s/%s", rel, dp->d_name);
+        } else {
+            strcpy(sub, dp->d_name);
+        }
+        r = _watch_add(w, sub); // IN_ONLYDIR sorts out the unknown ones
+        free(sub);
+    }
+    closedir(dfd);
+    return r;
+}
+
+
+/*
+ * Forget the watches on the subdirectories, and watch them again from the
+ * top: directories that were moved around keep their watches, but not their
+ * paths.
+ */
+int _watch_reset(watch_t *w) {
+    for (size_t i = 1; i < w->count; i++) {
+        inotify_rm_watch(w->fd, w->wds[i]);
+        free(w->paths[i]);
+    }
+    w->count = 1;
+    return _watch_subdirs(w, NULL);
+}
+
+
+int _wd_cmp(const void *a, const void *b) {
+    int x = *(int *)a, y = *(int *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Get the path of the file an event is about, relative to the top directory,
+ * or NULL if it comes from a watch we no longer have.
+ */
+char *_watch_path(watch_t *w, struct inotify_event *ev) {
+    int *wd = bsearch(&ev->wd, w->wds, w->count, sizeof(int), _wd_cmp);
+    if (wd == NULL) {
+        return NULL;
+    }
+    char *dir = w->paths[wd - w->wds];
+    if (dir == NULL) {
+        return strdup(ev->name);
+    }
+    char *path = malloc(strlen(dir) + strlen(ev->name) + 2);
+    sprintf(path, "%s/%s", dir, ev->name);
+    return path;
+}
+
+
+/*
+ * Hash a directory, then keep its digest up to date as files change,
+ * printing and publishing it after every batch of changes. Runs until
+ * interrupted.
+ */
+int _watch(ishake_t *is, dirstate_t *state, char *dirname, uint32_t datalen,
+           int thrno, int debounce, char *publish, int quiet) {
+    watch_t w = {inotify_init1(IN_CLOEXEC), dirname, NULL, NULL, 0, 0};
+    int fd = w.fd;
+    if (fd < 0) {
+        return -1;
+    }
+    // watch before hashing, so that we don't miss anything in between
+    if (_watch_add(&w, NULL) || w.count == 0) {
+        fprintf(stderr, "cannot watch the directory or its subdirectories: "
+                "%s.\n", strerror(errno));
+        close(fd);
+        for (size_t i = 1; i < w.count; i++) {
+            free(w.paths[i]);
+        }
+        free(w.wds);
+        free(w.paths);
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = _watch_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    uint16_t bytes = state->bits / 8;
+    uint8_t *digest = malloc(bytes);
+    char *buf = malloc(65536);
+    size_t cap = 1024, n = 0;
+    char **names = malloc(cap * sizeof(char *));
+    int rescan = 1, rewatch = 0, ret = 0;
+
+    while (!_watch_stop) {
+        char *failed = NULL;
+        if (rewatch && _watch_reset(&w)) {
+            fprintf(stderr, "cannot watch the subdirectories: %s.\n",
+                    strerror(errno));
+            ret = -1;
+            break;
+        }
+        rewatch = 0;
+        long r = rescan ?
+                 _state_update(is, state, dirname, datalen, thrno, &failed) :
+                 _state_apply(is, state, dirname, names, n, datalen, thrno,
+                              &failed);
+        if (r < 0 && failed == NULL) {
+            ret = -1;
+            break;
+        }
+        if (failed) { // keep going without it, and retry when it changes
+            fprintf(stderr, "cannot read file '%s' or it does not fit in a "
+                    "block.\n", failed);
+            free(failed);
+        }
+        rescan = 0;
+        for (size_t i = 0; i < n; i++) {
+            free(names[i]);
+        }
+        n = 0;
+
+        // publish the new digest
+        char *ho, *line;
+        if (_state_digest(is, state, digest)) {
+            ret = -1;
+            break;
+        }
+        bin2hex(&ho, digest, bytes);
+        line = malloc(strlen(ho) + strlen(dirname) + 5);
+        if (quiet) {
+            sprintf(line, "%s\n", ho);
+        } else {
+            sprintf(line, "%s - %s\n", ho, dirname);
+        }
+        fputs(line, stdout);
+        fflush(stdout);
+        if (publish && _publish(publish, line)) {
+            fprintf(stderr, "cannot publish the digest to '%s'.\n", publish);
+        }
+        free(line);
+        free(ho);
+
+        // collect a batch of events, until things are quiet for a while
+        struct timespec first;
+        int timeout = -1;
+        while (!_watch_stop) {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            int p = poll(&pfd, 1, timeout);
+            if (p < 0 && errno != EINTR) {
+                _watch_stop = 1;
+                ret = -1;
+            }
+            if (p <= 0) {
+                if (p == 0) {
+                    break; // quiet, apply the batch
+                }
+                continue;
+            }
+
+            ssize_t len = read(fd, buf, 65536);
+            for (char *ptr = buf; len > 0 && ptr < buf + len;) {
+                struct inotify_event *ev = (struct inotify_event *)ptr;
+                ptr += sizeof(struct inotify_event) + ev->len;
+
+                uint64_t nonce;
+                char *path;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    rescan = 1; // we lost track, look at everything
+                } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF |
+                                       IN_IGNORED)) {
+                    if (ev->wd == w.wds[0]) { // the directory itself
+                        _watch_stop = 1;
+                        ret = -1;
+                    } // a subdirectory, its parent tells us about it
+                } else if (ev->mask & IN_ISDIR) {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM |
+                                    IN_DELETE)) {
+                        // a subdirectory came or went, with its files
+                        rescan = rewatch = 1;
+                    }
+                } else if (ev->len && !(ev->mask & IN_CREATE) &&
+                           !_parse_nonce(ev->name, &nonce) &&
+                           (path = _watch_path(&w, ev)) != NULL) {
+                    if (n == cap) {
+                        cap *= 2;
+                        names = realloc(names, cap * sizeof(char *));
+                    }
+                    names[n++] = path;
+                }
+            }
+            if (n == 0 && !rescan) {
+                continue; // nothing we care about, keep waiting
+            }
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (timeout < 0) {
+                first = now;
+            }
+            long elapsed = (now.tv_sec - first.tv_sec) * 1000 +
+                           (now.tv_nsec - first.tv_nsec) / 1000000;
+            if (elapsed >= (long)debounce * WATCH_MAX_DELAY) {
+                break; // too busy to ever be quiet, apply what we have
+            }
+            timeout = debounce;
+        }
+    }
+
+    close(fd);
+    for (size_t i = 1; i < w.count; i++) {
+        free(w.paths[i]);
+    }
+    free(w.wds);
+    free(w.paths);
+    for (size_t i = 0; i < n; i++) {
+        free(names[i]);
+    }
+    free(names);
+    free(buf);
+    free(digest);
+    return ret;
 }
 
+#endif
+
 
 int main(int argc, char **argv) {
     struct dirent *dp;
-    DIR *dfd;
+    DIR *dfd = NULL;
 
     char *ho;
-    char *dirname = "", *oldhash = NULL;
-
-    uint64_t prev_nonce_f = 0;
+    char *dirname = "", *oldhash = NULL, *statefile = NULL, *publish = NULL;
+    char *tarfile = NULL, *journal = NULL;
 
     // file extensions with special meaning, should always be '.' + 3 bytes
     char *delext = ".del";
     char *oldext = ".old";
     char *newext = ".new";
 
-    int shake = 0, blocks = 0, quiet = 0, rehash = 0, thrno = 0, profile = 0;
+    int shake = 0, quiet = 0, rehash = 0, thrno = 0, profile = 0;
+    int auto_threads = 0;
+    int watch = 0, debounce = WATCH_DEBOUNCE;
+    uint8_t affinity = ISHAKE_AFFINITY_NONE;
+    char *cpus = NULL;
     unsigned long bits = 0;
 
     uint8_t *buf;
@@ -149,12 +1861,73 @@ int main(int argc, char **argv) {
             }
             oldhash = argv[i + 1];
             i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--apply-journal", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--apply-journal must be followed by the "
+                        "journal with the changes to apply.", 0);
+            }
+            journal = argv[i + 1];
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--state", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--state must be followed by the file where "
+                        "the state of the directory is kept.", 0);
+            }
+            statefile = argv[i + 1];
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--tar", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--tar must be followed by the tar archive to "
+                        "read the blocks from, or '-' for standard input.", 0);
+            }
+            tarfile = argv[i + 1];
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--watch", argv[i]) == 0) {
+            watch = 1;
+        } else if (strcmp("--debounce", argv[i]) == 0) {
+            char *ms_str;
+            if (i == argc - 1) {
+                panic(argv[0], "--debounce must be followed by the amount of "
+                        "milliseconds to wait for more changes.", 0);
+            }
+            debounce = (int)strtol(argv[i + 1], &ms_str, 10);
+            if (argv[i + 1] == ms_str || debounce < 0) {
+                panic(argv[0], "--debounce must be followed by the amount of "
+                        "milliseconds to wait for more changes.", 0);
+            }
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--publish", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--publish must be followed by the file or "
+                        "socket where the hash is published.", 0);
+            }
+            publish = argv[i + 1];
+            i++; // two arguments consumed, advance the pointer!
         } else if (strcmp("--threads", argv[i]) == 0) {
             if (i == argc - 1) {
                 panic(argv[0], "--threads must be followed by the amount of "
                         "threads to use.", 0);
             }
-            thrno = atoi(argv[i + 1]);
+            if (strcmp("auto", argv[i + 1]) == 0) {
+                auto_threads = 1;
+                thrno = affinity_cpus();
+            } else {
+                thrno = atoi(argv[i + 1]);
+            }
+            i++; // two arguments consumed, advance the pointer!
+        } else if (strcmp("--affinity", argv[i]) == 0) {
+            if (i == argc - 1) {
+                panic(argv[0], "--affinity must be followed by compact, "
+                        "scatter or a list of CPUs.", 0);
+            }
+            if (strcmp("compact", argv[i + 1]) == 0) {
+                affinity = ISHAKE_AFFINITY_COMPACT;
+            } else if (strcmp("scatter", argv[i + 1]) == 0) {
+                affinity = ISHAKE_AFFINITY_SCATTER;
+            } else {
+                affinity = ISHAKE_AFFINITY_LIST;
+                cpus = argv[i + 1];
+            }
             i++; // two arguments consumed, advance the pointer!
         } else if (strcmp("--profile", argv[i]) == 0) {
             profile = 1;
@@ -215,7 +1988,10 @@ int main(int argc, char **argv) {
     // initialize ishake
     ishake_t *is;
     is = malloc(sizeof(ishake_t));
-    if (ishake_init(is, block_size, (uint16_t) bits, mode, (uint16_t)thrno)) {
+    if (ishake_init_affinity(is, block_size, (uint16_t) bits, mode,
+                             auto_threads ? ISHAKE_THREADS_AUTO
+                                          : (uint16_t)thrno,
+                             affinity, cpus)) {
         panic(argv[0], "cannot initialize iSHAKE.", 0);
     }
 
@@ -226,10 +2002,45 @@ int main(int argc, char **argv) {
         uint8_t2uint64_t(is->hash, bin, bits / 8);
     }
 
-    // open directory
-    if ((dfd = opendir(dirname)) == NULL) {
-        panic(argv[0], "cannot find directory '%s' or read access denied.",
-              1, dirname);
+    if (journal && (tarfile || statefile || watch)) {
+        panic(argv[0], "--apply-journal cannot be used with --tar, --state "
+                "or --watch.", 0);
+    }
+
+    if (tarfile && (rehash || statefile || watch || strlen(dirname) > 0)) {
+        panic(argv[0], "--tar cannot be used with a directory, --rehash, "
+                "--state or --watch.", 0);
+    }
+
+    if (watch) { // keep the hash up to date as the directory changes
+        if (rehash) {
+            panic(argv[0], "--watch cannot be used with --rehash.", 0);
+        }
+#ifdef __linux__
+        dirstate_t *state = malloc(sizeof(dirstate_t));
+        dirstate_init(state, block_size, (uint16_t) bits, mode);
+        if (statefile) {
+            dirstate_load(state, statefile);
+        }
+        int err = _watch(is, state, dirname, datalen, thrno, debounce,
+                         publish, quiet);
+        if (statefile && dirstate_save(state, statefile)) {
+            panic(argv[0], "cannot write the state to '%s'.", 1, statefile);
+        }
+        dirstate_cleanup(state);
+        ishake_cleanup(is);
+        if (err) {
+            panic(argv[0], "cannot watch directory '%s' or read access "
+                    "denied.\n", 1, dirname);
+        }
+        return EXIT_SUCCESS;
+#else
+        panic(argv[0], "--watch is only supported on Linux.", 0);
+#endif
+    }
+
+    if (statefile && rehash) {
+        panic(argv[0], "--state cannot be used with --rehash.", 0);
     }
 
     // start measuring performance
@@ -242,9 +2053,75 @@ int main(int argc, char **argv) {
 
     }
 
+    if (tarfile) { // hash the members of an archive instead of files
+        FILE *fp = strcmp(tarfile, "-") == 0 ? stdin : fopen(tarfile, "rb");
+        if (fp == NULL) {
+            panic(argv[0], "cannot open archive '%s'.", 1, tarfile);
+        }
+        char *failed = NULL;
+        long members = _tar_hash(is, fp, datalen, thrno, &failed);
+        if (fp != stdin) {
+            fclose(fp);
+        }
+        if (members < 0) {
+            if (failed) {
+                panic(argv[0], "member '%s' does not fit in a block, is "
+                        "repeated, or is out of order in FULL mode.\n", 1,
+                      failed);
+            }
+            panic(argv[0], "cannot read archive '%s', or it is not a valid "
+                    "tar archive.\n", 1, tarfile);
+        }
+
+        // as if we had processed every member, which we did
+        is->proc_bytes = (uint64_t)members;
+        dirname = tarfile;
+    } else if (journal) { // apply a batch of changes recorded elsewhere
+        uint64_t failed = 0;
+        if (_journal_apply(is, journal, dirname, datalen, thrno,
+                           &failed) < 0) {
+            if (failed) {
+                panic(argv[0], "record %" PRIu64 " of the journal is not "
+                        "valid for this mode, does not fit in a block, or "
+                        "refers to data that cannot be read.\n", 1, failed);
+            }
+            panic(argv[0], "cannot read journal '%s', or it is not a valid "
+                    "journal.\n", 1, journal);
+        }
+        if (strlen(dirname) == 0) {
+            dirname = journal;
+        }
+    } else if (!rehash) { // hash the block files in parallel, by their numbers
+        dirstate_t *state = malloc(sizeof(dirstate_t));
+        dirstate_init(state, block_size, (uint16_t) bits, mode);
+        if (statefile) { // hash only what changed since the last run
+            dirstate_load(state, statefile);
+        }
+        char *failed = NULL;
+        if (_state_update(is, state, dirname, datalen, thrno, &failed) < 0) {
+            if (failed) {
+                panic(argv[0], "cannot read file '%s', it does not fit in a "
+                        "block, or another file has the same number.\n", 1,
+                      failed);
+            }
+            panic(argv[0], "cannot find directory '%s' or read access "
+                    "denied.\n", 1, dirname);
+        }
+        if (statefile && dirstate_save(state, statefile)) {
+            panic(argv[0], "cannot write the state to '%s'.", 1, statefile);
+        }
+
+        // the total is our digest, as if we had processed every file
+        memcpy(is->hash, state->total, bits / 8);
+        is->proc_bytes = state->count;
+        dirstate_cleanup(state);
+    } else if ((dfd = opendir(dirname)) == NULL) { // open directory
+        panic(argv[0], "cannot find directory '%s' or read access denied.",
+              1, dirname);
+    }
+
     // iterate over list of files in directory
-    while ((dp = readdir(dfd)) != NULL) {
-        char *file;
+    while (dfd && (dp = readdir(dfd)) != NULL) {
         if (dp->d_name[0] == '.' && rehash) { // dot file and we need to rehash
             size_t file_l = strlen(dp->d_name);
             size_t ext_l = strlen(oldext);
@@ -561,85 +2438,8 @@ int main(int argc, char **argv) {
 
                 continue;
             }
-        } else if (rehash) { // rehashing, but not a dot file
-            continue;
-        } else if (dp->d_name[0] == '.') { // not rehashing and a dot file
-            continue;
-        }
-
-        // regular hash, no dot file
-
-        if (mode == ISHAKE_FULL_MODE) { // full mode, new block, append it
-            size_t namlen = strlen(dp->d_name);
-            char *filename = malloc(namlen + 1);
-            strncpy(filename, dp->d_name, namlen + 1);
-
-            resolve_file_path(&file, dirname, filename);
-
-            if (access(file, R_OK) == -1) {
-                panic(argv[0], "cannot read file '%s'.", 1, file);
-            }
-
-            // parse the name of the file into the nonce of the block
-            uint64_t nonce = str2uint64_t(filename, 10);
-
-            // read file and process it on the go
-            FILE *fp = fopen(file, "r");
-            size_t b_read;
-
-            // in FULL R&W mode, files size must be less or equal to block size
-            ishake_block_t *block = malloc(sizeof(ishake_block_t));
-            block->data = malloc(datalen);
-            b_read = fread(block->data, 1, datalen, fp);
-            block->data_len = (uint32_t) b_read;
-            block->header.length = 16;
-            block->header.value.nonce.prev = prev_nonce_f;
-            block->header.value.nonce.nonce = nonce;
-
-            // insert here
-            ishake_insert(is, block, NULL);
-
-            // record the last block processed to set the "prev" pointer of the
-            // next block appended, if any
-            prev_nonce_f = nonce;
-
-            fclose(fp);
-            free(file);
-            free(filename);
-
-            // we're done with this file
-            continue;
-        }
-
-        // append-only mode
-
-        resolve_file_path(&file, dirname, dp->d_name);
-
-        if (access(file, R_OK) == -1) {
-            panic(argv[0], "cannot read file '%s'.", 1, file);
         }
-
-        // read file and process it on the go
-        FILE *fp = fopen(file, "r");
-        unsigned long b_read;
-
-        do {
-            blocks++;
-            buf = malloc(datalen);
-            b_read = fread(buf, 1, datalen, fp);
-            if (b_read == 0) {
-                // the file size is a multiple of the block size, we are done
-                break;
-            }
-
-            if (ishake_append(is, buf, b_read)) {
-                panic(argv[0], "iSHAKE failed to process data.", 0);
-            }
-        } while (b_read == datalen);
-
-        free(buf);
-        fclose(fp);
-        free(file);
+        // not a dot file, nothing to rehash
     }
 
     // finish computations and get the hash
@@ -671,7 +2471,9 @@ int main(int argc, char **argv) {
 
     // clean
     ishake_cleanup(is);
-    closedir(dfd);
+    if (dfd) {
+        closedir(dfd);
+    }
     free(bo);
     free(ho);
     return EXIT_SUCCESS;
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "journal.h"
+
+// the magic string and the version
+#define JOURNAL_HEADER_SIZE 12
+
+// the op, padding, nonce, prev and next
+#define JOURNAL_RECORD_SIZE 32
+
+
+/*
+ * Tell how many parts a record has, or -1 if its op is not valid.
+ */
+int _journal_parts(uint8_t op, uint64_t next) {
+    switch (op) {
+        case JOURNAL_APPEND:
+            return 1;
+        case JOURNAL_UPDATE:
+            return 2;
+        case JOURNAL_INSERT:
+        case JOURNAL_DELETE:
+            return next ? 2 : 1;
+        default:
+            return -1;
+    }
+}
+
+
+/*
+ * Make sure that there are at least n bytes left to read in a journal.
+ */
+int _journal_avail(journal_t *j, size_t n) {
+    return j->size - j->pos >= n;
+}
+
+
+int journal_open(journal_t *j, const char *path) {
+    struct stat st;
+    j->fp = NULL;
+    j->map = NULL;
+    j->pos = JOURNAL_HEADER_SIZE;
+    j->count = 0;
+    j->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (j->fd < 0) {
+        return -1;
+    }
+    if (fstat(j->fd, &st) || st.st_size < JOURNAL_HEADER_SIZE) {
+        close(j->fd);
+        return -1;
+    }
+    j->size = (size_t)st.st_size;
+    j->map = mmap(NULL, j->size, PROT_READ, MAP_PRIVATE, j->fd, 0);
+    if (j->map == MAP_FAILED) {
+        close(j->fd);
+        return -1;
+    }
+    madvise(j->map, j->size, MADV_SEQUENTIAL);
+
+    uint32_t version;
+    memcpy(&version, j->map + 8, sizeof(uint32_t));
+    if (memcmp(j->map, JOURNAL_MAGIC, 8) != 0 || version != JOURNAL_VERSION) {
+        munmap(j->map, j->size);
+        close(j->fd);
+        return -1;
+    }
+    return 0;
+}
+
+
+int journal_next(journal_t *j, journal_record_t *r) {
+    if (j->pos == j->size) {
+        return 0;
+    }
+    if (!_journal_avail(j, JOURNAL_RECORD_SIZE)) {
+        return -1;
+    }
+    unsigned char *p = j->map + j->pos;
+    r->op = p[0];
+    memcpy(&r->nonce, p + 8, sizeof(uint64_t));
+    memcpy(&r->prev, p + 16, sizeof(uint64_t));
+    memcpy(&r->next, p + 24, sizeof(uint64_t));
+    int parts = _journal_parts(r->op, r->next);
+    if (parts < 0) {
+        return -1;
+    }
+    j->pos += JOURNAL_RECORD_SIZE;
+
+    r->parts = (uint8_t)parts;
+    for (int i = 0; i < parts; i++) {
+        journal_part_t *part = &r->part[i];
+        if (!_journal_avail(j, 6)) {
+            return -1;
+        }
+        memcpy(&part->length, j->map + j->pos, sizeof(uint32_t));
+        memcpy(&part->pathlen, j->map + j->pos + 4, sizeof(uint16_t));
+        j->pos += 6;
+        if (part->pathlen) { // a reference to another file
+            if (!_journal_avail(j, 8 + (size_t)part->pathlen)) {
+                return -1;
+            }
+            memcpy(&part->offset, j->map + j->pos, sizeof(uint64_t));
+            part->path = (const char *)(j->map + j->pos + 8);
+            part->data = NULL;
+            j->pos += 8 + part->pathlen;
+        } else { // the data is right here
+            if (!_journal_avail(j, part->length)) {
+                return -1;
+            }
+            part->path = NULL;
+            part->offset = 0;
+            part->data = j->map + j->pos;
+            j->pos += part->length;
+        }
+    }
+    j->count++;
+    return 1;
+}
+
+
+int journal_create(journal_t *j, const char *path) {
+    uint32_t version = JOURNAL_VERSION;
+    j->fd = -1;
+    j->map = NULL;
+    j->size = 0;
+    j->pos = 0;
+    j->count = 0;
+    j->fp = fopen(path, "wb");
+    if (j->fp == NULL) {
+        return -1;
+    }
+    if (fwrite(JOURNAL_MAGIC, 1, 8, j->fp) != 8 ||
+        fwrite(&version, sizeof(uint32_t), 1, j->fp) != 1) {
+        fclose(j->fp);
+        return -1;
+    }
+    j->pos = JOURNAL_HEADER_SIZE;
+    return 0;
+}
+
+
+int journal_write(journal_t *j, journal_record_t *r) {
+    unsigned char rec[JOURNAL_RECORD_SIZE] = {0};
+    int parts = _journal_parts(r->op, r->next);
+    if (j->fp == NULL || parts < 0) {
+        return -1;
+    }
+    rec[0] = r->op;
+    memcpy(rec + 8, &r->nonce, sizeof(uint64_t));
+    memcpy(rec + 16, &r->prev, sizeof(uint64_t));
+    memcpy(rec + 24, &r->next, sizeof(uint64_t));
+    if (fwrite(rec, 1, JOURNAL_RECORD_SIZE, j->fp) != JOURNAL_RECORD_SIZE) {
+        return -1;
+    }
+
+    for (int i = 0; i < parts; i++) {
+        journal_part_t *part = &r->part[i];
+        if (fwrite(&part->length, sizeof(uint32_t), 1, j->fp) != 1 ||
+            fwrite(&part->pathlen, sizeof(uint16_t), 1, j->fp) != 1) {
+            return -1;
+        }
+        if (part->pathlen) {
+            if (fwrite(&part->offset, sizeof(uint64_t), 1, j->fp) != 1 ||
+                fwrite(part->path, 1, part->pathlen, j->fp) != part->pathlen) {
+                return -1;
+            }
+        } else if (part->length &&
+                   fwrite(part->data, 1, part->length, j->fp) !=
+                   part->length) {
+            return -1;
+        }
+    }
+    j->count++;
+    return 0;
+}
+
+
+int journal_close(journal_t *j) {
+    if (j->fp != NULL) {
+        return fclose(j->fp) ? -1 : 0;
+    }
+    munmap(j->map, j->size);
+    return close(j->fd);
+}
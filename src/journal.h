@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#ifndef ISHAKE_JOURNAL_H
+#define ISHAKE_JOURNAL_H
+
+#define JOURNAL_MAGIC "iSHAKEjr"
+#define JOURNAL_VERSION 1
+
+/*
+ * The kinds of changes a journal records. Every record carries the data of
+ * the blocks it needs to fix the digest up:
+ *
+ *  - JOURNAL_APPEND: the data of a new block (APPEND_ONLY mode only).
+ *  - JOURNAL_UPDATE: the old and the new data of a block.
+ *  - JOURNAL_INSERT: the data of the new block, and the data of the block
+ *    that follows it, if next is not 0 (FULL mode only).
+ *  - JOURNAL_DELETE: the data of the deleted block, and the data of the
+ *    block that follows it, if next is not 0 (FULL mode only).
+ */
+#define JOURNAL_APPEND 1
+#define JOURNAL_UPDATE 2
+#define JOURNAL_INSERT 3
+#define JOURNAL_DELETE 4
+
+/*
+ * The data of a block, either stored in the journal itself, or a reference
+ * to length bytes at offset in another file.
+ *
+ * In the journal, a part is written as a 32-bit length and a 16-bit path
+ * length, followed either by the data, if the path length is 0, or by a
+ * 64-bit offset and the path (not NUL-terminated).
+ */
+typedef struct {
+    uint32_t length;
+    uint16_t pathlen;
+    const char *path;           // the file with the data, if pathlen is not 0
+    uint64_t offset;
+    const unsigned char *data;  // the data, if pathlen is 0
+} journal_part_t;
+
+/*
+ * A change. The nonce is the index of the block in APPEND_ONLY mode, and
+ * prev and next are the nonces of the blocks around it in FULL mode.
+ *
+ * In the journal, a record is written as the op in one byte, seven bytes
+ * of padding, the nonce, prev and next, and then its parts.
+ */
+typedef struct {
+    uint8_t op;
+    uint64_t nonce;
+    uint64_t prev;
+    uint64_t next;
+    uint8_t parts;
+    journal_part_t part[2];
+} journal_record_t;
+
+/*
+ * A journal, either mapped into memory to be read, or open for writing.
+ * The file starts with the magic string and the version, and all numbers
+ * are in host byte order.
+ */
+typedef struct {
+    int fd;
+    FILE *fp;
+    unsigned char *map;
+    size_t size;
+    size_t pos;
+    uint64_t count; // records read or written so far
+} journal_t;
+
+/*
+ * Open a journal to read its records.
+ */
+int journal_open(journal_t *j, const char *path);
+
+/*
+ * Read the next record of a journal. Its parts point into the journal, and
+ * are valid until it is closed.
+ *
+ * Returns 1 if a record was read, 0 at the end of the journal, or -1 if the
+ * record is not valid.
+ */
+int journal_next(journal_t *j, journal_record_t *r);
+
+/*
+ * Create an empty journal to write records to, or truncate an existing one.
+ */
+int journal_create(journal_t *j, const char *path);
+
+/*
+ * Write a record at the end of a journal.
+ */
+int journal_write(journal_t *j, journal_record_t *r);
+
+/*
+ * Close a journal, flushing the records written to it.
+ */
+int journal_close(journal_t *j);
+
+#endif //ISHAKE_JOURNAL_H
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "keccak_x4.h"
+
+
+void keccak_x4_init(keccak_x4_t *x4, unsigned int rate, unsigned char suffix) {
+    KeccakP1600times4_StaticInitialize();
+    KeccakP1600times4_InitializeAll(x4->states);
+    x4->rate = rate;
+    x4->rounds = 24;
+    x4->suffix = suffix;
+}
+
+
+void keccak_x4_rounds(keccak_x4_t *x4, unsigned int rounds) {
+    x4->rounds = rounds;
+}
+
+
+void keccak_x4_reset(keccak_x4_t *x4, unsigned int lane) {
+    // there's no way to initialize a single lane, so cancel it with itself
+    unsigned char state[200];
+    KeccakP1600times4_ExtractBytes(x4->states, lane, state, 0, sizeof(state));
+    KeccakP1600times4_AddBytes(x4->states, lane, state, 0, sizeof(state));
+}
+
+
+void keccak_x4_add(keccak_x4_t *x4,
+                   unsigned int lane,
+                   const uint8_t *data,
+                   unsigned int len) {
+    KeccakP1600times4_AddBytes(x4->states, lane, data, 0, len);
+}
+
+
+void keccak_x4_pad(keccak_x4_t *x4,
+                   unsigned int lane,
+                   const uint8_t *data,
+                   unsigned int len) {
+    if (len) {
+        KeccakP1600times4_AddBytes(x4->states, lane, data, 0, len);
+    }
+    KeccakP1600times4_AddByte(x4->states, lane, x4->suffix, len);
+    KeccakP1600times4_AddByte(x4->states, lane, 0x80, x4->rate - 1);
+}
+
+
+void keccak_x4_permute(keccak_x4_t *x4) {
+    if (x4->rounds == 12) {
+        KeccakP1600times4_PermuteAll_12rounds(x4->states);
+    } else {
+        KeccakP1600times4_PermuteAll_24rounds(x4->states);
+    }
+}
+
+
+void keccak_x4_extract(keccak_x4_t *x4,
+                       unsigned int lane,
+                       uint8_t *out,
+                       unsigned int len) {
+    KeccakP1600times4_ExtractBytes(x4->states, lane, out, 0, len);
+}
+
+
+void keccak_x4_hash(unsigned int rate,
+                    unsigned int rounds,
+                    unsigned char suffix,
+                    unsigned int count,
+                    const uint8_t **in[],
+                    const size_t *len[],
+                    const unsigned int *n,
+                    uint8_t *out[],
+                    size_t outlen) {
+    keccak_x4_t x4;
+    unsigned int seg[KECCAK_X4_LANES] = {0};
+    size_t pos[KECCAK_X4_LANES] = {0}, squeezed[KECCAK_X4_LANES] = {0};
+    uint8_t padded[KECCAK_X4_LANES] = {0};
+    unsigned int busy = count;
+
+    keccak_x4_init(&x4, rate, suffix);
+    keccak_x4_rounds(&x4, rounds);
+    while (busy) {
+        // fill a block in every lane still absorbing, straight from segments
+        for (unsigned int l = 0; l < count; l++) {
+            if (padded[l]) {
+                continue;
+            }
+            unsigned int offset = 0;
+            while (offset < rate && seg[l] < n[l]) {
+                size_t left = len[l][seg[l]] - pos[l];
+                unsigned int take = left < rate - offset ?
+                                    (unsigned int)left : rate - offset;
+                if (take) {
+                    KeccakP1600times4_AddBytes(x4.states, l,
+                                               in[l][seg[l]] + pos[l],
+                                               offset, take);
+                }
+                offset += take;
+                pos[l] += take;
+                if (pos[l] == len[l][seg[l]]) {
+                    seg[l]++;
+                    pos[l] = 0;
+                }
+            }
+            if (offset < rate) { // the message ends in this block
+                KeccakP1600times4_AddByte(x4.states, l, suffix, offset);
+                KeccakP1600times4_AddByte(x4.states, l, 0x80, rate - 1);
+                padded[l] = 1;
+            }
+        }
+
+        keccak_x4_permute(&x4);
+
+        // squeeze from the lanes that are done absorbing
+        for (unsigned int l = 0; l < count; l++) {
+            if (!padded[l] || squeezed[l] == outlen) {
+                continue;
+            }
+            size_t take = outlen - squeezed[l] < rate ?
+                          outlen - squeezed[l] : rate;
+            keccak_x4_extract(&x4, l, out[l] + squeezed[l],
+                              (unsigned int)take);
+            squeezed[l] += take;
+            if (squeezed[l] == outlen) {
+                busy--;
+            }
+        }
+    }
+}
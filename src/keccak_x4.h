@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "KeccakP-1600-times4-SnP.h"
+
+#ifndef ISHAKE_KECCAK_X4_H
+#define ISHAKE_KECCAK_X4_H
+
+#define KECCAK_X4_LANES 4
+
+/*
+ * Four independent Keccak-f[1600] sponges, permuted together by a single call
+ * to the multi-buffer permutation of the KeccakCodePackage. Each lane can run
+ * a different message, but all of them must use the same rate.
+ */
+typedef struct {
+    unsigned char states[KeccakP1600times4_statesSizeInBytes]
+        __attribute__((aligned(KeccakP1600times4_statesAlignment)));
+    unsigned int rate;
+    unsigned int rounds;
+    unsigned char suffix;
+} keccak_x4_t;
+
+/*
+ * Initialize all lanes. rate is given in bytes, and suffix holds the domain
+ * separation bits (0x06 for SHA3, 0x1F for SHAKE). The full 24 rounds of the
+ * permutation are used unless keccak_x4_rounds() says otherwise.
+ */
+void keccak_x4_init(keccak_x4_t *x4, unsigned int rate, unsigned char suffix);
+
+/*
+ * Set the number of rounds of the permutation, either 12 or 24.
+ */
+void keccak_x4_rounds(keccak_x4_t *x4, unsigned int rounds);
+
+/*
+ * Reset a single lane to the initial state, leaving the others untouched.
+ */
+void keccak_x4_reset(keccak_x4_t *x4, unsigned int lane);
+
+/*
+ * Absorb len bytes (at most the rate) into a lane, starting at offset 0.
+ */
+void keccak_x4_add(keccak_x4_t *x4,
+                   unsigned int lane,
+                   const uint8_t *data,
+                   unsigned int len);
+
+/*
+ * Absorb the last len bytes (less than the rate) of a message into a lane,
+ * followed by the padding.
+ */
+void keccak_x4_pad(keccak_x4_t *x4,
+                   unsigned int lane,
+                   const uint8_t *data,
+                   unsigned int len);
+
+/*
+ * Permute all lanes.
+ */
+void keccak_x4_permute(keccak_x4_t *x4);
+
+/*
+ * Squeeze len bytes (at most the rate) out of a lane.
+ */
+void keccak_x4_extract(keccak_x4_t *x4,
+                       unsigned int lane,
+                       uint8_t *out,
+                       unsigned int len);
+
+/*
+ * Hash up to four messages in memory at once. in[i] may be a list of segments
+ * to absorb one after the other, n[i] of them with the lengths in len[i], and
+ * outlen bytes of digest are written to out[i].
+ */
+void keccak_x4_hash(unsigned int rate,
+                    unsigned int rounds,
+                    unsigned char suffix,
+                    unsigned int count,
+                    const uint8_t **in[],
+                    const size_t *len[],
+                    const unsigned int *n,
+                    uint8_t *out[],
+                    size_t outlen);
+
+#endif //ISHAKE_KECCAK_X4_H
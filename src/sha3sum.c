@@ -2,13 +2,25 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "KeccakCodePackage.h"
+#include "keccak_x4.h"
+#include "treehash.h"
 #include "utils.h"
 
 #define BLOCK_SIZE 1024
 #define algorithm_Keccak 0
 
+// amount of data read at once from each file when hashing several of them
+#define CHUNK_SIZE 64*1024
+
+// TurboSHAKE is not a tree hash, but it's hashed like one
+#define TURBOSHAKE 2
+
+// amount of data read at once with tree hashes, to keep all threads busy
+#define TREE_READ_SIZE 4*1024*1024
+
 typedef struct {
     unsigned int algorithm;
     unsigned int rate;
@@ -17,6 +29,270 @@ typedef struct {
     unsigned char delimitedSuffix;
 } Specifications;
 
+/*
+ * A file to hash, and its result once a worker is done with it.
+ */
+typedef struct {
+    char *name;
+    uint8_t *out;
+    int status; // 0 pending, 1 hashed, -1 cannot be read
+} sha3_file_t;
+
+/*
+ * The list of files to hash, shared by all workers.
+ */
+typedef struct {
+    sha3_file_t *files;
+    size_t count;
+    size_t next;
+    unsigned int rate;
+    unsigned char suffix;
+    unsigned long bytes;
+    int hex_input;
+    pthread_mutex_t lck;
+    pthread_cond_t hashed;
+} sha3_jobs_t;
+
+/*
+ * A lane of a worker, hashing one file.
+ */
+typedef struct {
+    sha3_file_t *file;
+    FILE *fp;
+    uint8_t *buf;
+    size_t have;
+    size_t pos;
+    int eof;
+    int padded;
+    unsigned long squeezed;
+} sha3_lane_t;
+
+
+/*
+ * Publish the result of a file, waking up the thread printing them.
+ */
+void _file_done(sha3_jobs_t *jobs, sha3_file_t *file, int status) {
+    pthread_mutex_lock(&jobs->lck);
+    file->status = status;
+    pthread_cond_broadcast(&jobs->hashed);
+    pthread_mutex_unlock(&jobs->lck);
+}
+
+
+/*
+ * Assign the next file in the list to a lane. Returns 0 if there are no more.
+ */
+int _lane_open(sha3_jobs_t *jobs, sha3_lane_t *lane) {
+    while (1) {
+        pthread_mutex_lock(&jobs->lck);
+        if (jobs->next == jobs->count) {
+            pthread_mutex_unlock(&jobs->lck);
+            return 0;
+        }
+        sha3_file_t *file = &jobs->files[jobs->next++];
+        pthread_mutex_unlock(&jobs->lck);
+
+        FILE *fp = fopen(file->name, "r");
+        if (fp == NULL) {
+            _file_done(jobs, file, -1);
+            continue;
+        }
+        lane->file = file;
+        lane->fp = fp;
+        lane->have = 0;
+        lane->pos = 0;
+        lane->eof = 0;
+        lane->padded = 0;
+        lane->squeezed = 0;
+        return 1;
+    }
+}
+
+
+/*
+ * Make sure a lane has at least a full block buffered, unless its file ends.
+ */
+void _lane_fill(sha3_jobs_t *jobs, sha3_lane_t *lane) {
+    if (lane->have - lane->pos >= jobs->rate || lane->eof) {
+        return;
+    }
+    memmove(lane->buf, lane->buf + lane->pos, lane->have - lane->pos);
+    lane->have -= lane->pos;
+    lane->pos = 0;
+
+    size_t b_read = fread(lane->buf + lane->have, 1, CHUNK_SIZE, lane->fp);
+    if (b_read < CHUNK_SIZE) {
+        lane->eof = 1;
+    }
+    if (jobs->hex_input && b_read) { // convert the input to bytes
+        uint8_t *input;
+        hex2bin((char **)&input, lane->buf + lane->have, b_read);
+        memcpy(lane->buf + lane->have, input, b_read / 2);
+        free(input);
+        b_read = b_read / 2;
+    }
+    lane->have += b_read;
+}
+
+
+/*
+ * Worker thread. It runs KECCAK_X4_LANES files at a time, permuting them all
+ * together with the multi-buffer implementation of Keccak-f[1600].
+ */
+void *_worker(void *arg) {
+    sha3_jobs_t *jobs = (sha3_jobs_t *) arg;
+    sha3_lane_t lanes[KECCAK_X4_LANES];
+    keccak_x4_t x4;
+    int busy = 0;
+
+    keccak_x4_init(&x4, jobs->rate, jobs->suffix);
+    for (int l = 0; l < KECCAK_X4_LANES; l++) {
+        lanes[l].fp = NULL;
+        lanes[l].buf = malloc(CHUNK_SIZE + jobs->rate);
+        if (_lane_open(jobs, &lanes[l])) {
+            busy++;
+        }
+    }
+
+    while (busy) {
+        // absorb a block in every lane, or pad those that reached the end
+        for (int l = 0; l < KECCAK_X4_LANES; l++) {
+            sha3_lane_t *lane = &lanes[l];
+            if (lane->fp == NULL || lane->padded) {
+                continue;
+            }
+            _lane_fill(jobs, lane);
+            size_t left = lane->have - lane->pos;
+            if (left >= jobs->rate) {
+                keccak_x4_add(&x4, l, lane->buf + lane->pos, jobs->rate);
+                lane->pos += jobs->rate;
+            } else {
+                keccak_x4_pad(&x4, l, lane->buf + lane->pos,
+                              (unsigned int)left);
+                lane->padded = 1;
+            }
+        }
+
+        keccak_x4_permute(&x4);
+
+        // squeeze the lanes that are done, and give them a new file
+        for (int l = 0; l < KECCAK_X4_LANES; l++) {
+            sha3_lane_t *lane = &lanes[l];
+            if (lane->fp == NULL || !lane->padded) {
+                continue;
+            }
+            unsigned long take = jobs->bytes - lane->squeezed;
+            if (take > jobs->rate) {
+                take = jobs->rate;
+            }
+            keccak_x4_extract(&x4, l, lane->file->out + lane->squeezed,
+                              (unsigned int)take);
+            lane->squeezed += take;
+            if (lane->squeezed < jobs->bytes) {
+                continue; // more output needed, permute again
+            }
+
+            fclose(lane->fp);
+            lane->fp = NULL;
+            _file_done(jobs, lane->file, 1);
+            keccak_x4_reset(&x4, l);
+            if (!_lane_open(jobs, lane)) {
+                busy--;
+            }
+        }
+    }
+
+    for (int l = 0; l < KECCAK_X4_LANES; l++) {
+        free(lanes[l].buf);
+    }
+    pthread_exit(NULL);
+}
+
+
+/*
+ * Hash everything in fp with a tree hash or TurboSHAKE.
+ */
+int _tree_hash(FILE *fp,
+               int tree,
+               uint16_t security,
+               size_t leaf,
+               char *custom,
+               uint16_t threads,
+               int hex_input,
+               uint8_t *out,
+               unsigned long bytes) {
+    treehash_t *th = NULL;
+    sponge_t turbo;
+    if (tree == TURBOSHAKE) {
+        turboshake_init(&turbo, security, 0x1F);
+    } else {
+        th = malloc(sizeof(treehash_t));
+        if (treehash_init(th, (uint8_t)tree, security, leaf, (uint8_t *)custom,
+                          strlen(custom), threads)) {
+            return -1;
+        }
+    }
+
+    uint8_t *buf = malloc(TREE_READ_SIZE);
+    size_t b_read;
+    while ((b_read = fread(buf, 1, TREE_READ_SIZE, fp)) > 0) {
+        uint8_t *input = buf;
+        if (hex_input) { // convert the input to bytes
+            hex2bin((char **)&input, buf, b_read);
+            b_read = b_read / 2;
+        }
+        if (th) {
+            treehash_update(th, input, b_read);
+        } else {
+            sponge_absorb(&turbo, input, b_read);
+        }
+        if (hex_input) {
+            free(input);
+        }
+    }
+    free(buf);
+
+    if (th) {
+        treehash_final(th, out, bytes);
+        treehash_cleanup(th);
+    } else {
+        sponge_squeeze(&turbo, out, bytes);
+    }
+    return ferror(fp) ? -1 : 0;
+}
+
+
+/*
+ * Add the files listed in a file, one per line, to the list of files to hash.
+ */
+int _files_from(char *list, sha3_file_t **files, size_t *count, size_t *cap) {
+    FILE *fp = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char *line = NULL;
+    size_t n = 0;
+    ssize_t len;
+    while ((len = getline(&line, &n, fp)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (*count == *cap) {
+            *cap = *cap ? *cap * 2 : 1024;
+            *files = realloc(*files, *cap * sizeof(sha3_file_t));
+        }
+        (*files)[(*count)++].name = strdup(line);
+    }
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return 0;
+}
+
 
 int main(int argc, char *argv[]) {
     FILE *fp;
@@ -25,8 +301,14 @@ int main(int argc, char *argv[]) {
     char *output;
 
     int shake = 0, sha = 0, hex_input = 0, quiet = 0;
+    int tree = 0, tree_sec = 0;
+    size_t leaf = 8192;
+    char *custom = "";
+    long thrno = 0;
     unsigned long bytes = 0;
     char *filename = "";
+    sha3_file_t *files = NULL;
+    size_t count = 0, cap = 0;
 
     Keccak_HashInstance keccak;
     Specifications specs;
@@ -44,36 +326,71 @@ int main(int argc, char *argv[]) {
             specs.hashbitlen = 264;
             shake = 128;
             sha = 0;
+            tree_sec = 0;
         } else if (strcmp("--shake256", argv[i]) == 0) {
             specs.rate = 1088;
             specs.capacity = 512;
             specs.hashbitlen = 528;
             shake = 256;
             sha = 0;
+            tree_sec = 0;
         } else if (strcmp("--sha3-224", argv[i]) == 0) {
             specs.rate = 1152;
             specs.capacity = 448;
             specs.hashbitlen = 224;
             sha = 224;
             shake = 0;
+            tree_sec = 0;
         } else if (strcmp("--sha3-256", argv[i]) == 0) {
             specs.rate = 1088;
             specs.capacity = 512;
             specs.hashbitlen = 256;
             sha = 256;
             shake = 0;
+            tree_sec = 0;
         } else if (strcmp("--sha3-384", argv[i]) == 0) {
             specs.rate = 832;
             specs.capacity = 768;
             specs.hashbitlen = 384;
             sha = 384;
             shake = 0;
+            tree_sec = 0;
         } else if (strcmp("--sha3-512", argv[i]) == 0) {
             specs.rate = 576;
             specs.capacity = 1024;
             specs.hashbitlen = 512;
             sha = 512;
             shake = 0;
+            tree_sec = 0;
+        } else if (strcmp("--parallelhash128", argv[i]) == 0 ||
+                   strcmp("--parallelhash256", argv[i]) == 0) {
+            tree = TREEHASH_PARALLELHASH;
+            tree_sec = atoi(argv[i] + 14);
+            shake = sha = 0;
+        } else if (strcmp("--kt128", argv[i]) == 0 ||
+                   strcmp("--kt256", argv[i]) == 0) {
+            tree = TREEHASH_KANGAROOTWELVE;
+            tree_sec = atoi(argv[i] + 4);
+            shake = sha = 0;
+        } else if (strcmp("--turboshake128", argv[i]) == 0 ||
+                   strcmp("--turboshake256", argv[i]) == 0) {
+            tree = TURBOSHAKE;
+            tree_sec = atoi(argv[i] + 12);
+            shake = sha = 0;
+        } else if (strcmp("--leaf-size", argv[i]) == 0) {
+            if (i == argc - 1 || (leaf = strtoul(argv[i + 1], NULL, 10)) == 0) {
+                printf("--leaf-size must be followed by the amount of bytes "
+                               "per leaf.\n");
+                return -1;
+            }
+            i++;
+        } else if (strcmp("--customization", argv[i]) == 0) {
+            if (i == argc - 1) {
+                printf("--customization must be followed by a string.\n");
+                return -1;
+            }
+            custom = argv[i + 1];
+            i++;
         } else if (strcmp("--hex", argv[i]) == 0) {
             hex_input = 1;
         } else if (strcmp("--quiet", argv[i]) == 0) {
@@ -89,6 +406,21 @@ int main(int argc, char *argv[]) {
             }
             i++;
             continue;
+        } else if (strcmp("--threads", argv[i]) == 0) {
+            if (i == argc - 1 || (thrno = atol(argv[i + 1])) <= 0) {
+                printf("--threads must be followed by the amount of threads "
+                               "to use.\n");
+                return -1;
+            }
+            i++;
+        } else if (strcmp("--files-from", argv[i]) == 0) {
+            if (i == argc - 1 ||
+                _files_from(argv[i + 1], &files, &count, &cap)) {
+                printf("--files-from must be followed by a readable file "
+                               "with one file name per line.\n");
+                return -1;
+            }
+            i++;
         } else {
             if (strlen(argv[i]) > 2) {
                 if ((argv[i][0] == '-') && (argv[i][1] == '-')) {
@@ -96,17 +428,64 @@ int main(int argc, char *argv[]) {
                     return -1;
                 }
             }
-            if (strlen(filename) > 1) {
-                printf("Cannot specify more than one file.\n");
-                return -1;
+            if (count == cap) {
+                cap = cap ? cap * 2 : 1024;
+                files = realloc(files, cap * sizeof(sha3_file_t));
             }
-            filename = argv[i];
+            files[count++].name = strdup(argv[i]);
         }
     }
-    if (bytes) {
-        specs.hashbitlen = (unsigned int)bytes * 8;
-    } else {
-        bytes = specs.hashbitlen / 8;
+    if (tree_sec != 0) { // tree hashes, one input at a time using all threads
+        if (bytes == 0) {
+            bytes = (unsigned long)tree_sec / 4;
+        }
+        if (thrno == 0) {
+            thrno = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        out = malloc(bytes);
+        size_t f = 0;
+        int r = 0;
+        do {
+            filename = count ? files[f].name : "";
+            fp = count ? fopen(filename, "r") : stdin;
+            if (fp == NULL ||
+                _tree_hash(fp, tree, (uint16_t)tree_sec, leaf, custom,
+                           (uint16_t)thrno, hex_input, out, bytes)) {
+                printf("Cannot find file '%s' or read access denied.\n",
+                       filename);
+                r = -1;
+            } else {
+                bin2hex(&output, out, (int)bytes);
+                if (quiet) {
+                    printf("%s\n", output);
+                } else {
+                    printf("%s - %s\n", output, filename);
+                }
+                free(output);
+            }
+            if (fp != NULL && fp != stdin) {
+                fclose(fp);
+            }
+            if (count) {
+                free(files[f].name);
+            }
+        } while (++f < count);
+        free(files);
+        free(out);
+        return r;
+    }
+
+    if (shake == 0 && sha == 0) { // SHA3-256 by default
+        specs.rate = 1088;
+        specs.capacity = 512;
+        specs.hashbitlen = 256;
+    }
+    if (shake != 0) { // only the XOFs take an output length
+        if (bytes) {
+            specs.hashbitlen = (unsigned int)bytes * 8;
+        } else {
+            bytes = specs.hashbitlen / 8;
+        }
     }
 
     if (shake != 0) { // we are asked for a shake hash (extensible output)
@@ -149,17 +528,72 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // open appropriate input source
-    if (strlen(filename) == 0) {
-        fp = stdin;
-    } else {
-        if (access(filename, R_OK) == -1) {
-            printf("Cannot find file '%s' or read access denied.\n", filename);
-            return -1;
+    if (count > 0) { // hash all files in parallel, print them in order
+        sha3_jobs_t jobs;
+        jobs.files = files;
+        jobs.count = count;
+        jobs.next = 0;
+        jobs.rate = specs.rate / 8;
+        jobs.suffix = specs.delimitedSuffix;
+        jobs.bytes = bytes;
+        jobs.hex_input = hex_input;
+        pthread_mutex_init(&jobs.lck, NULL);
+        pthread_cond_init(&jobs.hashed, NULL);
+        for (size_t f = 0; f < count; f++) {
+            files[f].out = malloc(bytes);
+            files[f].status = 0;
+        }
+
+        // no need for more workers than we can keep busy
+        if (thrno == 0) {
+            thrno = sysconf(_SC_NPROCESSORS_ONLN);
         }
-        fp = fopen(filename, "r");
+        size_t needed = (count + KECCAK_X4_LANES - 1) / KECCAK_X4_LANES;
+        if ((size_t)thrno > needed) {
+            thrno = (long)needed;
+        }
+        pthread_t *threads = malloc(thrno * sizeof(pthread_t));
+        for (long t = 0; t < thrno; t++) {
+            pthread_create(&threads[t], NULL, _worker, &jobs);
+        }
+
+        int r = 0;
+        for (size_t f = 0; f < count; f++) {
+            pthread_mutex_lock(&jobs.lck);
+            while (files[f].status == 0) {
+                pthread_cond_wait(&jobs.hashed, &jobs.lck);
+            }
+            pthread_mutex_unlock(&jobs.lck);
+
+            if (files[f].status < 0) {
+                printf("Cannot find file '%s' or read access denied.\n",
+                       files[f].name);
+                r = -1;
+            } else {
+                bin2hex(&output, files[f].out, (int)bytes);
+                if (quiet) {
+                    printf("%s\n", output);
+                } else {
+                    printf("%s - %s\n", output, files[f].name);
+                }
+                free(output);
+            }
+            free(files[f].out);
+            free(files[f].name);
+        }
+
+        for (long t = 0; t < thrno; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        free(threads);
+        free(files);
+        free(out);
+        return r;
     }
 
+    // no files, hash whatever we get from stdin
+    fp = stdin;
+
     if (Keccak_HashInitialize(&keccak, specs.rate, specs.capacity,
                               specs.hashbitlen, specs.delimitedSuffix)) {
         return -1;
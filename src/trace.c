@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "trace.h"
+#include "ishake_cdc.h"
+
+// the magic string, the version and the parameters of the hash
+#define TRACE_HEADER_SIZE 24
+
+// more than the longest piece of a record written at once
+#define TRACE_RECORD_MAX 64
+
+
+/*
+ * Tell how many parts a record has, or -1 if its op is not valid.
+ */
+int _trace_parts(uint8_t op) {
+    switch (op) {
+        case TRACE_APPEND:
+            return 1;
+        case TRACE_UPDATE:
+            return 2;
+        case TRACE_INSERT:
+        case TRACE_DELETE:
+            return 1; // and maybe another one
+        case TRACE_SNAPSHOT:
+        case TRACE_FINAL:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+
+/*
+ * Hash some data to tell it apart, not to protect it.
+ */
+uint64_t _trace_sum(const unsigned char *data, uint64_t length) {
+    uint64_t sum = length;
+    do { // the nonces of content-defined blocks are good enough
+        uint32_t n = length > (1U << 30) ? 1U << 30 : (uint32_t)length;
+        sum ^= ishake_cdc_nonce(data, n) + (sum << 6) + (sum >> 2);
+        data += n;
+        length -= n;
+    } while (length);
+    return sum;
+}
+
+
+/*
+ * Write a number in as many bytes as needed, seven bits at a time.
+ */
+size_t _trace_put(unsigned char *p, uint64_t n) {
+    size_t i = 0;
+    while (n >= 0x80) {
+        p[i++] = (unsigned char)(n | 0x80);
+        n >>= 7;
+    }
+    p[i++] = (unsigned char)n;
+    return i;
+}
+
+
+/*
+ * Read a number written by _trace_put().
+ */
+int _trace_get(trace_t *t, uint64_t *n) {
+    *n = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (t->pos == t->size) {
+            return -1;
+        }
+        unsigned char b = t->map[t->pos++];
+        *n |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Make sure that there are at least n bytes left to read in a trace.
+ */
+int _trace_avail(trace_t *t, size_t n) {
+    return t->size - t->pos >= n;
+}
+
+
+/*
+ * Read the length of a part, and its hash or data.
+ */
+int _trace_get_part(trace_t *t, trace_part_t *p) {
+    p->sum = 0;
+    p->data = NULL;
+    p->owned = 0;
+    if (_trace_get(t, &p->length)) {
+        return -1;
+    }
+    if (t->what == TRACE_HASHES) {
+        if (!_trace_avail(t, sizeof(uint64_t))) {
+            return -1;
+        }
+        memcpy(&p->sum, t->map + t->pos, sizeof(uint64_t));
+        t->pos += sizeof(uint64_t);
+    } else if (t->what == TRACE_DATA) {
+        if (!_trace_avail(t, p->length)) {
+            return -1;
+        }
+        p->data = t->map + t->pos;
+        p->sum = _trace_sum(p->data, p->length);
+        t->pos += p->length;
+    }
+    return 0;
+}
+
+
+/*
+ * Read the header of a block.
+ */
+int _trace_get_header(trace_t *t, ishake_header *h) {
+    if (!_trace_avail(t, 1)) {
+        return -1;
+    }
+    h->length = t->map[t->pos++];
+    if (h->length == 8) {
+        return _trace_get(t, &h->value.idx);
+    }
+    if (h->length != 16 || !_trace_avail(t, 2 * sizeof(uint64_t))) {
+        return -1;
+    }
+    memcpy(&h->value.nonce.nonce, t->map + t->pos, sizeof(uint64_t));
+    memcpy(&h->value.nonce.prev, t->map + t->pos + 8, sizeof(uint64_t));
+    t->pos += 2 * sizeof(uint64_t);
+    return 0;
+}
+
+
+int trace_open(trace_t *t, const char *path) {
+    struct stat st;
+    t->fp = NULL;
+    t->map = NULL;
+    t->pos = TRACE_HEADER_SIZE;
+    t->count = 0;
+    t->last = 0;
+    t->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (t->fd < 0) {
+        return -1;
+    }
+    if (fstat(t->fd, &st) || st.st_size < TRACE_HEADER_SIZE) {
+        close(t->fd);
+        return -1;
+    }
+    t->size = (size_t)st.st_size;
+    t->map = mmap(NULL, t->size, PROT_READ, MAP_PRIVATE, t->fd, 0);
+    if (t->map == MAP_FAILED) {
+        close(t->fd);
+        return -1;
+    }
+    madvise(t->map, t->size, MADV_SEQUENTIAL);
+
+    uint32_t version;
+    memcpy(&version, t->map + 8, sizeof(uint32_t));
+    t->what = t->map[12];
+    t->mode = t->map[13];
+    memcpy(&t->output_len, t->map + 14, sizeof(uint16_t));
+    memcpy(&t->block_size, t->map + 16, sizeof(uint32_t));
+    memcpy(&t->threads, t->map + 20, sizeof(uint16_t));
+    if (memcmp(t->map, TRACE_MAGIC, 8) != 0 || version != TRACE_VERSION ||
+        t->what > TRACE_DATA) {
+        munmap(t->map, t->size);
+        close(t->fd);
+        return -1;
+    }
+    return 0;
+}
+
+
+int trace_next(trace_t *t, trace_record_t *r) {
+    if (t->pos == t->size) {
+        return 0;
+    }
+    uint64_t at;
+    r->op = t->map[t->pos++];
+    int parts = _trace_parts(r->op);
+    if (parts < 0 || _trace_get(t, &at) || _trace_get(t, &r->took)) {
+        return -1;
+    }
+    // the start is stored as a difference, positive or not
+    t->last += (at >> 1) ^ (~(at & 1) + 1);
+    r->at = t->last;
+
+    if (r->op == TRACE_INSERT || r->op == TRACE_DELETE) {
+        if (!_trace_avail(t, 1)) {
+            return -1;
+        }
+        parts = t->map[t->pos++];
+        if (parts < 1 || parts > 2) {
+            return -1;
+        }
+    }
+    r->parts = (uint8_t)parts;
+    for (int i = 0; i < parts; i++) {
+        if (r->op != TRACE_APPEND && _trace_get_header(t, &r->header[i])) {
+            return -1;
+        }
+        if (_trace_get_part(t, &r->part[i])) {
+            return -1;
+        }
+    }
+
+    r->seq = 0;
+    r->digest = NULL;
+    if (r->op == TRACE_SNAPSHOT && _trace_get(t, &r->seq)) {
+        return -1;
+    }
+    if (r->op == TRACE_FINAL) {
+        if (!_trace_avail(t, 1)) {
+            return -1;
+        }
+        if (t->map[t->pos++]) {
+            if (!_trace_avail(t, (size_t)t->output_len / 8)) {
+                return -1;
+            }
+            r->digest = t->map + t->pos;
+            t->pos += t->output_len / 8;
+        }
+    }
+    t->count++;
+    return 1;
+}
+
+
+int trace_create(trace_t *t, const char *path) {
+    unsigned char header[TRACE_HEADER_SIZE] = {0};
+    uint32_t version = TRACE_VERSION;
+    t->fd = -1;
+    t->map = NULL;
+    t->size = 0;
+    t->pos = 0;
+    t->count = 0;
+    t->last = 0;
+    t->fp = fopen(path, "wb");
+    if (t->fp == NULL) {
+        return -1;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    t->start = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    memcpy(header, TRACE_MAGIC, 8);
+    memcpy(header + 8, &version, sizeof(uint32_t));
+    header[12] = t->what;
+    header[13] = t->mode;
+    memcpy(header + 14, &t->output_len, sizeof(uint16_t));
+    memcpy(header + 16, &t->block_size, sizeof(uint32_t));
+    memcpy(header + 20, &t->threads, sizeof(uint16_t));
+    if (fwrite(header, 1, TRACE_HEADER_SIZE, t->fp) != TRACE_HEADER_SIZE) {
+        fclose(t->fp);
+        return -1;
+    }
+    pthread_mutex_init(&t->lck, NULL);
+    t->pos = TRACE_HEADER_SIZE;
+    return 0;
+}
+
+
+int trace_part(trace_t *t,
+               trace_part_t *p,
+               const unsigned char *data,
+               uint64_t length,
+               uint8_t copy) {
+    p->length = length;
+    p->sum = 0;
+    p->data = NULL;
+    p->owned = 0;
+    if (t->what == TRACE_HASHES) {
+        p->sum = _trace_sum(data, length);
+    } else if (t->what == TRACE_DATA) {
+        p->data = data;
+        if (copy) {
+            unsigned char *dup = malloc(length ? length : 1);
+            if (dup == NULL) {
+                return -1;
+            }
+            memcpy(dup, data, length);
+            p->data = dup;
+            p->owned = 1;
+        }
+    }
+    return 0;
+}
+
+
+int trace_write(trace_t *t, trace_record_t *r) {
+    unsigned char rec[TRACE_RECORD_MAX];
+    int parts = _trace_parts(r->op);
+    int res = t->fp == NULL || parts < 0 ? -1 : 0;
+
+    pthread_mutex_lock(&t->lck);
+    if (res == 0) {
+        // calls may end in a different order than they started
+        int64_t diff = (int64_t)(r->at - t->last);
+        size_t len = 0;
+        rec[len++] = r->op;
+        len += _trace_put(rec + len,
+                          ((uint64_t)diff << 1) ^ (uint64_t)(diff >> 63));
+        len += _trace_put(rec + len, r->took);
+        if (r->op == TRACE_INSERT || r->op == TRACE_DELETE) {
+            rec[len++] = r->parts;
+        }
+        t->last = r->at;
+        res = fwrite(rec, 1, len, t->fp) == len ? 0 : -1;
+    }
+
+    for (int i = 0; i < r->parts; i++) {
+        trace_part_t *p = &r->part[i];
+        size_t len = 0;
+        if (res == 0 && r->op != TRACE_APPEND) {
+            ishake_header *h = &r->header[i];
+            rec[len++] = (unsigned char)h->length;
+            if (h->length == 8) {
+                len += _trace_put(rec + len, h->value.idx);
+            } else {
+                memcpy(rec + len, &h->value.nonce.nonce, sizeof(uint64_t));
+                memcpy(rec + len + 8, &h->value.nonce.prev, sizeof(uint64_t));
+                len += 2 * sizeof(uint64_t);
+            }
+        }
+        if (res == 0) {
+            len += _trace_put(rec + len, p->length);
+            if (t->what == TRACE_HASHES) {
+                memcpy(rec + len, &p->sum, sizeof(uint64_t));
+                len += sizeof(uint64_t);
+            }
+            res = fwrite(rec, 1, len, t->fp) == len ? 0 : -1;
+        }
+        if (res == 0 && t->what == TRACE_DATA && p->length &&
+            fwrite(p->data, 1, p->length, t->fp) != p->length) {
+            res = -1;
+        }
+        if (p->owned) {
+            free((unsigned char *)p->data);
+        }
+    }
+
+    if (res == 0 && r->op == TRACE_SNAPSHOT) {
+        size_t len = _trace_put(rec, r->seq);
+        res = fwrite(rec, 1, len, t->fp) == len ? 0 : -1;
+    }
+    if (res == 0 && r->op == TRACE_FINAL) {
+        unsigned char known = r->digest != NULL;
+        size_t len = t->output_len / 8;
+        if (fwrite(&known, 1, 1, t->fp) != 1 ||
+            (known && fwrite(r->digest, 1, len, t->fp) != len)) {
+            res = -1;
+        }
+    }
+    if (res == 0) {
+        t->count++;
+    }
+    pthread_mutex_unlock(&t->lck);
+    return res;
+}
+
+
+int trace_close(trace_t *t) {
+    if (t->fp != NULL) {
+        pthread_mutex_destroy(&t->lck);
+        return fclose(t->fp) ? -1 : 0;
+    }
+    munmap(t->map, t->size);
+    return close(t->fd);
+}
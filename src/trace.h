@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "ishake.h"
+
+#ifndef ISHAKE_TRACE_H
+#define ISHAKE_TRACE_H
+
+#define TRACE_MAGIC "iSHAKEtr"
+#define TRACE_VERSION 1
+
+/*
+ * The calls a trace records, with what each of them carries:
+ *
+ *  - TRACE_APPEND: the data appended.
+ *  - TRACE_INSERT, TRACE_DELETE: the header and data of the block, and those
+ *    of the block that follows it, if any.
+ *  - TRACE_UPDATE: the header and data of the old and the new block.
+ *  - TRACE_SNAPSHOT: the sequence point returned.
+ *  - TRACE_FINAL: the digest, unless the call was asynchronous.
+ */
+#define TRACE_APPEND 1
+#define TRACE_INSERT 2
+#define TRACE_DELETE 3
+#define TRACE_UPDATE 4
+#define TRACE_SNAPSHOT 5
+#define TRACE_FINAL 6
+
+/*
+ * The data is described by its length alone, or with a 64-bit hash of it
+ * too, or stored in full, so that replaying gives the same digest.
+ */
+#define TRACE_SIZES ISHAKE_TRACE_SIZES
+#define TRACE_HASHES ISHAKE_TRACE_HASHES
+#define TRACE_DATA ISHAKE_TRACE_DATA
+
+/*
+ * The data handed over in a call. In the trace, a part is written as its
+ * length, followed by the hash or the data depending on what is recorded.
+ */
+typedef struct {
+    uint64_t length;
+    uint64_t sum;               // with TRACE_HASHES or TRACE_DATA
+    const unsigned char *data;  // with TRACE_DATA
+    uint8_t owned;              // data is a copy to free once written
+} trace_part_t;
+
+/*
+ * A call. at is when it started, in nanoseconds since the trace was
+ * created, and took how long it lasted.
+ *
+ * In the trace, a record is written as the op in one byte, the difference
+ * with the start of the previous call and its duration, then its parts, each
+ * after its header for block operations, and last the sequence point or the
+ * digest. Numbers are variable-length, seven bits per byte, and nonces are
+ * written as they are.
+ */
+typedef struct {
+    uint8_t op;
+    uint64_t at;
+    uint64_t took;
+    uint8_t parts;
+    ishake_header header[2];
+    trace_part_t part[2];
+    uint64_t seq;
+    const uint8_t *digest;      // NULL if not known
+} trace_record_t;
+
+/*
+ * A trace, either mapped into memory to be read, or open for writing. The
+ * file starts with the magic string, the version, and the parameters the
+ * hash was initialized with, in host byte order.
+ */
+typedef struct _trace_t {
+    int fd;
+    FILE *fp;
+    unsigned char *map;
+    size_t size;
+    size_t pos;
+    uint64_t count; // records read or written so far
+    uint64_t last;  // the start of the last record
+    uint64_t start; // when the trace was created, in CLOCK_MONOTONIC time
+    pthread_mutex_t lck;
+
+    // what the calls carry, and the parameters of the hash
+    uint8_t what;
+    uint8_t mode;
+    uint16_t output_len;
+    uint32_t block_size;
+    uint16_t threads;
+} trace_t;
+
+/*
+ * Open a trace to read its records, with the parameters of the hash.
+ */
+int trace_open(trace_t *t, const char *path);
+
+/*
+ * Read the next record of a trace. Its data points into the trace, and is
+ * valid until it is closed, or is NULL if it was not recorded.
+ *
+ * Returns 1 if a record was read, 0 at the end of the trace, or -1 if the
+ * record is not valid.
+ */
+int trace_next(trace_t *t, trace_record_t *r);
+
+/*
+ * Create an empty trace to write records to, or truncate an existing one.
+ * The parameters of the hash must be set already.
+ */
+int trace_create(trace_t *t, const char *path);
+
+/*
+ * Describe some data in a part, as much as the trace records of it. If the
+ * data will be gone by the time the record is written, ask for a copy.
+ */
+int trace_part(trace_t *t,
+               trace_part_t *p,
+               const unsigned char *data,
+               uint64_t length,
+               uint8_t copy);
+
+/*
+ * Write a record at the end of a trace, releasing the copies of its data.
+ * Records can be written from several threads.
+ */
+int trace_write(trace_t *t, trace_record_t *r);
+
+/*
+ * Close a trace, flushing the records written to it.
+ */
+int trace_close(trace_t *t);
+
+#endif //ISHAKE_TRACE_H
@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "treehash.h"
+#include "keccak_x4.h"
+
+// leaves hashed per thread in each batch, a multiple of KECCAK_X4_LANES
+#define TREEHASH_BATCH 32
+
+
+/*************************
+ | Sponge and cSHAKE     |
+ *************************/
+
+void sponge_init(sponge_t *s,
+                 unsigned int rate,
+                 unsigned int rounds,
+                 unsigned char suffix) {
+    KeccakP1600_StaticInitialize();
+    KeccakP1600_Initialize(s->state);
+    s->rate = rate;
+    s->rounds = rounds;
+    s->pos = 0;
+    s->suffix = suffix;
+    s->squeezing = 0;
+}
+
+
+void _sponge_permute(sponge_t *s) {
+    if (s->rounds == 12) {
+        KeccakP1600_Permute_12rounds(s->state);
+    } else {
+        KeccakP1600_Permute_24rounds(s->state);
+    }
+}
+
+
+void sponge_absorb(sponge_t *s, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        unsigned int take = s->rate - s->pos;
+        if (len < take) {
+            take = (unsigned int)len;
+        }
+        KeccakP1600_AddBytes(s->state, data, s->pos, take);
+        s->pos += take;
+        data += take;
+        len -= take;
+        if (s->pos == s->rate) {
+            _sponge_permute(s);
+            s->pos = 0;
+        }
+    }
+}
+
+
+void sponge_squeeze(sponge_t *s, uint8_t *out, size_t len) {
+    if (!s->squeezing) { // pad and switch to squeezing
+        KeccakP1600_AddByte(s->state, s->suffix, s->pos);
+        KeccakP1600_AddByte(s->state, 0x80, s->rate - 1);
+        _sponge_permute(s);
+        s->pos = 0;
+        s->squeezing = 1;
+    }
+    while (len > 0) {
+        if (s->pos == s->rate) {
+            _sponge_permute(s);
+            s->pos = 0;
+        }
+        unsigned int take = s->rate - s->pos;
+        if (len < take) {
+            take = (unsigned int)len;
+        }
+        KeccakP1600_ExtractBytes(s->state, out, s->pos, take);
+        s->pos += take;
+        out += take;
+        len -= take;
+    }
+}
+
+
+/*
+ * Encode an integer as in NIST SP 800-185, with the number of bytes used
+ * before (left_encode) or after (right_encode) it. Returns the length.
+ */
+unsigned int _encode(uint8_t *out, uint64_t x, int left) {
+    uint8_t bytes[8];
+    unsigned int n = 0;
+    do {
+        bytes[n++] = (uint8_t)(x & 0xff);
+        x >>= 8;
+    } while (x);
+
+    unsigned int o = 0;
+    if (left) out[o++] = (uint8_t)n;
+    for (unsigned int i = 0; i < n; i++) {
+        out[o++] = bytes[n - 1 - i];
+    }
+    if (!left) out[o++] = (uint8_t)n;
+    return o;
+}
+
+
+/*
+ * Encode an integer as in KangarooTwelve: the bytes needed to represent it,
+ * with no leading zeros, followed by how many they are. Returns the length.
+ */
+unsigned int _length_encode(uint8_t *out, uint64_t x) {
+    if (x == 0) {
+        out[0] = 0;
+        return 1;
+    }
+    return _encode(out, x, 0);
+}
+
+
+void cshake_init(sponge_t *s,
+                 uint16_t security,
+                 const uint8_t *N,
+                 size_t n_len,
+                 const uint8_t *S,
+                 size_t s_len) {
+    unsigned int rate = security == 256 ? 136 : 168;
+    if (n_len == 0 && s_len == 0) { // cSHAKE is just SHAKE then
+        sponge_init(s, rate, 24, 0x1F);
+        return;
+    }
+    sponge_init(s, rate, 24, 0x04);
+
+    // bytepad(encode_string(N) || encode_string(S), rate)
+    uint8_t enc[9];
+    size_t total = 0;
+    unsigned int l = _encode(enc, rate, 1);
+    sponge_absorb(s, enc, l);
+    total += l;
+    l = _encode(enc, (uint64_t)n_len * 8, 1);
+    sponge_absorb(s, enc, l);
+    sponge_absorb(s, N, n_len);
+    total += l + n_len;
+    l = _encode(enc, (uint64_t)s_len * 8, 1);
+    sponge_absorb(s, enc, l);
+    sponge_absorb(s, S, s_len);
+    total += l + s_len;
+
+    uint8_t zero[168] = {0};
+    if (total % rate) {
+        sponge_absorb(s, zero, rate - total % rate);
+    }
+}
+
+
+void turboshake_init(sponge_t *s, uint16_t security, unsigned char D) {
+    sponge_init(s, security == 256 ? 136 : 168, 12, D);
+}
+
+
+/*************************
+ | Tree hashing          |
+ *************************/
+
+/*
+ * Hash count leaves of data, starting at the first one, four at a time.
+ */
+void _hash_leaves(treehash_t *th, const uint8_t *data, size_t len,
+                  uint64_t first, uint64_t count) {
+    unsigned int rate = th->security == 256 ? 136 : 168;
+    unsigned int rounds = th->type == TREEHASH_KANGAROOTWELVE ? 12 : 24;
+    unsigned char suffix = th->type == TREEHASH_KANGAROOTWELVE ? 0x0B : 0x1F;
+
+    for (uint64_t i = first; i < first + count; i += KECCAK_X4_LANES) {
+        const uint8_t *seg[KECCAK_X4_LANES];
+        const uint8_t **in[KECCAK_X4_LANES];
+        size_t seg_len[KECCAK_X4_LANES];
+        const size_t *len_p[KECCAK_X4_LANES];
+        unsigned int n[KECCAK_X4_LANES];
+        uint8_t *out[KECCAK_X4_LANES];
+
+        unsigned int lanes = 0;
+        for (uint64_t j = i; j < first + count &&
+                             lanes < KECCAK_X4_LANES; j++, lanes++) {
+            size_t offset = (size_t)j * th->leaf;
+            seg[lanes] = data + offset;
+            seg_len[lanes] = len - offset < th->leaf ? len - offset : th->leaf;
+            in[lanes] = &seg[lanes];
+            len_p[lanes] = &seg_len[lanes];
+            n[lanes] = 1;
+            out[lanes] = th->cv + j * th->cv_len;
+        }
+        keccak_x4_hash(rate, rounds, suffix, lanes, in, len_p, n, out,
+                       th->cv_len);
+    }
+}
+
+
+/*
+ * Get the range of leaves of the current batch that corresponds to the given
+ * thread (the caller is the first one). Returns zero if there's none.
+ */
+int _range(treehash_t *th, uint16_t t, uint64_t *first, uint64_t *count) {
+    *first = (uint64_t)t * th->per_thread;
+    if (*first >= th->batch_leaves) {
+        return 0;
+    }
+    *count = th->batch_leaves - *first < th->per_thread ?
+             th->batch_leaves - *first : th->per_thread;
+    return 1;
+}
+
+
+/*
+ * A worker of the pool: wait for a batch, hash its range, and tell when
+ * done, until the tree hash is cleaned up.
+ */
+void *_treehash_worker(void *arg) {
+    treehash_worker_t *w = (treehash_worker_t *) arg;
+    treehash_t *th = w->th;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&th->lck);
+    while (1) {
+        while (!th->stop && th->round == seen) {
+            pthread_cond_wait(&th->batch_ready, &th->lck);
+        }
+        if (th->stop) {
+            break;
+        }
+        seen = th->round;
+
+        // the batch may change as soon as we are done, so take it now
+        uint64_t first, count;
+        const uint8_t *data = th->batch;
+        size_t len = th->batch_len;
+        if (!_range(th, w->index + 1, &first, &count)) {
+            continue; // nothing for us this time
+        }
+        pthread_mutex_unlock(&th->lck);
+
+        _hash_leaves(th, data, len, first, count);
+
+        pthread_mutex_lock(&th->lck);
+        if (--th->pending == 0) {
+            pthread_cond_signal(&th->batch_done);
+        }
+    }
+    pthread_mutex_unlock(&th->lck);
+    return NULL;
+}
+
+
+/*
+ * Hash the leaves in data (the last one may be shorter) and absorb their
+ * chaining values into the final node.
+ */
+void _leaves(treehash_t *th, const uint8_t *data, size_t len) {
+    uint64_t count = (len + th->leaf - 1) / th->leaf;
+    if (count == 0) {
+        return;
+    }
+
+    uint16_t threads = th->started + 1;
+    uint64_t per = (count + threads - 1) / threads;
+    per = (per + KECCAK_X4_LANES - 1) / KECCAK_X4_LANES * KECCAK_X4_LANES;
+
+    // hand the batch over to the pool
+    pthread_mutex_lock(&th->lck);
+    th->batch = data;
+    th->batch_len = len;
+    th->batch_leaves = count;
+    th->per_thread = per;
+    th->pending = (uint16_t)((count + per - 1) / per - 1);
+    if (th->pending) {
+        th->round++;
+        pthread_cond_broadcast(&th->batch_ready);
+    }
+    pthread_mutex_unlock(&th->lck);
+
+    uint64_t first = 0, mine = 0;
+    _range(th, 0, &first, &mine);
+    _hash_leaves(th, data, len, first, mine); // we work too
+
+    pthread_mutex_lock(&th->lck);
+    while (th->pending) {
+        pthread_cond_wait(&th->batch_done, &th->lck);
+    }
+    pthread_mutex_unlock(&th->lck);
+
+    sponge_absorb(&th->final, th->cv, (size_t)count * th->cv_len);
+    th->leaves += count;
+}
+
+
+int treehash_init(treehash_t *th,
+                  uint8_t type,
+                  uint16_t security,
+                  size_t leaf,
+                  const uint8_t *custom,
+                  size_t custom_len,
+                  uint16_t threads) {
+    if (th == NULL) {
+        return -1;
+    }
+    th->type = type;
+    th->security = security;
+    th->threads = threads;
+    th->cv_len = security / 4;
+    th->leaves = 0;
+    th->tree = 0;
+    th->buf_len = 0;
+    th->custom = NULL;
+    th->custom_len = 0;
+    th->buf = NULL;
+    th->cv = NULL;
+    th->workers = NULL;
+    th->started = 0;
+    th->round = 0;
+    th->pending = 0;
+    th->stop = 0;
+    pthread_mutex_init(&th->lck, NULL);
+    pthread_cond_init(&th->batch_ready, NULL);
+    pthread_cond_init(&th->batch_done, NULL);
+    if (security != 128 && security != 256) {
+        return -1;
+    }
+
+    uint8_t enc[9];
+    switch (type) {
+        case TREEHASH_PARALLELHASH:
+            if (leaf == 0) {
+                return -1;
+            }
+            th->leaf = leaf;
+            cshake_init(&th->final, security, (uint8_t *)"ParallelHash", 12,
+                        custom, custom_len);
+            sponge_absorb(&th->final, enc, _encode(enc, leaf, 1));
+            break;
+        case TREEHASH_KANGAROOTWELVE:
+            th->leaf = K12_CHUNK_SIZE;
+            turboshake_init(&th->final, security, 0x06);
+            if (custom_len) { // appended to the message at the end
+                th->custom = malloc(custom_len);
+                if (th->custom == NULL) {
+                    return -1;
+                }
+                memcpy(th->custom, custom, custom_len);
+                th->custom_len = custom_len;
+            }
+            break;
+        default:
+            return -1;
+    }
+
+    size_t batch = (size_t)TREEHASH_BATCH * (threads > 1 ? threads : 1);
+    th->buf_cap = batch * th->leaf;
+    th->buf = malloc(th->buf_cap);
+    th->cv = malloc(batch * th->cv_len);
+    if (th->buf == NULL || th->cv == NULL) {
+        return -1;
+    }
+
+    // the caller hashes its share of every batch, so one thread less
+    if (threads > 1) {
+        th->workers = calloc(threads - 1, sizeof(treehash_worker_t));
+        if (th->workers == NULL) {
+            return -1;
+        }
+        for (; th->started < threads - 1; th->started++) {
+            treehash_worker_t *w = &th->workers[th->started];
+            w->th = th;
+            w->index = th->started;
+            if (pthread_create(&w->thread, NULL, _treehash_worker, w)) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+int treehash_update(treehash_t *th, const uint8_t *data, size_t len) {
+    if (th == NULL || (data == NULL && len)) {
+        return -1;
+    }
+
+    while (len > 0) {
+        // KangarooTwelve: the first chunk goes into the final node untouched
+        size_t cap = th->type == TREEHASH_KANGAROOTWELVE && !th->tree ?
+                     K12_CHUNK_SIZE : th->buf_cap;
+        if (th->buf_len == cap) {
+            if (cap == K12_CHUNK_SIZE && !th->tree) {
+                // there's more than one chunk, so we are building a tree
+                const uint8_t marker[8] = {0x03, 0, 0, 0, 0, 0, 0, 0};
+                sponge_absorb(&th->final, th->buf, K12_CHUNK_SIZE);
+                sponge_absorb(&th->final, marker, sizeof(marker));
+                th->tree = 1;
+            } else {
+                _leaves(th, th->buf, th->buf_len);
+            }
+            th->buf_len = 0;
+            continue;
+        }
+
+        size_t take = cap - th->buf_len < len ? cap - th->buf_len : len;
+        memcpy(th->buf + th->buf_len, data, take);
+        th->buf_len += take;
+        data += take;
+        len -= take;
+    }
+    return 0;
+}
+
+
+int treehash_final(treehash_t *th, uint8_t *out, size_t outlen) {
+    if (th == NULL || out == NULL) {
+        return -1;
+    }
+    uint8_t enc[9];
+
+    if (th->type == TREEHASH_PARALLELHASH) {
+        _leaves(th, th->buf, th->buf_len);
+        sponge_absorb(&th->final, enc, _encode(enc, th->leaves, 0));
+        sponge_absorb(&th->final, enc, _encode(enc, (uint64_t)outlen * 8, 0));
+        sponge_squeeze(&th->final, out, outlen);
+        return 0;
+    }
+
+    // KangarooTwelve: C || length_encode(|C|) is the end of the message
+    treehash_update(th, th->custom, th->custom_len);
+    treehash_update(th, enc, _length_encode(enc, th->custom_len));
+
+    if (!th->tree) { // a single node
+        th->final.suffix = 0x07;
+        sponge_absorb(&th->final, th->buf, th->buf_len);
+    } else {
+        const uint8_t end[2] = {0xFF, 0xFF};
+        _leaves(th, th->buf, th->buf_len);
+        sponge_absorb(&th->final, enc, _length_encode(enc, th->leaves));
+        sponge_absorb(&th->final, end, sizeof(end));
+    }
+    sponge_squeeze(&th->final, out, outlen);
+    return 0;
+}
+
+
+void treehash_cleanup(treehash_t *th) {
+    pthread_mutex_lock(&th->lck);
+    th->stop = 1;
+    pthread_cond_broadcast(&th->batch_ready);
+    pthread_mutex_unlock(&th->lck);
+    for (uint16_t i = 0; i < th->started; i++) {
+        pthread_join(th->workers[i].thread, NULL);
+    }
+    pthread_mutex_destroy(&th->lck);
+    pthread_cond_destroy(&th->batch_ready);
+    pthread_cond_destroy(&th->batch_done);
+
+    free(th->workers);
+    free(th->buf);
+    free(th->cv);
+    free(th->custom);
+    free(th);
+}
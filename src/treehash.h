@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#include "KeccakP-1600-SnP.h"
+
+#ifndef ISHAKE_TREEHASH_H
+#define ISHAKE_TREEHASH_H
+
+#define TREEHASH_PARALLELHASH 0
+#define TREEHASH_KANGAROOTWELVE 1
+
+// size of the chunks KangarooTwelve splits its input in
+#define K12_CHUNK_SIZE 8192
+
+/*
+ * A Keccak-p[1600] sponge with a configurable number of rounds, enough to
+ * build cSHAKE (24 rounds) and TurboSHAKE (12 rounds) on top of it.
+ */
+typedef struct {
+    unsigned char state[KeccakP1600_stateSizeInBytes]
+        __attribute__((aligned(KeccakP1600_stateAlignment)));
+    unsigned int rate;
+    unsigned int rounds;
+    unsigned int pos;
+    unsigned char suffix;
+    uint8_t squeezing;
+} sponge_t;
+
+/*
+ * A thread hashing leaves for a tree hash, with its position in the pool.
+ */
+typedef struct {
+    struct _treehash_t *th;
+    pthread_t thread;
+    uint16_t index;
+} treehash_worker_t;
+
+/*
+ * A parallel tree hash, either ParallelHash from NIST SP 800-185 or
+ * KangarooTwelve. Leaves are hashed in batches by a number of threads, four
+ * of them at a time per thread, and their chaining values are absorbed in
+ * order by the final node. The threads are started once, and wait for the
+ * next batch between one and the next.
+ */
+typedef struct _treehash_t {
+    uint8_t type;
+    uint16_t security;
+    uint16_t threads;
+    sponge_t final;
+    size_t leaf;
+    unsigned int cv_len;
+    uint8_t *buf;
+    size_t buf_len;
+    size_t buf_cap;
+    uint8_t *cv;
+    uint64_t leaves;
+    uint8_t tree;
+    uint8_t *custom;
+    size_t custom_len;
+
+    // worker pool, and the batch being hashed
+    treehash_worker_t *workers;
+    uint16_t started;
+    pthread_mutex_t lck;
+    pthread_cond_t batch_ready;
+    pthread_cond_t batch_done;
+    uint64_t round;
+    uint16_t pending;
+    uint8_t stop;
+    const uint8_t *batch;
+    size_t batch_len;
+    uint64_t batch_leaves;
+    uint64_t per_thread;
+} treehash_t;
+
+/*
+ * Sponge primitives. suffix holds the domain separation bits, and the
+ * permutation runs the given number of rounds (12 or 24).
+ */
+void sponge_init(sponge_t *s,
+                 unsigned int rate,
+                 unsigned int rounds,
+                 unsigned char suffix);
+void sponge_absorb(sponge_t *s, const uint8_t *data, size_t len);
+void sponge_squeeze(sponge_t *s, uint8_t *out, size_t len);
+
+/*
+ * Initialize a sponge as cSHAKE128 or cSHAKE256 (security is 128 or 256),
+ * with function name N and customization string S.
+ */
+void cshake_init(sponge_t *s,
+                 uint16_t security,
+                 const uint8_t *N,
+                 size_t n_len,
+                 const uint8_t *S,
+                 size_t s_len);
+
+/*
+ * Initialize a sponge as TurboSHAKE128 or TurboSHAKE256, with domain
+ * separation byte D (0x1F when there's no need to separate domains).
+ */
+void turboshake_init(sponge_t *s, uint16_t security, unsigned char D);
+
+/*
+ * Initialize a tree hash. For ParallelHash, leaf is the block size B and
+ * custom the customization string S. For KangarooTwelve (KT128 or KT256
+ * depending on security), leaf is ignored and custom is the customization
+ * string C. threads can be zero to hash everything in the calling thread,
+ * and otherwise all but one of them are started here.
+ */
+int treehash_init(treehash_t *th,
+                  uint8_t type,
+                  uint16_t security,
+                  size_t leaf,
+                  const uint8_t *custom,
+                  size_t custom_len,
+                  uint16_t threads);
+
+/*
+ * Absorb data into a tree hash.
+ */
+int treehash_update(treehash_t *th, const uint8_t *data, size_t len);
+
+/*
+ * Finish a tree hash, writing outlen bytes of output.
+ */
+int treehash_final(treehash_t *th, uint8_t *out, size_t outlen);
+
+/*
+ * Release the resources of a tree hash, including the structure itself.
+ */
+void treehash_cleanup(treehash_t *th);
+
+#endif //ISHAKE_TREEHASH_H
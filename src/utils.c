@@ -96,6 +96,13 @@ uint64_t swap_uint64(uint_fast64_t val)
     return (val << 32) | (val >> 32);
 }
 
+uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
 void resolve_file_path(char **path, char *dirname, char *filename) {
     char *p;
     size_t d_l = strlen(dirname);
@@ -47,6 +47,12 @@ void uint64_t2uint8_t(uint8_t *output, uint64_t *data, unsigned long len);
  */
 uint64_t swap_uint64(uint64_t val);
 
+/*
+ * Get the next number from a SplitMix64 pseudo-random generator with the
+ * given state. Fast, but not suitable for cryptographic purposes.
+ */
+uint64_t splitmix64(uint64_t *state);
+
 /*
  * Return the full path to a file located in dirname with name filename.
  *
@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../src/ishake_doc.h"
+
+// the size of the blocks in the documents, by default
+#define DOC_BLOCK_SIZE 80
+
+// random operations applied to each document, by default
+#define DOC_OPS 20000
+
+// the largest document, in blocks
+#define DOC_MAX_BLOCKS 512
+
+#define OP_INSERT 0
+#define OP_DELETE 1
+#define OP_UPDATE 2
+#define OP_MOVE 3
+#define OP_SPLIT 4
+#define OP_MERGE 5
+
+
+/*
+ * The model of a document: its blocks in order, with their nonces and data,
+ * kept apart from ishake_doc_t to rebuild it from scratch.
+ */
+typedef struct {
+    uint64_t nonce;
+    uint32_t len;
+    unsigned char *data;
+} model_block_t;
+
+typedef struct {
+    model_block_t *blocks;
+    uint64_t count;
+    uint32_t max_data_len;
+} model_t;
+
+
+uint64_t rnd_state = 88172645463325252ULL;
+
+uint64_t rnd(void) {
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state;
+}
+
+
+void random_data(unsigned char *data, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        data[i] = (unsigned char)rnd();
+    }
+}
+
+
+/*
+ * Make room for a block at position pos of the model, and return it.
+ */
+model_block_t *model_open(model_t *m, uint64_t pos) {
+    memmove(&m->blocks[pos + 1], &m->blocks[pos],
+            (m->count - pos) * sizeof(model_block_t));
+    m->count++;
+    m->blocks[pos].data = malloc(m->max_data_len);
+    return &m->blocks[pos];
+}
+
+
+/*
+ * Remove the block at position pos of the model, without freeing its data.
+ */
+model_block_t model_take(model_t *m, uint64_t pos) {
+    model_block_t b = m->blocks[pos];
+    memmove(&m->blocks[pos], &m->blocks[pos + 1],
+            (m->count - pos - 1) * sizeof(model_block_t));
+    m->count--;
+    return b;
+}
+
+
+/*
+ * Apply a random operation to both the document and its model. Returns the
+ * operation applied, or -1 if the document failed to apply it.
+ */
+int random_op(ishake_doc_t *doc, model_t *m, uint64_t max_blocks) {
+    int op = (int)(rnd() % 6);
+    if (m->count < 2 || (m->count < max_blocks && op == OP_MERGE &&
+                         rnd() % 2)) {
+        op = OP_INSERT; // keep the document from running out of blocks
+    } else if (m->count >= max_blocks &&
+               (op == OP_INSERT || op == OP_SPLIT)) {
+        op = OP_DELETE;
+    }
+
+    uint64_t pos = rnd() % m->count;
+    switch (op) {
+        case OP_INSERT: {
+            pos = rnd() % (m->count + 1);
+            uint32_t len = 1 + (uint32_t)(rnd() % m->max_data_len);
+            unsigned char *data = malloc(len);
+            uint64_t nonce = 0;
+            random_data(data, len);
+            if (ishake_doc_insert_at(doc, pos, data, len, &nonce)) {
+                free(data);
+                return -1;
+            }
+            model_block_t *b = model_open(m, pos);
+            memcpy(b->data, data, len);
+            b->len = len;
+            b->nonce = nonce;
+            free(data);
+            break;
+        }
+        case OP_DELETE: {
+            if (ishake_doc_delete_at(doc, pos)) {
+                return -1;
+            }
+            free(model_take(m, pos).data);
+            break;
+        }
+        case OP_UPDATE: {
+            model_block_t *b = &m->blocks[pos];
+            uint32_t len = (uint32_t)(rnd() % (m->max_data_len + 1));
+            unsigned char *data = malloc(len + 1);
+            random_data(data, len);
+            if (ishake_doc_update_at(doc, pos, data, len)) {
+                free(data);
+                return -1;
+            }
+            memcpy(b->data, data, len);
+            b->len = len;
+            free(data);
+            break;
+        }
+        case OP_MOVE: {
+            uint64_t to = rnd() % m->count;
+            if (ishake_doc_move(doc, pos, to)) {
+                return -1;
+            }
+            model_block_t b = model_take(m, pos);
+            memmove(&m->blocks[to + 1], &m->blocks[to],
+                    (m->count - to) * sizeof(model_block_t));
+            m->blocks[to] = b;
+            m->count++;
+            break;
+        }
+        case OP_SPLIT: {
+            model_block_t *b = &m->blocks[pos];
+            if (b->len < 2) {
+                return OP_SPLIT; // nothing to split
+            }
+            uint32_t offset = 1 + (uint32_t)(rnd() % (b->len - 1));
+            if (ishake_doc_split(doc, pos, offset)) {
+                return -1;
+            }
+            model_block_t *second = model_open(m, pos + 1);
+            b = &m->blocks[pos];
+            second->len = b->len - offset;
+            memcpy(second->data, b->data + offset, second->len);
+            b->len = offset;
+            if (ishake_doc_nonce(doc, pos + 1, &second->nonce)) {
+                return -1;
+            }
+            break;
+        }
+        case OP_MERGE: {
+            pos = rnd() % (m->count - 1);
+            model_block_t *b = &m->blocks[pos];
+            if (b->len + m->blocks[pos + 1].len > m->max_data_len) {
+                // too large, the document must refuse it
+                return ishake_doc_merge(doc, pos) ? OP_MERGE : -1;
+            }
+            if (ishake_doc_merge(doc, pos)) {
+                return -1;
+            }
+            model_block_t next = model_take(m, pos + 1);
+            memcpy(b->data + b->len, next.data, next.len);
+            b->len += next.len;
+            free(next.data);
+            break;
+        }
+    }
+    return op;
+}
+
+
+/*
+ * Check that the nonce index of the document agrees with the model.
+ */
+int check_positions(ishake_doc_t *doc, model_t *m) {
+    for (uint64_t i = 0; i < m->count; i++) {
+        uint64_t nonce, pos;
+        if (ishake_doc_nonce(doc, i, &nonce) || nonce != m->blocks[i].nonce ||
+            ishake_doc_position(doc, nonce, &pos) || pos != i) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Build a document from scratch with the blocks in the model, reusing their
+ * nonces, and get its digest.
+ */
+int rebuild(model_t *m, uint32_t block_size, uint16_t bits,
+            uint16_t threads, uint8_t *digest) {
+    ishake_doc_t *doc = malloc(sizeof(ishake_doc_t));
+    if (ishake_doc_init(doc, block_size, bits, threads)) {
+        free(doc);
+        return -1;
+    }
+    for (uint64_t i = 0; i < m->count; i++) {
+        uint64_t nonce = m->blocks[i].nonce;
+        if (ishake_doc_insert_at(doc, i, m->blocks[i].data, m->blocks[i].len,
+                                 &nonce)) {
+            ishake_doc_cleanup(doc);
+            return -1;
+        }
+    }
+    int r = ishake_doc_final(doc, digest);
+    ishake_doc_cleanup(doc);
+    return r;
+}
+
+
+void usage(char *program) {
+    printf("Usage:\t%s [--block-size N] [--ops N] [--threads N] "
+                   "[--seed N]\n\n", program);
+    printf("\t--block-size\tThe size in bytes of the blocks. Defaults to %d."
+                   "\n", DOC_BLOCK_SIZE);
+    printf("\t--ops\t\tThe number of random operations to apply. Defaults "
+                   "to %d.\n", DOC_OPS);
+    printf("\t--threads\tThe number of threads to use, besides running "
+                   "without threads. Defaults to the number of CPUs "
+                   "available.\n");
+    printf("\t--seed\t\tThe seed of the random operations.\n");
+    exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Write a message to stderr and exit.
+ */
+void panic(char *program, char *format, int argc, ...) {
+    va_list valist;
+    va_start(valist, argc);
+
+    fprintf(stderr, "%s: ", program);
+    if (argc > 0) {
+        vfprintf(stderr, format, valist);
+    } else {
+        fprintf(stderr, "%s\n", format);
+    }
+
+    usage(program);
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[]) {
+    uint32_t block_size = DOC_BLOCK_SIZE, ops = DOC_OPS;
+    uint16_t bits = 2688;
+    long thrno = affinity_cpus();
+    uint64_t seed = rnd_state;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--help", argv[i]) == 0) {
+            usage(argv[0]);
+        }
+        if (i == argc - 1) {
+            panic(argv[0], "unknown option '%s', or it needs a value.\n", 1,
+                  argv[i]);
+        }
+        unsigned long v = strtoul(argv[i + 1], NULL, 10);
+        if (strcmp("--block-size", argv[i]) == 0) {
+            block_size = (uint32_t)v;
+        } else if (strcmp("--ops", argv[i]) == 0) {
+            ops = (uint32_t)v;
+        } else if (strcmp("--threads", argv[i]) == 0) {
+            thrno = (long)v;
+        } else if (strcmp("--seed", argv[i]) == 0) {
+            seed = (uint64_t)v;
+        } else {
+            panic(argv[0], "unknown option '%s'\n", 1, argv[i]);
+        }
+        i++; // two arguments consumed, advance the pointer!
+    }
+    if (block_size <= 17 || thrno < 1 || seed == 0) {
+        panic(argv[0], "the block size must be larger than 17 bytes, and "
+                "there must be at least a thread and a non-zero seed.", 0);
+    }
+
+    uint8_t *digest = malloc(bits / 8), *expected = malloc(bits / 8);
+    const char *names[] = {"insert", "delete", "update", "move", "split",
+                           "merge"};
+    int failed = 0;
+
+    uint16_t configs[2] = {0, (uint16_t)thrno};
+    for (int c = 0; c < 2; c++) {
+        uint16_t threads = configs[c];
+        uint64_t applied[6] = {0};
+        rnd_state = seed; // the same operations with and without threads
+
+        ishake_doc_t *doc = malloc(sizeof(ishake_doc_t));
+        if (ishake_doc_init(doc, block_size, bits, threads)) {
+            panic(argv[0], "cannot initialize the document.", 0);
+        }
+        model_t m;
+        m.max_data_len = block_size - 16;
+        m.blocks = calloc(DOC_MAX_BLOCKS + 1, sizeof(model_block_t));
+        m.count = 0;
+
+        for (uint32_t i = 0; i < ops; i++) {
+            int op = random_op(doc, &m, DOC_MAX_BLOCKS);
+            if (op < 0) {
+                fprintf(stderr, "%s: operation %u failed\n", argv[0], i);
+                failed = 1;
+                break;
+            }
+            applied[op]++;
+        }
+        if (!failed && check_positions(doc, &m)) {
+            fprintf(stderr, "%s: the nonce index does not match the "
+                    "document\n", argv[0]);
+            failed = 1;
+        }
+
+        // rebuild it with and without threads: nonces are random, so the
+        // documents of both runs are not the same
+        int match = 1;
+        if (ishake_doc_final(doc, digest)) {
+            panic(argv[0], "cannot hash the document.", 0);
+        }
+        for (int r = 0; r < 2; r++) {
+            if (rebuild(&m, block_size, bits, configs[r], expected)) {
+                panic(argv[0], "cannot hash the document.", 0);
+            }
+            match = match && memcmp(digest, expected, bits / 8) == 0;
+        }
+        failed = failed || !match;
+
+        printf("threads %u, %lu blocks:", threads, (unsigned long)m.count);
+        for (int o = 0; o < 6; o++) {
+            printf(" %s %lu", names[o], (unsigned long)applied[o]);
+        }
+        printf(", digest %s\n", match ? "OK" : "MISMATCH");
+
+        ishake_doc_cleanup(doc);
+        for (uint64_t i = 0; i < m.count; i++) {
+            free(m.blocks[i].data);
+        }
+        free(m.blocks);
+    }
+
+    free(digest);
+    free(expected);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
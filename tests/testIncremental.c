@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/ishake.h"
+
+// the size of the blocks in the documents, by default
+#define INCR_BLOCK_SIZE 1024
+
+// operations of each type measured on every document, by default
+#define INCR_OPS 1000
+
+// the largest document, in blocks, by default
+#define INCR_MAX_BLOCKS 1000000
+
+#define OP_UPDATE 0
+#define OP_INSERT 1
+#define OP_DELETE 2
+
+
+/*
+ * A document in FULL mode: a chain of blocks, linked by their nonces, and the
+ * version of the data of each block. The data of a block is generated from
+ * its nonce and version, so it does not need to be kept.
+ */
+typedef struct {
+    uint32_t *next;
+    uint32_t *prev;
+    uint8_t *version;
+    uint32_t head;
+    uint32_t count;
+    uint32_t nonces; // nonces used so far
+    uint32_t cap;
+    uint32_t data_len;
+} doc_t;
+
+
+double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+uint64_t rnd_state = 88172645463325252ULL;
+
+uint64_t rnd(void) {
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state;
+}
+
+
+/*
+ * Build a block of a document, ready to be handed over to iSHAKE.
+ */
+ishake_block_t *make_block(doc_t *doc, uint32_t nonce, uint32_t prev,
+                           uint8_t version) {
+    ishake_block_t *b = malloc(sizeof(ishake_block_t));
+    b->data = malloc(doc->data_len);
+    b->data_len = doc->data_len;
+    b->header.length = 16;
+    b->header.value.nonce.nonce = nonce;
+    b->header.value.nonce.prev = prev;
+
+    uint64_t x = ((uint64_t)nonce << 8 | version) * 0x9E3779B97F4A7C15ULL + 1;
+    for (uint32_t i = 0; i + 8 <= doc->data_len; i += 8) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(b->data + i, &x, 8);
+    }
+    memset(b->data + (doc->data_len & ~7U), 0, doc->data_len & 7U);
+    return b;
+}
+
+
+void doc_init(doc_t *doc, uint32_t blocks, uint32_t extra, uint32_t data_len) {
+    doc->cap = blocks + extra + 1;
+    doc->next = calloc(doc->cap, sizeof(uint32_t));
+    doc->prev = calloc(doc->cap, sizeof(uint32_t));
+    doc->version = calloc(doc->cap, sizeof(uint8_t));
+    doc->data_len = data_len;
+    doc->count = blocks;
+    doc->nonces = blocks;
+    doc->head = blocks ? 1 : 0;
+    for (uint32_t n = 1; n <= blocks; n++) {
+        doc->prev[n] = n - 1;
+        doc->next[n] = n < blocks ? n + 1 : 0;
+    }
+}
+
+
+void doc_free(doc_t *doc) {
+    free(doc->next);
+    free(doc->prev);
+    free(doc->version);
+}
+
+
+/*
+ * Pick a random block still in the document.
+ */
+uint32_t doc_pick(doc_t *doc) {
+    while (1) {
+        uint32_t n = (uint32_t)(rnd() % doc->nonces) + 1;
+        if (n == doc->head || doc->prev[n] != 0) {
+            return n;
+        }
+    }
+}
+
+
+/*
+ * Wait for the workers to hash every block handed over.
+ */
+void wait_workers(ishake_t *is) {
+    while (is->thrd_no > 0 && ishake_pending(is) > 0) {
+        sched_yield();
+    }
+}
+
+
+/*
+ * Hash a whole document from scratch, and get the time it took.
+ */
+double full_hash(doc_t *doc, uint32_t block_size, uint16_t bits,
+                 uint16_t threads, uint8_t *digest) {
+    ishake_t *is = malloc(sizeof(ishake_t));
+    double t = now_ns();
+    if (ishake_init(is, block_size, bits, ISHAKE_FULL_MODE, threads)) {
+        fprintf(stderr, "ishake_init() failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t n = doc->head; n != 0; n = doc->next[n]) {
+        ishake_insert(is, make_block(doc, n, doc->prev[n], doc->version[n]),
+                      NULL);
+    }
+    ishake_final(is, digest);
+    t = now_ns() - t;
+    ishake_cleanup(is);
+    return t;
+}
+
+
+/*
+ * Prepare the blocks for an operation on a random block of the document, and
+ * update the document as if it was done.
+ */
+void prepare_op(doc_t *doc, int op, ishake_block_t **a, ishake_block_t **b) {
+    uint32_t n = doc_pick(doc), p = doc->prev[n], next = doc->next[n];
+    *b = NULL;
+    switch (op) {
+        case OP_UPDATE:
+            *a = make_block(doc, n, p, doc->version[n]);
+            *b = make_block(doc, n, p, ++doc->version[n]);
+            break;
+        case OP_INSERT: { // a new block right after n
+            uint32_t m = ++doc->nonces;
+            *a = make_block(doc, m, n, 0);
+            if (next) {
+                *b = make_block(doc, next, n, doc->version[next]);
+                doc->prev[next] = m;
+            }
+            doc->prev[m] = n;
+            doc->next[m] = next;
+            doc->next[n] = m;
+            doc->count++;
+            break;
+        }
+        case OP_DELETE:
+            *a = make_block(doc, n, p, doc->version[n]);
+            if (next) {
+                *b = make_block(doc, next, n, doc->version[next]);
+                doc->prev[next] = p;
+            }
+            if (p) {
+                doc->next[p] = next;
+            } else {
+                doc->head = next;
+            }
+            doc->prev[n] = 0;
+            doc->next[n] = 0;
+            doc->count--;
+            break;
+    }
+}
+
+
+int run_op(ishake_t *is, int op, ishake_block_t *a, ishake_block_t *b) {
+    switch (op) {
+        case OP_UPDATE:
+            return ishake_update(is, a, b);
+        case OP_INSERT:
+            return ishake_insert(is, a, b);
+        default:
+            return ishake_delete(is, a, b);
+    }
+}
+
+
+int double_cmp(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Measure the latency of ops operations of a type, one at a time and
+ * waiting for each of them to be hashed, and then the throughput of as
+ * many more, handed over back to back.
+ */
+void measure_op(ishake_t *is, doc_t *doc, int op, uint32_t ops,
+                double *p50, double *p99, double *rate) {
+    double *lat = malloc(ops * sizeof(double));
+    ishake_block_t **a = malloc(ops * sizeof(ishake_block_t *));
+    ishake_block_t **b = malloc(ops * sizeof(ishake_block_t *));
+
+    for (uint32_t i = 0; i < ops; i++) {
+        prepare_op(doc, op, &a[0], &b[0]);
+        double t = now_ns();
+        run_op(is, op, a[0], b[0]);
+        wait_workers(is);
+        lat[i] = now_ns() - t;
+    }
+    qsort(lat, ops, sizeof(double), double_cmp);
+    *p50 = lat[ops / 2];
+    *p99 = lat[(uint32_t)(ops * 0.99)];
+
+    for (uint32_t i = 0; i < ops; i++) {
+        prepare_op(doc, op, &a[i], &b[i]);
+    }
+    double t = now_ns();
+    for (uint32_t i = 0; i < ops; i++) {
+        run_op(is, op, a[i], b[i]);
+    }
+    wait_workers(is);
+    *rate = ops / ((now_ns() - t) / 1e9);
+
+    free(lat);
+    free(a);
+    free(b);
+}
+
+
+/*
+ * Print help on how to use this program and exit.
+ */
+void usage(char *program) {
+    printf("Usage:\t%s [--block-size N] [--ops N] [--max-blocks N] "
+                   "[--threads N]\n\n", program);
+    printf("\t--block-size\tThe size in bytes of the blocks. Defaults to %d."
+                   "\n", INCR_BLOCK_SIZE);
+    printf("\t--ops\t\tThe number of operations of each type to measure. "
+                   "Defaults to %d.\n", INCR_OPS);
+    printf("\t--max-blocks\tThe size of the largest document, in blocks. "
+                   "Documents of 1000 blocks and every power of ten up to "
+                   "this are measured. Defaults to %d.\n", INCR_MAX_BLOCKS);
+    printf("\t--threads\tThe number of threads to use, besides measuring "
+                   "without threads. Defaults to the number of CPUs "
+                   "available.\n");
+    exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Write a message to stderr and exit.
+ */
+void panic(char *program, char *format, int argc, ...) {
+    va_list valist;
+    va_start(valist, argc);
+
+    fprintf(stderr, "%s: ", program);
+    if (argc > 0) {
+        vfprintf(stderr, format, valist);
+    } else {
+        fprintf(stderr, "%s\n", format);
+    }
+
+    usage(program);
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[]) {
+    uint32_t block_size = INCR_BLOCK_SIZE, ops = INCR_OPS;
+    uint32_t max_blocks = INCR_MAX_BLOCKS;
+    uint16_t bits = 2688;
+    long thrno = affinity_cpus();
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--help", argv[i]) == 0) {
+            usage(argv[0]);
+        }
+        if (i == argc - 1) {
+            panic(argv[0], "unknown option '%s', or it needs a value.\n", 1,
+                  argv[i]);
+        }
+        unsigned long v = strtoul(argv[i + 1], NULL, 10);
+        if (strcmp("--block-size", argv[i]) == 0) {
+            block_size = (uint32_t)v;
+        } else if (strcmp("--ops", argv[i]) == 0) {
+            ops = (uint32_t)v;
+        } else if (strcmp("--max-blocks", argv[i]) == 0) {
+            max_blocks = (uint32_t)v;
+        } else if (strcmp("--threads", argv[i]) == 0) {
+            thrno = (long)v;
+        } else {
+            panic(argv[0], "unknown option '%s'\n", 1, argv[i]);
+        }
+        i++; // two arguments consumed, advance the pointer!
+    }
+    if (block_size <= 16 || ops == 0 || max_blocks < 1000 || thrno < 1) {
+        panic(argv[0], "the block size must be larger than 16 bytes, and "
+                "there must be at least one operation, a thousand blocks "
+                "and a thread.", 0);
+    }
+
+    const char *names[] = {"update", "insert", "delete"};
+    uint8_t *digest = malloc(bits / 8), *expected = malloc(bits / 8);
+    printf("Block size: %u bytes, %u operations of each type.\n\n",
+           block_size, ops);
+    printf("%10s %7s %11s %7s %11s %11s %12s %11s %7s\n", "blocks",
+           "threads", "full (ms)", "op", "p50 (us)", "p99 (us)", "ops/s",
+           "break-even", "inline");
+
+    uint16_t configs[2] = {0, (uint16_t)thrno};
+    for (int c = 0; c < 2; c++) {
+        uint16_t threads = configs[c];
+        for (uint64_t blocks = 1000; blocks <= max_blocks; blocks *= 10) {
+            doc_t doc;
+            doc_init(&doc, (uint32_t)blocks, 6 * ops, block_size - 16);
+
+            // hash the document from scratch, and keep it for the operations
+            ishake_t *is = malloc(sizeof(ishake_t));
+            double full = now_ns();
+            if (ishake_init(is, block_size, bits, ISHAKE_FULL_MODE,
+                            threads)) {
+                panic(argv[0], "cannot initialize iSHAKE.", 0);
+            }
+            for (uint32_t n = doc.head; n != 0; n = doc.next[n]) {
+                ishake_insert(is, make_block(&doc, n, doc.prev[n], 0), NULL);
+            }
+            wait_workers(is);
+            full = now_ns() - full;
+
+            for (int op = OP_UPDATE; op <= OP_DELETE; op++) {
+                double p50, p99, rate;
+                ishake_stats_t before, after;
+                ishake_stats(is, &before);
+                measure_op(is, &doc, op, ops, &p50, &p99, &rate);
+                ishake_stats(is, &after);
+
+                // the share of blocks hashed by this thread instead of workers
+                uint64_t hashed = after.inline_blocks - before.inline_blocks;
+                uint64_t all = hashed +
+                        after.bulk_blocks - before.bulk_blocks +
+                        after.large_blocks - before.large_blocks +
+                        after.busy_blocks - before.busy_blocks +
+                        after.burst_blocks - before.burst_blocks;
+                printf("%10lu %7u %11.2f %7s %11.2f %11.2f %12.0f %11.0f "
+                       "%6.1f%%\n", (unsigned long)blocks, threads,
+                       full / 1e6, names[op], p50 / 1e3, p99 / 1e3, rate,
+                       full / p50, all ? 100.0 * hashed / all : 0.0);
+            }
+
+            // the digest must be the one of the document as it is now
+            ishake_final(is, digest);
+            ishake_cleanup(is);
+            full_hash(&doc, block_size, bits, threads, expected);
+            if (memcmp(digest, expected, bits / 8) != 0) {
+                fprintf(stderr, "%s: the digest after the operations does not "
+                        "match the document.\n", argv[0]);
+                return EXIT_FAILURE;
+            }
+            doc_free(&doc);
+        }
+    }
+
+    free(digest);
+    free(expected);
+    return EXIT_SUCCESS;
+}
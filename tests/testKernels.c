@@ -0,0 +1,605 @@
+/*
+ * Copyright (c) 2016 Jaime Pérez <jaimep@stud.ntnu.no>, NTNU
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of NTNU nor the names of its contributors may be used
+ *       to endorse or promote products derived from this software without
+ *       specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL JAIME PEREZ OR NTNU BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "../src/ishake.h"
+#include "../src/utils.h"
+#include "KeccakCodePackage.h"
+
+// repetitions measured for each kernel by default, and discarded before
+#define KERNEL_REPS 31
+#define KERNEL_WARMUP 5
+
+// the least time a repetition should take, in nanoseconds
+#define KERNEL_MIN_NS 200000
+
+// the slowdown over the baseline considered a regression, in percent
+#define KERNEL_TOLERANCE 5.0
+
+// internal functions of the library that we measure on their own
+int _hash_block(ishake_t *is, ishake_block_t *block, uint64_t *hash);
+int _enqueue(ishake_t *is, ishake_producer_t *p, uint16_t q,
+             ishake_block_t *block, group_op op, uint8_t pooled);
+ishake_task_t *_dequeue(ishake_queue_t *queue);
+
+
+/*
+ * Everything the kernels work on, prepared once.
+ */
+typedef struct {
+    ishake_t *is;
+    ishake_block_t block;
+    uint16_t words;
+    uint64_t *acc;
+    uint64_t *digest;
+    uint8_t *bytes;
+    char *hex;
+    Keccak_HashInstance absorbed;
+    uint64_t sink;
+} kernel_ctx_t;
+
+/*
+ * A kernel, running its operation n times.
+ */
+typedef struct {
+    const char *name;
+    void (*run)(kernel_ctx_t *ctx, uint64_t n);
+} kernel_t;
+
+/*
+ * The hardware counters read for a repetition, or -1 for those that are not
+ * available, and the time it took.
+ */
+typedef struct {
+    double cycles;
+    double instructions;
+    double misses;
+    double ns;
+} sample_t;
+
+/*
+ * What we observed for a kernel, per operation.
+ */
+typedef struct {
+    double cycles;      // median
+    double mad;         // median absolute deviation of the cycles
+    double instructions;
+    double ipc;
+    double misses;
+} result_t;
+
+
+/*
+ * Keep the compiler from optimizing away what a kernel computes.
+ */
+#define KEEP(p) __asm__ __volatile__("" : : "r"(p) : "memory")
+
+
+void kernel_hash_block(kernel_ctx_t *ctx, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        _hash_block(ctx->is, &ctx->block, ctx->digest);
+        KEEP(ctx->digest);
+    }
+}
+
+
+void kernel_absorb(kernel_ctx_t *ctx, uint64_t n) {
+    Keccak_HashInstance k;
+    uint64_t idx = swap_uint64(ctx->block.header.value.idx);
+    for (uint64_t i = 0; i < n; i++) {
+        Keccak_HashInitialize_SHAKE128(&k);
+        Keccak_HashUpdate(&k, ctx->block.data,
+                          (DataLength)ctx->block.data_len * 8);
+        Keccak_HashUpdate(&k, (uint8_t *)&idx, 64);
+        KEEP(&k);
+    }
+}
+
+
+void kernel_squeeze(kernel_ctx_t *ctx, uint64_t n) {
+    Keccak_HashInstance k;
+    for (uint64_t i = 0; i < n; i++) {
+        memcpy(&k, &ctx->absorbed, sizeof(k));
+        Keccak_HashFinal(&k, ctx->bytes);
+        KEEP(ctx->bytes);
+    }
+}
+
+
+void kernel_combine(kernel_ctx_t *ctx, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        combine(ctx->acc, ctx->digest, ctx->words, add_mod64);
+        KEEP(ctx->acc);
+    }
+}
+
+
+void kernel_uint8_t2uint64_t(kernel_ctx_t *ctx, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        uint8_t2uint64_t(ctx->acc, ctx->bytes, (unsigned long)ctx->words * 8);
+        KEEP(ctx->acc);
+    }
+}
+
+
+void kernel_uint64_t2uint8_t(kernel_ctx_t *ctx, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t2uint8_t(ctx->bytes, ctx->digest, ctx->words);
+        KEEP(ctx->bytes);
+    }
+}
+
+
+void kernel_swap_uint64(kernel_ctx_t *ctx, uint64_t n) {
+    uint64_t x = ctx->sink;
+    for (uint64_t i = 0; i < n; i++) {
+        x = swap_uint64(x + i);
+        KEEP(x);
+    }
+    ctx->sink = x;
+}
+
+
+void kernel_bin2hex(kernel_ctx_t *ctx, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        char *hex;
+        bin2hex(&hex, ctx->bytes, (unsigned long)ctx->words * 8);
+        KEEP(hex);
+        free(hex);
+    }
+}
+
+
+void kernel_hex2bin(kernel_ctx_t *ctx, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        char *bin = malloc((size_t)ctx->words * 8);
+        hex2bin(&bin, (uint8_t *)ctx->hex, (unsigned long)ctx->words * 16);
+        KEEP(bin);
+        free(bin);
+    }
+}
+
+
+/*
+ * Push a task onto the queue of the workers, and pop it as a worker does.
+ */
+void kernel_queue(kernel_ctx_t *ctx, uint64_t n) {
+    ishake_queue_t *queue = &ctx->is->queues[0];
+    for (uint64_t i = 0; i < n; i++) {
+        _enqueue(ctx->is, &ctx->is->main, 0, &ctx->block, add_mod64, 0);
+
+        pthread_mutex_lock(&queue->lck);
+        ishake_task_t *task = _dequeue(queue);
+        pthread_mutex_unlock(&queue->lck);
+        __atomic_sub_fetch(&ctx->is->epoch_pending[task->epoch & 1], 1,
+                           __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&ctx->is->pending, 1, __ATOMIC_SEQ_CST);
+        free(task);
+    }
+}
+
+
+kernel_t kernels[] = {
+        {"hash_block", kernel_hash_block},
+        {"absorb", kernel_absorb},
+        {"squeeze", kernel_squeeze},
+        {"combine", kernel_combine},
+        {"uint8_t2uint64_t", kernel_uint8_t2uint64_t},
+        {"uint64_t2uint8_t", kernel_uint64_t2uint8_t},
+        {"swap_uint64", kernel_swap_uint64},
+        {"bin2hex", kernel_bin2hex},
+        {"hex2bin", kernel_hex2bin},
+        {"queue", kernel_queue},
+};
+
+
+/*
+ * Hardware counters for the calling thread: cycles, instructions and cache
+ * misses, read together as a group.
+ */
+typedef struct {
+    int fd[3];
+} counters_t;
+
+
+/*
+ * Open the hardware counters. Returns -1 if they are not available.
+ */
+int counters_open(counters_t *c) {
+    c->fd[0] = c->fd[1] = c->fd[2] = -1;
+#ifdef __linux__
+    uint64_t config[3] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                          PERF_COUNT_HW_CACHE_MISSES};
+    for (int i = 0; i < 3; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        c->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1,
+                                i ? c->fd[0] : -1, 0);
+        if (c->fd[i] < 0 && i == 0) {
+            return -1;
+        }
+    }
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+
+void counters_start(counters_t *c) {
+#ifdef __linux__
+    if (c->fd[0] >= 0) {
+        ioctl(c->fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(c->fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+}
+
+
+/*
+ * Stop the counters and read them into a sample.
+ */
+void counters_stop(counters_t *c, sample_t *s) {
+    s->cycles = s->instructions = s->misses = -1;
+#ifdef __linux__
+    if (c->fd[0] < 0) {
+        return;
+    }
+    ioctl(c->fd[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t values[4] = {0};
+    if (read(c->fd[0], values, sizeof(values)) < (ssize_t)sizeof(uint64_t)) {
+        return;
+    }
+
+    // values come in the order the counters were opened, skipping failures
+    double *out[3] = {&s->cycles, &s->instructions, &s->misses};
+    uint64_t v = 1;
+    for (int i = 0; i < 3 && v <= values[0]; i++) {
+        if (c->fd[i] >= 0) {
+            *out[i] = (double)values[v++];
+        }
+    }
+#endif
+}
+
+
+void counters_close(counters_t *c) {
+    for (int i = 0; i < 3; i++) {
+        if (c->fd[i] >= 0) {
+            close(c->fd[i]);
+        }
+    }
+}
+
+
+double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+int double_cmp(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+
+/*
+ * Get the median of some values, sorting them.
+ */
+double median(double *v, int n) {
+    qsort(v, (size_t)n, sizeof(double), double_cmp);
+    return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+
+/*
+ * Measure a kernel: find how many operations make a repetition long enough
+ * to be measured reliably, discard a few repetitions to warm caches and
+ * branch predictors up, and take the median of the rest, which unlike the
+ * mean or the minimum is not thrown off by interrupts or frequency changes.
+ * Without hardware counters, cycles are nanoseconds.
+ */
+void measure(kernel_t *k, kernel_ctx_t *ctx, counters_t *c, int reps,
+             result_t *r) {
+    uint64_t n = 1;
+    while (1) {
+        double t = now_ns();
+        k->run(ctx, n);
+        if (now_ns() - t >= KERNEL_MIN_NS || n >= (1ULL << 40)) {
+            break;
+        }
+        n *= 2;
+    }
+
+    double *cycles = malloc(reps * sizeof(double));
+    double *instr = malloc(reps * sizeof(double));
+    double *ipc = malloc(reps * sizeof(double));
+    double *misses = malloc(reps * sizeof(double));
+    for (int i = -KERNEL_WARMUP; i < reps; i++) {
+        sample_t s;
+        counters_start(c);
+        s.ns = now_ns();
+        k->run(ctx, n);
+        s.ns = now_ns() - s.ns;
+        counters_stop(c, &s);
+        if (i < 0) {
+            continue;
+        }
+        cycles[i] = (s.cycles >= 0 ? s.cycles : s.ns) / n;
+        instr[i] = s.instructions >= 0 ? s.instructions / n : -1;
+        ipc[i] = s.instructions >= 0 && s.cycles > 0 ?
+                 s.instructions / s.cycles : -1;
+        misses[i] = s.misses >= 0 ? s.misses / n : -1;
+    }
+
+    r->cycles = median(cycles, reps);
+    for (int i = 0; i < reps; i++) {
+        cycles[i] = fabs(cycles[i] - r->cycles);
+    }
+    r->mad = median(cycles, reps);
+    r->instructions = median(instr, reps);
+    r->ipc = median(ipc, reps);
+    r->misses = median(misses, reps);
+    free(cycles);
+    free(instr);
+    free(ipc);
+    free(misses);
+}
+
+
+/*
+ * Look a kernel up in a baseline file, written by --save. Returns 0 if found.
+ */
+int baseline_find(FILE *fp, const char *unit, const char *name,
+                  double *cycles) {
+    char line[256], found[64], u[16] = "";
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "# unit %15s", u) == 1) {
+            continue;
+        }
+        if (line[0] != '#' && sscanf(line, "%63s %lf", found, cycles) == 2 &&
+            strcmp(found, name) == 0) {
+            return strcmp(u, unit) == 0 ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Print help on how to use this program and exit.
+ */
+void usage(char *program) {
+    printf("Usage:\t%s [--reps N] [--kernel NAME] [--block-size N] "
+                   "[--bits N] [--save FILE] [--baseline FILE] "
+                   "[--tolerance PCT]\n\n", program);
+    printf("\t--reps\t\tThe number of repetitions to measure for each "
+                   "kernel. Defaults to %d.\n", KERNEL_REPS);
+    printf("\t--kernel\tMeasure only the kernels whose name contains NAME."
+                   "\n");
+    printf("\t--block-size\tThe size in bytes of the blocks to hash. "
+                   "Defaults to %d.\n", ISHAKE_BLOCK_SIZE);
+    printf("\t--bits\t\tThe number of bits in the digests. Defaults to "
+                   "2688.\n");
+    printf("\t--save\t\tWrite the results to FILE, to use as a baseline.\n");
+    printf("\t--baseline\tCompare the results with those in FILE, and exit "
+                   "with an error if any kernel is slower.\n");
+    printf("\t--tolerance\tHow much slower than the baseline a kernel can be, "
+                   "in percent. Defaults to %.0f.\n", KERNEL_TOLERANCE);
+    exit(EXIT_SUCCESS);
+}
+
+
+/*
+ * Write a message to stderr and exit.
+ */
+void panic(char *program, char *format, int argc, ...) {
+    va_list valist;
+    va_start(valist, argc);
+
+    fprintf(stderr, "%s: ", program);
+    if (argc > 0) {
+        vfprintf(stderr, format, valist);
+    } else {
+        fprintf(stderr, "%s\n", format);
+    }
+
+    usage(program);
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char *argv[]) {
+    int reps = KERNEL_REPS;
+    char *only = NULL, *save = NULL, *baseline = NULL;
+    double tolerance = KERNEL_TOLERANCE;
+    uint32_t block_size = ISHAKE_BLOCK_SIZE;
+    uint16_t bits = 2688;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp("--help", argv[i]) == 0) {
+            usage(argv[0]);
+        }
+        if (i == argc - 1) {
+            panic(argv[0], "unknown option '%s', or it needs a value.\n", 1,
+                  argv[i]);
+        }
+        if (strcmp("--reps", argv[i]) == 0) {
+            reps = atoi(argv[i + 1]);
+            if (reps < 1) {
+                panic(argv[0], "--reps must be followed by a positive "
+                        "number.", 0);
+            }
+        } else if (strcmp("--kernel", argv[i]) == 0) {
+            only = argv[i + 1];
+        } else if (strcmp("--block-size", argv[i]) == 0) {
+            block_size = (uint32_t)strtoul(argv[i + 1], NULL, 10);
+        } else if (strcmp("--bits", argv[i]) == 0) {
+            bits = (uint16_t)strtoul(argv[i + 1], NULL, 10);
+        } else if (strcmp("--save", argv[i]) == 0) {
+            save = argv[i + 1];
+        } else if (strcmp("--baseline", argv[i]) == 0) {
+            baseline = argv[i + 1];
+        } else if (strcmp("--tolerance", argv[i]) == 0) {
+            tolerance = atof(argv[i + 1]);
+        } else {
+            panic(argv[0], "unknown option '%s'\n", 1, argv[i]);
+        }
+        i++; // two arguments consumed, advance the pointer!
+    }
+
+    // a structure with a queue but no workers, to push and pop by hand
+    kernel_ctx_t ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.is = malloc(sizeof(ishake_t));
+    if (ishake_init(ctx.is, block_size, bits, ISHAKE_APPEND_ONLY_MODE, 0)) {
+        panic(argv[0], "cannot initialize iSHAKE.", 0);
+    }
+    ctx.is->queue_no = 1;
+    ctx.is->queues = calloc(1, sizeof(ishake_queue_t));
+    pthread_mutex_init(&ctx.is->queues[0].lck, NULL);
+    pthread_cond_init(&ctx.is->queues[0].data_available, NULL);
+
+    ctx.words = bits / 64;
+    ctx.block.data_len = block_size - 8;
+    ctx.block.data = malloc(ctx.block.data_len);
+    for (uint32_t i = 0; i < ctx.block.data_len; i++) {
+        ctx.block.data[i] = (unsigned char)(i * 7);
+    }
+    ctx.block.header.length = 8;
+    ctx.block.header.value.idx = 1;
+    ctx.acc = calloc(ctx.words, sizeof(uint64_t));
+    ctx.digest = calloc(ctx.words, sizeof(uint64_t));
+    ctx.bytes = malloc((size_t)ctx.words * 8);
+    _hash_block(ctx.is, &ctx.block, ctx.digest);
+    uint64_t2uint8_t(ctx.bytes, ctx.digest, ctx.words);
+    bin2hex(&ctx.hex, ctx.bytes, (unsigned long)ctx.words * 8);
+    Keccak_HashInitialize_SHAKE128(&ctx.absorbed);
+    ctx.absorbed.fixedOutputLength = bits;
+    Keccak_HashUpdate(&ctx.absorbed, ctx.block.data,
+                      (DataLength)ctx.block.data_len * 8);
+
+    counters_t counters;
+    int hw = counters_open(&counters) == 0;
+    const char *unit = hw ? "cycles" : "ns";
+    if (!hw) {
+        fprintf(stderr, "%s: hardware counters are not available, measuring "
+                "time instead.\n", argv[0]);
+    }
+
+    FILE *base = NULL, *out = NULL;
+    if (baseline && (base = fopen(baseline, "r")) == NULL) {
+        panic(argv[0], "cannot read baseline '%s'.\n", 1, baseline);
+    }
+    if (save && (out = fopen(save, "w")) == NULL) {
+        panic(argv[0], "cannot write '%s'.\n", 1, save);
+    }
+    if (out) {
+        fprintf(out, "# unit %s\n", unit);
+    }
+
+    printf("Block size: %u bytes, %u bit digests, %d repetitions.\n\n",
+           block_size, bits, reps);
+    printf("%-18s %12s %10s %10s %6s %10s\n", "kernel", unit, "+-MAD",
+           "instr", "IPC", "misses");
+    int regressions = 0;
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (only && strstr(kernels[k].name, only) == NULL) {
+            continue;
+        }
+        result_t r;
+        measure(&kernels[k], &ctx, &counters, reps, &r);
+        printf("%-18s %12.2f %10.2f ", kernels[k].name, r.cycles, r.mad);
+        if (r.instructions >= 0) {
+            printf("%10.1f %6.2f ", r.instructions, r.ipc);
+        } else {
+            printf("%10s %6s ", "-", "-");
+        }
+        if (r.misses >= 0) {
+            printf("%10.3f", r.misses);
+        } else {
+            printf("%10s", "-");
+        }
+
+        // slower than the baseline beyond both the tolerance and the noise
+        double old;
+        if (base && baseline_find(base, unit, kernels[k].name, &old) == 0) {
+            double delta = (r.cycles - old) * 100 / old;
+            int slower = delta > tolerance && r.cycles - old > 3 * r.mad;
+            printf("  %+7.1f%%%s", delta, slower ? " REGRESSION" : "");
+            regressions += slower;
+        }
+        printf("\n");
+        if (out) {
+            fprintf(out, "%s %.4f %.4f\n", kernels[k].name, r.cycles, r.mad);
+        }
+    }
+
+    if (base) {
+        fclose(base);
+    }
+    if (out) {
+        fclose(out);
+    }
+    counters_close(&counters);
+    free(ctx.block.data);
+    free(ctx.acc);
+    free(ctx.digest);
+    free(ctx.bytes);
+    free(ctx.hex);
+    pthread_mutex_destroy(&ctx.is->queues[0].lck);
+    pthread_cond_destroy(&ctx.is->queues[0].data_available);
+    free(ctx.is->queues);
+    ctx.is->queues = NULL;
+    ishake_cleanup(ctx.is);
+    return regressions ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -26,7 +26,7 @@
  */
 
 
-#include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -42,36 +42,10 @@
 
 #include "timing.h"
 #include "../src/ishake.h"
+#include "../src/treehash.h"
 #include "../src/utils.h"
 
 
-/*
- * Try to get the number of available cores.
- */
-long getNumberOfCores(void) {
-    long nprocs = -1;
-#ifdef _WIN32
-#ifndef _SC_NPROCESSORS_ONLN
-    SYSTEM_INFO info;
-    GetSystemInfo(&info);
-#define sysconf(a) info.dwNumberOfProcessors
-#define _SC_NPROCESSORS_ONLN
-#endif
-#endif
-#ifdef _SC_NPROCESSORS_ONLN
-    nprocs = sysconf(_SC_NPROCESSORS_ONLN);
-    if (nprocs < 1) {
-        fprintf(stderr, "Could not determine number of CPUs online:\n%s\n",
-                strerror (errno));
-    }
-    return nprocs;
-#else
-    fprintf(stderr, "Could not determine number of CPUs");
-    return nprocs;
-#endif
-}
-
-
 /*
  * Hash some data n times, while measuring the time it takes each time, and
  * return the minimum time observed.
@@ -117,13 +91,74 @@ uint64_t measureHash(
 }
 
 
+/*
+ * Measure the time needed to hash blkno blocks of data with a parallel tree
+ * hash, so that iSHAKE can be compared with its non-incremental alternatives.
+ */
+uint64_t measureTree(
+        uint64_t dtMin,
+        uint8_t type,
+        unsigned char *data,
+        unsigned char *hash,
+        uint16_t blkno,
+        uint16_t thrno
+) {
+    treehash_t *th;
+    measureTimingBegin
+    th = malloc(sizeof(treehash_t));
+    if (treehash_init(th, type, 128, 8192, NULL, 0, thrno)) {
+        treehash_cleanup(th);
+        fprintf(stderr, "treehash_init() failed\n");
+        return 0;
+    }
+
+    for (int i = 0; i < blkno; i++) {
+        treehash_update(th, data, ISHAKE_BLOCK_SIZE);
+    }
+
+    treehash_final(th, hash, 32);
+    treehash_cleanup(th);
+    measureTimingEnd
+    return tMin;
+}
+
+
+/*
+ * Measure the time needed to hash msgno small messages of msglen bytes each,
+ * either one by one with ishake_hash() or all at once with
+ * ishake_hash_many().
+ */
+uint64_t measureMany(
+        uint64_t dtMin,
+        int many,
+        unsigned char **msgs,
+        uint64_t *lens,
+        unsigned char **hashes,
+        uint16_t hashbitlen,
+        uint32_t msgno,
+        uint16_t thrno
+) {
+    measureTimingBegin
+    if (many) {
+        ishake_hash_many(msgs, lens, hashes, msgno, hashbitlen, thrno);
+    } else {
+        for (uint32_t m = 0; m < msgno; m++) {
+            ishake_hash(msgs[m], lens[m], hashes[m], hashbitlen);
+        }
+    }
+    measureTimingEnd
+    return tMin;
+}
+
+
 /*
  * Print help on how to use this program and exit.
  */
 void usage(char *program) {
     printf("Usage:\t%s [--threads N]\n\n", program);
     printf("\t--threads\tThe number of threads to use. The amount of threads "
-                   "used by default depends on the number of logical cores.\n");
+                   "used by default depends on the number of CPUs available, "
+                   "after affinity and cgroup quotas.\n");
     exit(EXIT_SUCCESS);
 }
 
@@ -155,11 +190,8 @@ int main(int argc, char *argv[]) {
     uint64_t calibration = calibrate();
     ishake_t *is;
 
-    long thrno = getNumberOfCores();
-    thrno--;
-    if (thrno < 0) {
-        thrno = 0;
-    }
+    // one CPU for this thread, the rest (within cgroup quotas) for workers
+    long thrno = affinity_cpus() - 1;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp("--threads", argv[i]) == 0) {
@@ -184,7 +216,53 @@ int main(int argc, char *argv[]) {
                ISHAKE_BLOCK_SIZE * 1024, time,
                time * 1.0 / (ISHAKE_BLOCK_SIZE * 1024));
     }
-    printf("\n\n");
+    printf("\n");
+
+    // the same amount of data and threads with ParallelHash and KangarooTwelve
+    const char *names[] = {"ParallelHash128", "KangarooTwelve"};
+    const uint8_t types[] = {TREEHASH_PARALLELHASH, TREEHASH_KANGAROOTWELVE};
+    unsigned char tree_hash[32];
+    for (int t = 0; t < 2; t++) {
+        printf("%s, using %lu threads.\n", names[t], thrno);
+        for (int i = 0; i < 10; i++) {
+            time = measureTree(calibration, types[t], data, tree_hash, 1024,
+                               (uint16_t)thrno);
+            printf("%10d bytes, %10" PRIu64 " cycles, %6.3f cycles/byte\n",
+                   ISHAKE_BLOCK_SIZE * 1024, time,
+                   time * 1.0 / (ISHAKE_BLOCK_SIZE * 1024));
+        }
+        printf("\n");
+    }
+    printf("\n");
+
+    // many small independent messages, one by one and in a single batch
+    uint32_t msgno = 4096, msglen = 64;
+    unsigned char **msgs = malloc(msgno * sizeof(unsigned char *));
+    unsigned char **hashes = malloc(msgno * sizeof(unsigned char *));
+    uint64_t *lens = malloc(msgno * sizeof(uint64_t));
+    for (uint32_t m = 0; m < msgno; m++) {
+        msgs[m] = data + m % (ISHAKE_BLOCK_SIZE - msglen);
+        lens[m] = msglen;
+        hashes[m] = malloc(hashbitlen / 8);
+    }
+    const char *ways[] = {"ishake_hash()", "ishake_hash_many()"};
+    for (int many = 0; many < 2; many++) {
+        printf("%u messages of %u bytes with %s, using %lu threads.\n",
+               msgno, msglen, ways[many], many ? thrno : 0);
+        for (int i = 0; i < 10; i++) {
+            time = measureMany(calibration, many, msgs, lens, hashes,
+                               hashbitlen, msgno, (uint16_t)thrno);
+            printf("%10u messages, %10" PRIu64 " cycles, "
+                   "%9.1f cycles/message\n", msgno, time, time * 1.0 / msgno);
+        }
+        printf("\n");
+    }
+    for (uint32_t m = 0; m < msgno; m++) {
+        free(hashes[m]);
+    }
+    free(msgs);
+    free(hashes);
+    free(lens);
 
     bin2hex(&hex, hash, (unsigned long)hashbitlen / 8);
     printf("%s\n", hex);
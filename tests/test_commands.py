@@ -56,6 +56,26 @@ def test_commands(tmpdir, threads, block_size=26, total_blocks=100):
     return results
 
 
+def test_cdc_repeats(threads):
+    """Check that content-defined blocks that repeat still keep the order of the input."""
+    tmpdir = tempfile.mkdtemp()
+    ishake = IShakeFulLRW(dir=tmpdir, threads=threads)
+    for cdc, size in [('64:64:64', 64), ('256:1024:4096', 3000)]:
+        a, b, c = [os.urandom(size) for _ in range(3)]
+        for name, data in [('abaca', a + b + a + c + a), ('acaba', a + c + a + b + a)]:
+            with open('%s/%s' % (tmpdir, name), 'wb') as f:
+                f.write(data)
+
+        first = ishake.hash_cdc('abaca', cdc)
+        second = ishake.hash_cdc('acaba', cdc)
+        if first == second:
+            raise Exception('Digests of inputs with the same blocks in a different order match (--cdc %s).' % cdc)
+        ishake.hash_cdc('abaca', cdc)
+        if ishake.hash_cdc('acaba', cdc, old='abaca') != second:
+            raise Exception('Digest after rehashing blocks that repeat does not match (--cdc %s).' % cdc)
+    shutil.rmtree(tmpdir)
+
+
 def main(dirname=None, repetitions=1, block_size=26, total_blocks=100, threads=0, debug=False):
     if not debug:
         sys.tracebacklimit = 0
@@ -129,6 +149,8 @@ def main(dirname=None, repetitions=1, block_size=26, total_blocks=100, threads=0
     time['delete']['last']['cpu'] /= repetitions
     time['delete']['last']['wall'] /= repetitions
 
+    test_cdc_repeats(threads)
+
     pp = pprint.PrettyPrinter(indent=2,)
     pp.pprint(time)
 
@@ -218,3 +218,17 @@ class IShakeFulLRW(IShakeModes):
             os.remove(prevdst)
         os.remove(dst)
         return result
+
+    def hash_cdc(self, file, cdc, old=None):
+        """Hash a file split in content-defined blocks, or rehash it from an old version of it.
+
+        Arguments:
+        file: the name of the file to hash
+        cdc: the minimum, average and maximum sizes of the blocks, as "MIN:AVG:MAX"
+        old: the name of the old version of the file, whose hash is the current digest, if any
+        """
+
+        rehash = "--rehash %s --from %s/%s" % (self._hash, self._dir, old) if old else ''
+        return self._run("%s --%d --bits %d --quiet --threads %d %s --cdc %s %s %s/%s" %
+                         (self._ishakesum, self._mode, self._output_bits, self._threads, self._profile, cdc, rehash,
+                          self._dir, file))